@@ -0,0 +1,126 @@
+#include "admission.h"
+#include "include/hmutex.h"
+#include "include/htime.h"
+#include "job.h"
+#include "spool.h"
+#include <math.h>
+#include <string.h>
+
+#define ADMISSION_RATE_WINDOW 10.0 // seconds the ingest rate is averaged over
+#define ADMISSION_DISK_RETRY  60   // finished jobs are swept every minute
+
+static admission_config_t s_config;
+static hmutex_t s_mutex;
+static honce_t s_once = HONCE_INIT;
+static admission_stats_t s_stats;
+// bytes of completed uploads per second, decayed like the scheduler load
+static double s_rate;
+static double s_rate_time;
+
+static void admission_once() {
+  hmutex_init(&s_mutex);
+  admission_config_init(&s_config);
+}
+
+void admission_config_init(admission_config_t *config) {
+  memset(config, 0, sizeof(*config));
+  config->max_upload_bytes = ADMISSION_MAX_UPLOAD;
+  config->max_inflight_bytes = ADMISSION_MAX_INFLIGHT;
+  config->min_free_bytes = ADMISSION_MIN_FREE;
+}
+
+void admission_init(const admission_config_t *config) {
+  honce(&s_once, admission_once);
+  hmutex_lock(&s_mutex);
+  s_config = *config;
+  hmutex_unlock(&s_mutex);
+}
+
+static double admission_now(void) { return gethrtime_us() / 1e6; }
+
+static void admission_decay_rate(double now) {
+  if (now > s_rate_time) {
+    s_rate *= exp(-(now - s_rate_time) / ADMISSION_RATE_WINDOW);
+    s_rate_time = now;
+  }
+}
+
+static int admission_retry(double seconds) {
+  if (seconds < 1)
+    return 1;
+  return seconds > ADMISSION_MAX_RETRY ? ADMISSION_MAX_RETRY
+                                       : (int)ceil(seconds);
+}
+
+bool admission_too_large(long long bytes) {
+  honce(&s_once, admission_once);
+  hmutex_lock(&s_mutex);
+  bool too_large =
+      s_config.max_upload_bytes > 0 && bytes > s_config.max_upload_bytes;
+  if (too_large)
+    s_stats.too_large++;
+  hmutex_unlock(&s_mutex);
+  return too_large;
+}
+
+admission_e admission_begin(long long bytes, int *retry_after) {
+  honce(&s_once, admission_once);
+  hmutex_lock(&s_mutex);
+  if (s_config.max_upload_bytes > 0 && bytes > s_config.max_upload_bytes) {
+    s_stats.too_large++;
+    hmutex_unlock(&s_mutex);
+    return ADMISSION_TOO_LARGE;
+  }
+  double retry = 0;
+  // the uploads being received are jobs soon
+  double queue_retry = 0;
+  if (!job_admit(s_stats.inflight, &queue_retry))
+    retry = queue_retry;
+  long long inflight = s_stats.inflight_bytes + bytes;
+  if (s_config.max_inflight_bytes > 0 && s_stats.inflight > 0 &&
+      inflight > s_config.max_inflight_bytes) {
+    admission_decay_rate(admission_now());
+    double rate = s_rate > 0 ? s_rate : 1;
+    double wait = (inflight - s_config.max_inflight_bytes) / rate;
+    if (wait > retry)
+      retry = wait;
+  }
+  long long free_bytes = spool_free_bytes();
+  if (free_bytes >= 0 &&
+      free_bytes - ADMISSION_SPOOL_FACTOR * inflight <
+          s_config.min_free_bytes &&
+      retry < ADMISSION_DISK_RETRY)
+    retry = ADMISSION_DISK_RETRY;
+  if (retry > 0) {
+    s_stats.busy++;
+    hmutex_unlock(&s_mutex);
+    if (retry_after)
+      *retry_after = admission_retry(retry);
+    return ADMISSION_BUSY;
+  }
+  s_stats.admitted++;
+  s_stats.inflight++;
+  s_stats.inflight_bytes = inflight;
+  hmutex_unlock(&s_mutex);
+  return ADMISSION_OK;
+}
+
+void admission_end(long long bytes, bool complete) {
+  honce(&s_once, admission_once);
+  hmutex_lock(&s_mutex);
+  s_stats.inflight--;
+  s_stats.inflight_bytes -= bytes;
+  if (complete) {
+    double now = admission_now();
+    admission_decay_rate(now);
+    s_rate += bytes / ADMISSION_RATE_WINDOW;
+  }
+  hmutex_unlock(&s_mutex);
+}
+
+void admission_stats(admission_stats_t *stats) {
+  honce(&s_once, admission_once);
+  hmutex_lock(&s_mutex);
+  *stats = s_stats;
+  hmutex_unlock(&s_mutex);
+}
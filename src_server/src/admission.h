@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdbool.h>
+
+// Admission control for uploads, decided from the request head before any
+// of the body is read. An upload is turned away with
+//   413  above max_upload_bytes
+//   503  while the transcode queue is full (see sched_admit), while
+//        max_inflight_bytes are already being received, or when the spool
+//        would keep less than min_free_bytes after the upload and its outputs
+// and a 503 carries the seconds after which a retry should get in.
+
+#define ADMISSION_MAX_UPLOAD    (1LL << 30)
+#define ADMISSION_MAX_INFLIGHT  (2LL << 30)
+#define ADMISSION_MIN_FREE      (1LL << 30)
+#define ADMISSION_SPOOL_FACTOR  2   // an upload and its outputs
+#define ADMISSION_MAX_RETRY     600 // seconds
+
+typedef enum {
+  ADMISSION_OK,
+  ADMISSION_BUSY,
+  ADMISSION_TOO_LARGE,
+} admission_e;
+
+typedef struct admission_config_t {
+  long long   max_upload_bytes;
+  long long   max_inflight_bytes;
+  long long   min_free_bytes; // over all spool devices, see spool.h
+} admission_config_t;
+
+typedef struct admission_stats_t {
+  long        admitted;
+  long        busy;
+  long        too_large;
+  int         inflight;
+  long long   inflight_bytes;
+} admission_stats_t;
+
+void admission_config_init(admission_config_t *config);
+// admission_init is optional, the defaults are used otherwise
+void admission_init(const admission_config_t *config);
+// admission_too_large tells from the Content-Length alone that an upload
+// gets 413, before the head is even complete
+bool admission_too_large(long long bytes);
+// admission_begin reserves bytes for an upload on ADMISSION_OK, otherwise
+// retry_after is set for ADMISSION_BUSY
+admission_e admission_begin(long long bytes, int *retry_after);
+// admission_end releases what admission_begin reserved, complete tells
+// whether the upload arrived in full
+void admission_end(long long bytes, bool complete);
+void admission_stats(admission_stats_t *stats);
@@ -0,0 +1,786 @@
+#include "bench.h"
+#include "cpu.h"
+#include "denoise.h"
+#include "framepool.h"
+#include "include/hsysinfo.h"
+#include "include/htime.h"
+#include "kernels.h"
+#include "metrics.h"
+#include "pattern.h"
+#include "pipeline.h"
+#include "scale.h"
+#include "sharpen.h"
+#include "y4m.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BENCH_SECONDS 2
+
+/*
+ * stages, each one turns src into dst the way the pipeline runs it. A stage
+ * is named on the command line as name[=args], open sets the output size.
+ */
+typedef struct bench_stage_t {
+  const char *name;
+  const char *args; // defaults
+  void *(*open)(const char *args, int width, int height, slice_pool_t *slices,
+                int *out_width, int *out_height);
+  void (*run)(void *ctx, const frame_t *src, frame_t *dst);
+  void (*close)(void *ctx);
+} bench_stage_t;
+
+static void *sharpen_open(const char *args, int width, int height,
+                          slice_pool_t *slices, int *out_width,
+                          int *out_height) {
+  sharpen_opts_t opts = {1.0f, 2, true};
+  sscanf(args, "%f", &opts.amount);
+  *out_width = width;
+  *out_height = height;
+  return sharpen_new(&opts, slices);
+}
+
+static void sharpen_run(void *ctx, const frame_t *src, frame_t *dst) {
+  sharpen_frame((sharpen_t *)ctx, src, dst);
+}
+
+static void sharpen_close(void *ctx) { sharpen_free((sharpen_t *)ctx); }
+
+// scale=WxH[:filter] or scale=factor[:filter]
+static void *scale_open(const char *args, int width, int height,
+                        slice_pool_t *slices, int *out_width,
+                        int *out_height) {
+  float factor = 1.0f;
+  if (sscanf(args, "%dx%d", out_width, out_height) != 2) {
+    sscanf(args, "%f", &factor);
+    *out_width = (int)(width * factor + 0.5f) & ~1;
+    *out_height = (int)(height * factor + 0.5f) & ~1;
+  }
+  const char *filter = strchr(args, ':');
+  return scale_new(width, height, *out_width, *out_height,
+                   filter ? scale_filter_from_name(filter + 1) : SCALE_LANCZOS,
+                   slices);
+}
+
+static void scale_run(void *ctx, const frame_t *src, frame_t *dst) {
+  scale_frame((scale_t *)ctx, src, dst);
+}
+
+static void scale_close(void *ctx) { scale_free((scale_t *)ctx); }
+
+// denoise=strength[:nrefs]
+static void *denoise_open(const char *args, int width, int height,
+                          slice_pool_t *slices, int *out_width,
+                          int *out_height) {
+  denoise_opts_t opts = {4, 2};
+  sscanf(args, "%d:%d", &opts.strength, &opts.nrefs);
+  *out_width = width;
+  *out_height = height;
+  return denoise_new(&opts, slices);
+}
+
+static void denoise_run(void *ctx, const frame_t *src, frame_t *dst) {
+  // the denoiser keeps a reference to src, stage inputs are pooled frames
+  denoise_frame((denoise_t *)ctx, (frame_t *)src, dst);
+}
+
+static void denoise_close(void *ctx) { denoise_free((denoise_t *)ctx); }
+
+static const bench_stage_t s_stages[] = {
+    {"denoise", "4:2", denoise_open, denoise_run, denoise_close},
+    {"sharpen", "1.0", sharpen_open, sharpen_run, sharpen_close},
+    {"scale", "2:lanczos", scale_open, scale_run, scale_close},
+};
+#define BENCH_NSTAGES (int)(sizeof(s_stages) / sizeof(s_stages[0]))
+
+static const struct {
+  const char *name;
+  int         width;
+  int         height;
+} s_sizes[] = {
+    {"480p", 854, 480},    {"720p", 1280, 720},   {"1080p", 1920, 1080},
+    {"1440p", 2560, 1440}, {"2160p", 3840, 2160},
+};
+#define BENCH_NSIZES (int)(sizeof(s_sizes) / sizeof(s_sizes[0]))
+
+// bench_find_stage looks up name[=args], *args points past the '=' or at
+// the defaults of the stage
+static const bench_stage_t *bench_find_stage(const char *name,
+                                             const char **args) {
+  const char *eq = strchr(name, '=');
+  size_t len = eq ? (size_t)(eq - name) : strlen(name);
+  for (int i = 0; i < BENCH_NSTAGES; i++) {
+    if (strlen(s_stages[i].name) == len &&
+        strncmp(s_stages[i].name, name, len) == 0) {
+      if (args)
+        *args = eq ? eq + 1 : s_stages[i].args;
+      return &s_stages[i];
+    }
+  }
+  return NULL;
+}
+
+static int bench_compare_frames(const frame_t *a, const frame_t *b) {
+  int mismatches = 0;
+  for (int i = 0; i < 3; i++) {
+    int w = frame_plane_width(a, i);
+    int h = frame_plane_height(a, i);
+    for (int y = 0; y < h; y++) {
+      const uint8_t *ra = a->data[i] + (size_t)y * a->linesize[i];
+      const uint8_t *rb = b->data[i] + (size_t)y * b->linesize[i];
+      for (int x = 0; x < w; x++) {
+        mismatches += ra[x] != rb[x];
+      }
+    }
+  }
+  return mismatches;
+}
+
+// frames per second of one stage over a set of input frames
+static double bench_stage_fps(const bench_stage_t *stage, void *ctx,
+                              frame_t **src, int nsrc, frame_t *dst) {
+  int nframes = 0;
+  unsigned long long start = gethrtime_us();
+  unsigned long long elapsed = 0;
+  do {
+    stage->run(ctx, src[nframes % nsrc], dst);
+    ++nframes;
+    elapsed = gethrtime_us() - start;
+  } while (elapsed < BENCH_SECONDS * 1000000ULL);
+  return nframes * 1e6 / elapsed;
+}
+
+// 480p..2160p or WxH
+static bool bench_parse_size(const char *str, int *width, int *height) {
+  for (int i = 0; i < BENCH_NSIZES; i++) {
+    if (strcmp(str, s_sizes[i].name) == 0) {
+      *width = s_sizes[i].width;
+      *height = s_sizes[i].height;
+      return true;
+    }
+  }
+  return sscanf(str, "%dx%d", width, height) == 2 && *width > 0 &&
+         *height > 0;
+}
+
+static void bench_stages_at(const char *stage_name, const char *label,
+                            int width, int height, slice_pool_t *slices) {
+  framepool_t *pool = framepool_default();
+  frame_t *src[2];
+  for (int i = 0; i < 2; i++) {
+    src[i] = framepool_get(pool, FRAME_YUV420P, width, height);
+    pattern_fill(src[i], PATTERN_MOTION, i);
+  }
+  for (int i = 0; i < BENCH_NSTAGES; i++) {
+    const bench_stage_t *stage = &s_stages[i];
+    const char *args = stage->args;
+    if (strcmp(stage_name, "all") != 0 &&
+        bench_find_stage(stage_name, &args) != stage)
+      continue;
+    int out_width = 0, out_height = 0;
+    void *ctx = stage->open(args, width, height, slices, &out_width,
+                            &out_height);
+    if (ctx == NULL)
+      continue;
+    frame_t *dst = framepool_get(pool, FRAME_YUV420P, out_width, out_height);
+    double fps = bench_stage_fps(stage, ctx, src, 2, dst);
+    stage->close(ctx);
+    frame_unref(dst);
+    printf("%-10s %-10s %10.1f %10.1f\n", stage->name, label, fps,
+           fps * width * height / 1e6);
+  }
+  frame_unref(src[0]);
+  frame_unref(src[1]);
+}
+
+// --bench [stage|all] [size|all] [threads]
+static int bench_stages(int argc, char **argv) {
+  const char *stage_name = argc > 1 ? argv[1] : "all";
+  const char *size_name = argc > 2 ? argv[2] : "all";
+  int nthreads = argc > 3 ? atoi(argv[3]) : get_ncpu();
+  if (strcmp(stage_name, "all") != 0 &&
+      bench_find_stage(stage_name, NULL) == NULL) {
+    fprintf(stderr, "Unknown stage: %s\n", stage_name);
+    return -10;
+  }
+  slice_pool_t *slices = slice_pool_new(nthreads);
+  printf("%-10s %-10s %10s %10s  (%d threads)\n", "stage", "size", "fps",
+         "Mpix/s", nthreads);
+  if (strcmp(size_name, "all") == 0) {
+    for (int i = 0; i < BENCH_NSIZES; i++) {
+      bench_stages_at(stage_name, s_sizes[i].name, s_sizes[i].width,
+                      s_sizes[i].height, slices);
+    }
+  } else {
+    int width = 0, height = 0;
+    if (bench_parse_size(size_name, &width, &height))
+      bench_stages_at(stage_name, size_name, width, height, slices);
+  }
+  slice_pool_free(slices);
+  return 0;
+}
+
+// --bench-sharpen [WxH] [threads]
+static int bench_sharpen(int argc, char **argv) {
+  int width = 1920, height = 1080;
+  int nthreads = get_ncpu();
+  if (argc > 1)
+    bench_parse_size(argv[1], &width, &height);
+  if (argc > 2)
+    nthreads = atoi(argv[2]);
+
+  sharpen_opts_t opts = {1.0f, 2, true};
+  frame_t *src = frame_alloc(FRAME_YUV420P, width, height);
+  frame_t *ref = frame_alloc(FRAME_YUV420P, width, height);
+  frame_t *dst = frame_alloc(FRAME_YUV420P, width, height);
+  pattern_fill(src, PATTERN_CHECKER, 0);
+
+  int nimpls = 0;
+  const kernel_impl_t *impls = kernel_impls(KERNEL_SHARPEN, &nimpls);
+  const kernel_impl_t *reference = &impls[nimpls - 1];
+  const bench_stage_t *stage = bench_find_stage("sharpen", NULL);
+  sharpen_t *sharpen = sharpen_new(&opts, NULL);
+  sharpen_set_kernel(sharpen, (const sharpen_kernel_t *)reference->fns);
+  sharpen_frame(sharpen, src, ref);
+
+  int failed = 0;
+  printf("sharpen %dx%d yuv420p\n", width, height);
+  for (int i = 0; i < nimpls; i++) {
+    if (!kernel_supported(&impls[i])) {
+      printf("  %-6s unsupported\n", impls[i].name);
+      continue;
+    }
+    sharpen_set_kernel(sharpen, (const sharpen_kernel_t *)impls[i].fns);
+    sharpen_frame(sharpen, src, dst);
+    int mismatches = bench_compare_frames(ref, dst);
+    failed |= mismatches != 0;
+    printf("  %-6s 1 thread  %8.1f fps  %s (%d mismatches)\n", impls[i].name,
+           bench_stage_fps(stage, sharpen, &src, 1, dst),
+           mismatches ? "FAIL" : "ok", mismatches);
+  }
+  sharpen_free(sharpen);
+
+  slice_pool_t *pool = slice_pool_new(nthreads);
+  sharpen = sharpen_new(&opts, pool);
+  sharpen_frame(sharpen, src, dst);
+  int mismatches = bench_compare_frames(ref, dst);
+  failed |= mismatches != 0;
+  printf("  %-6s %d threads %8.1f fps  %s (%d mismatches)\n",
+         kernel_bound(KERNEL_SHARPEN)->name, nthreads,
+         bench_stage_fps(stage, sharpen, &src, 1, dst),
+         mismatches ? "FAIL" : "ok", mismatches);
+  sharpen_free(sharpen);
+  slice_pool_free(pool);
+
+  frame_free(src);
+  frame_free(ref);
+  frame_free(dst);
+  return failed ? 1 : 0;
+}
+
+// --bench-scale [WxH] [threads]
+// every filter up and down by 2, fixed point against double precision
+static int bench_scale(int argc, char **argv) {
+  int width = 1920, height = 1080;
+  int nthreads = get_ncpu();
+  if (argc > 1)
+    bench_parse_size(argv[1], &width, &height);
+  if (argc > 2)
+    nthreads = atoi(argv[2]);
+
+  frame_t *src = frame_alloc(FRAME_YUV420P, width, height);
+  pattern_fill(src, PATTERN_ZONEPLATE, 0);
+  int nimpls = 0;
+  const kernel_impl_t *impls = kernel_impls(KERNEL_SCALE, &nimpls);
+  const kernel_impl_t *reference = &impls[nimpls - 1];
+  const bench_stage_t *stage = bench_find_stage("scale", NULL);
+  slice_pool_t *pool = slice_pool_new(nthreads);
+  int failed = 0;
+  for (int filter = 0; filter < SCALE_NUM; filter++) {
+    for (int up = 1; up >= 0; up--) {
+      int dst_width = (up ? width * 2 : width / 2) & ~1;
+      int dst_height = (up ? height * 2 : height / 2) & ~1;
+      // halving a side under 4 pixels leaves nothing to scale to
+      scale_t *scale = scale_new(width, height, dst_width, dst_height,
+                                 (scale_filter_e)filter, NULL);
+      if (scale == NULL) {
+        printf("scale %s %dx%d -> %dx%d skipped\n",
+               scale_filter_name((scale_filter_e)filter), width, height,
+               dst_width, dst_height);
+        continue;
+      }
+      frame_t *ref = frame_alloc(FRAME_YUV420P, dst_width, dst_height);
+      frame_t *fixed = frame_alloc(FRAME_YUV420P, dst_width, dst_height);
+      frame_t *dst = frame_alloc(FRAME_YUV420P, dst_width, dst_height);
+      scale_frame_reference(src, ref, (scale_filter_e)filter);
+      scale_set_kernel(scale, (const scale_kernel_t *)reference->fns);
+      scale_frame(scale, src, fixed);
+      metrics_psnr_t psnr;
+      metrics_psnr(ref, fixed, &psnr);
+      printf("scale %s %dx%d -> %dx%d, %.2f dB against double precision\n",
+             scale_filter_name((scale_filter_e)filter), width, height,
+             dst_width, dst_height, psnr.yuv);
+      for (int i = 0; i < nimpls; i++) {
+        if (!kernel_supported(&impls[i])) {
+          printf("  %-6s unsupported\n", impls[i].name);
+          continue;
+        }
+        scale_set_kernel(scale, (const scale_kernel_t *)impls[i].fns);
+        scale_frame(scale, src, dst);
+        int mismatches = bench_compare_frames(fixed, dst);
+        failed |= mismatches != 0;
+        printf("  %-6s 1 thread  %8.1f fps  %s (%d mismatches)\n",
+               impls[i].name, bench_stage_fps(stage, scale, &src, 1, dst),
+               mismatches ? "FAIL" : "ok", mismatches);
+      }
+      scale_free(scale);
+
+      scale = scale_new(width, height, dst_width, dst_height,
+                        (scale_filter_e)filter, pool);
+      scale_frame(scale, src, dst);
+      int mismatches = bench_compare_frames(fixed, dst);
+      failed |= mismatches != 0;
+      printf("  %-6s %d threads %8.1f fps  %s (%d mismatches)\n",
+             kernel_bound(KERNEL_SCALE)->name, nthreads,
+             bench_stage_fps(stage, scale, &src, 1, dst),
+             mismatches ? "FAIL" : "ok", mismatches);
+      scale_free(scale);
+      frame_free(ref);
+      frame_free(fixed);
+      frame_free(dst);
+    }
+  }
+  slice_pool_free(pool);
+  frame_free(src);
+  return failed ? 1 : 0;
+}
+
+// uniform noise of the given sigma, deterministic per frame
+static void bench_add_noise(frame_t *frame, int sigma, int index) {
+  unsigned int state = 2166136261u ^ (unsigned int)index;
+  int range = (int)(sigma * 1.732 + 0.5); // uniform in [-r, r] has sigma r/√3
+  for (int i = 0; i < 3; i++) {
+    int w = frame_plane_width(frame, i);
+    int h = frame_plane_height(frame, i);
+    for (int y = 0; y < h; y++) {
+      uint8_t *row = frame->data[i] + (size_t)y * frame->linesize[i];
+      for (int x = 0; x < w; x++) {
+        state = state * 1664525u + 1013904223u;
+        int v = row[x] + (int)((state >> 16) % (2 * range + 1)) - range;
+        row[x] = (uint8_t)(v < 0 ? 0 : v > 255 ? 255 : v);
+      }
+    }
+  }
+}
+
+#define BENCH_DENOISE_FRAMES 8
+
+// --bench-denoise [WxH] [threads] [strength]
+// a panning texture with added noise, scored against the clean frames
+static int bench_denoise(int argc, char **argv) {
+  int width = 1920, height = 1080;
+  int nthreads = get_ncpu();
+  denoise_opts_t opts = {4, 2};
+  if (argc > 1)
+    bench_parse_size(argv[1], &width, &height);
+  if (argc > 2)
+    nthreads = atoi(argv[2]);
+  if (argc > 3)
+    opts.strength = atoi(argv[3]);
+
+  framepool_t *pool = framepool_default();
+  frame_t *clean[BENCH_DENOISE_FRAMES];
+  frame_t *noisy[BENCH_DENOISE_FRAMES];
+  frame_t *ref[BENCH_DENOISE_FRAMES];
+  double noisy_psnr = 0.0;
+  for (int i = 0; i < BENCH_DENOISE_FRAMES; i++) {
+    clean[i] = framepool_get(pool, FRAME_YUV420P, width, height);
+    noisy[i] = framepool_get(pool, FRAME_YUV420P, width, height);
+    ref[i] = framepool_get(pool, FRAME_YUV420P, width, height);
+    pattern_fill(clean[i], PATTERN_PAN, i);
+    pattern_fill(noisy[i], PATTERN_PAN, i);
+    bench_add_noise(noisy[i], opts.strength, i);
+    metrics_psnr_t psnr;
+    metrics_psnr(clean[i], noisy[i], &psnr);
+    noisy_psnr += psnr.yuv / BENCH_DENOISE_FRAMES;
+  }
+  frame_t *dst = framepool_get(pool, FRAME_YUV420P, width, height);
+
+  int nimpls = 0;
+  const kernel_impl_t *impls = kernel_impls(KERNEL_DENOISE, &nimpls);
+  const kernel_impl_t *reference = &impls[nimpls - 1];
+  const bench_stage_t *stage = bench_find_stage("denoise", NULL);
+  denoise_t *denoise = denoise_new(&opts, NULL);
+  denoise_set_kernel(denoise, (const denoise_kernel_t *)reference->fns);
+  // the first frame has no references yet and is not scored
+  double denoised_psnr = 0.0;
+  for (int i = 0; i < BENCH_DENOISE_FRAMES; i++) {
+    denoise_frame(denoise, noisy[i], ref[i]);
+    metrics_psnr_t psnr;
+    metrics_psnr(clean[i], ref[i], &psnr);
+    if (i > 0)
+      denoised_psnr += psnr.yuv / (BENCH_DENOISE_FRAMES - 1);
+  }
+  denoise_free(denoise);
+  printf("denoise %dx%d yuv420p, strength %d, %d refs: %.2f dB noisy, "
+         "%.2f dB denoised\n",
+         width, height, opts.strength, opts.nrefs, noisy_psnr, denoised_psnr);
+
+  int failed = 0;
+  for (int i = 0; i < nimpls; i++) {
+    if (!kernel_supported(&impls[i])) {
+      printf("  %-6s unsupported\n", impls[i].name);
+      continue;
+    }
+    denoise = denoise_new(&opts, NULL);
+    denoise_set_kernel(denoise, (const denoise_kernel_t *)impls[i].fns);
+    int mismatches = 0;
+    for (int f = 0; f < BENCH_DENOISE_FRAMES; f++) {
+      denoise_frame(denoise, noisy[f], dst);
+      mismatches += bench_compare_frames(ref[f], dst);
+    }
+    failed |= mismatches != 0;
+    printf("  %-6s 1 thread  %8.1f fps  %s (%d mismatches)\n", impls[i].name,
+           bench_stage_fps(stage, denoise, noisy, BENCH_DENOISE_FRAMES, dst),
+           mismatches ? "FAIL" : "ok", mismatches);
+    denoise_free(denoise);
+  }
+
+  slice_pool_t *slices = slice_pool_new(nthreads);
+  denoise = denoise_new(&opts, slices);
+  int mismatches = 0;
+  for (int f = 0; f < BENCH_DENOISE_FRAMES; f++) {
+    denoise_frame(denoise, noisy[f], dst);
+    mismatches += bench_compare_frames(ref[f], dst);
+  }
+  failed |= mismatches != 0;
+  printf("  %-6s %d threads %8.1f fps  %s (%d mismatches)\n",
+         kernel_bound(KERNEL_DENOISE)->name, nthreads,
+         bench_stage_fps(stage, denoise, noisy, BENCH_DENOISE_FRAMES, dst),
+         mismatches ? "FAIL" : "ok", mismatches);
+  denoise_free(denoise);
+  slice_pool_free(slices);
+
+  for (int i = 0; i < BENCH_DENOISE_FRAMES; i++) {
+    frame_unref(clean[i]);
+    frame_unref(noisy[i]);
+    frame_unref(ref[i]);
+  }
+  frame_unref(dst);
+  return failed ? 1 : 0;
+}
+
+#define BENCH_METRICS_FRAMES 4
+
+static double bench_metrics_fps(metrics_t *metrics, frame_t **ref,
+                                frame_t **dist, int n) {
+  int nframes = 0;
+  unsigned long long start = gethrtime_us();
+  unsigned long long elapsed = 0;
+  do {
+    metrics_frame(metrics, ref[nframes % n], dist[nframes % n], NULL);
+    ++nframes;
+    elapsed = gethrtime_us() - start;
+  } while (elapsed < BENCH_SECONDS * 1000000ULL);
+  return nframes * 1e6 / elapsed;
+}
+
+// --bench-metrics [WxH] [threads]
+// PSNR, SSIM and MS-SSIM of a noisy panning texture against the clean one
+static int bench_metrics(int argc, char **argv) {
+  int width = 1920, height = 1080;
+  int nthreads = get_ncpu();
+  if (argc > 1)
+    bench_parse_size(argv[1], &width, &height);
+  if (argc > 2)
+    nthreads = atoi(argv[2]);
+
+  framepool_t *pool = framepool_default();
+  frame_t *ref[BENCH_METRICS_FRAMES];
+  frame_t *dist[BENCH_METRICS_FRAMES];
+  for (int i = 0; i < BENCH_METRICS_FRAMES; i++) {
+    ref[i] = framepool_get(pool, FRAME_YUV420P, width, height);
+    dist[i] = framepool_get(pool, FRAME_YUV420P, width, height);
+    pattern_fill(ref[i], PATTERN_PAN, i);
+    pattern_fill(dist[i], PATTERN_PAN, i);
+    bench_add_noise(dist[i], 2 * (i + 1), i);
+  }
+
+  const unsigned flags = METRICS_SSIM | METRICS_MS_SSIM;
+  int nimpls = 0;
+  const kernel_impl_t *impls = kernel_impls(KERNEL_METRICS, &nimpls);
+  const kernel_impl_t *reference = &impls[nimpls - 1];
+  metrics_result_t expected[BENCH_METRICS_FRAMES];
+  metrics_t *metrics = metrics_new(flags, NULL);
+  metrics_set_kernel(metrics, (const metrics_kernel_t *)reference->fns);
+  for (int i = 0; i < BENCH_METRICS_FRAMES; i++) {
+    metrics_frame(metrics, ref[i], dist[i], &expected[i]);
+    printf("metrics %dx%d sigma %2d: psnr %.2f dB, ssim %.4f, ms-ssim %.4f\n",
+           width, height, 2 * (i + 1), expected[i].psnr.yuv,
+           expected[i].ssim.yuv, expected[i].ms_ssim);
+  }
+  metrics_result_t same;
+  metrics_frame(metrics, ref[0], ref[0], &same);
+  metrics_free(metrics);
+  int failed = same.ssim.yuv != 1.0 || same.ms_ssim != 1.0 ||
+               same.psnr.yuv != METRICS_PSNR_MAX;
+  printf("metrics identical frames: psnr %.2f dB, ssim %.4f, ms-ssim %.4f  "
+         "%s\n",
+         same.psnr.yuv, same.ssim.yuv, same.ms_ssim, failed ? "FAIL" : "ok");
+
+  for (int i = 0; i < nimpls + 1; i++) {
+    // the last round runs the bound kernel on the slice pool
+    slice_pool_t *slices = i == nimpls ? slice_pool_new(nthreads) : NULL;
+    if (i < nimpls && !kernel_supported(&impls[i])) {
+      printf("  %-6s unsupported\n", impls[i].name);
+      continue;
+    }
+    metrics = metrics_new(flags, slices);
+    if (i < nimpls)
+      metrics_set_kernel(metrics, (const metrics_kernel_t *)impls[i].fns);
+    int mismatches = 0;
+    for (int f = 0; f < BENCH_METRICS_FRAMES; f++) {
+      metrics_result_t result;
+      metrics_frame(metrics, ref[f], dist[f], &result);
+      mismatches += memcmp(&result, &expected[f], sizeof(result)) != 0;
+    }
+    failed |= mismatches != 0;
+    double fps = bench_metrics_fps(metrics, ref, dist, BENCH_METRICS_FRAMES);
+    if (i < nimpls)
+      printf("  %-6s 1 thread  %8.1f fps  %s (%d mismatches)\n",
+             impls[i].name, fps, mismatches ? "FAIL" : "ok", mismatches);
+    else
+      printf("  %-6s %d threads %8.1f fps  %s (%d mismatches), %.1fx real "
+             "time at 30 fps\n",
+             kernel_bound(KERNEL_METRICS)->name, nthreads, fps,
+             mismatches ? "FAIL" : "ok", mismatches, fps / 30);
+    metrics_free(metrics);
+    slice_pool_free(slices);
+  }
+
+  for (int i = 0; i < BENCH_METRICS_FRAMES; i++) {
+    frame_unref(ref[i]);
+    frame_unref(dist[i]);
+  }
+  return failed ? 1 : 0;
+}
+
+// --quality ref.y4m dist.y4m [-v]
+// scores two Y4M files of the same size frame by frame, prints JSON
+static int y4m_quality(int argc, char **argv) {
+  if (argc < 3) {
+    fprintf(stderr, "Usage: --quality ref.y4m dist.y4m [-v]\n");
+    return -10;
+  }
+  bool verbose = argc > 3 && strcmp(argv[3], "-v") == 0;
+  y4m_t *ref = y4m_open_read(argv[1]);
+  y4m_t *dist = y4m_open_read(argv[2]);
+  if (ref == NULL || dist == NULL || ref->width != dist->width ||
+      ref->height != dist->height) {
+    fprintf(stderr, "Cannot compare %s and %s\n", argv[1], argv[2]);
+    y4m_close(ref);
+    y4m_close(dist);
+    return 1;
+  }
+  slice_pool_t *slices = slice_pool_new(get_ncpu());
+  metrics_t *metrics = metrics_new(METRICS_SSIM | METRICS_MS_SSIM, slices);
+  framepool_t *pool = framepool_default();
+  frame_t *a = framepool_get(pool, FRAME_YUV420P, ref->width, ref->height);
+  frame_t *b = framepool_get(pool, FRAME_YUV420P, ref->width, ref->height);
+  char json[512];
+  metrics_result_t result;
+  while (y4m_read_frame(ref, a) == 0 && y4m_read_frame(dist, b) == 0) {
+    metrics_frame(metrics, a, b, &result);
+    if (verbose) {
+      metrics_dump_json(&result, 1, json, sizeof(json));
+      printf("%s\n", json);
+    }
+  }
+  long nframes = metrics_summary(metrics, &result);
+  metrics_dump_json(&result, nframes, json, sizeof(json));
+  printf("%s\n", json);
+  frame_unref(a);
+  frame_unref(b);
+  metrics_free(metrics);
+  slice_pool_free(slices);
+  y4m_close(ref);
+  y4m_close(dist);
+  return nframes ? 0 : 1;
+}
+
+// --y4m-pattern WxH frames out.y4m [pattern]
+static int y4m_pattern(int argc, char **argv) {
+  y4m_t params = {0};
+  if (argc < 4 || !bench_parse_size(argv[1], &params.width, &params.height)) {
+    fprintf(stderr, "Usage: --y4m-pattern WxH frames out.y4m [pattern]\n");
+    return -10;
+  }
+  int nframes = atoi(argv[2]);
+  pattern_e pattern = argc > 4 ? pattern_from_name(argv[4]) : PATTERN_MOTION;
+  if (pattern == PATTERN_NUM) {
+    fprintf(stderr, "Unknown pattern: %s\n", argv[4]);
+    return -10;
+  }
+  params.fps_num = 30;
+  params.fps_den = 1;
+  y4m_t *out = y4m_open_write(argv[3], &params);
+  if (out == NULL)
+    return 1;
+  frame_t *frame = frame_alloc(FRAME_YUV420P, params.width, params.height);
+  int ret = 0;
+  for (int i = 0; i < nframes && ret == 0; i++) {
+    pattern_fill(frame, pattern, i);
+    ret = y4m_write_frame(out, frame);
+  }
+  frame_free(frame);
+  y4m_close(out);
+  return ret ? 1 : 0;
+}
+
+/*
+ * --y4m-process in.y4m out.y4m [stage[=args]...]
+ * runs the frame pipeline between two Y4M files, no codecs involved
+ */
+typedef struct y4m_filter_t {
+  const bench_stage_t *stage;
+  void                *ctx;
+  slice_pool_t        *slices; // its own, the filters run side by side
+  int                  width; // output size
+  int                  height;
+} y4m_filter_t;
+
+typedef struct y4m_process_t {
+  y4m_t         *in;
+  y4m_t         *out;
+  y4m_filter_t   filters[PIPELINE_MAX_STAGES - 2];
+  int            nfilters;
+} y4m_process_t;
+
+static int y4m_source(void *userdata, frame_t *in, frame_t **out) {
+  y4m_process_t *process = (y4m_process_t *)userdata;
+  frame_t *frame = framepool_get(framepool_default(), FRAME_YUV420P,
+                                 process->in->width, process->in->height);
+  int ret = y4m_read_frame(process->in, frame);
+  if (ret != 0) {
+    frame_unref(frame);
+    return ret < 0 ? -1 : 0;
+  }
+  *out = frame;
+  return 0;
+}
+
+static int y4m_filter(void *userdata, frame_t *in, frame_t **out) {
+  y4m_filter_t *filter = (y4m_filter_t *)userdata;
+  frame_t *frame = framepool_get(framepool_default(), FRAME_YUV420P,
+                                 filter->width, filter->height);
+  filter->stage->run(filter->ctx, in, frame);
+  frame->pts = in->pts;
+  frame_unref(in);
+  *out = frame;
+  return 0;
+}
+
+static int y4m_sink(void *userdata, frame_t *in, frame_t **out) {
+  y4m_process_t *process = (y4m_process_t *)userdata;
+  int ret = y4m_write_frame(process->out, in);
+  frame_unref(in);
+  return ret;
+}
+
+static int y4m_process(int argc, char **argv) {
+  if (argc < 3) {
+    fprintf(stderr,
+            "Usage: --y4m-process in.y4m out.y4m [stage[=args]...]\n");
+    return -10;
+  }
+  y4m_process_t process;
+  memset(&process, 0, sizeof(process));
+  const char *args[PIPELINE_MAX_STAGES - 2];
+  for (int i = 3; i < argc && process.nfilters < PIPELINE_MAX_STAGES - 2;
+       i++) {
+    const bench_stage_t *stage =
+        bench_find_stage(argv[i], &args[process.nfilters]);
+    if (stage == NULL) {
+      fprintf(stderr, "Unknown stage: %s\n", argv[i]);
+      return -10;
+    }
+    process.filters[process.nfilters++].stage = stage;
+  }
+  process.in = y4m_open_read(argv[1]);
+  if (process.in == NULL) {
+    fprintf(stderr, "Failed to open %s\n", argv[1]);
+    return 1;
+  }
+  int nthreads = process.nfilters > 1 ? get_ncpu() / process.nfilters
+                                       : get_ncpu();
+  pipeline_t pipeline;
+  pipeline_init(&pipeline, PIPELINE_RING_SIZE);
+  pipeline_add_stage(&pipeline, "read", y4m_source, &process);
+  y4m_t params = *process.in;
+  bool ok = true;
+  for (int i = 0; i < process.nfilters && ok; i++) {
+    y4m_filter_t *filter = &process.filters[i];
+    filter->slices = slice_pool_new(nthreads);
+    filter->ctx = filter->stage->open(args[i], params.width, params.height,
+                                      filter->slices, &filter->width,
+                                      &filter->height);
+    if (filter->ctx == NULL) {
+      fprintf(stderr, "Bad arguments for %s: %s\n", filter->stage->name,
+              args[i]);
+      ok = false;
+      break;
+    }
+    params.width = filter->width;
+    params.height = filter->height;
+    pipeline_add_stage(&pipeline, filter->stage->name, y4m_filter, filter);
+  }
+  pipeline_add_stage(&pipeline, "write", y4m_sink, &process);
+  if (ok)
+    process.out = y4m_open_write(argv[2], &params);
+  if (process.out) {
+    ok = pipeline_run(&pipeline);
+    char stats[1024];
+    pipeline_dump_stats(&pipeline, stats, sizeof(stats));
+    fprintf(stderr, "%lld frames %dx%d in %.2fs\n%s",
+            (long long)process.out->nframes, params.width, params.height,
+            pipeline.elapsed_us / 1e6, stats);
+  } else {
+    ok = false;
+  }
+  pipeline_destroy(&pipeline);
+  for (int i = 0; i < process.nfilters; i++) {
+    if (process.filters[i].ctx)
+      process.filters[i].stage->close(process.filters[i].ctx);
+    slice_pool_free(process.filters[i].slices);
+  }
+  y4m_close(process.in);
+  y4m_close(process.out);
+  return ok ? 0 : 1;
+}
+
+int bench_main(int argc, char **argv) {
+  if (strcmp(argv[0], "--bench") == 0) {
+    kernels_dump();
+    return bench_stages(argc, argv);
+  } else if (strcmp(argv[0], "--bench-sharpen") == 0) {
+    kernels_dump();
+    return bench_sharpen(argc, argv);
+  } else if (strcmp(argv[0], "--bench-scale") == 0) {
+    kernels_dump();
+    return bench_scale(argc, argv);
+  } else if (strcmp(argv[0], "--bench-denoise") == 0) {
+    kernels_dump();
+    return bench_denoise(argc, argv);
+  } else if (strcmp(argv[0], "--bench-metrics") == 0) {
+    kernels_dump();
+    return bench_metrics(argc, argv);
+  } else if (strcmp(argv[0], "--y4m-pattern") == 0) {
+    return y4m_pattern(argc, argv);
+  } else if (strcmp(argv[0], "--y4m-process") == 0) {
+    return y4m_process(argc, argv);
+  } else if (strcmp(argv[0], "--quality") == 0) {
+    return y4m_quality(argc, argv);
+  }
+  fprintf(stderr, "Unknown command: %s\n", argv[0]);
+  return -10;
+}
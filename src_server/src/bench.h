@@ -0,0 +1,7 @@
+#pragma once
+
+// bench_main runs a pixel engine benchmark instead of the server, every
+// optimized kernel is checked against the C reference on the way.
+// argv[0] is the benchmark switch, e.g. --bench-sharpen 1920x1080 4, or
+// one of the Y4M tools --y4m-pattern, --y4m-process and --quality.
+int bench_main(int argc, char **argv);
@@ -0,0 +1,328 @@
+#include "cache.h"
+#include "include/hbase.h"
+#include "include/hmutex.h"
+#include "include/sha1.h"
+#include <dirent.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct cache_entry_t {
+  char        key[CACHE_KEY_LEN];
+  long long   bytes;
+  time_t      used;
+  int         readers; // fetches copying out of it, it is not evicted then
+} cache_entry_t;
+
+static cache_config_t s_config;
+static hmutex_t s_mutex;
+static honce_t s_once = HONCE_INIT;
+static cache_stats_t s_stats;
+static cache_entry_t s_entries[CACHE_MAX_ENTRIES];
+static int s_nentries = 0;
+static unsigned int s_next_tmp = 0;
+
+static void entry_path(const char *key, char *path, int len) {
+  snprintf(path, len, "%s/%.2s/%s", s_config.dir, key, key);
+}
+
+static void remove_entry_dir(const char *path) {
+  DIR *dp = opendir(path);
+  if (dp == NULL)
+    return;
+  char file[512];
+  struct dirent *ent = NULL;
+  while ((ent = readdir(dp)) != NULL) {
+    if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+      continue;
+    snprintf(file, sizeof(file), "%s/%s", path, ent->d_name);
+    remove(file);
+  }
+  closedir(dp);
+  rmdir(path);
+}
+
+// the files cache_store keeps
+static bool result_file(const char *dir, const char *name, struct stat *st) {
+  if (name[0] == '.' || strcmp(hv_suffixname(name), "tmp") == 0)
+    return false;
+  char path[512];
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  return stat(path, st) == 0 && S_ISREG(st->st_mode);
+}
+
+static long long dir_bytes(const char *dir) {
+  DIR *dp = opendir(dir);
+  if (dp == NULL)
+    return -1;
+  long long bytes = 0;
+  struct dirent *ent = NULL;
+  struct stat st;
+  while ((ent = readdir(dp)) != NULL) {
+    if (result_file(dir, ent->d_name, &st))
+      bytes += st.st_size;
+  }
+  closedir(dp);
+  return bytes;
+}
+
+static cache_entry_t *find_entry(const char *key) {
+  for (int i = 0; i < s_nentries; i++) {
+    if (strcmp(s_entries[i].key, key) == 0)
+      return &s_entries[i];
+  }
+  return NULL;
+}
+
+// evict_one runs locked. The least recently used entry no fetch is reading
+// is renamed aside at once, so a store of the same key can go ahead, path
+// gets where to delete it after the lock is released
+static bool evict_one(long long incoming, char *path, int len) {
+  if (s_nentries == 0 ||
+      (s_stats.bytes + incoming <= s_config.quota_bytes &&
+       (incoming == 0 || s_nentries < CACHE_MAX_ENTRIES)))
+    return false;
+  int oldest = -1;
+  for (int i = 0; i < s_nentries; i++) {
+    if (s_entries[i].readers == 0 &&
+        (oldest < 0 || s_entries[i].used < s_entries[oldest].used))
+      oldest = i;
+  }
+  if (oldest < 0)
+    return false;
+  cache_entry_t *entry = &s_entries[oldest];
+  char entry_dir[512];
+  entry_path(entry->key, entry_dir, sizeof(entry_dir));
+  snprintf(path, len, "%s/.evict-%u", s_config.dir, s_next_tmp++);
+  if (rename(entry_dir, path) != 0)
+    path[0] = '\0';
+  s_stats.bytes -= entry->bytes;
+  s_stats.evicted++;
+  *entry = s_entries[--s_nentries];
+  s_stats.entries = s_nentries;
+  return true;
+}
+
+// cache_evict makes room for incoming bytes
+static void cache_evict(long long incoming) {
+  char path[512];
+  for (;;) {
+    hmutex_lock(&s_mutex);
+    bool evicted = evict_one(incoming, path, sizeof(path));
+    hmutex_unlock(&s_mutex);
+    if (!evicted)
+      break;
+    remove_entry_dir(path);
+  }
+}
+
+static void add_entry(const char *key, long long bytes, time_t used) {
+  if (s_nentries == CACHE_MAX_ENTRIES)
+    return;
+  cache_entry_t *entry = &s_entries[s_nentries++];
+  snprintf(entry->key, sizeof(entry->key), "%s", key);
+  entry->bytes = bytes;
+  entry->used = used;
+  entry->readers = 0;
+  s_stats.bytes += bytes;
+  s_stats.entries = s_nentries;
+}
+
+// the index is rebuilt from the entries on disk, what a crash left half
+// written is dropped
+static void cache_scan(void) {
+  DIR *root = opendir(s_config.dir);
+  if (root == NULL)
+    return;
+  struct dirent *fan = NULL;
+  while ((fan = readdir(root)) != NULL) {
+    char fan_path[512];
+    if (fan->d_name[0] == '.') {
+      if (strncmp(fan->d_name, ".evict-", 7) == 0) {
+        snprintf(fan_path, sizeof(fan_path), "%s/%s", s_config.dir,
+                 fan->d_name);
+        remove_entry_dir(fan_path);
+      }
+      continue;
+    }
+    snprintf(fan_path, sizeof(fan_path), "%s/%s", s_config.dir, fan->d_name);
+    DIR *dp = opendir(fan_path);
+    if (dp == NULL)
+      continue;
+    struct dirent *ent = NULL;
+    while ((ent = readdir(dp)) != NULL) {
+      char path[1024];
+      struct stat st;
+      if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+        continue;
+      snprintf(path, sizeof(path), "%s/%s", fan_path, ent->d_name);
+      if (ent->d_name[0] == '.' || strlen(ent->d_name) != CACHE_KEY_LEN - 1) {
+        remove_entry_dir(path);
+        continue;
+      }
+      if (stat(path, &st) == 0)
+        add_entry(ent->d_name, dir_bytes(path), st.st_mtime);
+    }
+    closedir(dp);
+  }
+  closedir(root);
+}
+
+static void cache_once() {
+  hmutex_init(&s_mutex);
+  if (s_config.dir == NULL)
+    cache_config_init(&s_config);
+  hv_mkdir_p(s_config.dir);
+  cache_scan();
+  cache_evict(0);
+}
+
+void cache_config_init(cache_config_t *config) {
+  memset(config, 0, sizeof(*config));
+  config->dir = CACHE_ROOT_DIR;
+  config->quota_bytes = CACHE_QUOTA;
+}
+
+void cache_init(const cache_config_t *config) {
+  s_config = *config;
+  honce(&s_once, cache_once);
+}
+
+void cache_key(const char *input_hash, const char *params,
+               char key[CACHE_KEY_LEN]) {
+  HV_SHA1_CTX ctx;
+  unsigned char digest[20];
+  HV_SHA1Init(&ctx);
+  HV_SHA1Update(&ctx, (const unsigned char *)input_hash, strlen(input_hash));
+  HV_SHA1Update(&ctx, (const unsigned char *)"\n", 1);
+  HV_SHA1Update(&ctx, (const unsigned char *)params, strlen(params));
+  HV_SHA1Final(digest, &ctx);
+  for (int i = 0; i < 20; i++)
+    snprintf(key + 2 * i, 3, "%02x", digest[i]);
+}
+
+static bool copy_file(const char *src, const char *dst) {
+  FILE *in = fopen(src, "rb");
+  if (in == NULL)
+    return false;
+  FILE *out = fopen(dst, "wb");
+  if (out == NULL) {
+    fclose(in);
+    return false;
+  }
+  char buf[64 * 1024];
+  size_t n = 0;
+  bool ok = true;
+  while (ok && (n = fread(buf, 1, sizeof(buf), in)) > 0)
+    ok = fwrite(buf, 1, n, out) == n;
+  fclose(in);
+  return fclose(out) == 0 && ok;
+}
+
+long long cache_link_files(const char *src, const char *dst) {
+  DIR *dp = opendir(src);
+  if (dp == NULL)
+    return -1;
+  long long bytes = 0;
+  struct dirent *ent = NULL;
+  struct stat st;
+  while ((ent = readdir(dp)) != NULL && bytes >= 0) {
+    if (!result_file(src, ent->d_name, &st))
+      continue;
+    char from[512], to[512];
+    snprintf(from, sizeof(from), "%s/%s", src, ent->d_name);
+    snprintf(to, sizeof(to), "%s/%s", dst, ent->d_name);
+    if (link(from, to) == 0 || copy_file(from, to))
+      bytes += st.st_size;
+    else
+      bytes = -1;
+  }
+  closedir(dp);
+  return bytes;
+}
+
+bool cache_fetch(const char *key, const char *dir) {
+  honce(&s_once, cache_once);
+  if (s_config.quota_bytes <= 0)
+    return false;
+  hmutex_lock(&s_mutex);
+  cache_entry_t *entry = find_entry(key);
+  if (entry == NULL) {
+    s_stats.misses++;
+    hmutex_unlock(&s_mutex);
+    return false;
+  }
+  entry->readers++;
+  entry->used = time(NULL);
+  hmutex_unlock(&s_mutex);
+
+  char path[512];
+  entry_path(key, path, sizeof(path));
+  bool ok = cache_link_files(path, dir) >= 0;
+  // the mtime keeps the LRU order over a restart
+  utimes(path, NULL);
+
+  hmutex_lock(&s_mutex);
+  entry = find_entry(key);
+  if (entry)
+    entry->readers--;
+  if (ok)
+    s_stats.hits++;
+  else
+    s_stats.misses++;
+  hmutex_unlock(&s_mutex);
+  return ok;
+}
+
+// the entry is put together under a dot name and renamed into place, a
+// half written one is never found
+bool cache_store(const char *key, const char *dir) {
+  honce(&s_once, cache_once);
+  if (s_config.quota_bytes <= 0)
+    return false;
+  long long bytes = dir_bytes(dir);
+  if (bytes <= 0 || bytes > s_config.quota_bytes)
+    return false;
+  char path[512], tmp_path[512];
+  entry_path(key, path, sizeof(path));
+  hmutex_lock(&s_mutex);
+  bool found = find_entry(key) != NULL;
+  snprintf(tmp_path, sizeof(tmp_path), "%s/%.2s/.%s.%u", s_config.dir, key,
+           key, s_next_tmp++);
+  hmutex_unlock(&s_mutex);
+  if (found)
+    return true;
+
+  char fan_path[256];
+  snprintf(fan_path, sizeof(fan_path), "%s/%.2s", s_config.dir, key);
+  hv_mkdir_p(fan_path);
+  if (mkdir(tmp_path, 0755) != 0)
+    return false;
+  bytes = cache_link_files(dir, tmp_path);
+  if (bytes <= 0) {
+    remove_entry_dir(tmp_path);
+    return false;
+  }
+
+  cache_evict(bytes);
+  hmutex_lock(&s_mutex);
+  bool stored = find_entry(key) == NULL && rename(tmp_path, path) == 0;
+  if (stored) {
+    add_entry(key, bytes, time(NULL));
+    s_stats.stored++;
+  }
+  hmutex_unlock(&s_mutex);
+  if (!stored)
+    remove_entry_dir(tmp_path);
+  return stored;
+}
+
+void cache_stats(cache_stats_t *stats) {
+  honce(&s_once, cache_once);
+  hmutex_lock(&s_mutex);
+  *stats = s_stats;
+  hmutex_unlock(&s_mutex);
+}
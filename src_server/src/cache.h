@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdbool.h>
+
+// Content addressed cache of job results. An entry is keyed by the SHA-1 of
+// the uploaded file and the processing parameters, and holds the files of a
+// finished job directory. A repeat upload gets them linked into its own job
+// directory, or copied across devices, and is done without transcoding.
+// Entries are evicted least recently used first once the cache is over its
+// quota. The last use is the mtime of the entry, so the order survives a
+// restart.
+
+#define CACHE_ROOT_DIR    "cache"
+#define CACHE_QUOTA       (10LL << 30)
+#define CACHE_MAX_ENTRIES 4096
+#define CACHE_FANOUT      256
+#define CACHE_KEY_LEN     41 // hex SHA-1
+
+typedef struct cache_config_t {
+  const char *dir;
+  long long   quota_bytes; // 0 turns the cache off
+} cache_config_t;
+
+typedef struct cache_stats_t {
+  int         entries;
+  long long   bytes;
+  long        hits;
+  long        misses;
+  long        stored;
+  long        evicted;
+} cache_stats_t;
+
+void cache_config_init(cache_config_t *config);
+// cache_init is optional, the defaults are used otherwise. The entries on
+// disk are indexed on first use
+void cache_init(const cache_config_t *config);
+// cache_key hashes the input hash and the parameters into key
+void cache_key(const char *input_hash, const char *params,
+               char key[CACHE_KEY_LEN]);
+// cache_fetch puts the files of entry key into dir, false is a miss
+bool cache_fetch(const char *key, const char *dir);
+// cache_store makes an entry of the files in dir, names starting with a dot
+// and temporary files left out
+bool cache_store(const char *key, const char *dir);
+void cache_stats(cache_stats_t *stats);
+// cache_link_files hard links the files cache_store would keep from src
+// into dst, or copies them across devices. It returns their bytes or -1
+long long cache_link_files(const char *src, const char *dst);
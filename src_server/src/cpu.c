@@ -0,0 +1,85 @@
+#include "cpu.h"
+#include "include/hmutex.h"
+#include <stdio.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+static unsigned s_detected = 0;
+static unsigned s_features = 0;
+static honce_t s_detect_once = HONCE_INIT;
+
+#if defined(__x86_64__) || defined(__i386__)
+static unsigned long long xgetbv0(void) {
+  unsigned int eax, edx;
+  __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+  return ((unsigned long long)edx << 32) | eax;
+}
+#endif
+
+static void cpu_detect_once() {
+  unsigned features = 0;
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned int eax, ebx, ecx, edx;
+  if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+    if (edx & bit_SSE2)
+      features |= CPU_SSE2;
+    bool osxsave = (ecx & bit_OSXSAVE) && (ecx & bit_AVX);
+    unsigned long long xcr0 = osxsave ? xgetbv0() : 0;
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+      // XMM|YMM state
+      if ((xcr0 & 0x06) == 0x06 && (ebx & bit_AVX2))
+        features |= CPU_AVX2;
+      // XMM|YMM|opmask|ZMM_Hi256|Hi16_ZMM state
+      if ((xcr0 & 0xe6) == 0xe6 && (ebx & bit_AVX512F) &&
+          (ebx & bit_AVX512BW))
+        features |= CPU_AVX512;
+    }
+  }
+#endif
+  s_detected = s_features = features;
+}
+
+unsigned cpu_detect(void) {
+  honce(&s_detect_once, cpu_detect_once);
+  return s_detected;
+}
+
+unsigned cpu_features(void) {
+  honce(&s_detect_once, cpu_detect_once);
+  return s_features;
+}
+
+bool cpu_set_features(const char *spec) {
+  unsigned wanted = 0;
+  if (strcmp(spec, "c") == 0 || strcmp(spec, "scalar") == 0) {
+    wanted = 0;
+  } else if (strcmp(spec, "sse2") == 0) {
+    wanted = CPU_SSE2;
+  } else if (strcmp(spec, "avx2") == 0) {
+    wanted = CPU_SSE2 | CPU_AVX2;
+  } else if (strcmp(spec, "avx512") == 0) {
+    wanted = CPU_SSE2 | CPU_AVX2 | CPU_AVX512;
+  } else {
+    fprintf(stderr, "Unknown cpu features: %s\n", spec);
+    return false;
+  }
+  unsigned detected = cpu_detect();
+  if ((wanted & detected) != wanted) {
+    fprintf(stderr, "cpu features %s not supported, host has %s\n", spec,
+            cpu_features_str(detected));
+  }
+  s_features = wanted & detected;
+  return true;
+}
+
+const char *cpu_features_str(unsigned features) {
+  if (features & CPU_AVX512)
+    return "avx512";
+  if (features & CPU_AVX2)
+    return "avx2";
+  if (features & CPU_SSE2)
+    return "sse2";
+  return "c";
+}
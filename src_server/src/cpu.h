@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdbool.h>
+
+// instruction set levels the pixel kernels are written for
+#define CPU_SSE2    0x01
+#define CPU_AVX2    0x02 // AVX2 and the OS saves YMM state
+#define CPU_AVX512  0x04 // AVX-512 F+BW and the OS saves ZMM state
+
+// cpu_detect probes CPUID once, the result is cached
+unsigned cpu_detect(void);
+// cpu_features is what the kernels may use, cpu_detect unless overridden
+unsigned cpu_features(void);
+// cpu_set_features caps the features for testing each path:
+// "c" (or "scalar"), "sse2", "avx2", "avx512"
+bool cpu_set_features(const char *spec);
+const char *cpu_features_str(unsigned features);
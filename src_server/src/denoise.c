@@ -0,0 +1,486 @@
+#include "denoise.h"
+#include "cpu.h"
+#include <immintrin.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DENOISE_SLICES_PER_THREAD 2
+
+static inline int clamp_int(int v, int lo, int hi) {
+  return v < lo ? lo : v > hi ? hi : v;
+}
+
+/*
+ * C reference
+ */
+static uint32_t sad16_c(const uint8_t *a, int a_stride, const uint8_t *b,
+                        int b_stride) {
+  uint32_t sad = 0;
+  for (int y = 0; y < 16; y++) {
+    for (int x = 0; x < 16; x++) {
+      sad += abs(a[x] - b[x]);
+    }
+    a += a_stride;
+    b += b_stride;
+  }
+  return sad;
+}
+
+static void blend_c(const uint8_t *cur, const uint8_t *const *refs,
+                    const uint16_t *weights, int nrefs, uint8_t *dst,
+                    int width, int threshold, int wsum, int recip) {
+  for (int x = 0; x < width; x++) {
+    int c = cur[x];
+    int acc = DENOISE_WEIGHT_MAX * c;
+    for (int i = 0; i < nrefs; i++) {
+      int r = refs[i][x];
+      if (abs(r - c) > threshold)
+        r = c;
+      acc += weights[i] * r;
+    }
+    dst[x] = (uint8_t)(((acc + wsum / 2) * recip) >> 16);
+  }
+}
+
+static const denoise_kernel_t denoise_kernel_c = {sad16_c, blend_c};
+
+/*
+ * SSE2
+ */
+static uint32_t sad16_sse2(const uint8_t *a, int a_stride, const uint8_t *b,
+                           int b_stride) {
+  __m128i sum = _mm_setzero_si128();
+  for (int y = 0; y < 16; y++) {
+    sum = _mm_add_epi64(
+        sum, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)a),
+                          _mm_loadu_si128((const __m128i *)b)));
+    a += a_stride;
+    b += b_stride;
+  }
+  return (uint32_t)(_mm_cvtsi128_si32(sum) +
+                    _mm_cvtsi128_si32(_mm_srli_si128(sum, 8)));
+}
+
+static inline __m128i load_n(const uint8_t *p, int n) {
+  return n == 16 ? _mm_loadu_si128((const __m128i *)p)
+                 : _mm_loadl_epi64((const __m128i *)p);
+}
+
+// n is 16 or 8, a constant once inlined
+static inline __attribute__((always_inline)) void
+blend_n_sse2(const uint8_t *cur, const uint8_t *const *refs,
+             const uint16_t *weights, int nrefs, uint8_t *dst, int x, int n,
+             __m128i threshold, __m128i half, __m128i recip) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i c = load_n(cur + x, n);
+  __m128i lo = _mm_slli_epi16(_mm_unpacklo_epi8(c, zero), 4);
+  __m128i hi = _mm_slli_epi16(_mm_unpackhi_epi8(c, zero), 4);
+  for (int i = 0; i < nrefs; i++) {
+    __m128i r = load_n(refs[i] + x, n);
+    __m128i diff = _mm_or_si128(_mm_subs_epu8(r, c), _mm_subs_epu8(c, r));
+    __m128i keep = _mm_cmpeq_epi8(_mm_min_epu8(diff, threshold), diff);
+    r = _mm_or_si128(_mm_and_si128(keep, r), _mm_andnot_si128(keep, c));
+    __m128i w = _mm_set1_epi16(weights[i]);
+    lo = _mm_add_epi16(lo, _mm_mullo_epi16(_mm_unpacklo_epi8(r, zero), w));
+    hi = _mm_add_epi16(hi, _mm_mullo_epi16(_mm_unpackhi_epi8(r, zero), w));
+  }
+  lo = _mm_mulhi_epu16(_mm_add_epi16(lo, half), recip);
+  hi = _mm_mulhi_epu16(_mm_add_epi16(hi, half), recip);
+  __m128i out = _mm_packus_epi16(lo, hi);
+  if (n == 16)
+    _mm_storeu_si128((__m128i *)(dst + x), out);
+  else
+    _mm_storel_epi64((__m128i *)(dst + x), out);
+}
+
+static void blend_sse2(const uint8_t *cur, const uint8_t *const *refs,
+                       const uint16_t *weights, int nrefs, uint8_t *dst,
+                       int width, int threshold, int wsum, int recip) {
+  const __m128i vthreshold = _mm_set1_epi8((char)threshold);
+  const __m128i half = _mm_set1_epi16(wsum / 2);
+  const __m128i vrecip = _mm_set1_epi16(recip);
+  int x = 0;
+  for (; x + 16 <= width; x += 16) {
+    blend_n_sse2(cur, refs, weights, nrefs, dst, x, 16, vthreshold, half,
+                 vrecip);
+  }
+  for (; x + 8 <= width; x += 8) {
+    blend_n_sse2(cur, refs, weights, nrefs, dst, x, 8, vthreshold, half,
+                 vrecip);
+  }
+  const uint8_t *tail[DENOISE_MAX_REFS];
+  for (int i = 0; i < nrefs; i++) {
+    tail[i] = refs[i] + x;
+  }
+  blend_c(cur + x, tail, weights, nrefs, dst + x, width - x, threshold, wsum,
+          recip);
+}
+
+static const denoise_kernel_t denoise_kernel_sse2 = {sad16_sse2, blend_sse2};
+
+/*
+ * AVX2, two rows per SAD and 16-bit lanes for the blend
+ */
+__attribute__((target("avx2"))) static uint32_t
+sad16_avx2(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride) {
+  __m256i sum = _mm256_setzero_si256();
+  for (int y = 0; y < 16; y += 2) {
+    __m256i va = _mm256_set_m128i(
+        _mm_loadu_si128((const __m128i *)(a + a_stride)),
+        _mm_loadu_si128((const __m128i *)a));
+    __m256i vb = _mm256_set_m128i(
+        _mm_loadu_si128((const __m128i *)(b + b_stride)),
+        _mm_loadu_si128((const __m128i *)b));
+    sum = _mm256_add_epi64(sum, _mm256_sad_epu8(va, vb));
+    a += 2 * a_stride;
+    b += 2 * b_stride;
+  }
+  __m128i s = _mm_add_epi64(_mm256_castsi256_si128(sum),
+                            _mm256_extracti128_si256(sum, 1));
+  return (uint32_t)(_mm_cvtsi128_si32(s) +
+                    _mm_cvtsi128_si32(_mm_srli_si128(s, 8)));
+}
+
+// 32 pixels at a time like blend_n_sse2 does 16: the clamp stays on bytes
+// and the unpacks and the pack are all in-lane, so they cancel out
+__attribute__((target("avx2"))) static void
+blend_avx2(const uint8_t *cur, const uint8_t *const *refs,
+           const uint16_t *weights, int nrefs, uint8_t *dst, int width,
+           int threshold, int wsum, int recip) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i vthreshold = _mm256_set1_epi8((char)threshold);
+  const __m256i half = _mm256_set1_epi16(wsum / 2);
+  const __m256i vrecip = _mm256_set1_epi16(recip);
+  int x = 0;
+  for (; x + 32 <= width; x += 32) {
+    __m256i c = _mm256_loadu_si256((const __m256i *)(cur + x));
+    __m256i lo = _mm256_slli_epi16(_mm256_unpacklo_epi8(c, zero), 4);
+    __m256i hi = _mm256_slli_epi16(_mm256_unpackhi_epi8(c, zero), 4);
+    for (int i = 0; i < nrefs; i++) {
+      __m256i r = _mm256_loadu_si256((const __m256i *)(refs[i] + x));
+      __m256i diff =
+          _mm256_or_si256(_mm256_subs_epu8(r, c), _mm256_subs_epu8(c, r));
+      __m256i keep =
+          _mm256_cmpeq_epi8(_mm256_min_epu8(diff, vthreshold), diff);
+      r = _mm256_blendv_epi8(c, r, keep);
+      __m256i w = _mm256_set1_epi16(weights[i]);
+      lo = _mm256_add_epi16(
+          lo, _mm256_mullo_epi16(_mm256_unpacklo_epi8(r, zero), w));
+      hi = _mm256_add_epi16(
+          hi, _mm256_mullo_epi16(_mm256_unpackhi_epi8(r, zero), w));
+    }
+    lo = _mm256_mulhi_epu16(_mm256_add_epi16(lo, half), vrecip);
+    hi = _mm256_mulhi_epu16(_mm256_add_epi16(hi, half), vrecip);
+    _mm256_storeu_si256((__m256i *)(dst + x), _mm256_packus_epi16(lo, hi));
+  }
+  // the tail runs legacy SSE code, leave no dirty upper halves behind
+  _mm256_zeroupper();
+  const uint8_t *tail[DENOISE_MAX_REFS];
+  for (int i = 0; i < nrefs; i++) {
+    tail[i] = refs[i] + x;
+  }
+  blend_sse2(cur + x, tail, weights, nrefs, dst + x, width - x, threshold,
+             wsum, recip);
+}
+
+static const denoise_kernel_t denoise_kernel_avx2 = {sad16_avx2, blend_avx2};
+
+const kernel_impl_t denoise_impls[DENOISE_NIMPLS] = {
+    {"avx2", CPU_SSE2 | CPU_AVX2, &denoise_kernel_avx2},
+    {"sse2", CPU_SSE2, &denoise_kernel_sse2},
+    {"c", 0, &denoise_kernel_c},
+};
+
+/*
+ * frame driver
+ */
+typedef struct denoise_mv_t {
+  int16_t x;
+  int16_t y;
+} denoise_mv_t;
+
+struct denoise_t {
+  const denoise_kernel_t *kernel;
+  slice_pool_t   *pool;
+  int             nrefs;
+  int             threshold;
+  uint32_t        sad_lo;
+  uint32_t        sad_hi;
+  // previous source frames, most recent first
+  frame_t        *refs[DENOISE_MAX_REFS];
+  int             nvalid;
+  // vectors per block and reference, of this frame and the last one
+  int             bw;
+  int             bh;
+  denoise_mv_t   *mv[DENOISE_MAX_REFS];
+  denoise_mv_t   *prev_mv[DENOISE_MAX_REFS];
+  bool            have_prev;
+  int             nslices;
+  // current frame
+  const frame_t  *src;
+  frame_t        *dst;
+};
+
+denoise_t *denoise_new(const denoise_opts_t *opts, slice_pool_t *pool) {
+  denoise_t *denoise = (denoise_t *)calloc(1, sizeof(denoise_t));
+  denoise->kernel = (const denoise_kernel_t *)kernel_get(KERNEL_DENOISE);
+  denoise->pool = pool;
+  int strength = clamp_int(opts->strength, 0, 64);
+  denoise->nrefs = strength ? clamp_int(opts->nrefs, 1, DENOISE_MAX_REFS) : 0;
+  denoise->threshold = clamp_int(3 * strength, 0, 255);
+  // 1.5 and 3 times the noise sigma per pixel, over 256 pixels
+  denoise->sad_lo = 384 * strength;
+  denoise->sad_hi = 768 * strength;
+  denoise->nslices = slice_pool_threads(pool) * DENOISE_SLICES_PER_THREAD;
+  return denoise;
+}
+
+static void denoise_reset(denoise_t *denoise) {
+  for (int i = 0; i < denoise->nvalid; i++) {
+    frame_unref(denoise->refs[i]);
+    denoise->refs[i] = NULL;
+  }
+  denoise->nvalid = 0;
+  denoise->have_prev = false;
+}
+
+void denoise_free(denoise_t *denoise) {
+  if (denoise == NULL)
+    return;
+  denoise_reset(denoise);
+  for (int i = 0; i < DENOISE_MAX_REFS; i++) {
+    free(denoise->mv[i]);
+    free(denoise->prev_mv[i]);
+  }
+  free(denoise);
+}
+
+void denoise_set_kernel(denoise_t *denoise, const denoise_kernel_t *kernel) {
+  denoise->kernel = kernel;
+}
+
+static inline denoise_mv_t clamp_mv(denoise_mv_t mv, int bx, int by, int w,
+                                    int h) {
+  mv.x = (int16_t)clamp_int(mv.x, bx > DENOISE_RANGE ? -DENOISE_RANGE : -bx,
+                            w - DENOISE_BLOCK - bx < DENOISE_RANGE
+                                ? w - DENOISE_BLOCK - bx
+                                : DENOISE_RANGE);
+  mv.y = (int16_t)clamp_int(mv.y, by > DENOISE_RANGE ? -DENOISE_RANGE : -by,
+                            h - DENOISE_BLOCK - by < DENOISE_RANGE
+                                ? h - DENOISE_BLOCK - by
+                                : DENOISE_RANGE);
+  return mv;
+}
+
+// predictors first, then a small diamond walk from the best of them
+static uint32_t denoise_search(denoise_t *denoise, const frame_t *ref, int bx,
+                               int by, const denoise_mv_t *cands, int ncands,
+                               denoise_mv_t *best) {
+  static const int8_t diamond[4][2] = {{1, 0}, {-1, 0}, {0, 1}, {0, -1}};
+  const frame_t *src = denoise->src;
+  const uint8_t *cur = src->data[0] + (size_t)by * src->linesize[0] + bx;
+  int stride = ref->linesize[0];
+  const uint8_t *base = ref->data[0] + (size_t)by * stride + bx;
+  uint32_t best_sad = UINT32_MAX;
+  for (int i = 0; i < ncands; i++) {
+    denoise_mv_t mv = clamp_mv(cands[i], bx, by, src->width, src->height);
+    if (i > 0 && mv.x == best->x && mv.y == best->y)
+      continue;
+    uint32_t sad = denoise->kernel->sad16(
+        cur, src->linesize[0], base + mv.y * stride + mv.x, stride);
+    if (sad < best_sad) {
+      best_sad = sad;
+      *best = mv;
+    }
+  }
+  for (int step = 0; step < DENOISE_RANGE; step++) {
+    denoise_mv_t center = *best;
+    for (int i = 0; i < 4; i++) {
+      denoise_mv_t mv = {(int16_t)(center.x + diamond[i][0]),
+                         (int16_t)(center.y + diamond[i][1])};
+      denoise_mv_t clamped = clamp_mv(mv, bx, by, src->width, src->height);
+      if (clamped.x != mv.x || clamped.y != mv.y)
+        continue;
+      uint32_t sad = denoise->kernel->sad16(
+          cur, src->linesize[0], base + mv.y * stride + mv.x, stride);
+      if (sad < best_sad) {
+        best_sad = sad;
+        *best = mv;
+      }
+    }
+    if (best->x == center.x && best->y == center.y)
+      break;
+  }
+  return best_sad;
+}
+
+// blend the rows [y0, y1) of the block at (bx, by) of one plane, the block
+// is size pixels wide and the vectors are in this plane's pixels
+static void denoise_blend_block(denoise_t *denoise, int plane, int bx, int y0,
+                                int y1, int size, const denoise_mv_t *mv,
+                                const uint16_t *weights, int nrefs,
+                                int wsum) {
+  const frame_t *src = denoise->src;
+  frame_t *dst = denoise->dst;
+  const uint8_t *refs[DENOISE_MAX_REFS];
+  for (int y = y0; y < y1; y++) {
+    const uint8_t *cur = src->data[plane] + (size_t)y * src->linesize[plane];
+    uint8_t *out = dst->data[plane] + (size_t)y * dst->linesize[plane];
+    if (nrefs == 0) {
+      memcpy(out + bx, cur + bx, size);
+      continue;
+    }
+    for (int i = 0; i < nrefs; i++) {
+      const frame_t *ref = denoise->refs[i];
+      refs[i] = ref->data[plane] + (size_t)(y + mv[i].y) * ref->linesize[plane] +
+                bx + mv[i].x;
+    }
+    denoise->kernel->blend(cur + bx, refs, weights, nrefs, out + bx, size,
+                           denoise->threshold, wsum, 65536 / wsum);
+  }
+}
+
+static void denoise_block(denoise_t *denoise, int i, int j) {
+  const frame_t *src = denoise->src;
+  int w = src->width;
+  int h = src->height;
+  int b = j * denoise->bw + i;
+  int bx = i * DENOISE_BLOCK < w - DENOISE_BLOCK ? i * DENOISE_BLOCK
+                                                 : w - DENOISE_BLOCK;
+  int by = j * DENOISE_BLOCK < h - DENOISE_BLOCK ? j * DENOISE_BLOCK
+                                                 : h - DENOISE_BLOCK;
+  denoise_mv_t mv[DENOISE_MAX_REFS];
+  uint16_t weights[DENOISE_MAX_REFS];
+  int nrefs = 0;
+  int wsum = DENOISE_WEIGHT_MAX;
+  for (int r = 0; r < denoise->nvalid; r++) {
+    // only predictors every slicing sees alike, so the result does not
+    // depend on the thread count: the block to the left, and this block and
+    // the one below in the last frame
+    denoise_mv_t cands[6] = {{0, 0}};
+    int ncands = 1;
+    if (i > 0)
+      cands[ncands++] = denoise->mv[r][b - 1];
+    if (denoise->have_prev) {
+      cands[ncands++] = denoise->prev_mv[r][b];
+      if (j + 1 < denoise->bh)
+        cands[ncands++] = denoise->prev_mv[r][b + denoise->bw];
+    }
+    if (r > 0) {
+      // constant motion, one frame further back
+      denoise_mv_t near = denoise->mv[r - 1][b];
+      cands[ncands++] = (denoise_mv_t){(int16_t)(near.x * (r + 1) / r),
+                                       (int16_t)(near.y * (r + 1) / r)};
+    }
+    denoise_mv_t best = {0, 0};
+    uint32_t sad = denoise_search(denoise, denoise->refs[r], bx, by, cands,
+                                  ncands, &best);
+    denoise->mv[r][b] = best;
+    int weight = 0;
+    if (sad <= denoise->sad_lo)
+      weight = DENOISE_WEIGHT_MAX;
+    else if (sad < denoise->sad_hi)
+      weight = DENOISE_WEIGHT_MAX * (denoise->sad_hi - sad) /
+               (denoise->sad_hi - denoise->sad_lo);
+    if (weight > 0) {
+      mv[nrefs] = best;
+      weights[nrefs++] = (uint16_t)weight;
+      wsum += weight;
+    }
+  }
+
+  // only the rows of this block row, the clamped last row overlaps the one
+  // above, which another slice may be writing
+  int y1 = (j + 1) * DENOISE_BLOCK < h ? (j + 1) * DENOISE_BLOCK : h;
+  denoise_blend_block(denoise, 0, bx, j * DENOISE_BLOCK, y1, DENOISE_BLOCK, mv,
+                      weights, nrefs, wsum);
+
+  int cw = frame_plane_width(src, 1);
+  int ch = frame_plane_height(src, 1);
+  int half = DENOISE_BLOCK / 2;
+  int cbx = i * half < cw - half ? i * half : cw - half;
+  int cy0 = j * half;
+  int cy1 = (j + 1) * half < ch ? (j + 1) * half : ch;
+  denoise_mv_t cmv[DENOISE_MAX_REFS];
+  for (int r = 0; r < nrefs; r++) {
+    // keep the chroma block and every row it reads inside the plane
+    cmv[r].x = (int16_t)clamp_int(mv[r].x >> 1, -cbx, cw - half - cbx);
+    cmv[r].y = (int16_t)clamp_int(mv[r].y >> 1, -cy0, ch - cy1);
+  }
+  for (int plane = 1; plane < 3; plane++) {
+    denoise_blend_block(denoise, plane, cbx, cy0, cy1, half, cmv, weights,
+                        nrefs, wsum);
+  }
+}
+
+static void denoise_slice(void *arg, int slice, int nslices) {
+  denoise_t *denoise = (denoise_t *)arg;
+  int row0 = denoise->bh * slice / nslices;
+  int row1 = denoise->bh * (slice + 1) / nslices;
+  for (int j = row0; j < row1; j++) {
+    for (int i = 0; i < denoise->bw; i++) {
+      denoise_block(denoise, i, j);
+    }
+  }
+}
+
+static void copy_frame(const frame_t *src, frame_t *dst) {
+  for (int i = 0; i < 3; i++) {
+    int w = frame_plane_width(src, i);
+    int h = frame_plane_height(src, i);
+    for (int y = 0; y < h; y++) {
+      memcpy(dst->data[i] + (size_t)y * dst->linesize[i],
+             src->data[i] + (size_t)y * src->linesize[i], w);
+    }
+  }
+  dst->pts = src->pts;
+}
+
+void denoise_frame(denoise_t *denoise, frame_t *src, frame_t *dst) {
+  if (denoise->nrefs == 0 || src->width < DENOISE_BLOCK ||
+      src->height < DENOISE_BLOCK) {
+    copy_frame(src, dst);
+    return;
+  }
+  int bw = (src->width + DENOISE_BLOCK - 1) / DENOISE_BLOCK;
+  int bh = (src->height + DENOISE_BLOCK - 1) / DENOISE_BLOCK;
+  if (bw != denoise->bw || bh != denoise->bh ||
+      (denoise->nvalid && (denoise->refs[0]->width != src->width ||
+                           denoise->refs[0]->height != src->height))) {
+    denoise_reset(denoise);
+    for (int i = 0; i < DENOISE_MAX_REFS; i++) {
+      free(denoise->mv[i]);
+      free(denoise->prev_mv[i]);
+      denoise->mv[i] = (denoise_mv_t *)calloc(bw * bh, sizeof(denoise_mv_t));
+      denoise->prev_mv[i] =
+          (denoise_mv_t *)calloc(bw * bh, sizeof(denoise_mv_t));
+    }
+    denoise->bw = bw;
+    denoise->bh = bh;
+  }
+
+  denoise->src = src;
+  denoise->dst = dst;
+  if (denoise->nvalid == 0) {
+    copy_frame(src, dst);
+  } else {
+    int nslices = denoise->nslices < bh ? denoise->nslices : bh;
+    slice_pool_run(denoise->pool, denoise_slice, denoise, nslices);
+    dst->pts = src->pts;
+    for (int i = 0; i < DENOISE_MAX_REFS; i++) {
+      denoise_mv_t *tmp = denoise->prev_mv[i];
+      denoise->prev_mv[i] = denoise->mv[i];
+      denoise->mv[i] = tmp;
+    }
+    denoise->have_prev = denoise->nvalid == denoise->nrefs;
+  }
+
+  // slide the window, src becomes the nearest reference
+  if (denoise->nvalid == denoise->nrefs)
+    frame_unref(denoise->refs[--denoise->nvalid]);
+  memmove(denoise->refs + 1, denoise->refs,
+          denoise->nvalid * sizeof(frame_t *));
+  denoise->refs[0] = frame_ref(src);
+  denoise->nvalid++;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "frame.h"
+#include "kernels.h"
+#include "slice.h"
+
+// Motion-compensated temporal denoiser for YUV420 frames. The previous
+// nrefs source frames stay referenced (they come from the frame pool, so
+// nothing is copied). Every 16x16 luma block searches each of them for its
+// best integer motion vector by SAD, starting from neighbour and previous
+// frame vectors, and gets a weight from how well it matched:
+//   sad/px <= 1.5 * strength  full weight
+//   sad/px >= 3 * strength    ignored (occlusion, scene cut)
+// Pixels that still differ by more than 3 * strength from the current one
+// are left out, then current and references are averaged. Chroma follows
+// the luma vectors on 8x8 blocks.
+
+#define DENOISE_MAX_REFS    4
+#define DENOISE_BLOCK       16
+#define DENOISE_RANGE       16 // search range in luma pixels
+#define DENOISE_WEIGHT_MAX  16 // weight of the current frame
+
+// sad16 sums absolute differences of a 16x16 block
+typedef uint32_t (*denoise_sad_fn)(const uint8_t *a, int a_stride,
+                                   const uint8_t *b, int b_stride);
+// blend averages one row of width pixels (8 or 16): refs pixels further than
+// threshold from cur are replaced by cur, then
+//   dst = ((16 * cur + sum(weights[i] * refs[i]) + wsum / 2) * recip) >> 16
+// where wsum = 16 + sum(weights) and recip = 65536 / wsum
+typedef void (*denoise_blend_fn)(const uint8_t *cur,
+                                 const uint8_t *const *refs,
+                                 const uint16_t *weights, int nrefs,
+                                 uint8_t *dst, int width, int threshold,
+                                 int wsum, int recip);
+
+typedef struct denoise_kernel_t {
+  denoise_sad_fn    sad16;
+  denoise_blend_fn  blend;
+} denoise_kernel_t;
+
+// avx2, sse2, c, see kernels.h
+#define DENOISE_NIMPLS 3
+extern const kernel_impl_t denoise_impls[DENOISE_NIMPLS];
+
+typedef struct denoise_opts_t {
+  int strength; // expected noise sigma in 8-bit steps, 0 disables
+  int nrefs;    // previous frames averaged in, up to DENOISE_MAX_REFS
+} denoise_opts_t;
+
+typedef struct denoise_t denoise_t;
+
+denoise_t *denoise_new(const denoise_opts_t *opts, slice_pool_t *pool);
+// denoise_free drops the references to the previous frames
+void denoise_free(denoise_t *denoise);
+// denoise_set_kernel overrides the kernel bound in the registry
+void denoise_set_kernel(denoise_t *denoise, const denoise_kernel_t *kernel);
+// denoise_frame keeps a reference to src for the following frames, src must
+// be a pooled or otherwise reference counted frame of a constant size
+void denoise_frame(denoise_t *denoise, frame_t *src, frame_t *dst);
@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "frame.h"
+#include "framepool.h"
+
+#define ALIGN_UP(x, a) (((x) + (a)-1) & ~((a)-1))
+
+int frame_plane_width(const frame_t *frame, int plane) {
+  return plane == 0 ? frame->width : (frame->width + 1) >> 1;
+}
+
+int frame_plane_height(const frame_t *frame, int plane) {
+  return plane == 0 ? frame->height : (frame->height + 1) >> 1;
+}
+
+int frame_linesize(int width) {
+  int linesize = ALIGN_UP(width, FRAME_ALIGN);
+  // strides of a multiple of 4K map every row to the same cache sets
+  if (linesize % 4096 == 0)
+    linesize += FRAME_ALIGN;
+  return linesize;
+}
+
+int frame_size(frame_format_e format, int width, int height) {
+  int chroma = ((width + 1) >> 1) * ((height + 1) >> 1);
+  return width * height + 2 * chroma;
+}
+
+frame_t *frame_alloc(frame_format_e format, int width, int height) {
+  frame_t *frame = (frame_t *)calloc(1, sizeof(frame_t));
+  if (frame == NULL)
+    return NULL;
+  frame->format = format;
+  frame->width = width;
+  frame->height = height;
+  size_t offsets[3];
+  size_t total = 0;
+  for (int i = 0; i < 3; i++) {
+    frame->linesize[i] = frame_linesize(frame_plane_width(frame, i));
+    offsets[i] = total;
+    total += (size_t)frame->linesize[i] * frame_plane_height(frame, i);
+  }
+  uint8_t *buf = (uint8_t *)aligned_alloc(FRAME_ALIGN, total);
+  if (buf == NULL) {
+    free(frame);
+    return NULL;
+  }
+  for (int i = 0; i < 3; i++) {
+    frame->data[i] = buf + offsets[i];
+  }
+  atomic_store(&frame->refcnt, 1);
+  return frame;
+}
+
+void frame_free(frame_t *frame) {
+  if (frame == NULL)
+    return;
+  free(frame->data[0]);
+  free(frame);
+}
+
+frame_t *frame_ref(frame_t *frame) {
+  atomic_fetch_add(&frame->refcnt, 1);
+  return frame;
+}
+
+void frame_unref(frame_t *frame) {
+  if (frame == NULL)
+    return;
+  if (atomic_fetch_sub(&frame->refcnt, 1) != 1)
+    return;
+  if (frame->owner == NULL)
+    frame_free(frame);
+  else
+    framepool_recycle(frame);
+}
+
+int frame_read_raw(frame_t *frame, FILE *fp) {
+  for (int i = 0; i < 3; i++) {
+    int w = frame_plane_width(frame, i);
+    int h = frame_plane_height(frame, i);
+    for (int y = 0; y < h; y++) {
+      if (fread(frame->data[i] + (size_t)y * frame->linesize[i], 1, w, fp) !=
+          (size_t)w)
+        return -1;
+    }
+  }
+  return 0;
+}
+
+int frame_write_raw(const frame_t *frame, FILE *fp) {
+  for (int i = 0; i < 3; i++) {
+    int w = frame_plane_width(frame, i);
+    int h = frame_plane_height(frame, i);
+    for (int y = 0; y < h; y++) {
+      if (fwrite(frame->data[i] + (size_t)y * frame->linesize[i], 1, w, fp) !=
+          (size_t)w)
+        return -1;
+    }
+  }
+  return 0;
+}
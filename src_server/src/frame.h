@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define FRAME_ALIGN 64
+
+typedef enum {
+  FRAME_YUV420P
+} frame_format_e;
+
+typedef struct frame_t {
+  frame_format_e format;
+  int            width;
+  int            height;
+  uint8_t       *data[3];
+  int            linesize[3];
+  int64_t        pts;
+  atomic_int     refcnt;  // 1 from frame_alloc and framepool_get
+  void          *owner;   // set for frames owned by a framepool
+} frame_t;
+
+// planes are FRAME_ALIGN aligned and every row is padded to FRAME_ALIGN
+frame_t *frame_alloc(frame_format_e format, int width, int height);
+void frame_free(frame_t *frame);
+
+// frame_ref/frame_unref share a frame between stages, pooled or not, the
+// last frame_unref gives it back to its pool or frees an unpooled frame
+frame_t *frame_ref(frame_t *frame);
+void frame_unref(frame_t *frame);
+
+// frame_linesize is the padded stride used for a plane of width bytes
+int frame_linesize(int width);
+
+int frame_plane_width(const frame_t *frame, int plane);
+int frame_plane_height(const frame_t *frame, int plane);
+// frame_size is the packed size of the frame as ffmpeg rawvideo writes it
+int frame_size(frame_format_e format, int width, int height);
+
+int frame_read_raw(frame_t *frame, FILE *fp);
+int frame_write_raw(const frame_t *frame, FILE *fp);
@@ -0,0 +1,278 @@
+#include "framepool.h"
+#include "include/hmutex.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define FRAMEPOOL_ARENA_FRAMES 4 // at least, an arena fills whole huge pages
+#define FRAMEPOOL_MAX_BUCKETS  16
+
+#define ALIGN_UP(x, a) (((x) + (a)-1) & ~((size_t)(a)-1))
+
+typedef struct framepool_bucket_t framepool_bucket_t;
+
+typedef struct framepool_arena_t {
+  struct framepool_arena_t *next;
+  framepool_bucket_t       *bucket;
+  uint8_t                  *base;
+  size_t                    size;
+  bool                      hugetlb;
+  int                       nframes;
+  int                       nfree;
+  frame_t                  *frames; // headers, one per frame in the arena
+} framepool_arena_t;
+
+struct framepool_bucket_t {
+  framepool_t        *pool;
+  frame_format_e      format;
+  int                 width;
+  int                 height;
+  size_t              frame_bytes;
+  framepool_arena_t  *arenas;
+  int                 nframes;  // in all arenas
+  frame_t           **free;
+  int                 nfree;
+  int                 capacity;
+};
+
+struct framepool_t {
+  hmutex_t            mutex;
+  framepool_bucket_t  buckets[FRAMEPOOL_MAX_BUCKETS];
+  int                 nbuckets;
+  framepool_stats_t   stats;
+};
+
+static framepool_t *s_default_pool = NULL;
+static honce_t s_default_once = HONCE_INIT;
+
+static void framepool_default_init() { s_default_pool = framepool_new(); }
+
+framepool_t *framepool_default(void) {
+  honce(&s_default_once, framepool_default_init);
+  return s_default_pool;
+}
+
+framepool_t *framepool_new(void) {
+  framepool_t *pool = (framepool_t *)calloc(1, sizeof(framepool_t));
+  hmutex_init(&pool->mutex);
+  return pool;
+}
+
+// frame layout inside an arena slot, planes FRAME_ALIGN aligned
+static size_t frame_layout(frame_t *frame, size_t offsets[3]) {
+  size_t total = 0;
+  for (int i = 0; i < 3; i++) {
+    frame->linesize[i] = frame_linesize(frame_plane_width(frame, i));
+    offsets[i] = total;
+    total += ALIGN_UP((size_t)frame->linesize[i] * frame_plane_height(frame, i),
+                      FRAME_ALIGN);
+  }
+  return total;
+}
+
+static void *arena_map(size_t size, bool *hugetlb) {
+  void *base = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+  *hugetlb = base != MAP_FAILED;
+  if (base == MAP_FAILED) {
+    // no reserved huge pages, ask for transparent ones instead
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+      return NULL;
+#ifdef MADV_HUGEPAGE
+    madvise(base, size, MADV_HUGEPAGE);
+#endif
+  }
+  return base;
+}
+
+// called with the pool mutex held
+static bool bucket_grow(framepool_bucket_t *bucket) {
+  framepool_t *pool = bucket->pool;
+  size_t size = ALIGN_UP(bucket->frame_bytes * FRAMEPOOL_ARENA_FRAMES,
+                         FRAMEPOOL_HUGEPAGE_SIZE);
+  // use the rounding slack for more frames
+  int nframes = size / bucket->frame_bytes;
+
+  if (bucket->nframes + nframes > bucket->capacity) {
+    frame_t **free_list = (frame_t **)realloc(
+        bucket->free, (bucket->nframes + nframes) * sizeof(frame_t *));
+    if (free_list == NULL)
+      return false;
+    bucket->free = free_list;
+    bucket->capacity = bucket->nframes + nframes;
+    pool->stats.mallocs++;
+  }
+  framepool_arena_t *arena =
+      (framepool_arena_t *)calloc(1, sizeof(framepool_arena_t));
+  frame_t *frames = (frame_t *)calloc(nframes, sizeof(frame_t));
+  bool hugetlb = false;
+  uint8_t *base =
+      arena && frames ? (uint8_t *)arena_map(size, &hugetlb) : NULL;
+  if (base == NULL) {
+    free(arena);
+    free(frames);
+    return false;
+  }
+  pool->stats.mallocs += 3;
+  pool->stats.arenas++;
+  pool->stats.hugetlb += hugetlb;
+  pool->stats.bytes += size;
+
+  arena->bucket = bucket;
+  arena->base = base;
+  arena->size = size;
+  arena->hugetlb = hugetlb;
+  arena->nframes = nframes;
+  arena->nfree = nframes;
+  arena->frames = frames;
+  arena->next = bucket->arenas;
+  bucket->arenas = arena;
+  bucket->nframes += nframes;
+  for (int i = 0; i < nframes; i++) {
+    frame_t *frame = &frames[i];
+    size_t offsets[3];
+    frame->format = bucket->format;
+    frame->width = bucket->width;
+    frame->height = bucket->height;
+    frame_layout(frame, offsets);
+    for (int p = 0; p < 3; p++) {
+      frame->data[p] = base + i * bucket->frame_bytes + offsets[p];
+    }
+    frame->owner = arena;
+    bucket->free[bucket->nfree++] = frame;
+  }
+  return true;
+}
+
+static framepool_bucket_t *bucket_find(framepool_t *pool,
+                                       frame_format_e format, int width,
+                                       int height) {
+  for (int i = 0; i < pool->nbuckets; i++) {
+    framepool_bucket_t *bucket = &pool->buckets[i];
+    if (bucket->format == format && bucket->width == width &&
+        bucket->height == height)
+      return bucket;
+  }
+  framepool_bucket_t *bucket = NULL;
+  if (pool->nbuckets < FRAMEPOOL_MAX_BUCKETS) {
+    bucket = &pool->buckets[pool->nbuckets++];
+  } else {
+    // recycle a bucket whose arenas were all trimmed away
+    for (int i = 0; i < pool->nbuckets && bucket == NULL; i++) {
+      if (pool->buckets[i].arenas == NULL)
+        bucket = &pool->buckets[i];
+    }
+    if (bucket == NULL)
+      return NULL;
+    free(bucket->free);
+  }
+  memset(bucket, 0, sizeof(*bucket));
+  bucket->pool = pool;
+  bucket->format = format;
+  bucket->width = width;
+  bucket->height = height;
+  frame_t layout = {.format = format, .width = width, .height = height};
+  size_t offsets[3];
+  bucket->frame_bytes = frame_layout(&layout, offsets);
+  return bucket;
+}
+
+frame_t *framepool_get(framepool_t *pool, frame_format_e format, int width,
+                       int height) {
+  frame_t *frame = NULL;
+  hmutex_lock(&pool->mutex);
+  framepool_bucket_t *bucket = bucket_find(pool, format, width, height);
+  if (bucket && bucket->nfree == 0) {
+    bucket_grow(bucket);
+  } else if (bucket) {
+    pool->stats.recycled++;
+  }
+  if (bucket && bucket->nfree > 0) {
+    frame = bucket->free[--bucket->nfree];
+    ((framepool_arena_t *)frame->owner)->nfree--;
+    pool->stats.gets++;
+  }
+  hmutex_unlock(&pool->mutex);
+  if (frame == NULL) {
+    // out of buckets or memory, hand out a plain frame rather than fail
+    frame = frame_alloc(format, width, height);
+    return frame;
+  }
+  atomic_store(&frame->refcnt, 1);
+  frame->pts = 0;
+  return frame;
+}
+
+void framepool_recycle(frame_t *frame) {
+  framepool_arena_t *arena = (framepool_arena_t *)frame->owner;
+  framepool_bucket_t *bucket = arena->bucket;
+  framepool_t *pool = bucket->pool;
+  hmutex_lock(&pool->mutex);
+  bucket->free[bucket->nfree++] = frame;
+  arena->nfree++;
+  hmutex_unlock(&pool->mutex);
+}
+
+static void arena_unmap(framepool_t *pool, framepool_arena_t *arena) {
+  pool->stats.arenas--;
+  pool->stats.hugetlb -= arena->hugetlb;
+  pool->stats.bytes -= arena->size;
+  munmap(arena->base, arena->size);
+  free(arena->frames);
+  free(arena);
+}
+
+void framepool_trim(framepool_t *pool) {
+  hmutex_lock(&pool->mutex);
+  for (int i = 0; i < pool->nbuckets; i++) {
+    framepool_bucket_t *bucket = &pool->buckets[i];
+    framepool_arena_t **link = &bucket->arenas;
+    while (*link) {
+      framepool_arena_t *arena = *link;
+      if (arena->nfree != arena->nframes) {
+        link = &arena->next;
+        continue;
+      }
+      // drop the arena's frames from the free list, then the arena
+      int nfree = 0;
+      for (int j = 0; j < bucket->nfree; j++) {
+        if (bucket->free[j]->owner != arena)
+          bucket->free[nfree++] = bucket->free[j];
+      }
+      bucket->nfree = nfree;
+      bucket->nframes -= arena->nframes;
+      *link = arena->next;
+      arena_unmap(pool, arena);
+    }
+  }
+  hmutex_unlock(&pool->mutex);
+}
+
+void framepool_stats(framepool_t *pool, framepool_stats_t *stats) {
+  hmutex_lock(&pool->mutex);
+  *stats = pool->stats;
+  hmutex_unlock(&pool->mutex);
+}
+
+void framepool_free(framepool_t *pool) {
+  if (pool == NULL)
+    return;
+  for (int i = 0; i < pool->nbuckets; i++) {
+    framepool_bucket_t *bucket = &pool->buckets[i];
+    while (bucket->arenas) {
+      framepool_arena_t *arena = bucket->arenas;
+      bucket->arenas = arena->next;
+      arena_unmap(pool, arena);
+    }
+    free(bucket->free);
+  }
+  hmutex_destroy(&pool->mutex);
+  free(pool);
+}
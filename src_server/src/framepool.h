@@ -0,0 +1,37 @@
+#pragma once
+
+#include "frame.h"
+
+// framepool hands out frames keyed by (format, width, height). Planes are
+// FRAME_ALIGN aligned and stride padded, carved from arenas backed by huge
+// pages (MAP_HUGETLB, falling back to transparent huge pages). Frames are
+// reference counted and go back to their bucket on the last frame_unref,
+// so a steady stream of one size never reaches malloc or mmap.
+
+#define FRAMEPOOL_HUGEPAGE_SIZE (2 << 20)
+
+typedef struct framepool_t framepool_t;
+
+typedef struct framepool_stats_t {
+  long gets;          // frames handed out
+  long recycled;      // of which came from a free list
+  long mallocs;       // arena mmaps and header allocations
+  long arenas;        // arenas currently mapped
+  long hugetlb;       // of which are backed by MAP_HUGETLB
+  long bytes;         // bytes currently mapped
+} framepool_stats_t;
+
+framepool_t *framepool_new(void);
+// framepool_default is shared by every job of the process
+framepool_t *framepool_default(void);
+void framepool_free(framepool_t *pool);
+
+// framepool_get returns a frame with one reference
+frame_t *framepool_get(framepool_t *pool, frame_format_e format, int width,
+                       int height);
+// framepool_trim unmaps arenas whose frames are all free
+void framepool_trim(framepool_t *pool);
+void framepool_stats(framepool_t *pool, framepool_stats_t *stats);
+
+// framepool_recycle is frame_unref's way back into the pool
+void framepool_recycle(frame_t *frame);
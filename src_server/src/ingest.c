@@ -0,0 +1,113 @@
+#include "ingest.h"
+#include "include/hatomic.h"
+#include "include/hbase.h"
+#include "include/hmutex.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define INGEST_CHUNK (256 * 1024)
+
+typedef enum {
+  INGEST_RUNNING,
+  INGEST_COMPLETE,
+  INGEST_ABORTED,
+} ingest_state_e;
+
+struct ingest_t {
+  atomic_int      refcnt;
+  hmutex_t        mutex;
+  hcondvar_t      cond;
+  long long       size;
+  ingest_state_e  state;
+};
+
+ingest_t *ingest_new(void) {
+  ingest_t *ingest = NULL;
+  HV_ALLOC_SIZEOF(ingest);
+  ingest->refcnt = 1;
+  hmutex_init(&ingest->mutex);
+  hcondvar_init(&ingest->cond);
+  return ingest;
+}
+
+ingest_t *ingest_ref(ingest_t *ingest) {
+  ATOMIC_INC(&ingest->refcnt);
+  return ingest;
+}
+
+void ingest_put(ingest_t *ingest) {
+  if (ingest == NULL)
+    return;
+  if (ATOMIC_DEC(&ingest->refcnt) == 1) {
+    hcondvar_destroy(&ingest->cond);
+    hmutex_destroy(&ingest->mutex);
+    HV_FREE(ingest);
+  }
+}
+
+void ingest_grow(ingest_t *ingest, long long size) {
+  hmutex_lock(&ingest->mutex);
+  if (size > ingest->size) {
+    ingest->size = size;
+    hcondvar_broadcast(&ingest->cond);
+  }
+  hmutex_unlock(&ingest->mutex);
+}
+
+void ingest_end(ingest_t *ingest, bool complete) {
+  hmutex_lock(&ingest->mutex);
+  if (ingest->state == INGEST_RUNNING) {
+    ingest->state = complete ? INGEST_COMPLETE : INGEST_ABORTED;
+    hcondvar_broadcast(&ingest->cond);
+  }
+  hmutex_unlock(&ingest->mutex);
+}
+
+// ingest_next waits until there is more than offset or the end
+static ingest_state_e ingest_next(ingest_t *ingest, long long offset,
+                                  long long *size) {
+  hmutex_lock(&ingest->mutex);
+  while (ingest->size <= offset && ingest->state == INGEST_RUNNING)
+    hcondvar_wait(&ingest->cond, &ingest->mutex);
+  *size = ingest->size;
+  ingest_state_e state = ingest->state;
+  hmutex_unlock(&ingest->mutex);
+  return state;
+}
+
+bool ingest_copy(ingest_t *ingest, const char *path, FILE *out) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return false;
+  char *buf = (char *)malloc(INGEST_CHUNK);
+  long long offset = 0, size = 0;
+  bool ok = false;
+  for (;;) {
+    ingest_state_e state = ingest_next(ingest, offset, &size);
+    if (state == INGEST_ABORTED)
+      break;
+    if (offset >= size) {
+      ok = state == INGEST_COMPLETE;
+      break;
+    }
+    long long left = size - offset;
+    ssize_t n = pread(fd, buf, left < INGEST_CHUNK ? left : INGEST_CHUNK,
+                      offset);
+    if (n <= 0 || fwrite(buf, 1, n, out) != (size_t)n)
+      break;
+    offset += n;
+  }
+  free(buf);
+  close(fd);
+  return fflush(out) == 0 && ok;
+}
+
+bool ingest_wait(ingest_t *ingest) {
+  hmutex_lock(&ingest->mutex);
+  while (ingest->state == INGEST_RUNNING)
+    hcondvar_wait(&ingest->cond, &ingest->mutex);
+  bool complete = ingest->state == INGEST_COMPLETE;
+  hmutex_unlock(&ingest->mutex);
+  return complete;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdio.h>
+
+// A spool file that is still being written, shared between the connection
+// receiving it and a job that reads it as it grows. The writer reports what
+// is on disk, the reader follows behind and blocks at the end until more
+// arrives, so the event loop never waits on the transcoder and the spool
+// keeps the whole input for a retry.
+
+typedef struct ingest_t ingest_t;
+
+// ingest_new returns a referenced ingest, release it with ingest_put
+ingest_t *ingest_new(void);
+ingest_t *ingest_ref(ingest_t *ingest);
+void ingest_put(ingest_t *ingest);
+
+// writer: size bytes of the file are written, then the end, complete tells
+// whether all of it arrived
+void ingest_grow(ingest_t *ingest, long long size);
+void ingest_end(ingest_t *ingest, bool complete);
+
+// reader: ingest_copy copies path to out as it grows, it returns false if
+// the upload was cut short or out stopped taking data
+bool ingest_copy(ingest_t *ingest, const char *path, FILE *out);
+// ingest_wait blocks until the end and returns whether the file is complete
+bool ingest_wait(ingest_t *ingest);
@@ -0,0 +1,706 @@
+#include "job.h"
+#include "admission.h"
+#include "ingest.h"
+#include "spool.h"
+#include "include/hbase.h"
+#include "include/hmutex.h"
+#include "include/hthread.h"
+#include "include/htime.h"
+#include "videoprocess.h"
+#include <dirent.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// scheduler cost of a job over its plain encode
+#define JOB_DENOISE_FACTOR  1.5
+#define JOB_CRF_CANDIDATES  6 // sample encodes per sample, see video_choose_crf
+#define JOB_SCHED_CLIENTS   16 // in job_dump_sched_json
+
+static job_t *s_jobs[JOB_MAX_NUM] = {0};
+static atomic_uint s_next_id = 1;
+static hmutex_t s_jobs_mutex;
+static honce_t s_jobs_once = HONCE_INIT;
+static sched_t *s_sched = NULL;
+static long s_coalesced = 0; // transcodes saved by waiting on a leader
+
+static double job_sched_run(sched_task_t *task);
+
+static void job_table_init() {
+  hmutex_init(&s_jobs_mutex);
+  sched_config_t config;
+  sched_config_init(&config);
+  config.trace_path = SCHED_TRACE_FILE;
+  s_sched = sched_new(&config);
+  sched_load_clients(s_sched, SCHED_CLIENTS_FILE);
+  sched_start(s_sched, job_sched_run);
+}
+
+static void remove_dir_files(const char *dir) {
+  DIR *dp = opendir(dir);
+  if (dp == NULL)
+    return;
+  char path[512];
+  struct dirent *ent = NULL;
+  while ((ent = readdir(dp)) != NULL) {
+    if (ent->d_name[0] == '.')
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+    remove(path);
+  }
+  closedir(dp);
+  rmdir(dir);
+}
+
+job_t *job_new(job_output_e output) {
+  honce(&s_jobs_once, job_table_init);
+  job_t *job = NULL;
+  HV_ALLOC_SIZEOF(job);
+  job->refcnt = 1;
+  job->state = JOB_QUEUED;
+  job->output = output;
+  job->created_ms = gettick_ms();
+  // the segmenters copy the video, everything else is encoded
+  job->crf = JOB_CRF_AUTO;
+  job->crf_target = CRF_TARGET;
+  switch (output) {
+  case JOB_OUTPUT_HLS:
+    strcpy(job->manifest, "index.m3u8");
+    job->crf = 0;
+    break;
+  case JOB_OUTPUT_DASH:
+    strcpy(job->manifest, "manifest.mpd");
+    job->crf = 0;
+    break;
+  case JOB_OUTPUT_LADDER:
+    // renditions are named after their height, see video_ladder
+    break;
+  case JOB_OUTPUT_TRIM:
+    strcpy(job->manifest, "output.mp4");
+    job->crf = 0;
+    break;
+  default:
+    strcpy(job->manifest, "output.mp4");
+    break;
+  }
+
+  // ids come off an atomic counter, the lock only guards the table slot. 0
+  // is no job, it is skipped when the counter wraps
+  for (int i = 0; i < JOB_MAX_NUM && job->id == 0; i++) {
+    unsigned int id = ATOMIC_INC(&s_next_id);
+    if (id == 0)
+      continue;
+    hmutex_lock(&s_jobs_mutex);
+    if (s_jobs[id % JOB_MAX_NUM] == NULL) {
+      job->id = id;
+      s_jobs[id % JOB_MAX_NUM] = job;
+    }
+    hmutex_unlock(&s_jobs_mutex);
+  }
+  if (job->id == 0) {
+    fprintf(stderr, "job table is full!\n");
+    HV_FREE(job);
+    return NULL;
+  }
+
+  // the outputs are written until the job finishes
+  char name[16];
+  snprintf(name, sizeof(name), "%u", job->id);
+  job->spool_dir = spool_place();
+  spool_fanout(job->spool_dir, name, job->dir, sizeof(job->dir));
+  // whatever an earlier job of this id left there is not this job's
+  remove_dir_files(job->dir);
+  hv_mkdir_p(job->dir);
+  // one reference for the table, one for the caller
+  ATOMIC_INC(&job->refcnt);
+  return job;
+}
+
+job_t *job_get(unsigned int id) {
+  honce(&s_jobs_once, job_table_init);
+  job_t *job = NULL;
+  hmutex_lock(&s_jobs_mutex);
+  job = s_jobs[id % JOB_MAX_NUM];
+  if (job && job->id == id) {
+    ATOMIC_INC(&job->refcnt);
+  } else {
+    job = NULL;
+  }
+  hmutex_unlock(&s_jobs_mutex);
+  return job;
+}
+
+void job_put(job_t *job) {
+  if (job == NULL)
+    return;
+  if (ATOMIC_DEC(&job->refcnt) == 1) {
+    ingest_put(job->ingest);
+    spool_free(job->spool);
+    job_put(job->leader);
+    remove_dir_files(job->dir);
+    HV_FREE(job);
+  }
+}
+
+static const char *job_output_name(job_t *job, int i, char *buf, int len) {
+  if (job->output == JOB_OUTPUT_LADDER)
+    snprintf(buf, len, "%dp.mp4", job->heights[i]);
+  else
+    snprintf(buf, len, "%s", job->manifest);
+  return buf;
+}
+
+// job_score runs after the outputs are served, the report fills in as
+// each of them is scored
+static void job_score(job_t *job) {
+  int noutputs = job->output == JOB_OUTPUT_LADDER ? job->nheights : 1;
+  for (int i = 0; i < noutputs; i++) {
+    char name[32], path[256];
+    snprintf(path, sizeof(path), "%s/%s", job->dir,
+             job_output_name(job, i, name, sizeof(name)));
+    if (!video_quality(job->input, path, &job->quality[i],
+                       &job->quality_frames[i]))
+      break;
+    job->nquality = i + 1;
+  }
+  job->scoring = false;
+}
+
+static void job_choose_crf(job_t *job, const char *preset) {
+  video_crf_t crf;
+  if (job->crf != JOB_CRF_AUTO)
+    return;
+  if (!video_choose_crf(job->input, job->dir, job->crf_target, preset,
+                        &crf)) {
+    job->crf = 0;
+    return;
+  }
+  job->crf = crf.crf;
+  job->crf_score = crf.score;
+  job->crf_ratio = crf.size_ratio;
+  job->crf_cpu_sec = crf.cpu_sec;
+}
+
+// the samples shrank by crf_ratio, the outputs are assumed to do the same
+static void job_count_saved(job_t *job) {
+  int noutputs = job->output == JOB_OUTPUT_LADDER ? job->nheights : 1;
+  size_t bytes = 0;
+  for (int i = 0; i < noutputs; i++) {
+    char name[32], path[256];
+    snprintf(path, sizeof(path), "%s/%s", job->dir,
+             job_output_name(job, i, name, sizeof(name)));
+    bytes += hv_filesize(path);
+  }
+  if (job->crf_ratio > 0)
+    job->bytes_saved = (long long)(bytes / job->crf_ratio) - (long long)bytes;
+}
+
+static bool job_encodes(const job_t *job) {
+  return job->output == JOB_OUTPUT_LADDER || job->output == JOB_OUTPUT_FILE;
+}
+
+// job_segment_live segments the upload as it arrives. Should ffmpeg give up
+// on the pipe the spool still gets all of it, and the segmenter runs again
+// on the file once it is in
+static bool job_segment_live(job_t *job) {
+  bool dash = job->output == JOB_OUTPUT_DASH;
+  FILE *fp = video_segment_pipe(job->dir, job->manifest, dash);
+  bool ok = fp != NULL;
+  if (fp) {
+    ok = ingest_copy(job->ingest, job->input, fp);
+    ok = video_segment_close(fp, job->dir, job->manifest, dash) && ok;
+  }
+  if (!ok && ingest_wait(job->ingest)) {
+    printf("job %u live segmenting failed, retrying from the spool\n",
+           job->id);
+    ok = video_segment(job->input, job->dir, job->manifest, dash);
+  }
+  return ok;
+}
+
+// job_release_waiters hands the outputs of a finished leader to the jobs
+// waiting on it, the waiters share its quality report through leader
+static void job_release_waiters(job_t *job, bool ok) {
+  hmutex_lock(&s_jobs_mutex);
+  job->leading = false;
+  job_t *waiter = job->waiters;
+  job->waiters = NULL;
+  hmutex_unlock(&s_jobs_mutex);
+  while (waiter) {
+    job_t *next = waiter->next_waiter;
+    waiter->next_waiter = NULL;
+    waiter->task.preset = job->task.preset;
+    waiter->crf = job->crf;
+    waiter->crf_score = job->crf_score;
+    waiter->crf_ratio = job->crf_ratio;
+    waiter->bytes_saved = job->bytes_saved;
+    job_finish(waiter, ok && cache_link_files(job->dir, waiter->dir) >= 0);
+    job_put(waiter);
+    waiter = next;
+  }
+}
+
+// job_run returns the seconds spent in the encode itself
+static double job_run(job_t *job) {
+  job->state = JOB_RUNNING;
+  bool ok = false;
+  const char *preset =
+      job_encodes(job) ? sched_preset_name(job->task.preset) : NULL;
+  job_choose_crf(job, preset);
+  double start = sched_now();
+  switch (job->output) {
+  case JOB_OUTPUT_HLS:
+  case JOB_OUTPUT_DASH:
+    ok = job->ingest ? job_segment_live(job)
+                     : video_segment(job->input, job->dir, job->manifest,
+                                     job->output == JOB_OUTPUT_DASH);
+    break;
+  case JOB_OUTPUT_TRIM: {
+    char output[256];
+    snprintf(output, sizeof(output), "%s/%s", job->dir, job->manifest);
+    ok = video_trim(job->input, job->dir, output, job->trim_start,
+                    job->trim_end);
+    break;
+  }
+  case JOB_OUTPUT_LADDER:
+    ok = video_ladder(job->input, job->dir, job->heights, job->nheights,
+                      job->crf, preset, &job->cpu_sec, &job->cpu_saved_sec);
+    break;
+  default: {
+    char output[256];
+    snprintf(output, sizeof(output), "%s/%s", job->dir, job->manifest);
+    // upscaled phone and CCTV footage looks soft, restore some edges
+    sharpen_opts_t sharpen = {0.5f, 2, false};
+    video_filter_opts_t opts = {job->denoise, NULL, job->scale_width,
+                                job->scale_height,
+                                (scale_filter_e)job->scale_filter, job->crf,
+                                preset};
+    if (job->scale_width || job->scale_height)
+      opts.sharpen = &sharpen;
+    ok = video_filter_cpu(job->input, output, &opts);
+    break;
+  }
+  }
+  double encode_sec = sched_now() - start;
+  if (ok)
+    job_count_saved(job);
+  // a trim only matches a piece of the input, there is nothing to score
+  job->scoring = ok && job->output != JOB_OUTPUT_TRIM;
+  job_finish(job, ok);
+  if (ok && *job->cache_key)
+    cache_store(job->cache_key, job->dir);
+  job_release_waiters(job, ok);
+  if (job->scoring)
+    job_score(job);
+  return ok ? encode_sec : 0;
+}
+
+static double job_sched_run(sched_task_t *task) {
+  job_t *job = (job_t *)task->userdata;
+  double encode_sec = job_run(job);
+  job_put(job);
+  return encode_sec;
+}
+
+// the segmenters and trims copy the video and skip the queue
+static HTHREAD_ROUTINE(job_thread) {
+  job_t *job = (job_t *)userdata;
+  job_run(job);
+  job_put(job);
+  return 0;
+}
+
+// the cost model counts the pixels encoded, all renditions of a ladder add up
+static HTHREAD_ROUTINE(job_probe_thread) {
+  job_t *job = (job_t *)userdata;
+  video_probe_t probe;
+  sched_task_t *task = &job->task;
+  task->userdata = job;
+  task->client = job->client;
+  if (video_probe(job->input, &probe)) {
+    task->duration = probe.duration;
+    task->width = probe.width;
+    task->height = probe.height;
+    if (job->output == JOB_OUTPUT_LADDER) {
+      double pixels = 0;
+      for (int i = 0; i < job->nheights; i++) {
+        pixels += (double)probe.width * job->heights[i] * job->heights[i] /
+                  probe.height;
+      }
+      task->height = (int)(pixels / probe.width);
+    } else if (job->scale_height > 0) {
+      task->width = job->scale_width > 0
+                        ? job->scale_width
+                        : probe.width * job->scale_height / probe.height;
+      task->height = job->scale_height;
+    } else if (job->scale_width > 0) {
+      task->height = probe.height * job->scale_width / probe.width;
+      task->width = job->scale_width;
+    }
+    // the shortest expected job runs first, so count what comes on top of
+    // the encode: the denoiser in process and the CRF sample encodes
+    task->factor = job->denoise > 0 ? JOB_DENOISE_FACTOR : 1.0;
+    if (job->crf == JOB_CRF_AUTO && probe.duration > 0)
+      task->factor += JOB_CRF_CANDIDATES * CRF_SAMPLES * CRF_SAMPLE_SEC /
+                      probe.duration;
+  }
+  sched_submit(s_sched, task);
+  return 0;
+}
+
+const char *job_output_dir(const job_t *job) {
+  return job->leader && job->state < JOB_DONE ? job->leader->dir : job->dir;
+}
+
+void job_finish(job_t *job, bool ok) {
+  if (job->spool_dir >= 0) {
+    spool_unplace(job->spool_dir);
+    job->spool_dir = -1;
+  }
+  job->finished_ms = gettick_ms();
+  job->state = ok ? JOB_DONE : JOB_FAILED;
+  printf("job %u %s\n", job->id, job_state_str(job->state));
+}
+
+void job_drop(job_t *job) {
+  if (job->spool_dir >= 0) {
+    spool_unplace(job->spool_dir);
+    job->spool_dir = -1;
+  }
+  bool listed = false;
+  hmutex_lock(&s_jobs_mutex);
+  if (s_jobs[job->id % JOB_MAX_NUM] == job) {
+    s_jobs[job->id % JOB_MAX_NUM] = NULL;
+    listed = true;
+  }
+  hmutex_unlock(&s_jobs_mutex);
+  if (listed)
+    job_put(job);
+  job_put(job);
+}
+
+// job_cache_params spells out everything the result depends on but the
+// input. The preset is left out: it follows the load, not the request
+static void job_cache_params(const job_t *job, char *buf, int len) {
+  // the size too, a client that only knows the hash of a file gets nothing
+  int offset = snprintf(buf, len, "size=%lld output=%d crf=%d target=%.4f",
+                        job->input_size, job->output, job->crf,
+                        job->crf_target);
+  switch (job->output) {
+  case JOB_OUTPUT_LADDER:
+    for (int i = 0; i < job->nheights && offset < len; i++) {
+      offset += snprintf(buf + offset, len - offset, " %dp", job->heights[i]);
+    }
+    break;
+  case JOB_OUTPUT_FILE:
+    snprintf(buf + offset, len - offset, " size=%dx%d filter=%d denoise=%d",
+             job->scale_width, job->scale_height, job->scale_filter,
+             job->denoise);
+    break;
+  case JOB_OUTPUT_TRIM:
+    snprintf(buf + offset, len - offset, " trim=%.6f-%.6f", job->trim_start,
+             job->trim_end);
+    break;
+  default:
+    break;
+  }
+}
+
+// job_fetch_cached finishes the job with a cached result if there is one
+static bool job_fetch_cached(job_t *job) {
+  if (*job->input_hash == '\0' || job->ingest)
+    return false;
+  char params[256];
+  job_cache_params(job, params, sizeof(params));
+  cache_key(job->input_hash, params, job->cache_key);
+  if (!cache_fetch(job->cache_key, job->dir))
+    return false;
+  job->cached = true;
+  job_finish(job, true);
+  return true;
+}
+
+static void job_spawn(job_t *job) {
+  hmutex_lock(&s_jobs_mutex);
+  job->started = true;
+  hmutex_unlock(&s_jobs_mutex);
+  ATOMIC_INC(&job->refcnt);
+  hthread_t th = hthread_create(
+      job_encodes(job) ? job_probe_thread : job_thread, job);
+  pthread_detach(th);
+}
+
+// job_join makes the job wait on a leader with the same cache_key, or with
+// lead set makes it the leader others wait on. Both happen under the table
+// lock, of two identical jobs started at once only one transcodes
+static bool job_join(job_t *job, bool lead) {
+  if (*job->cache_key == '\0')
+    return false;
+  job_t *leader = NULL;
+  spool_t *spool = NULL;
+  hmutex_lock(&s_jobs_mutex);
+  for (int i = 0; i < JOB_MAX_NUM && leader == NULL; i++) {
+    job_t *other = s_jobs[i];
+    if (other && other != job && other->leading &&
+        strcmp(other->cache_key, job->cache_key) == 0)
+      leader = other;
+  }
+  if (leader) {
+    // one reference each way, the leader drops its own on release
+    ATOMIC_INC(&leader->refcnt);
+    ATOMIC_INC(&job->refcnt);
+    job->leader = leader;
+    job->next_waiter = leader->waiters;
+    leader->waiters = job;
+    // the leader has the same input, this copy is not needed
+    spool = job->spool;
+    job->spool = NULL;
+    job->input[0] = '\0';
+    s_coalesced++;
+  } else {
+    job->leading = lead;
+  }
+  hmutex_unlock(&s_jobs_mutex);
+  spool_free(spool);
+  if (leader)
+    printf("job %u waits on job %u\n", job->id, leader->id);
+  return leader != NULL;
+}
+
+bool job_start(job_t *job) {
+  honce(&s_jobs_once, job_table_init);
+  if (!job_fetch_cached(job) && !job_join(job, true))
+    job_spawn(job);
+  return true;
+}
+
+// job_find_input dups the spool of a started job whose uploaded input has
+// hash and size. The size guards against a client that knows a hash only.
+// Waiters gave their spool up and jobs not started yet may still, the dup
+// is made under the table lock so the file cannot go in between
+static spool_t *job_find_input(const char *hash, long long size) {
+  spool_t *found = NULL;
+  hmutex_lock(&s_jobs_mutex);
+  for (int i = 0; i < JOB_MAX_NUM && found == NULL; i++) {
+    job_t *job = s_jobs[i];
+    if (job && job->started && job->leader == NULL && job->spool &&
+        strcmp(job->input_hash, hash) == 0 &&
+        spool_size(job->spool) == size)
+      found = spool_dup(job->spool);
+  }
+  hmutex_unlock(&s_jobs_mutex);
+  return found;
+}
+
+bool job_start_known(job_t *job) {
+  honce(&s_jobs_once, job_table_init);
+  if (job_fetch_cached(job) || job_join(job, false))
+    return true;
+  job->spool = job_find_input(job->input_hash, job->input_size);
+  if (job->spool == NULL)
+    return false;
+  job->reused_input = true;
+  snprintf(job->input, sizeof(job->input), "%s", spool_path(job->spool));
+  if (!job_join(job, true))
+    job_spawn(job);
+  return true;
+}
+
+bool job_start_live(job_t *job, ingest_t *ingest) {
+  if (job_encodes(job) || job->output == JOB_OUTPUT_TRIM)
+    return false;
+  job->ingest = ingest_ref(ingest);
+  return job_start(job);
+}
+
+const char *job_state_str(job_state_e state) {
+  switch (state) {
+  case JOB_QUEUED:
+    return "queued";
+  case JOB_RUNNING:
+    return "running";
+  case JOB_DONE:
+    return "done";
+  case JOB_FAILED:
+    return "failed";
+  default:
+    return "unknown";
+  }
+}
+
+// a waiter is as far as its leader
+static job_state_e job_shown_state(const job_t *job) {
+  return job->leader && job->state < JOB_DONE ? job->leader->state
+                                               : job->state;
+}
+
+int job_dump_json(job_t *job, char *buf, int len) {
+  int offset = 0;
+  job_state_e state = job_shown_state(job);
+  if (job->output != JOB_OUTPUT_LADDER) {
+    offset = snprintf(
+        buf, len, "{\"id\":%u,\"state\":\"%s\",\"manifest\":\"/stream/%u/%s\"",
+        job->id, job_state_str(state), job->id, job->manifest);
+  } else {
+    offset = snprintf(buf, len, "{\"id\":%u,\"state\":\"%s\",\"renditions\":[",
+                      job->id, job_state_str(state));
+    for (int i = 0; i < job->nheights && offset < len; i++) {
+      offset += snprintf(buf + offset, len - offset, "%s\"/stream/%u/%dp.mp4\"",
+                         i ? "," : "", job->id, job->heights[i]);
+    }
+    if (offset < len) {
+      offset += snprintf(buf + offset, len - offset,
+                         "],\"cpu_sec\":%.2f,\"cpu_saved_sec\":%.2f",
+                         job->cpu_sec, job->cpu_saved_sec);
+    }
+  }
+  if (offset < len && job->ingest)
+    offset += snprintf(buf + offset, len - offset, ",\"live\":true");
+  if (offset < len && job->cached)
+    offset += snprintf(buf + offset, len - offset, ",\"cached\":true");
+  if (offset < len && job->reused_input)
+    offset += snprintf(buf + offset, len - offset, ",\"reused_input\":true");
+  if (offset < len && job->leader)
+    offset += snprintf(buf + offset, len - offset, ",\"leader\":%u",
+                       job->leader->id);
+  if (offset < len && job_encodes(job) && state != JOB_QUEUED) {
+    offset += snprintf(buf + offset, len - offset, ",\"preset\":\"%s\"",
+                       sched_preset_name(job->task.preset));
+  }
+  if (offset < len && job->crf_ratio > 0) {
+    offset += snprintf(buf + offset, len - offset,
+                       ",\"crf\":{\"value\":%d,\"target\":%.4f,\"score\":%.4f,"
+                       "\"cpu_sec\":%.2f,\"bytes_saved\":%lld}",
+                       job->crf, job->crf_target, job->crf_score,
+                       job->crf_cpu_sec, job->bytes_saved);
+  }
+  if (offset < len)
+    offset += snprintf(buf + offset, len - offset, "}");
+  return offset < len ? offset : len - 1;
+}
+
+int job_dump_quality_json(job_t *job, char *buf, int len) {
+  // the outputs of a waiter are those of its leader
+  const job_t *scored = job->leader ? job->leader : job;
+  int offset = snprintf(buf, len,
+                        "{\"id\":%u,\"state\":\"%s\",\"scoring\":%s,"
+                        "\"outputs\":[",
+                        job->id, job_state_str(job_shown_state(job)),
+                        scored->scoring ? "true" : "false");
+  int nquality = scored->nquality;
+  for (int i = 0; i < nquality && offset < len; i++) {
+    char name[32];
+    offset += snprintf(buf + offset, len - offset,
+                       "%s{\"output\":\"/stream/%u/%s\",\"quality\":",
+                       i ? "," : "", job->id,
+                       job_output_name(job, i, name, sizeof(name)));
+    if (offset < len)
+      offset += metrics_dump_json(&scored->quality[i],
+                                  scored->quality_frames[i], buf + offset,
+                                  len - offset);
+    if (offset < len)
+      offset += snprintf(buf + offset, len - offset, "}");
+  }
+  if (offset < len)
+    offset += snprintf(buf + offset, len - offset, "]}");
+  return offset < len ? offset : len - 1;
+}
+
+bool job_admit(int pending, double *retry_after) {
+  honce(&s_jobs_once, job_table_init);
+  return sched_admit(s_sched, pending, retry_after);
+}
+
+// json_appendf appends at offset while there is room and returns the offset
+// the text ends at either way, so a report can be measured with a 0 len
+static int json_appendf(char *buf, int len, int offset, const char *fmt,
+                        ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int n = offset < len ? vsnprintf(buf + offset, len - offset, fmt, ap)
+                       : vsnprintf(NULL, 0, fmt, ap);
+  va_end(ap);
+  return offset + n;
+}
+
+int job_dump_sched_json(char *buf, int len) {
+  honce(&s_jobs_once, job_table_init);
+  sched_stats_t stats;
+  sched_client_stats_t clients[JOB_SCHED_CLIENTS];
+  sched_stats(s_sched, &stats);
+  int nclients = sched_client_stats(s_sched, clients, JOB_SCHED_CLIENTS);
+  int offset = json_appendf(
+      buf, len, 0,
+      "{\"submitted\":%ld,\"finished\":%ld,\"queued\":%d,"
+      "\"running\":%d,\"backlog_sec\":%.1f,\"calibration\":%.3f,"
+      "\"clients\":[",
+      stats.submitted, stats.finished, stats.queued, stats.running,
+      stats.backlog_sec, stats.calibration);
+  for (int i = 0; i < nclients; i++) {
+    const sched_client_stats_t *client = &clients[i];
+    offset = json_appendf(
+        buf, len, offset,
+        "%s{\"client\":\"%s\",\"weight\":%g,\"max_running\":%d,"
+        "\"queued\":%d,\"running\":%d,\"finished\":%ld,"
+        "\"service_sec\":%.1f,\"share\":%.3f}",
+        i ? "," : "", client->id, client->weight, client->max_running,
+        client->queued, client->running, client->finished,
+        client->service_sec, client->share);
+  }
+  admission_stats_t admission;
+  admission_stats(&admission);
+  spool_stats_t spool;
+  spool_stats(&spool);
+  offset = json_appendf(
+      buf, len, offset,
+      "],\"admission\":{\"admitted\":%ld,\"busy\":%ld,\"too_large\":%ld,"
+      "\"inflight\":%d,\"inflight_bytes\":%lld},"
+      "\"spool\":{\"memory_files\":%d,\"memory_bytes\":%lld,"
+      "\"disk_files\":%d,\"spilled\":%ld,\"dirs\":[",
+      admission.admitted, admission.busy, admission.too_large,
+      admission.inflight, admission.inflight_bytes, spool.memory_files,
+      spool.memory_bytes, spool.disk_files, spool.spilled);
+  spool_dir_stats_t dirs[SPOOL_MAX_DIRS];
+  int ndirs = spool_dir_stats(dirs, SPOOL_MAX_DIRS);
+  for (int i = 0; i < ndirs; i++) {
+    offset = json_appendf(
+        buf, len, offset,
+        "%s{\"path\":\"%s\",\"free_bytes\":%lld,\"writers\":%d}",
+        i ? "," : "", dirs[i].path, dirs[i].free_bytes, dirs[i].writers);
+  }
+  cache_stats_t cache;
+  cache_stats(&cache);
+  hmutex_lock(&s_jobs_mutex);
+  long coalesced = s_coalesced;
+  hmutex_unlock(&s_jobs_mutex);
+  offset = json_appendf(
+      buf, len, offset,
+      "]},\"cache\":{\"entries\":%d,\"bytes\":%lld,\"hits\":%ld,"
+      "\"misses\":%ld,\"stored\":%ld,\"evicted\":%ld},"
+      "\"coalesced\":%ld}",
+      cache.entries, cache.bytes, cache.hits, cache.misses, cache.stored,
+      cache.evicted, coalesced);
+  return offset;
+}
+
+void job_sweep(void) {
+  honce(&s_jobs_once, job_table_init);
+  unsigned int now = gettick_ms();
+  job_t *expired[JOB_MAX_NUM];
+  int nexpired = 0;
+  hmutex_lock(&s_jobs_mutex);
+  for (int i = 0; i < JOB_MAX_NUM; i++) {
+    job_t *job = s_jobs[i];
+    if (job == NULL || job->state < JOB_DONE)
+      continue;
+    if (now - job->finished_ms >= JOB_TTL) {
+      s_jobs[i] = NULL;
+      expired[nexpired++] = job;
+    }
+  }
+  hmutex_unlock(&s_jobs_mutex);
+  for (int i = 0; i < nexpired; i++) {
+    job_put(expired[i]);
+  }
+}
@@ -0,0 +1,137 @@
+#pragma once
+
+#include "include/hatomic.h"
+#include "cache.h"
+#include "metrics.h"
+#include "scheduler.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define JOB_MAX_NUM   1024
+#define JOB_TTL       3600000 // ms, finished jobs stay watchable this long
+
+typedef enum {
+  JOB_QUEUED,
+  JOB_RUNNING,
+  JOB_DONE,
+  JOB_FAILED
+} job_state_e;
+
+typedef enum {
+  JOB_OUTPUT_FILE,
+  JOB_OUTPUT_HLS,
+  JOB_OUTPUT_DASH,
+  JOB_OUTPUT_LADDER,
+  JOB_OUTPUT_TRIM
+} job_output_e;
+
+#define JOB_MAX_RENDITIONS 4
+#define JOB_CRF_AUTO       -1
+
+typedef struct job_t {
+  // queued on the encode workers, task.userdata is the job
+  sched_task_t          task;
+  unsigned int          id;
+  atomic_int            refcnt;
+  volatile job_state_e  state;
+  job_output_e          output;
+  unsigned int          created_ms;
+  unsigned int          finished_ms;
+  char                  dir[128];
+  int                   spool_dir; // dir is placed there, see spool_place
+  char                  input[2048];
+  struct spool_t       *spool;   // input lives here, owned by the job
+  // the spool is a dup of the one of another job with the same input, the
+  // client sent only its hash, see job_start_known
+  bool                  reused_input;
+  bool                  started; // spawned, its spool is final
+  // hex SHA-1 and size of the input, with the parameters they key the
+  // result cache and the jobs waiting on a leader
+  char                  input_hash[41];
+  long long             input_size;
+  char                  cache_key[CACHE_KEY_LEN];
+  bool                  cached;  // the result came from the cache
+  // a job whose cache_key matches one already running waits for it instead
+  // of transcoding again, see job_start. The leader takes waiters until it
+  // is done, then links its outputs into theirs
+  bool                  leading;
+  struct job_t         *leader;
+  struct job_t         *waiters;
+  struct job_t         *next_waiter;
+  // set when the job starts while input is still being uploaded, see
+  // ingest.h, the segmenters then read it as it arrives
+  struct ingest_t      *ingest;
+  char                  manifest[32];
+  char                  client[SCHED_CLIENT_LEN];
+  // JOB_OUTPUT_LADDER
+  int                   heights[JOB_MAX_RENDITIONS];
+  int                   nheights;
+  double                cpu_sec;
+  double                cpu_saved_sec;
+  // JOB_OUTPUT_FILE, a 0 size follows the aspect ratio, 0x0 keeps it
+  int                   scale_width;
+  int                   scale_height;
+  int                   scale_filter; // scale_filter_e
+  int                   denoise;      // strength, 0 is off
+  // JOB_OUTPUT_TRIM, seconds
+  double                trim_start;
+  double                trim_end;
+  // x264 CRF of the encoded outputs, 0 is the x264 default and JOB_CRF_AUTO
+  // picks it from sample encodes scored against crf_target
+  int                   crf;
+  double                crf_target;   // MS-SSIM
+  double                crf_score;    // of the worst sample
+  double                crf_ratio;    // sample bytes against CRF_DEFAULT
+  double                crf_cpu_sec;
+  long long             bytes_saved;  // against CRF_DEFAULT, estimated
+  // every output scored against the input once the job is done, a ladder
+  // has one entry per rendition
+  metrics_result_t      quality[JOB_MAX_RENDITIONS];
+  long                  quality_frames[JOB_MAX_RENDITIONS];
+  volatile int          nquality;
+  volatile bool         scoring;
+} job_t;
+
+// job_new returns a referenced job with its own directory in the spool
+// directory with the most room, see spool.h
+job_t *job_new(job_output_e output);
+// job_get returns a new reference or NULL, release it with job_put
+job_t *job_get(unsigned int id);
+void job_put(job_t *job);
+
+// job_start takes ownership of job->input and runs the job in the background,
+// jobs that encode wait for a worker of the scheduler and get their preset.
+// With input_hash set a cached result is used instead, the job is done then,
+// or the job waits on a running one with the same input and parameters
+bool job_start(job_t *job);
+// job_start_known starts a job on an input known only by input_hash and
+// input_size, from the cache, the input of another job or by waiting on a
+// job with the same input. It returns false if none has it, the input must
+// be uploaded then
+bool job_start_known(job_t *job);
+// job_start_live starts a segmenter job on an input that is still arriving,
+// it takes a reference to ingest. Encoding jobs need all of their input for
+// the probe and the CRF samples and are refused
+bool job_start_live(job_t *job, struct ingest_t *ingest);
+// job_finish marks the job done or failed, it is swept JOB_TTL later
+void job_finish(job_t *job, bool ok);
+// job_output_dir is where the outputs are served from, the directory of
+// the leader while the job waits on one
+const char *job_output_dir(const job_t *job);
+// job_drop takes a job that never started out of the table and releases
+// the reference of the caller
+void job_drop(job_t *job);
+
+const char *job_state_str(job_state_e state);
+int job_dump_json(job_t *job, char *buf, int len);
+int job_dump_quality_json(job_t *job, char *buf, int len);
+// job_admit is sched_admit on the job queue
+bool job_admit(int pending, double *retry_after);
+// job_dump_sched_json reports the queue and its busiest clients, their
+// depth and share of the encode time so far, and the upload admission. Like
+// snprintf it returns the length of the whole report, len or more means buf
+// was too small
+int job_dump_sched_json(char *buf, int len);
+
+// job_sweep drops finished jobs older than JOB_TTL and their files
+void job_sweep(void);
@@ -0,0 +1,68 @@
+#include "kernels.h"
+#include "cpu.h"
+#include "denoise.h"
+#include "metrics.h"
+#include "scale.h"
+#include "sharpen.h"
+#include <stdio.h>
+
+typedef struct kernel_entry_t {
+  const char           *name;
+  const kernel_impl_t  *impls;
+  int                   nimpls;
+  const kernel_impl_t  *bound;
+} kernel_entry_t;
+
+static kernel_entry_t s_kernels[KERNEL_NUM] = {
+    [KERNEL_SHARPEN] = {"sharpen", sharpen_impls, SHARPEN_NIMPLS, NULL},
+    [KERNEL_SCALE] = {"scale", scale_impls, SCALE_NIMPLS, NULL},
+    [KERNEL_DENOISE] = {"denoise", denoise_impls, DENOISE_NIMPLS, NULL},
+    [KERNEL_METRICS] = {"metrics", metrics_impls, METRICS_NIMPLS, NULL},
+};
+
+static const kernel_impl_t *kernel_bind(const kernel_entry_t *entry,
+                                        unsigned features) {
+  for (int i = 0; i < entry->nimpls; i++) {
+    if ((entry->impls[i].requires & features) == entry->impls[i].requires)
+      return &entry->impls[i];
+  }
+  // the C reference requires nothing and is always last
+  return &entry->impls[entry->nimpls - 1];
+}
+
+void kernels_init(unsigned features) {
+  for (int i = 0; i < KERNEL_NUM; i++) {
+    s_kernels[i].bound = kernel_bind(&s_kernels[i], features);
+  }
+}
+
+const void *kernel_get(kernel_id_e id) {
+  if (s_kernels[id].bound == NULL)
+    s_kernels[id].bound = kernel_bind(&s_kernels[id], cpu_features());
+  return s_kernels[id].bound->fns;
+}
+
+const kernel_impl_t *kernel_bound(kernel_id_e id) {
+  kernel_get(id);
+  return s_kernels[id].bound;
+}
+
+const kernel_impl_t *kernel_impls(kernel_id_e id, int *nimpls) {
+  *nimpls = s_kernels[id].nimpls;
+  return s_kernels[id].impls;
+}
+
+int kernel_supported(const kernel_impl_t *impl) {
+  return (impl->requires & cpu_features()) == impl->requires;
+}
+
+const char *kernel_name(kernel_id_e id) { return s_kernels[id].name; }
+
+void kernels_dump(void) {
+  printf("cpu features: detected %s, using %s\n",
+         cpu_features_str(cpu_detect()), cpu_features_str(cpu_features()));
+  for (int i = 0; i < KERNEL_NUM; i++) {
+    printf("  %-10s %s\n", s_kernels[i].name,
+           kernel_bound((kernel_id_e)i)->name);
+  }
+}
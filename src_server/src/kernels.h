@@ -0,0 +1,31 @@
+#pragma once
+
+// Pixel kernel registry. Each routine lists its implementations best first
+// and kernels_init binds the first one the CPU supports, so one binary runs
+// the widest vectors every host has.
+
+typedef enum {
+  KERNEL_SHARPEN,   // sharpen_kernel_t
+  KERNEL_SCALE,     // scale_kernel_t
+  KERNEL_DENOISE,   // denoise_kernel_t
+  KERNEL_METRICS,   // metrics_kernel_t
+  KERNEL_NUM
+} kernel_id_e;
+
+typedef struct kernel_impl_t {
+  const char *name;
+  unsigned    requires; // CPU_* bits
+  const void *fns;      // routine specific function table
+} kernel_impl_t;
+
+// kernels_init binds every routine for features, see cpu_features
+void kernels_init(unsigned features);
+// kernel_get returns the bound function table of a routine
+const void *kernel_get(kernel_id_e id);
+// kernel_bound is the implementation kernel_get hands out
+const kernel_impl_t *kernel_bound(kernel_id_e id);
+const kernel_impl_t *kernel_impls(kernel_id_e id, int *nimpls);
+// kernel_supported tells whether impl fits the (possibly capped) features
+int kernel_supported(const kernel_impl_t *impl);
+const char *kernel_name(kernel_id_e id);
+void kernels_dump(void);
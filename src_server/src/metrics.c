@@ -0,0 +1,628 @@
+#include "metrics.h"
+#include "cpu.h"
+#include <immintrin.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define METRICS_SLICES_PER_THREAD 2
+
+// Wang, Simoncelli, Bovik, finest scale first
+static const double s_ms_weights[METRICS_MS_LEVELS] = {
+    0.0448, 0.2856, 0.3001, 0.2363, 0.1333};
+
+/*
+ * C reference
+ */
+static uint64_t sse_c(const uint8_t *a, int a_stride, const uint8_t *b,
+                      int b_stride, int width, int height) {
+  uint64_t sse = 0;
+  for (int y = 0; y < height; y++) {
+    const uint8_t *ra = a + (size_t)y * a_stride;
+    const uint8_t *rb = b + (size_t)y * b_stride;
+    uint32_t row = 0;
+    for (int x = 0; x < width; x++) {
+      int d = ra[x] - rb[x];
+      row += d * d;
+    }
+    sse += row;
+  }
+  return sse;
+}
+
+static void ssim4_c(const uint8_t *a, int a_stride, const uint8_t *b,
+                    int b_stride, int nblocks, int32_t (*sums)[4]) {
+  for (int i = 0; i < nblocks; i++) {
+    int32_t s1 = 0, s2 = 0, ss = 0, s12 = 0;
+    for (int y = 0; y < 4; y++) {
+      const uint8_t *ra = a + (size_t)y * a_stride + 4 * i;
+      const uint8_t *rb = b + (size_t)y * b_stride + 4 * i;
+      for (int x = 0; x < 4; x++) {
+        int pa = ra[x];
+        int pb = rb[x];
+        s1 += pa;
+        s2 += pb;
+        ss += pa * pa + pb * pb;
+        s12 += pa * pb;
+      }
+    }
+    sums[i][0] = s1;
+    sums[i][1] = s2;
+    sums[i][2] = ss;
+    sums[i][3] = s12;
+  }
+}
+
+static const metrics_kernel_t metrics_kernel_c = {sse_c, ssim4_c};
+
+/*
+ * SSE2, 16 pixels per SSE step and two 4x4 blocks per SSIM step
+ */
+static uint64_t sse_sse2(const uint8_t *a, int a_stride, const uint8_t *b,
+                         int b_stride, int width, int height) {
+  const __m128i zero = _mm_setzero_si128();
+  int w16 = width & ~15;
+  __m128i sum = _mm_setzero_si128();
+  for (int y = 0; y < height; y++) {
+    const uint8_t *ra = a + (size_t)y * a_stride;
+    const uint8_t *rb = b + (size_t)y * b_stride;
+    // 32-bit lanes hold a row of up to 2^14 16-pixel steps
+    __m128i row = _mm_setzero_si128();
+    for (int x = 0; x < w16; x += 16) {
+      __m128i va = _mm_loadu_si128((const __m128i *)(ra + x));
+      __m128i vb = _mm_loadu_si128((const __m128i *)(rb + x));
+      __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(va, zero),
+                                 _mm_unpacklo_epi8(vb, zero));
+      __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(va, zero),
+                                 _mm_unpackhi_epi8(vb, zero));
+      row = _mm_add_epi32(row, _mm_madd_epi16(lo, lo));
+      row = _mm_add_epi32(row, _mm_madd_epi16(hi, hi));
+    }
+    sum = _mm_add_epi64(sum, _mm_unpacklo_epi32(row, zero));
+    sum = _mm_add_epi64(sum, _mm_unpackhi_epi32(row, zero));
+  }
+  sum = _mm_add_epi64(sum, _mm_srli_si128(sum, 8));
+  uint64_t sse = (uint64_t)_mm_cvtsi128_si64(sum);
+  if (w16 < width)
+    sse += sse_c(a + w16, a_stride, b + w16, b_stride, width - w16, height);
+  return sse;
+}
+
+// lanes of s1, s2, ss, s12 hold two halves of block 0, then of block 1:
+// transpose them into {s1, s2, ss, s12} per block
+static inline void ssim4_store_sse2(__m128i s1, __m128i s2, __m128i ss,
+                                    __m128i s12, int32_t (*sums)[4]) {
+  __m128i t0 = _mm_unpacklo_epi32(s1, s2);
+  __m128i t1 = _mm_unpackhi_epi32(s1, s2);
+  __m128i t2 = _mm_unpacklo_epi32(ss, s12);
+  __m128i t3 = _mm_unpackhi_epi32(ss, s12);
+  __m128i b0 = _mm_add_epi32(_mm_unpacklo_epi64(t0, t2),
+                             _mm_unpackhi_epi64(t0, t2));
+  __m128i b1 = _mm_add_epi32(_mm_unpacklo_epi64(t1, t3),
+                             _mm_unpackhi_epi64(t1, t3));
+  _mm_storeu_si128((__m128i *)sums[0], b0);
+  _mm_storeu_si128((__m128i *)sums[1], b1);
+}
+
+static void ssim4_sse2(const uint8_t *a, int a_stride, const uint8_t *b,
+                       int b_stride, int nblocks, int32_t (*sums)[4]) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i ones = _mm_set1_epi16(1);
+  int i = 0;
+  for (; i + 2 <= nblocks; i += 2) {
+    __m128i sa = _mm_setzero_si128();
+    __m128i sb = _mm_setzero_si128();
+    __m128i ss = _mm_setzero_si128();
+    __m128i s12 = _mm_setzero_si128();
+    for (int y = 0; y < 4; y++) {
+      __m128i va = _mm_unpacklo_epi8(
+          _mm_loadl_epi64((const __m128i *)(a + (size_t)y * a_stride + 4 * i)),
+          zero);
+      __m128i vb = _mm_unpacklo_epi8(
+          _mm_loadl_epi64((const __m128i *)(b + (size_t)y * b_stride + 4 * i)),
+          zero);
+      sa = _mm_add_epi16(sa, va);
+      sb = _mm_add_epi16(sb, vb);
+      ss = _mm_add_epi32(ss, _mm_add_epi32(_mm_madd_epi16(va, va),
+                                           _mm_madd_epi16(vb, vb)));
+      s12 = _mm_add_epi32(s12, _mm_madd_epi16(va, vb));
+    }
+    ssim4_store_sse2(_mm_madd_epi16(sa, ones), _mm_madd_epi16(sb, ones), ss,
+                     s12, sums + i);
+  }
+  if (i < nblocks)
+    ssim4_c(a + 4 * i, a_stride, b + 4 * i, b_stride, nblocks - i, sums + i);
+}
+
+static const metrics_kernel_t metrics_kernel_sse2 = {sse_sse2, ssim4_sse2};
+
+/*
+ * AVX2, 32 pixels per SSE step and four 4x4 blocks per SSIM step
+ */
+__attribute__((target("avx2"))) static uint64_t
+sse_avx2(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride,
+         int width, int height) {
+  const __m256i zero = _mm256_setzero_si256();
+  int w32 = width & ~31;
+  __m256i sum = _mm256_setzero_si256();
+  for (int y = 0; y < height; y++) {
+    const uint8_t *ra = a + (size_t)y * a_stride;
+    const uint8_t *rb = b + (size_t)y * b_stride;
+    __m256i row = _mm256_setzero_si256();
+    for (int x = 0; x < w32; x += 32) {
+      __m256i va = _mm256_loadu_si256((const __m256i *)(ra + x));
+      __m256i vb = _mm256_loadu_si256((const __m256i *)(rb + x));
+      __m256i lo = _mm256_sub_epi16(_mm256_unpacklo_epi8(va, zero),
+                                    _mm256_unpacklo_epi8(vb, zero));
+      __m256i hi = _mm256_sub_epi16(_mm256_unpackhi_epi8(va, zero),
+                                    _mm256_unpackhi_epi8(vb, zero));
+      row = _mm256_add_epi32(row, _mm256_madd_epi16(lo, lo));
+      row = _mm256_add_epi32(row, _mm256_madd_epi16(hi, hi));
+    }
+    sum = _mm256_add_epi64(sum, _mm256_unpacklo_epi32(row, zero));
+    sum = _mm256_add_epi64(sum, _mm256_unpackhi_epi32(row, zero));
+  }
+  __m128i s = _mm_add_epi64(_mm256_castsi256_si128(sum),
+                            _mm256_extracti128_si256(sum, 1));
+  s = _mm_add_epi64(s, _mm_srli_si128(s, 8));
+  uint64_t sse = (uint64_t)_mm_cvtsi128_si64(s);
+  // the tail runs legacy SSE code, leave no dirty upper halves behind
+  _mm256_zeroupper();
+  if (w32 < width)
+    sse += sse_sse2(a + w32, a_stride, b + w32, b_stride, width - w32, height);
+  return sse;
+}
+
+__attribute__((target("avx2"))) static void
+ssim4_avx2(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride,
+           int nblocks, int32_t (*sums)[4]) {
+  const __m256i ones = _mm256_set1_epi16(1);
+  int i = 0;
+  for (; i + 4 <= nblocks; i += 4) {
+    __m256i sa = _mm256_setzero_si256();
+    __m256i sb = _mm256_setzero_si256();
+    __m256i ss = _mm256_setzero_si256();
+    __m256i s12 = _mm256_setzero_si256();
+    for (int y = 0; y < 4; y++) {
+      // blocks 0 and 1 in the low lane, 2 and 3 in the high one
+      __m256i va = _mm256_cvtepu8_epi16(_mm_loadu_si128(
+          (const __m128i *)(a + (size_t)y * a_stride + 4 * i)));
+      __m256i vb = _mm256_cvtepu8_epi16(_mm_loadu_si128(
+          (const __m128i *)(b + (size_t)y * b_stride + 4 * i)));
+      sa = _mm256_add_epi16(sa, va);
+      sb = _mm256_add_epi16(sb, vb);
+      ss = _mm256_add_epi32(ss, _mm256_add_epi32(_mm256_madd_epi16(va, va),
+                                                 _mm256_madd_epi16(vb, vb)));
+      s12 = _mm256_add_epi32(s12, _mm256_madd_epi16(va, vb));
+    }
+    __m256i s1 = _mm256_madd_epi16(sa, ones);
+    __m256i s2 = _mm256_madd_epi16(sb, ones);
+    __m256i t0 = _mm256_unpacklo_epi32(s1, s2);
+    __m256i t1 = _mm256_unpackhi_epi32(s1, s2);
+    __m256i t2 = _mm256_unpacklo_epi32(ss, s12);
+    __m256i t3 = _mm256_unpackhi_epi32(ss, s12);
+    __m256i b0 = _mm256_add_epi32(_mm256_unpacklo_epi64(t0, t2),
+                                  _mm256_unpackhi_epi64(t0, t2));
+    __m256i b1 = _mm256_add_epi32(_mm256_unpacklo_epi64(t1, t3),
+                                  _mm256_unpackhi_epi64(t1, t3));
+    _mm_storeu_si128((__m128i *)sums[i], _mm256_castsi256_si128(b0));
+    _mm_storeu_si128((__m128i *)sums[i + 1], _mm256_castsi256_si128(b1));
+    _mm_storeu_si128((__m128i *)sums[i + 2], _mm256_extracti128_si256(b0, 1));
+    _mm_storeu_si128((__m128i *)sums[i + 3], _mm256_extracti128_si256(b1, 1));
+  }
+  _mm256_zeroupper();
+  if (i < nblocks)
+    ssim4_sse2(a + 4 * i, a_stride, b + 4 * i, b_stride, nblocks - i,
+               sums + i);
+}
+
+static const metrics_kernel_t metrics_kernel_avx2 = {sse_avx2, ssim4_avx2};
+
+const kernel_impl_t metrics_impls[METRICS_NIMPLS] = {
+    {"avx2", CPU_SSE2 | CPU_AVX2, &metrics_kernel_avx2},
+    {"sse2", CPU_SSE2, &metrics_kernel_sse2},
+    {"c", 0, &metrics_kernel_c},
+};
+
+/*
+ * PSNR
+ */
+uint64_t metrics_sse(const uint8_t *a, int a_stride, const uint8_t *b,
+                     int b_stride, int width, int height) {
+  const metrics_kernel_t *kernel =
+      (const metrics_kernel_t *)kernel_get(KERNEL_METRICS);
+  return kernel->sse(a, a_stride, b, b_stride, width, height);
+}
+
+double metrics_psnr_from_sse(uint64_t sse, uint64_t npixels) {
+  if (sse == 0 || npixels == 0)
+    return METRICS_PSNR_MAX;
+  double psnr = 10.0 * log10(255.0 * 255.0 * npixels / sse);
+  return psnr < METRICS_PSNR_MAX ? psnr : METRICS_PSNR_MAX;
+}
+
+static void psnr_from_sse(const uint64_t sse[3], const uint64_t npixels[3],
+                          metrics_psnr_t *psnr) {
+  psnr->y = metrics_psnr_from_sse(sse[0], npixels[0]);
+  psnr->u = metrics_psnr_from_sse(sse[1], npixels[1]);
+  psnr->v = metrics_psnr_from_sse(sse[2], npixels[2]);
+  psnr->yuv = (4.0 * psnr->y + psnr->u + psnr->v) / 6.0;
+}
+
+void metrics_psnr(const frame_t *ref, const frame_t *dist,
+                  metrics_psnr_t *psnr) {
+  uint64_t sse[3];
+  uint64_t npixels[3];
+  for (int i = 0; i < 3; i++) {
+    int w = frame_plane_width(ref, i);
+    int h = frame_plane_height(ref, i);
+    sse[i] = metrics_sse(ref->data[i], ref->linesize[i], dist->data[i],
+                         dist->linesize[i], w, h);
+    npixels[i] = (uint64_t)w * h;
+  }
+  psnr_from_sse(sse, npixels, psnr);
+}
+
+/*
+ * SSIM and MS-SSIM
+ */
+typedef struct metrics_plane_t {
+  const uint8_t *a;
+  const uint8_t *b;
+  int            a_stride;
+  int            b_stride;
+  int            width;
+  int            height;
+} metrics_plane_t;
+
+struct metrics_t {
+  const metrics_kernel_t *kernel;
+  slice_pool_t   *pool;
+  unsigned        flags;
+  int             nslices;
+  int             width;
+  int             height;
+  // per slice: SSE of the planes and two rows of 4x4 block sums
+  uint64_t      (*sse)[3];
+  int32_t     (**blocks)[4];
+  // per window row: sums of ssim and of cs, reduced in row order
+  double         *rows[3];
+  // downscaled luma of ref and dist, level 0 is the frame itself
+  uint8_t        *pyramid[2][METRICS_MS_LEVELS];
+  // current batch
+  const frame_t  *ref;
+  const frame_t  *dist;
+  int             level;
+  // whole sequence
+  long            nframes;
+  uint64_t        total_sse[3];
+  uint64_t        total_npixels[3];
+  double          total_ssim[3];
+  double          total_ms_ssim;
+};
+
+metrics_t *metrics_new(unsigned flags, slice_pool_t *pool) {
+  metrics_t *metrics = (metrics_t *)calloc(1, sizeof(metrics_t));
+  metrics->kernel = (const metrics_kernel_t *)kernel_get(KERNEL_METRICS);
+  metrics->pool = pool;
+  metrics->flags = flags;
+  metrics->nslices = slice_pool_threads(pool) * METRICS_SLICES_PER_THREAD;
+  metrics->sse = (uint64_t(*)[3])calloc(metrics->nslices, sizeof(uint64_t[3]));
+  metrics->blocks =
+      (int32_t(**)[4])calloc(metrics->nslices, sizeof(int32_t(*)[4]));
+  return metrics;
+}
+
+static void metrics_release(metrics_t *metrics) {
+  for (int i = 0; i < metrics->nslices; i++) {
+    free(metrics->blocks[i]);
+    metrics->blocks[i] = NULL;
+  }
+  for (int i = 0; i < 3; i++) {
+    free(metrics->rows[i]);
+    metrics->rows[i] = NULL;
+  }
+  for (int l = 1; l < METRICS_MS_LEVELS; l++) {
+    free(metrics->pyramid[0][l]);
+    free(metrics->pyramid[1][l]);
+    metrics->pyramid[0][l] = NULL;
+    metrics->pyramid[1][l] = NULL;
+  }
+}
+
+void metrics_free(metrics_t *metrics) {
+  if (metrics == NULL)
+    return;
+  metrics_release(metrics);
+  free(metrics->blocks);
+  free(metrics->sse);
+  free(metrics);
+}
+
+void metrics_set_kernel(metrics_t *metrics, const metrics_kernel_t *kernel) {
+  metrics->kernel = kernel;
+}
+
+static void metrics_alloc(metrics_t *metrics, int width, int height) {
+  metrics_release(metrics);
+  int nbx = width / 4;
+  for (int i = 0; i < metrics->nslices; i++) {
+    metrics->blocks[i] =
+        (int32_t(*)[4])malloc(2 * (nbx + 1) * sizeof(int32_t[4]));
+  }
+  for (int i = 0; i < 3; i++) {
+    int h = i ? (height + 1) / 2 : height;
+    metrics->rows[i] = (double *)calloc(2 * (h / 4 + 1), sizeof(double));
+  }
+  if (metrics->flags & METRICS_MS_SSIM) {
+    for (int l = 1; l < METRICS_MS_LEVELS; l++) {
+      size_t size = (size_t)(width >> l) * (height >> l) + 16;
+      metrics->pyramid[0][l] = (uint8_t *)malloc(size);
+      metrics->pyramid[1][l] = (uint8_t *)malloc(size);
+    }
+  }
+  metrics->width = width;
+  metrics->height = height;
+}
+
+static inline int64_t sum4(const int32_t *s0, const int32_t *s1,
+                           const int32_t *s2, const int32_t *s3, int k) {
+  return (int64_t)s0[k] + s1[k] + s2[k] + s3[k];
+}
+
+// one 8x8 window out of four 4x4 block sums, *cs gets the contrast-structure
+// term and the SSIM is returned
+static inline double ssim_window(const int32_t *s0, const int32_t *s1,
+                                 const int32_t *s2, const int32_t *s3,
+                                 double *cs) {
+  const double c1 = 0.01 * 0.01 * 255 * 255 * 64 * 64;
+  const double c2 = 0.03 * 0.03 * 255 * 255 * 64 * 63;
+  int64_t sa = sum4(s0, s1, s2, s3, 0);
+  int64_t sb = sum4(s0, s1, s2, s3, 1);
+  int64_t ss = sum4(s0, s1, s2, s3, 2);
+  int64_t s12 = sum4(s0, s1, s2, s3, 3);
+  double vars = (double)(ss * 64 - sa * sa - sb * sb);
+  double covar = (double)(s12 * 64 - sa * sb);
+  double l = (2.0 * sa * sb + c1) / ((double)(sa * sa + sb * sb) + c1);
+  *cs = (2.0 * covar + c2) / (vars + c2);
+  return l * *cs;
+}
+
+// ssim_rows scores window rows [wy0, wy1) of a plane into rows[2 * wy] and
+// rows[2 * wy + 1]
+static void ssim_rows(const metrics_kernel_t *kernel,
+                      const metrics_plane_t *p, int wy0, int wy1,
+                      int32_t (*blocks)[4], double *rows) {
+  int nbx = p->width / 4;
+  int32_t(*prev)[4] = blocks;
+  int32_t(*cur)[4] = blocks + nbx;
+  kernel->ssim4(p->a + (size_t)4 * wy0 * p->a_stride, p->a_stride,
+                p->b + (size_t)4 * wy0 * p->b_stride, p->b_stride, nbx, prev);
+  for (int wy = wy0; wy < wy1; wy++) {
+    kernel->ssim4(p->a + (size_t)4 * (wy + 1) * p->a_stride, p->a_stride,
+                  p->b + (size_t)4 * (wy + 1) * p->b_stride, p->b_stride, nbx,
+                  cur);
+    double ssim = 0, cs_sum = 0;
+    for (int x = 0; x + 1 < nbx; x++) {
+      double cs;
+      ssim += ssim_window(prev[x], prev[x + 1], cur[x], cur[x + 1], &cs);
+      cs_sum += cs;
+    }
+    rows[2 * wy] = ssim;
+    rows[2 * wy + 1] = cs_sum;
+    int32_t(*tmp)[4] = prev;
+    prev = cur;
+    cur = tmp;
+  }
+}
+
+static inline int window_rows(const metrics_plane_t *p) {
+  return p->width >= 8 && p->height >= 8 ? p->height / 4 - 1 : 0;
+}
+
+// 2x2 box filter of rows [y0, y1) of the next level
+static void downsample_rows(const uint8_t *src, int src_stride, uint8_t *dst,
+                            int width, int y0, int y1) {
+  for (int y = y0; y < y1; y++) {
+    const uint8_t *r0 = src + (size_t)2 * y * src_stride;
+    const uint8_t *r1 = r0 + src_stride;
+    uint8_t *d = dst + (size_t)y * width;
+    for (int x = 0; x < width; x++) {
+      d[x] = (uint8_t)((r0[2 * x] + r0[2 * x + 1] + r1[2 * x] +
+                        r1[2 * x + 1] + 2) >> 2);
+    }
+  }
+}
+
+static void metrics_level_plane(const metrics_t *metrics, int level,
+                                metrics_plane_t *p) {
+  if (level == 0) {
+    p->a = metrics->ref->data[0];
+    p->b = metrics->dist->data[0];
+    p->a_stride = metrics->ref->linesize[0];
+    p->b_stride = metrics->dist->linesize[0];
+  } else {
+    p->a = metrics->pyramid[0][level];
+    p->b = metrics->pyramid[1][level];
+    p->a_stride = p->b_stride = metrics->width >> level;
+  }
+  p->width = metrics->width >> level;
+  p->height = metrics->height >> level;
+}
+
+static void metrics_slice(void *arg, int slice, int nslices) {
+  metrics_t *metrics = (metrics_t *)arg;
+  const frame_t *ref = metrics->ref;
+  const frame_t *dist = metrics->dist;
+  bool ssim = metrics->flags & (METRICS_SSIM | METRICS_MS_SSIM);
+  metrics_plane_t p;
+
+  if (metrics->level == 0) {
+    for (int i = 0; i < 3; i++) {
+      p.a = ref->data[i];
+      p.b = dist->data[i];
+      p.a_stride = ref->linesize[i];
+      p.b_stride = dist->linesize[i];
+      p.width = frame_plane_width(ref, i);
+      p.height = frame_plane_height(ref, i);
+      int y0 = p.height * slice / nslices;
+      int y1 = p.height * (slice + 1) / nslices;
+      metrics->sse[slice][i] = metrics->kernel->sse(
+          p.a + (size_t)y0 * p.a_stride, p.a_stride,
+          p.b + (size_t)y0 * p.b_stride, p.b_stride, p.width, y1 - y0);
+      int nwy = window_rows(&p);
+      if (ssim && nwy > 0) {
+        ssim_rows(metrics->kernel, &p, nwy * slice / nslices,
+                  nwy * (slice + 1) / nslices, metrics->blocks[slice],
+                  metrics->rows[i]);
+      }
+    }
+  } else {
+    metrics_level_plane(metrics, metrics->level, &p);
+    int nwy = window_rows(&p);
+    ssim_rows(metrics->kernel, &p, nwy * slice / nslices,
+              nwy * (slice + 1) / nslices, metrics->blocks[slice],
+              metrics->rows[0]);
+  }
+
+  // build the next level of the pyramid
+  if ((metrics->flags & METRICS_MS_SSIM) &&
+      metrics->level + 1 < METRICS_MS_LEVELS) {
+    metrics_level_plane(metrics, metrics->level, &p);
+    int level = metrics->level + 1;
+    int h = metrics->height >> level;
+    int y0 = h * slice / nslices;
+    int y1 = h * (slice + 1) / nslices;
+    downsample_rows(p.a, p.a_stride, metrics->pyramid[0][level],
+                    metrics->width >> level, y0, y1);
+    downsample_rows(p.b, p.b_stride, metrics->pyramid[1][level],
+                    metrics->width >> level, y0, y1);
+  }
+}
+
+// mean ssim and cs of a plane, 1 when it is too small for a window
+static void reduce_rows(const double *rows, const metrics_plane_t *p,
+                        double *ssim, double *cs) {
+  int nwy = window_rows(p);
+  double sum_ssim = 0, sum_cs = 0;
+  for (int wy = 0; wy < nwy; wy++) {
+    sum_ssim += rows[2 * wy];
+    sum_cs += rows[2 * wy + 1];
+  }
+  long nwindows = (long)nwy * (p->width / 4 - 1);
+  *ssim = nwindows ? sum_ssim / nwindows : 1.0;
+  *cs = nwindows ? sum_cs / nwindows : 1.0;
+}
+
+static int metrics_run(metrics_t *metrics, int level) {
+  metrics_plane_t p;
+  metrics_level_plane(metrics, level, &p);
+  int nslices = metrics->nslices;
+  if (nslices > p.height / 2)
+    nslices = p.height / 2 > 0 ? p.height / 2 : 1;
+  metrics->level = level;
+  slice_pool_run(metrics->pool, metrics_slice, metrics, nslices);
+  return nslices;
+}
+
+void metrics_frame(metrics_t *metrics, const frame_t *ref,
+                   const frame_t *dist, metrics_result_t *result) {
+  if (ref->width != metrics->width || ref->height != metrics->height)
+    metrics_alloc(metrics, ref->width, ref->height);
+  metrics->ref = ref;
+  metrics->dist = dist;
+
+  metrics_result_t r;
+  memset(&r, 0, sizeof(r));
+  int nslices = metrics_run(metrics, 0);
+  uint64_t sse[3] = {0, 0, 0};
+  uint64_t npixels[3];
+  for (int i = 0; i < 3; i++) {
+    for (int s = 0; s < nslices; s++) {
+      sse[i] += metrics->sse[s][i];
+    }
+    npixels[i] = (uint64_t)frame_plane_width(ref, i) *
+                 frame_plane_height(ref, i);
+    metrics->total_sse[i] += sse[i];
+    metrics->total_npixels[i] += npixels[i];
+  }
+  psnr_from_sse(sse, npixels, &r.psnr);
+
+  if (metrics->flags & (METRICS_SSIM | METRICS_MS_SSIM)) {
+    double ssim[3], cs[METRICS_MS_LEVELS];
+    for (int i = 0; i < 3; i++) {
+      metrics_plane_t p;
+      p.width = frame_plane_width(ref, i);
+      p.height = frame_plane_height(ref, i);
+      reduce_rows(metrics->rows[i], &p, &ssim[i], &cs[0]);
+    }
+    r.ssim.y = ssim[0];
+    r.ssim.u = ssim[1];
+    r.ssim.v = ssim[2];
+    r.ssim.yuv = (4.0 * ssim[0] + ssim[1] + ssim[2]) / 6.0;
+    for (int i = 0; i < 3; i++) {
+      metrics->total_ssim[i] += ssim[i];
+    }
+
+    if (metrics->flags & METRICS_MS_SSIM) {
+      metrics_plane_t p;
+      metrics_level_plane(metrics, 0, &p);
+      reduce_rows(metrics->rows[0], &p, &ssim[0], &cs[0]);
+      // the coarsest scale needs windows left, smaller frames get the SSIM
+      int min_size = 8 << (METRICS_MS_LEVELS - 1);
+      if (ref->width < min_size || ref->height < min_size) {
+        r.ms_ssim = r.ssim.y;
+      } else {
+        double level_ssim = 0;
+        for (int l = 1; l < METRICS_MS_LEVELS; l++) {
+          metrics_run(metrics, l);
+          metrics_level_plane(metrics, l, &p);
+          reduce_rows(metrics->rows[0], &p, &level_ssim, &cs[l]);
+        }
+        double ms = 1.0;
+        for (int l = 0; l < METRICS_MS_LEVELS - 1; l++) {
+          ms *= pow(cs[l] > 0 ? cs[l] : 0, s_ms_weights[l]);
+        }
+        ms *= pow(level_ssim > 0 ? level_ssim : 0,
+                  s_ms_weights[METRICS_MS_LEVELS - 1]);
+        r.ms_ssim = ms;
+      }
+      metrics->total_ms_ssim += r.ms_ssim;
+    }
+  }
+
+  metrics->nframes++;
+  metrics->ref = NULL;
+  metrics->dist = NULL;
+  if (result)
+    *result = r;
+}
+
+long metrics_summary(metrics_t *metrics, metrics_result_t *result) {
+  memset(result, 0, sizeof(*result));
+  psnr_from_sse(metrics->total_sse, metrics->total_npixels, &result->psnr);
+  long n = metrics->nframes;
+  if (n && (metrics->flags & (METRICS_SSIM | METRICS_MS_SSIM))) {
+    result->ssim.y = metrics->total_ssim[0] / n;
+    result->ssim.u = metrics->total_ssim[1] / n;
+    result->ssim.v = metrics->total_ssim[2] / n;
+    result->ssim.yuv =
+        (4.0 * result->ssim.y + result->ssim.u + result->ssim.v) / 6.0;
+  }
+  if (n && (metrics->flags & METRICS_MS_SSIM))
+    result->ms_ssim = metrics->total_ms_ssim / n;
+  return n;
+}
+
+int metrics_dump_json(const metrics_result_t *result, long nframes, char *buf,
+                      int len) {
+  return snprintf(buf, len,
+                  "{\"frames\":%ld,"
+                  "\"psnr\":{\"y\":%.3f,\"u\":%.3f,\"v\":%.3f,\"yuv\":%.3f},"
+                  "\"ssim\":{\"y\":%.5f,\"u\":%.5f,\"v\":%.5f,\"yuv\":%.5f},"
+                  "\"ms_ssim\":%.5f}",
+                  nframes, result->psnr.y, result->psnr.u, result->psnr.v,
+                  result->psnr.yuv, result->ssim.y, result->ssim.u,
+                  result->ssim.v, result->ssim.yuv, result->ms_ssim);
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "frame.h"
+#include "kernels.h"
+#include "slice.h"
+#include <stdbool.h>
+
+// Objective quality of a distorted frame against its reference.
+//   PSNR     per plane and as the 4:1:1 weighted YUV average, identical
+//            frames score METRICS_PSNR_MAX
+//   SSIM     8x8 windows every 4 pixels (summed from 4x4 blocks), per plane
+//            and weighted like PSNR
+//   MS-SSIM  luma over 5 dyadic scales with the weights of Wang et al.
+// Rows are split over a slice pool, every slice keeps its own partial sums
+// which are reduced in a fixed order, so results do not depend on threads.
+
+#define METRICS_PSNR_MAX   100.0
+#define METRICS_MS_LEVELS  5
+
+typedef struct metrics_psnr_t {
+  double y;
+  double u;
+  double v;
+  double yuv;
+} metrics_psnr_t;
+
+typedef struct metrics_result_t {
+  metrics_psnr_t  psnr;
+  metrics_psnr_t  ssim;    // same layout, SSIM in [-1, 1]
+  double          ms_ssim; // 0 unless METRICS_MS_SSIM was asked for
+} metrics_result_t;
+
+enum {
+  METRICS_SSIM    = 1 << 0,
+  METRICS_MS_SSIM = 1 << 1,
+};
+
+// sse sums squared differences of a width x height block
+typedef uint64_t (*metrics_sse_fn)(const uint8_t *a, int a_stride,
+                                   const uint8_t *b, int b_stride, int width,
+                                   int height);
+// ssim4 sums nblocks 4x4 blocks side by side:
+//   sums[i] = {sum a, sum b, sum a*a + b*b, sum a*b}
+typedef void (*metrics_ssim4_fn)(const uint8_t *a, int a_stride,
+                                 const uint8_t *b, int b_stride, int nblocks,
+                                 int32_t (*sums)[4]);
+
+typedef struct metrics_kernel_t {
+  metrics_sse_fn    sse;
+  metrics_ssim4_fn  ssim4;
+} metrics_kernel_t;
+
+// avx2, sse2, c, see kernels.h
+#define METRICS_NIMPLS 3
+extern const kernel_impl_t metrics_impls[METRICS_NIMPLS];
+
+// metrics_sse returns the sum of squared differences of one plane
+uint64_t metrics_sse(const uint8_t *a, int a_stride, const uint8_t *b,
+                     int b_stride, int width, int height);
+double metrics_psnr_from_sse(uint64_t sse, uint64_t npixels);
+// ref and dist must have the same size
+void metrics_psnr(const frame_t *ref, const frame_t *dist,
+                  metrics_psnr_t *psnr);
+
+// metrics_t scores a sequence, frame by frame and as a whole. The summary
+// PSNR comes from the SSE of all frames, the SSIMs are frame averages.
+typedef struct metrics_t metrics_t;
+
+metrics_t *metrics_new(unsigned flags, slice_pool_t *pool);
+void metrics_free(metrics_t *metrics);
+// metrics_set_kernel overrides the kernel bound in the registry
+void metrics_set_kernel(metrics_t *metrics, const metrics_kernel_t *kernel);
+// metrics_frame scores one pair, result may be NULL
+void metrics_frame(metrics_t *metrics, const frame_t *ref,
+                   const frame_t *dist, metrics_result_t *result);
+// metrics_summary returns the number of frames scored so far
+long metrics_summary(metrics_t *metrics, metrics_result_t *result);
+int metrics_dump_json(const metrics_result_t *result, long nframes, char *buf,
+                      int len);
@@ -0,0 +1,100 @@
+#include "pattern.h"
+#include <math.h>
+#include <string.h>
+
+static const char *s_pattern_names[PATTERN_NUM] = {
+    "bars", "gradient", "zoneplate", "checker", "motion", "pan"};
+
+pattern_e pattern_from_name(const char *name) {
+  for (int i = 0; i < PATTERN_NUM; i++) {
+    if (strcmp(name, s_pattern_names[i]) == 0)
+      return (pattern_e)i;
+  }
+  return PATTERN_NUM;
+}
+
+const char *pattern_name(pattern_e pattern) {
+  return pattern < PATTERN_NUM ? s_pattern_names[pattern] : "unknown";
+}
+
+static inline uint8_t clamp_u8(int v) {
+  return (uint8_t)(v < 0 ? 0 : v > 255 ? 255 : v);
+}
+
+// cheap hash noise in [-16, 15], the same for a given position and frame
+static inline int noise(unsigned int x, unsigned int y, unsigned int index) {
+  unsigned int h = x * 374761393u + y * 668265263u + index * 2246822519u;
+  h = (h ^ (h >> 13)) * 1274126177u;
+  return (int)((h >> 16) & 31) - 16;
+}
+
+static uint8_t pattern_pixel(pattern_e pattern, int plane, int x, int y,
+                             int w, int h, int index) {
+  switch (pattern) {
+  case PATTERN_BARS: {
+    // white, yellow, cyan, green, magenta, red, blue, black
+    static const uint8_t yuv[8][3] = {
+        {235, 128, 128}, {210, 16, 146}, {170, 166, 16}, {145, 54, 34},
+        {106, 202, 222}, {81, 90, 240},  {41, 240, 110}, {16, 128, 128}};
+    return yuv[x * 8 / w][plane];
+  }
+  case PATTERN_GRADIENT:
+    if (plane == 0)
+      return (uint8_t)(x * 255 / (w > 1 ? w - 1 : 1));
+    return (uint8_t)(plane == 1 ? y * 255 / (h > 1 ? h - 1 : 1) : 128);
+  case PATTERN_ZONEPLATE: {
+    if (plane > 0)
+      return 128;
+    double cx = x - w / 2.0, cy = y - h / 2.0;
+    double k = M_PI / (w > h ? w : h);
+    return clamp_u8(128 + (int)(100 * cos(k * (cx * cx + cy * cy) + index * 0.2)));
+  }
+  case PATTERN_CHECKER: {
+    int scale = plane ? 4 : 8;
+    int v = ((x / scale + y / scale) & 1) ? 200 : 40;
+    if (plane)
+      v = 128 + (v - 128) / 4;
+    return clamp_u8(v + noise(x, y + plane * h, index));
+  }
+  case PATTERN_MOTION: {
+    // box position in luma units, so chroma moves along with it
+    int shift = plane ? 1 : 0;
+    int lw = w << shift, lh = h << shift;
+    int box = (lw < lh ? lw : lh) / 4;
+    int bx = (index * 4) % (lw - box > 0 ? lw - box : 1);
+    int by = (index * 2) % (lh - box > 0 ? lh - box : 1);
+    int lx = x << shift, ly = y << shift;
+    int v = 96 + (plane ? 32 : 0);
+    if (lx >= bx && lx < bx + box && ly >= by && ly < by + box) {
+      // texture moves with the box so it can be motion compensated
+      v = ((lx - bx) / 8 + (ly - by) / 8) & 1 ? 220 : 60;
+      if (plane)
+        v = 128 + (v - 128) / 3;
+    }
+    return clamp_u8(v + noise(x, y + plane * h, index) / 2);
+  }
+  case PATTERN_PAN: {
+    // smooth texture sampled in luma units, scrolled 3 right and 1 down
+    int shift = plane ? 1 : 0;
+    double lx = (x << shift) + index * 3, ly = (y << shift) + index;
+    double v = 60 * sin(lx * 0.05) * cos(ly * 0.07) + 40 * sin((lx + ly) * 0.013);
+    return clamp_u8(128 + (int)(plane ? v / 3 : v));
+  }
+  default:
+    return 128;
+  }
+}
+
+void pattern_fill(frame_t *frame, pattern_e pattern, int index) {
+  for (int i = 0; i < 3; i++) {
+    int w = frame_plane_width(frame, i);
+    int h = frame_plane_height(frame, i);
+    for (int y = 0; y < h; y++) {
+      uint8_t *row = frame->data[i] + (size_t)y * frame->linesize[i];
+      for (int x = 0; x < w; x++) {
+        row[x] = pattern_pixel(pattern, i, x, y, w, h, index);
+      }
+    }
+  }
+  frame->pts = index;
+}
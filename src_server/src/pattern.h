@@ -0,0 +1,22 @@
+#pragma once
+
+#include "frame.h"
+
+// Deterministic synthetic content for testing and benchmarking the pixel
+// engine without decoders. index is the frame number, moving patterns
+// advance with it.
+
+typedef enum {
+  PATTERN_BARS,      // SMPTE-like color bars
+  PATTERN_GRADIENT,  // smooth ramps, shows banding
+  PATTERN_ZONEPLATE, // circular chirp, shows aliasing in scalers
+  PATTERN_CHECKER,   // hard edges with sensor-like noise
+  PATTERN_MOTION,    // textured box moving over a noisy background
+  PATTERN_PAN,       // noise-free texture panning diagonally
+  PATTERN_NUM
+} pattern_e;
+
+// pattern_from_name returns PATTERN_NUM for unknown names
+pattern_e pattern_from_name(const char *name);
+const char *pattern_name(pattern_e pattern);
+void pattern_fill(frame_t *frame, pattern_e pattern, int index);
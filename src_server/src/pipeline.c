@@ -0,0 +1,164 @@
+#include "pipeline.h"
+#include "include/hthread.h"
+#include "include/htime.h"
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define PIPELINE_SPIN        64
+#define PIPELINE_MAX_SLEEP   200 // us
+
+// backoff for a stage waiting on a ring: spin, yield, then short sleeps
+static void pipeline_backoff(int *round) {
+  if (*round < PIPELINE_SPIN) {
+    ++*round;
+    return;
+  }
+  if (*round < 2 * PIPELINE_SPIN) {
+    ++*round;
+    sched_yield();
+    return;
+  }
+  int us = (*round - 2 * PIPELINE_SPIN + 1) * 10;
+  if (us > PIPELINE_MAX_SLEEP)
+    us = PIPELINE_MAX_SLEEP;
+  else
+    ++*round;
+  struct timespec ts = {0, us * 1000};
+  nanosleep(&ts, NULL);
+}
+
+static bool pipeline_aborted(pipeline_t *pipeline) {
+  return atomic_load_explicit(&pipeline->abort, memory_order_acquire);
+}
+
+void pipeline_init(pipeline_t *pipeline, int ring_size) {
+  memset(pipeline, 0, sizeof(*pipeline));
+  pipeline->ring_size = ring_size > 0 ? ring_size : PIPELINE_RING_SIZE;
+  atomic_init(&pipeline->abort, false);
+}
+
+void pipeline_destroy(pipeline_t *pipeline) {
+  for (int i = 0; i + 1 < pipeline->nstages; i++) {
+    frame_t *frame = NULL;
+    while ((frame = (frame_t *)ring_pop(&pipeline->rings[i])) != NULL)
+      frame_unref(frame);
+    ring_destroy(&pipeline->rings[i]);
+  }
+  pipeline->nstages = 0;
+}
+
+bool pipeline_add_stage(pipeline_t *pipeline, const char *name, pipeline_fn fn,
+                        void *ctx) {
+  if (pipeline->nstages == PIPELINE_MAX_STAGES)
+    return false;
+  int index = pipeline->nstages;
+  pipeline_stage_t *stage = &pipeline->stages[index];
+  memset(stage, 0, sizeof(*stage));
+  stage->name = name;
+  stage->fn = fn;
+  stage->ctx = ctx;
+  stage->pipeline = pipeline;
+  if (index > 0) {
+    ring_t *ring = &pipeline->rings[index - 1];
+    if (!ring_init(ring, pipeline->ring_size))
+      return false;
+    pipeline->stages[index - 1].out = ring;
+    stage->in = ring;
+  }
+  ++pipeline->nstages;
+  return true;
+}
+
+static HTHREAD_ROUTINE(pipeline_stage_thread) {
+  pipeline_stage_t *stage = (pipeline_stage_t *)userdata;
+  pipeline_t *pipeline = stage->pipeline;
+  pipeline_stats_t *stats = &stage->stats;
+  while (!pipeline_aborted(pipeline)) {
+    frame_t *in = NULL;
+    if (stage->in) {
+      unsigned long long wait_start = gethrtime_us();
+      int round = 0;
+      size_t queued = 0;
+      while ((queued = ring_count(stage->in)) == 0) {
+        if (ring_is_eos(stage->in) || pipeline_aborted(pipeline))
+          goto done;
+        pipeline_backoff(&round);
+      }
+      stats->stall_in_us += gethrtime_us() - wait_start;
+      stats->occupancy += queued;
+      in = (frame_t *)ring_pop(stage->in);
+    }
+
+    frame_t *out = NULL;
+    unsigned long long start = gethrtime_us();
+    int ret = stage->fn(stage->ctx, in, &out);
+    stats->busy_us += gethrtime_us() - start;
+    if (ret < 0) {
+      fprintf(stderr, "pipeline stage %s failed: %d\n", stage->name, ret);
+      frame_unref(out);
+      atomic_store_explicit(&pipeline->abort, true, memory_order_release);
+      break;
+    }
+    if (stage->in == NULL && out == NULL)
+      break; // end of stream
+    ++stats->frames;
+    if (stage->out && out) {
+      unsigned long long wait_start = gethrtime_us();
+      int round = 0;
+      while (!ring_push(stage->out, out)) {
+        if (pipeline_aborted(pipeline)) {
+          frame_unref(out);
+          goto done;
+        }
+        pipeline_backoff(&round);
+      }
+      stats->stall_out_us += gethrtime_us() - wait_start;
+    }
+  }
+done:
+  if (stage->out)
+    ring_set_eos(stage->out);
+  return 0;
+}
+
+bool pipeline_run(pipeline_t *pipeline) {
+  hthread_t threads[PIPELINE_MAX_STAGES];
+  unsigned long long start = gethrtime_us();
+  for (int i = 0; i < pipeline->nstages; i++) {
+    threads[i] = hthread_create(pipeline_stage_thread, &pipeline->stages[i]);
+  }
+  for (int i = 0; i < pipeline->nstages; i++) {
+    hthread_join(threads[i]);
+  }
+  pipeline->elapsed_us = gethrtime_us() - start;
+  return !pipeline_aborted(pipeline);
+}
+
+int pipeline_dump_stats(pipeline_t *pipeline, char *buf, int len) {
+  int offset = 0;
+  int bottleneck = 0;
+  for (int i = 1; i < pipeline->nstages; i++) {
+    if (pipeline->stages[i].stats.busy_us >
+        pipeline->stages[bottleneck].stats.busy_us)
+      bottleneck = i;
+  }
+  double elapsed = pipeline->elapsed_us ? pipeline->elapsed_us : 1;
+  for (int i = 0; i < pipeline->nstages && offset < len; i++) {
+    pipeline_stage_t *stage = &pipeline->stages[i];
+    pipeline_stats_t *stats = &stage->stats;
+    double occupancy =
+        stage->in && stats->frames
+            ? 100.0 * stats->occupancy / stats->frames / ring_capacity(stage->in)
+            : 0;
+    offset += snprintf(
+        buf + offset, len - offset,
+        "%-8s frames=%ld busy=%.1f%% stall_in=%.1fms stall_out=%.1fms "
+        "queue=%.0f%%%s\n",
+        stage->name, stats->frames, 100.0 * stats->busy_us / elapsed,
+        stats->stall_in_us / 1000.0, stats->stall_out_us / 1000.0, occupancy,
+        i == bottleneck ? " <- bottleneck" : "");
+  }
+  return offset < len ? offset : len - 1;
+}
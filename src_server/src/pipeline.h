@@ -0,0 +1,59 @@
+#pragma once
+
+#include "frame.h"
+#include "ring.h"
+#include <stdbool.h>
+
+// Frame pipeline: every stage runs on its own thread and hands frames to
+// the next one through a bounded SPSC ring.
+//
+//   source -> ring -> filter -> ring -> ... -> ring -> sink
+//
+// A stage function gets the frame popped from its input ring (NULL for the
+// source) and stores the frame to pass on in *out (NULL for the sink, or
+// NULL from the source at end of stream). It returns 0 or a negative error,
+// which aborts the whole pipeline. A stage owns the reference of the frame it
+// was given and either passes it on or drops it with frame_unref.
+
+#define PIPELINE_MAX_STAGES 8
+#define PIPELINE_RING_SIZE  4
+
+typedef int (*pipeline_fn)(void *ctx, frame_t *in, frame_t **out);
+
+typedef struct pipeline_stats_t {
+  long               frames;
+  unsigned long long busy_us;      // inside the stage function
+  unsigned long long stall_in_us;  // waiting for the previous stage
+  unsigned long long stall_out_us; // waiting for room in the next ring
+  unsigned long long occupancy;    // input ring fill, summed per frame
+} pipeline_stats_t;
+
+typedef struct pipeline_stage_t {
+  const char        *name;
+  pipeline_fn        fn;
+  void              *ctx;
+  ring_t            *in;
+  ring_t            *out;
+  pipeline_stats_t   stats;
+  struct pipeline_t *pipeline;
+} pipeline_stage_t;
+
+typedef struct pipeline_t {
+  pipeline_stage_t   stages[PIPELINE_MAX_STAGES];
+  ring_t             rings[PIPELINE_MAX_STAGES - 1];
+  int                nstages;
+  int                ring_size;
+  atomic_bool        abort;
+  unsigned long long elapsed_us;
+} pipeline_t;
+
+void pipeline_init(pipeline_t *pipeline, int ring_size);
+void pipeline_destroy(pipeline_t *pipeline);
+// the first stage added is the source, the last one the sink
+bool pipeline_add_stage(pipeline_t *pipeline, const char *name, pipeline_fn fn,
+                        void *ctx);
+// pipeline_run blocks until the source is drained or a stage fails
+bool pipeline_run(pipeline_t *pipeline);
+// pipeline_dump_stats formats one line per stage, the busiest one is the
+// bottleneck
+int pipeline_dump_stats(pipeline_t *pipeline, char *buf, int len);
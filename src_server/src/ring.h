@@ -0,0 +1,74 @@
+#pragma once
+
+// Bounded single-producer/single-consumer ring of pointers. Only the
+// producer writes tail and only the consumer writes head, so neither side
+// takes a lock; they sit on separate cache lines to avoid false sharing.
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#define RING_CACHELINE 64
+
+typedef struct ring_t {
+  _Alignas(RING_CACHELINE) atomic_size_t head; // next slot to pop
+  _Alignas(RING_CACHELINE) atomic_size_t tail; // next slot to push
+  _Alignas(RING_CACHELINE) atomic_bool   eos;  // producer is done
+  size_t  mask;
+  void  **slots;
+} ring_t;
+
+// capacity is rounded up to a power of two
+static inline bool ring_init(ring_t *ring, size_t capacity) {
+  size_t size = 1;
+  while (size < capacity)
+    size <<= 1;
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  atomic_init(&ring->eos, false);
+  ring->mask = size - 1;
+  ring->slots = (void **)calloc(size, sizeof(void *));
+  return ring->slots != NULL;
+}
+
+static inline void ring_destroy(ring_t *ring) {
+  free(ring->slots);
+  ring->slots = NULL;
+}
+
+static inline size_t ring_capacity(const ring_t *ring) { return ring->mask + 1; }
+
+static inline size_t ring_count(ring_t *ring) {
+  return atomic_load_explicit(&ring->tail, memory_order_acquire) -
+         atomic_load_explicit(&ring->head, memory_order_acquire);
+}
+
+static inline bool ring_push(ring_t *ring, void *item) {
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  if (tail - head > ring->mask)
+    return false;
+  ring->slots[tail & ring->mask] = item;
+  atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+  return true;
+}
+
+static inline void *ring_pop(ring_t *ring) {
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  if (head == tail)
+    return NULL;
+  void *item = ring->slots[head & ring->mask];
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+  return item;
+}
+
+static inline void ring_set_eos(ring_t *ring) {
+  atomic_store_explicit(&ring->eos, true, memory_order_release);
+}
+
+// ring_is_eos is true once the producer is done and everything is popped
+static inline bool ring_is_eos(ring_t *ring) {
+  return atomic_load_explicit(&ring->eos, memory_order_acquire) &&
+         ring_count(ring) == 0;
+}
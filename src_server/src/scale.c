@@ -0,0 +1,509 @@
+#include "scale.h"
+#include "cpu.h"
+#include <immintrin.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SCALE_SLICES_PER_THREAD 4
+#define SCALE_INTER_SHIFT       8  // Q14 * 8-bit >> 8 leaves Q6 rows
+#define SCALE_OUT_SHIFT         20 // Q6 * Q14
+
+static inline int clamp_int(int v, int lo, int hi) {
+  return v < lo ? lo : v > hi ? hi : v;
+}
+
+/*
+ * C reference
+ */
+static void hscale_c(const uint8_t *src, int16_t *dst, int width,
+                     const int32_t *pos, const int16_t *coef, int taps) {
+  for (int x = 0; x < width; x++) {
+    const uint8_t *s = src + pos[x];
+    const int16_t *c = coef + (x / 8) * taps * 8 + (x % 8) * 4;
+    int sum = 0;
+    for (int k = 0; k < taps; k += 4, c += 32) {
+      sum += s[k] * c[0] + s[k + 1] * c[1] + s[k + 2] * c[2] +
+             s[k + 3] * c[3];
+    }
+    dst[x] = (int16_t)clamp_int(
+        (sum + (1 << (SCALE_INTER_SHIFT - 1))) >> SCALE_INTER_SHIFT, INT16_MIN,
+        INT16_MAX);
+  }
+}
+
+static void vscale_c(const int16_t *const *rows, const int16_t *coef,
+                     uint8_t *dst, int width, int taps) {
+  for (int x = 0; x < width; x++) {
+    int sum = 0;
+    for (int k = 0; k < taps; k++) {
+      sum += rows[k][x] * coef[k];
+    }
+    dst[x] = (uint8_t)clamp_int(
+        (sum + (1 << (SCALE_OUT_SHIFT - 1))) >> SCALE_OUT_SHIFT, 0, 255);
+  }
+}
+
+static const scale_kernel_t scale_kernel_c = {hscale_c, vscale_c};
+
+/*
+ * SSE2, 8 outputs per iteration
+ */
+static inline __m128i load4(const uint8_t *p) {
+  int32_t v;
+  memcpy(&v, p, sizeof(v));
+  return _mm_cvtsi32_si128(v);
+}
+
+// 4 taps of 4 outputs, widened and multiplied into pairwise sums
+static inline __m128i hquad_sse2(const uint8_t *s0, const uint8_t *s1,
+                                 const uint8_t *s2, const uint8_t *s3,
+                                 const int16_t *c, __m128i *hi) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i p = _mm_unpacklo_epi64(_mm_unpacklo_epi32(load4(s0), load4(s1)),
+                                 _mm_unpacklo_epi32(load4(s2), load4(s3)));
+  *hi = _mm_madd_epi16(_mm_unpackhi_epi8(p, zero),
+                       _mm_loadu_si128((const __m128i *)(c + 8)));
+  return _mm_madd_epi16(_mm_unpacklo_epi8(p, zero),
+                        _mm_loadu_si128((const __m128i *)c));
+}
+
+// [a0 a1 b0 b1] [c0 c1 d0 d1] -> [a b c d]
+static inline __m128i hsum_pairs_sse2(__m128i ab, __m128i cd) {
+  __m128i lo = _mm_unpacklo_epi32(ab, cd);
+  __m128i hi = _mm_unpackhi_epi32(ab, cd);
+  __m128i sum = _mm_add_epi32(_mm_unpacklo_epi64(lo, hi),
+                              _mm_unpackhi_epi64(lo, hi));
+  return _mm_shuffle_epi32(sum, _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+static void hscale_sse2(const uint8_t *src, int16_t *dst, int width,
+                        const int32_t *pos, const int16_t *coef, int taps) {
+  const __m128i round = _mm_set1_epi32(1 << (SCALE_INTER_SHIFT - 1));
+  const int16_t *c = coef;
+  for (int x = 0; x < width; x += 8) {
+    const int32_t *p = pos + x;
+    __m128i acc[4] = {_mm_setzero_si128(), _mm_setzero_si128(),
+                      _mm_setzero_si128(), _mm_setzero_si128()};
+    for (int k = 0; k < taps; k += 4, c += 32) {
+      __m128i hi;
+      __m128i lo = hquad_sse2(src + p[0] + k, src + p[1] + k, src + p[2] + k,
+                              src + p[3] + k, c, &hi);
+      acc[0] = _mm_add_epi32(acc[0], lo);
+      acc[1] = _mm_add_epi32(acc[1], hi);
+      lo = hquad_sse2(src + p[4] + k, src + p[5] + k, src + p[6] + k,
+                      src + p[7] + k, c + 16, &hi);
+      acc[2] = _mm_add_epi32(acc[2], lo);
+      acc[3] = _mm_add_epi32(acc[3], hi);
+    }
+    __m128i s0 = _mm_srai_epi32(
+        _mm_add_epi32(hsum_pairs_sse2(acc[0], acc[1]), round),
+        SCALE_INTER_SHIFT);
+    __m128i s1 = _mm_srai_epi32(
+        _mm_add_epi32(hsum_pairs_sse2(acc[2], acc[3]), round),
+        SCALE_INTER_SHIFT);
+    _mm_storeu_si128((__m128i *)(dst + x), _mm_packs_epi32(s0, s1));
+  }
+}
+
+static void vscale_sse2(const int16_t *const *rows, const int16_t *coef,
+                        uint8_t *dst, int width, int taps) {
+  const __m128i round = _mm_set1_epi32(1 << (SCALE_OUT_SHIFT - 1));
+  __m128i pairs[SCALE_MAX_TAPS / 2];
+  for (int k = 0; k < taps; k += 2) {
+    pairs[k / 2] = _mm_set1_epi32((uint16_t)coef[k] |
+                                  ((uint32_t)(uint16_t)coef[k + 1] << 16));
+  }
+  int x = 0;
+  for (; x + 8 <= width; x += 8) {
+    __m128i lo = _mm_setzero_si128();
+    __m128i hi = _mm_setzero_si128();
+    for (int k = 0; k < taps; k += 2) {
+      __m128i a = _mm_loadu_si128((const __m128i *)(rows[k] + x));
+      __m128i b = _mm_loadu_si128((const __m128i *)(rows[k + 1] + x));
+      lo = _mm_add_epi32(lo,
+                         _mm_madd_epi16(_mm_unpacklo_epi16(a, b), pairs[k / 2]));
+      hi = _mm_add_epi32(hi,
+                         _mm_madd_epi16(_mm_unpackhi_epi16(a, b), pairs[k / 2]));
+    }
+    lo = _mm_srai_epi32(_mm_add_epi32(lo, round), SCALE_OUT_SHIFT);
+    hi = _mm_srai_epi32(_mm_add_epi32(hi, round), SCALE_OUT_SHIFT);
+    __m128i v = _mm_packs_epi32(lo, hi);
+    _mm_storel_epi64((__m128i *)(dst + x), _mm_packus_epi16(v, v));
+  }
+  const int16_t *tail[SCALE_MAX_TAPS];
+  for (int k = 0; k < taps; k++) {
+    tail[k] = rows[k] + x;
+  }
+  vscale_c(tail, coef, dst + x, width - x, taps);
+}
+
+static const scale_kernel_t scale_kernel_sse2 = {hscale_sse2, vscale_sse2};
+
+/*
+ * AVX2, the 8 outputs of a group in one register
+ */
+__attribute__((target("avx2"))) static void
+hscale_avx2(const uint8_t *src, int16_t *dst, int width, const int32_t *pos,
+            const int16_t *coef, int taps) {
+  const __m256i round = _mm256_set1_epi32(1 << (SCALE_INTER_SHIFT - 1));
+  const int16_t *c = coef;
+  for (int x = 0; x < width; x += 8) {
+    const int32_t *q = pos + x;
+    __m256i acc0 = _mm256_setzero_si256();
+    __m256i acc1 = _mm256_setzero_si256();
+    for (int k = 0; k < taps; k += 4, c += 32) {
+      // plain loads beat vpgatherdd on most cores
+      __m256i p = _mm256_set_m128i(
+          _mm_unpacklo_epi64(
+              _mm_unpacklo_epi32(load4(src + q[4] + k), load4(src + q[5] + k)),
+              _mm_unpacklo_epi32(load4(src + q[6] + k), load4(src + q[7] + k))),
+          _mm_unpacklo_epi64(
+              _mm_unpacklo_epi32(load4(src + q[0] + k), load4(src + q[1] + k)),
+              _mm_unpacklo_epi32(load4(src + q[2] + k), load4(src + q[3] + k))));
+      acc0 = _mm256_add_epi32(
+          acc0, _mm256_madd_epi16(
+                    _mm256_cvtepu8_epi16(_mm256_castsi256_si128(p)),
+                    _mm256_loadu_si256((const __m256i *)c)));
+      acc1 = _mm256_add_epi32(
+          acc1, _mm256_madd_epi16(
+                    _mm256_cvtepu8_epi16(_mm256_extracti128_si256(p, 1)),
+                    _mm256_loadu_si256((const __m256i *)(c + 16))));
+    }
+    // hadd interleaves the lanes as 0 1 4 5 2 3 6 7
+    __m256i sum =
+        _mm256_permute4x64_epi64(_mm256_hadd_epi32(acc0, acc1), 0xD8);
+    sum = _mm256_srai_epi32(_mm256_add_epi32(sum, round), SCALE_INTER_SHIFT);
+    sum = _mm256_permute4x64_epi64(_mm256_packs_epi32(sum, sum), 0x08);
+    _mm_storeu_si128((__m128i *)(dst + x), _mm256_castsi256_si128(sum));
+  }
+}
+
+__attribute__((target("avx2"))) static void
+vscale_avx2(const int16_t *const *rows, const int16_t *coef, uint8_t *dst,
+            int width, int taps) {
+  const __m256i round = _mm256_set1_epi32(1 << (SCALE_OUT_SHIFT - 1));
+  __m256i pairs[SCALE_MAX_TAPS / 2];
+  for (int k = 0; k < taps; k += 2) {
+    pairs[k / 2] = _mm256_set1_epi32((uint16_t)coef[k] |
+                                     ((uint32_t)(uint16_t)coef[k + 1] << 16));
+  }
+  int x = 0;
+  for (; x + 16 <= width; x += 16) {
+    __m256i lo = _mm256_setzero_si256();
+    __m256i hi = _mm256_setzero_si256();
+    for (int k = 0; k < taps; k += 2) {
+      __m256i a = _mm256_loadu_si256((const __m256i *)(rows[k] + x));
+      __m256i b = _mm256_loadu_si256((const __m256i *)(rows[k + 1] + x));
+      lo = _mm256_add_epi32(
+          lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), pairs[k / 2]));
+      hi = _mm256_add_epi32(
+          hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), pairs[k / 2]));
+    }
+    lo = _mm256_srai_epi32(_mm256_add_epi32(lo, round), SCALE_OUT_SHIFT);
+    hi = _mm256_srai_epi32(_mm256_add_epi32(hi, round), SCALE_OUT_SHIFT);
+    // both packs work per 128-bit lane, which restores the pixel order
+    __m256i v = _mm256_packs_epi32(lo, hi);
+    v = _mm256_permute4x64_epi64(_mm256_packus_epi16(v, v), 0x08);
+    _mm_storeu_si128((__m128i *)(dst + x), _mm256_castsi256_si128(v));
+  }
+  const int16_t *tail[SCALE_MAX_TAPS];
+  for (int k = 0; k < taps; k++) {
+    tail[k] = rows[k] + x;
+  }
+  vscale_sse2(tail, coef, dst + x, width - x, taps);
+}
+
+static const scale_kernel_t scale_kernel_avx2 = {hscale_avx2, vscale_avx2};
+
+const kernel_impl_t scale_impls[SCALE_NIMPLS] = {
+    {"avx2", CPU_SSE2 | CPU_AVX2, &scale_kernel_avx2},
+    {"sse2", CPU_SSE2, &scale_kernel_sse2},
+    {"c", 0, &scale_kernel_c},
+};
+
+/*
+ * filter weights
+ */
+static const char *s_filter_names[SCALE_NUM] = {"bilinear", "bicubic",
+                                                "lanczos"};
+static const double s_filter_radius[SCALE_NUM] = {1.0, 2.0, 3.0};
+
+scale_filter_e scale_filter_from_name(const char *name) {
+  for (int i = 0; i < SCALE_NUM; i++) {
+    if (strcmp(name, s_filter_names[i]) == 0)
+      return (scale_filter_e)i;
+  }
+  return SCALE_NUM;
+}
+
+const char *scale_filter_name(scale_filter_e filter) {
+  return filter < SCALE_NUM ? s_filter_names[filter] : "unknown";
+}
+
+static double filter_weight(scale_filter_e filter, double x) {
+  x = fabs(x);
+  switch (filter) {
+  case SCALE_BILINEAR:
+    return x < 1.0 ? 1.0 - x : 0.0;
+  case SCALE_BICUBIC:
+    if (x < 1.0)
+      return (1.5 * x - 2.5) * x * x + 1.0;
+    if (x < 2.0)
+      return ((-0.5 * x + 2.5) * x - 4.0) * x + 2.0;
+    return 0.0;
+  default:
+    if (x < 1e-9)
+      return 1.0;
+    if (x >= 3.0)
+      return 0.0;
+    return 3.0 * sin(M_PI * x) * sin(M_PI * x / 3.0) / (M_PI * M_PI * x * x);
+  }
+}
+
+// scale_weights fills the normalized weights of output x starting at source
+// pixel *start, it returns their count, the same for every x
+static int scale_weights(scale_filter_e filter, int src_size, int dst_size,
+                         int x, int *start, double *weights) {
+  double ratio = (double)src_size / dst_size;
+  double radius = s_filter_radius[filter];
+  double stretch = ratio > 1.0 ? ratio : 1.0;
+  if (radius * stretch > SCALE_MAX_TAPS / 2)
+    stretch = SCALE_MAX_TAPS / 2 / radius;
+  int half = (int)ceil(radius * stretch);
+  double center = (x + 0.5) * ratio - 0.5;
+  *start = (int)floor(center) - half + 1;
+  double sum = 0.0;
+  for (int i = 0; i < 2 * half; i++) {
+    weights[i] = filter_weight(filter, (*start + i - center) / stretch);
+    sum += weights[i];
+  }
+  for (int i = 0; i < 2 * half; i++) {
+    weights[i] /= sum;
+  }
+  return 2 * half;
+}
+
+// one direction of one plane
+typedef struct scale_table_t {
+  int      dst_size;
+  int      padded;  // dst_size rounded up to 8
+  int      taps;    // multiple of 4
+  int32_t *pos;
+  int16_t *coef;    // hscale layout, or taps per output for vscale
+} scale_table_t;
+
+// taps that fall off the edge are folded onto the edge pixel, and the window
+// is kept inside the source so kernels never clamp
+static void scale_table_init(scale_table_t *table, scale_filter_e filter,
+                             int src_size, int dst_size, bool grouped) {
+  double weights[SCALE_MAX_TAPS];
+  double window[SCALE_MAX_TAPS];
+  int start = 0;
+  int n = scale_weights(filter, src_size, dst_size, 0, &start, weights);
+  table->dst_size = dst_size;
+  table->padded = (dst_size + 7) & ~7;
+  table->taps = (n + 3) & ~3;
+  table->pos = (int32_t *)calloc(table->padded, sizeof(int32_t));
+  table->coef =
+      (int16_t *)calloc((size_t)table->padded * table->taps, sizeof(int16_t));
+  int max_pos = src_size > table->taps ? src_size - table->taps : 0;
+  for (int x = 0; x < dst_size; x++) {
+    scale_weights(filter, src_size, dst_size, x, &start, weights);
+    int pos = clamp_int(start, 0, max_pos);
+    memset(window, 0, sizeof(window));
+    for (int i = 0; i < n; i++) {
+      window[clamp_int(start + i, 0, src_size - 1) - pos] += weights[i];
+    }
+    table->pos[x] = pos;
+    // quantize the running sum so the taps always add up to 1 << 14
+    double cum = 0.0;
+    int prev = 0;
+    for (int k = 0; k < table->taps; k++) {
+      cum += window[k];
+      int next = (int)lround(cum * (1 << SCALE_COEF_BITS));
+      int idx = grouped ? (x / 8) * table->taps * 8 + (k / 4) * 32 +
+                              (x % 8) * 4 + k % 4
+                        : x * table->taps + k;
+      table->coef[idx] = (int16_t)(next - prev);
+      prev = next;
+    }
+  }
+}
+
+static void scale_table_destroy(scale_table_t *table) {
+  free(table->pos);
+  free(table->coef);
+}
+
+/*
+ * frame driver
+ */
+typedef struct scale_slice_t {
+  int16_t *tmp;
+  size_t   size;
+} scale_slice_t;
+
+struct scale_t {
+  const scale_kernel_t *kernel;
+  slice_pool_t   *pool;
+  int             src_width;
+  int             src_height;
+  int             dst_width;
+  int             dst_height;
+  // luma and chroma
+  scale_table_t   h[2];
+  scale_table_t   v[2];
+  // horizontally scaled source rows per slice
+  scale_slice_t  *slices;
+  int             nslices;
+  // current frame
+  const frame_t  *src;
+  frame_t        *dst;
+};
+
+scale_t *scale_new(int src_width, int src_height, int dst_width,
+                   int dst_height, scale_filter_e filter, slice_pool_t *pool) {
+  if (src_width <= 0 || src_height <= 0 || dst_width <= 0 || dst_height <= 0 ||
+      filter >= SCALE_NUM)
+    return NULL;
+  scale_t *scale = (scale_t *)calloc(1, sizeof(scale_t));
+  scale->kernel = (const scale_kernel_t *)kernel_get(KERNEL_SCALE);
+  scale->pool = pool;
+  scale->src_width = src_width;
+  scale->src_height = src_height;
+  scale->dst_width = dst_width;
+  scale->dst_height = dst_height;
+  for (int i = 0; i < 2; i++) {
+    int shift = i;
+    scale_table_init(&scale->h[i], filter, (src_width + shift) >> shift,
+                     (dst_width + shift) >> shift, true);
+    scale_table_init(&scale->v[i], filter, (src_height + shift) >> shift,
+                     (dst_height + shift) >> shift, false);
+  }
+  scale->nslices = slice_pool_threads(pool) * SCALE_SLICES_PER_THREAD;
+  scale->slices =
+      (scale_slice_t *)calloc(scale->nslices, sizeof(scale_slice_t));
+  return scale;
+}
+
+void scale_free(scale_t *scale) {
+  if (scale == NULL)
+    return;
+  for (int i = 0; i < 2; i++) {
+    scale_table_destroy(&scale->h[i]);
+    scale_table_destroy(&scale->v[i]);
+  }
+  for (int i = 0; i < scale->nslices; i++) {
+    free(scale->slices[i].tmp);
+  }
+  free(scale->slices);
+  free(scale);
+}
+
+void scale_set_kernel(scale_t *scale, const scale_kernel_t *kernel) {
+  scale->kernel = kernel;
+}
+
+static void scale_plane_rows(scale_t *scale, scale_slice_t *slice, int plane,
+                             int y0, int y1) {
+  const scale_table_t *h = &scale->h[plane > 0];
+  const scale_table_t *v = &scale->v[plane > 0];
+  const frame_t *src = scale->src;
+  frame_t *dst = scale->dst;
+  int src_height = frame_plane_height(src, plane);
+  int first = v->pos[y0];
+  int nrows = v->pos[y1 - 1] + v->taps - first;
+  size_t size = (size_t)nrows * h->padded;
+  if (slice->size < size) {
+    free(slice->tmp);
+    slice->tmp = (int16_t *)aligned_alloc(
+        FRAME_ALIGN, (size * sizeof(int16_t) + FRAME_ALIGN - 1) &
+                         ~(size_t)(FRAME_ALIGN - 1));
+    slice->size = size;
+  }
+  for (int r = 0; r < nrows; r++) {
+    int y = clamp_int(first + r, 0, src_height - 1);
+    scale->kernel->hscale(src->data[plane] + (size_t)y * src->linesize[plane],
+                          slice->tmp + (size_t)r * h->padded, h->padded,
+                          h->pos, h->coef, h->taps);
+  }
+  const int16_t *rows[SCALE_MAX_TAPS];
+  for (int y = y0; y < y1; y++) {
+    for (int k = 0; k < v->taps; k++) {
+      rows[k] = slice->tmp + (size_t)(v->pos[y] - first + k) * h->padded;
+    }
+    scale->kernel->vscale(rows, v->coef + (size_t)y * v->taps,
+                          dst->data[plane] + (size_t)y * dst->linesize[plane],
+                          h->dst_size, v->taps);
+  }
+}
+
+static void scale_slice(void *arg, int slice, int nslices) {
+  scale_t *scale = (scale_t *)arg;
+  for (int plane = 0; plane < 3; plane++) {
+    int h = frame_plane_height(scale->dst, plane);
+    int y0 = h * slice / nslices;
+    int y1 = h * (slice + 1) / nslices;
+    if (y0 < y1)
+      scale_plane_rows(scale, &scale->slices[slice], plane, y0, y1);
+  }
+}
+
+void scale_frame(scale_t *scale, const frame_t *src, frame_t *dst) {
+  scale->src = src;
+  scale->dst = dst;
+  int nslices = scale->nslices;
+  // every slice filters its own source rows, so thin slices redo work
+  if (nslices > dst->height / 16)
+    nslices = dst->height / 16 > 0 ? dst->height / 16 : 1;
+  slice_pool_run(scale->pool, scale_slice, scale, nslices);
+  dst->pts = src->pts;
+}
+
+static void scale_plane_reference(const uint8_t *src, int src_stride,
+                                  int src_width, int src_height, uint8_t *dst,
+                                  int dst_stride, int dst_width,
+                                  int dst_height, scale_filter_e filter) {
+  double *tmp = (double *)malloc(sizeof(double) * dst_width * src_height);
+  double weights[SCALE_MAX_TAPS];
+  int start = 0;
+  for (int x = 0; x < dst_width; x++) {
+    int n = scale_weights(filter, src_width, dst_width, x, &start, weights);
+    for (int y = 0; y < src_height; y++) {
+      const uint8_t *s = src + (size_t)y * src_stride;
+      double sum = 0.0;
+      for (int i = 0; i < n; i++) {
+        sum += weights[i] * s[clamp_int(start + i, 0, src_width - 1)];
+      }
+      tmp[(size_t)y * dst_width + x] = sum;
+    }
+  }
+  for (int y = 0; y < dst_height; y++) {
+    int n = scale_weights(filter, src_height, dst_height, y, &start, weights);
+    for (int x = 0; x < dst_width; x++) {
+      double sum = 0.0;
+      for (int i = 0; i < n; i++) {
+        sum += weights[i] *
+               tmp[(size_t)clamp_int(start + i, 0, src_height - 1) * dst_width +
+                   x];
+      }
+      dst[(size_t)y * dst_stride + x] =
+          (uint8_t)clamp_int((int)lround(sum), 0, 255);
+    }
+  }
+  free(tmp);
+}
+
+void scale_frame_reference(const frame_t *src, frame_t *dst,
+                           scale_filter_e filter) {
+  for (int plane = 0; plane < 3; plane++) {
+    scale_plane_reference(src->data[plane], src->linesize[plane],
+                          frame_plane_width(src, plane),
+                          frame_plane_height(src, plane), dst->data[plane],
+                          dst->linesize[plane], frame_plane_width(dst, plane),
+                          frame_plane_height(dst, plane), filter);
+  }
+  dst->pts = src->pts;
+}
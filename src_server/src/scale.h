@@ -0,0 +1,57 @@
+#pragma once
+
+#include "frame.h"
+#include "kernels.h"
+#include "slice.h"
+
+// Separable polyphase scaler for YUV420 planes. Filter weights are computed
+// once per geometry and quantized to Q14, the horizontal pass leaves pixels
+// in Q6 int16 rows and the vertical pass rounds them back to 8 bits, so
+// every kernel is bit-exact with the C one.
+// Downscaling widens the filter by the scale ratio (up to SCALE_MAX_TAPS).
+
+#define SCALE_COEF_BITS   14
+#define SCALE_MAX_TAPS    32
+
+typedef enum {
+  SCALE_BILINEAR,
+  SCALE_BICUBIC, // Keys, a = -0.5
+  SCALE_LANCZOS, // 3 lobes
+  SCALE_NUM
+} scale_filter_e;
+
+// hscale filters width outputs (a multiple of 8) of one row. pos is the first
+// source pixel of each output, taps a multiple of 4, and coef holds groups of
+// 8 outputs: tap k of output x is coef[(x/8)*taps*8 + (k/4)*32 + (x%8)*4 + k%4]
+typedef void (*scale_h_fn)(const uint8_t *src, int16_t *dst, int width,
+                           const int32_t *pos, const int16_t *coef, int taps);
+// vscale blends taps rows of hscale output into one row of width pixels
+typedef void (*scale_v_fn)(const int16_t *const *rows, const int16_t *coef,
+                           uint8_t *dst, int width, int taps);
+
+typedef struct scale_kernel_t {
+  scale_h_fn  hscale;
+  scale_v_fn  vscale;
+} scale_kernel_t;
+
+// avx2, sse2, c, see kernels.h
+#define SCALE_NIMPLS 3
+extern const kernel_impl_t scale_impls[SCALE_NIMPLS];
+
+// scale_filter_from_name returns SCALE_NUM for unknown names
+scale_filter_e scale_filter_from_name(const char *name);
+const char *scale_filter_name(scale_filter_e filter);
+
+typedef struct scale_t scale_t;
+
+scale_t *scale_new(int src_width, int src_height, int dst_width,
+                   int dst_height, scale_filter_e filter, slice_pool_t *pool);
+void scale_free(scale_t *scale);
+// scale_set_kernel overrides the kernel bound in the registry
+void scale_set_kernel(scale_t *scale, const scale_kernel_t *kernel);
+// src and dst must have the sizes given to scale_new
+void scale_frame(scale_t *scale, const frame_t *src, frame_t *dst);
+// scale_frame_reference filters in double precision with unquantized
+// weights, it is slow and only meant to measure the fixed-point error
+void scale_frame_reference(const frame_t *src, frame_t *dst,
+                           scale_filter_e filter);
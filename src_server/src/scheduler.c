@@ -0,0 +1,911 @@
+#include "scheduler.h"
+#include "include/hmutex.h"
+#include "include/hsysinfo.h"
+#include "include/hthread.h"
+#include "include/htime.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SCHED_DEFAULT_DURATION 60.0 // seconds, when the probe failed
+#define SCHED_1080P_PIXELS     (1920.0 * 1080.0)
+#define SCHED_TARGET_LOAD      0.8 // headroom on the workers and the SLA
+
+static const char *s_preset_names[SCHED_NPRESETS] = {
+    "ultrafast", "superfast", "veryfast", "faster", "fast", "medium", "slow",
+};
+
+// x264 at 1080p30 on a quarter of a recent 16 core machine
+static const double s_default_cost[SCHED_NPRESETS] = {
+    0.12, 0.18, 0.28, 0.45, 0.60, 0.80, 1.50,
+};
+
+typedef struct sched_client_t {
+  char            id[SCHED_CLIENT_LEN];
+  double          weight;
+  int             max_running;
+  bool            configured;
+  double          deficit; // seconds of expected work
+  sched_task_t   *head;    // sorted by key
+  int             queued;
+  int             running;
+  long            finished;
+  double          service_sec;
+} sched_client_t;
+
+struct sched_t {
+  sched_config_t  config;
+  hmutex_t        mutex;
+  hcondvar_t      cond;
+  hthread_t      *threads;
+  sched_run_fn    run;
+  bool            stop;
+  // clients[0] is "*", the anonymous and overflow queue
+  sched_client_t *clients[SCHED_MAX_CLIENTS];
+  int             nclients;
+  int             cursor;
+  double          default_weight;
+  int             default_max_running;
+  double          service_sec;
+  double          calibration;
+  // ultrafast work arriving per second, averaged over a quarter of the SLA
+  // so a burst shows up before the first of it is due
+  double          load;
+  double          load_time;
+  sched_stats_t   stats;
+};
+
+const char *sched_preset_name(sched_preset_e preset) {
+  return preset < SCHED_NPRESETS ? s_preset_names[preset] : "unknown";
+}
+
+sched_preset_e sched_preset_from_name(const char *name) {
+  for (int i = 0; i < SCHED_NPRESETS; i++) {
+    if (strcmp(name, s_preset_names[i]) == 0)
+      return (sched_preset_e)i;
+  }
+  return SCHED_NPRESETS;
+}
+
+void sched_config_init(sched_config_t *config) {
+  memset(config, 0, sizeof(*config));
+  config->nworkers = (get_ncpu() + 3) / 4;
+  config->sla_sec = SCHED_SLA_SEC;
+  memcpy(config->cost, s_default_cost, sizeof(s_default_cost));
+  config->fixed_preset = -1;
+  config->order = SCHED_ORDER_SEJF;
+  config->aging = SCHED_AGING;
+  config->fair = true;
+  config->quantum_sec = SCHED_QUANTUM_SEC;
+  config->max_queued = SCHED_MAX_QUEUED;
+  // admitted work still has half the SLA left to encode in
+  config->max_wait_sec = SCHED_SLA_SEC / 2;
+}
+
+const char *sched_order_name(sched_order_e order) {
+  return order == SCHED_ORDER_FIFO ? "fifo" : "sejf";
+}
+
+double sched_now(void) { return gethrtime_us() / 1e6; }
+
+sched_t *sched_new(const sched_config_t *config) {
+  sched_t *sched = (sched_t *)calloc(1, sizeof(sched_t));
+  sched->config = *config;
+  if (sched->config.nworkers < 1)
+    sched->config.nworkers = 1;
+  if (sched->config.quantum_sec <= 0)
+    sched->config.quantum_sec = SCHED_QUANTUM_SEC;
+  sched->calibration = 1.0;
+  sched->default_weight = 1.0;
+  sched->clients[sched->nclients++] =
+      (sched_client_t *)calloc(1, sizeof(sched_client_t));
+  strcpy(sched->clients[0]->id, "*");
+  sched->clients[0]->weight = 1.0;
+  hmutex_init(&sched->mutex);
+  hcondvar_init(&sched->cond);
+  return sched;
+}
+
+void sched_free(sched_t *sched) {
+  if (sched == NULL)
+    return;
+  if (sched->threads) {
+    hmutex_lock(&sched->mutex);
+    sched->stop = true;
+    hcondvar_broadcast(&sched->cond);
+    hmutex_unlock(&sched->mutex);
+    for (int i = 0; i < sched->config.nworkers; i++) {
+      hthread_join(sched->threads[i]);
+    }
+    free(sched->threads);
+  }
+  for (int i = 0; i < sched->nclients; i++) {
+    free(sched->clients[i]);
+  }
+  hcondvar_destroy(&sched->cond);
+  hmutex_destroy(&sched->mutex);
+  free(sched);
+}
+
+// predicted seconds at calibration 1
+static double sched_work(const sched_config_t *config,
+                         const sched_task_t *task, sched_preset_e preset) {
+  double duration =
+      task->duration > 0 ? task->duration : SCHED_DEFAULT_DURATION;
+  double pixels = task->width > 0 && task->height > 0
+                      ? (double)task->width * task->height
+                      : SCHED_1080P_PIXELS;
+  double factor = task->factor > 0 ? task->factor : 1.0;
+  return config->cost[preset] * duration * pixels / SCHED_1080P_PIXELS *
+         factor;
+}
+
+double sched_predict(const sched_t *sched, const sched_task_t *task,
+                     sched_preset_e preset) {
+  return sched_work(&sched->config, task, preset) * sched->calibration;
+}
+
+static double sched_load_window(const sched_t *sched) {
+  return sched->config.sla_sec / 4;
+}
+
+static void sched_decay_load(sched_t *sched, double now) {
+  if (now > sched->load_time) {
+    sched->load *= exp(-(now - sched->load_time) / sched_load_window(sched));
+    sched->load_time = now;
+  }
+}
+
+static bool sched_idle_client(const sched_client_t *client) {
+  return client->head == NULL && client->running == 0 && !client->configured;
+}
+
+// sched_client finds the queue of id, it makes one from the defaults if
+// there is none, reusing the slot of an idle client when the table is full
+static sched_client_t *sched_client(sched_t *sched, const char *id) {
+  if (id == NULL || *id == '\0' || strcmp(id, "*") == 0)
+    return sched->clients[0];
+  int slot = -1;
+  for (int i = 1; i < sched->nclients; i++) {
+    if (strncmp(sched->clients[i]->id, id, SCHED_CLIENT_LEN - 1) == 0)
+      return sched->clients[i];
+    if (slot < 0 && sched_idle_client(sched->clients[i]))
+      slot = i;
+  }
+  if (sched->nclients < SCHED_MAX_CLIENTS) {
+    slot = sched->nclients++;
+    sched->clients[slot] = (sched_client_t *)malloc(sizeof(sched_client_t));
+  } else if (slot < 0) {
+    return sched->clients[0];
+  } else {
+    sched->service_sec -= sched->clients[slot]->service_sec;
+  }
+  sched_client_t *client = sched->clients[slot];
+  memset(client, 0, sizeof(*client));
+  strncpy(client->id, id, SCHED_CLIENT_LEN - 1);
+  client->weight = sched->default_weight;
+  client->max_running = sched->default_max_running;
+  return client;
+}
+
+void sched_set_client(sched_t *sched, const char *id, double weight,
+                      int max_running) {
+  if (weight < 0.01)
+    weight = 0.01;
+  if (max_running < 0)
+    max_running = 0;
+  hmutex_lock(&sched->mutex);
+  if (strcmp(id, "*") == 0) {
+    sched->default_weight = weight;
+    sched->default_max_running = max_running;
+    for (int i = 0; i < sched->nclients; i++) {
+      if (!sched->clients[i]->configured) {
+        sched->clients[i]->weight = weight;
+        sched->clients[i]->max_running = max_running;
+      }
+    }
+  } else {
+    sched_client_t *client = sched_client(sched, id);
+    if (client != sched->clients[0]) {
+      client->weight = weight;
+      client->max_running = max_running;
+      client->configured = true;
+    }
+  }
+  hmutex_unlock(&sched->mutex);
+}
+
+int sched_load_clients(sched_t *sched, const char *path) {
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL)
+    return -1;
+  int nclients = 0;
+  char line[256];
+  while (fgets(line, sizeof(line), fp)) {
+    char id[SCHED_CLIENT_LEN];
+    double weight = 1.0;
+    int max_running = 0;
+    if (line[0] == '#' ||
+        sscanf(line, "%63s %lf %d", id, &weight, &max_running) < 2)
+      continue;
+    sched_set_client(sched, id, weight, max_running);
+    nclients++;
+  }
+  fclose(fp);
+  return nclients;
+}
+
+void sched_push(sched_t *sched, sched_task_t *task, double now) {
+  task->arrival = now;
+  // the ultrafast estimate is kept until dispatch to take it off again
+  task->predicted = sched_predict(sched, task, SCHED_ULTRAFAST);
+  // cost - aging * (now - arrival) ranks tasks the same at any later now,
+  // so the key is fixed at arrival and the queue stays sorted
+  task->key = sched->config.order == SCHED_ORDER_FIFO
+                  ? now
+                  : task->predicted + sched->config.aging * now;
+  sched_client_t *client =
+      sched->config.fair ? sched_client(sched, task->client)
+                         : sched->clients[0];
+  task->owner = client;
+  sched_task_t **link = &client->head;
+  while (*link && (*link)->key <= task->key)
+    link = &(*link)->next;
+  task->next = *link;
+  *link = task;
+  client->queued++;
+  sched->stats.submitted++;
+  sched->stats.queued++;
+  sched->stats.backlog_sec += task->predicted;
+  sched_decay_load(sched, now);
+  sched->load += task->predicted / sched_load_window(sched);
+}
+
+static sched_preset_e sched_choose(sched_t *sched, const sched_task_t *task,
+                                   double now) {
+  if (sched->config.fixed_preset >= 0)
+    return (sched_preset_e)sched->config.fixed_preset;
+  // what is left of the SLA, and the share of a worker the jobs behind need
+  // at the very least
+  double budget = sched->config.sla_sec - (now - task->arrival);
+  double behind = sched->config.sla_sec -
+                  sched->stats.backlog_sec / sched->config.nworkers;
+  if (behind < budget)
+    budget = behind;
+  // the recent arrivals must also keep fitting if they all got this preset
+  sched_decay_load(sched, now);
+  double load = sched->load / sched->config.nworkers;
+  for (int p = SCHED_NPRESETS - 1; p > SCHED_ULTRAFAST; p--) {
+    double slowdown = sched->config.cost[p] / sched->config.cost[0];
+    if (load * slowdown <= SCHED_TARGET_LOAD &&
+        sched_predict(sched, task, (sched_preset_e)p) <=
+            SCHED_TARGET_LOAD * budget)
+      return (sched_preset_e)p;
+  }
+  return SCHED_ULTRAFAST;
+}
+
+static bool sched_capped(const sched_t *sched, const sched_client_t *client) {
+  return sched->config.fair && client->max_running > 0 &&
+         client->running >= client->max_running;
+}
+
+// sched_next_client goes round the clients from the cursor. The cursor
+// stays on a client while its credit covers its next task, so it runs a
+// weighted share of work per round and not of tasks. Capped clients sit the
+// round out without credit.
+static sched_client_t *sched_next_client(sched_t *sched) {
+  double quantum = sched->config.quantum_sec;
+  for (;;) {
+    // rounds every client with a queue is short of, skipped at once below
+    double short_rounds = -1;
+    for (int i = 0; i < sched->nclients; i++) {
+      sched_client_t *client = sched->clients[sched->cursor];
+      if (client->head == NULL) {
+        client->deficit = 0;
+      } else if (!sched_capped(sched, client)) {
+        if (client->deficit >= client->head->predicted)
+          return client;
+        client->deficit += client->weight * quantum;
+        double rounds = ceil((client->head->predicted - client->deficit) /
+                             (client->weight * quantum));
+        if (rounds < 0)
+          rounds = 0;
+        if (short_rounds < 0 || rounds < short_rounds)
+          short_rounds = rounds;
+      }
+      sched->cursor = (sched->cursor + 1) % sched->nclients;
+    }
+    if (short_rounds < 0)
+      return NULL;
+    if (short_rounds > 0) {
+      for (int i = 0; i < sched->nclients; i++) {
+        sched_client_t *client = sched->clients[i];
+        if (client->head && !sched_capped(sched, client))
+          client->deficit += short_rounds * client->weight * quantum;
+      }
+    }
+  }
+}
+
+sched_task_t *sched_pop(sched_t *sched, double now) {
+  if (sched->stats.queued == 0 ||
+      sched->stats.running >= sched->config.nworkers)
+    return NULL;
+  sched_client_t *client = sched_next_client(sched);
+  if (client == NULL)
+    return NULL;
+  sched_task_t *task = client->head;
+  client->head = task->next;
+  client->deficit -= task->predicted;
+  client->queued--;
+  client->running++;
+  task->next = NULL;
+  sched->stats.queued--;
+  sched->stats.backlog_sec -= task->predicted;
+  if (sched->stats.queued == 0 || sched->stats.backlog_sec < 0)
+    sched->stats.backlog_sec = 0;
+  sched->stats.running++;
+
+  task->preset = sched_choose(sched, task, now);
+  task->predicted = sched_predict(sched, task, task->preset);
+  task->start = now;
+  task->encode_sec = 0;
+  sched->stats.presets[task->preset]++;
+  return task;
+}
+
+static bool sched_admit_locked(sched_t *sched, int pending,
+                               double *retry_after) {
+  const sched_config_t *config = &sched->config;
+  int queued = sched->stats.queued + pending;
+  // uploads not probed yet count as the average queued task
+  double mean = sched->stats.queued > 0
+                    ? sched->stats.backlog_sec / sched->stats.queued
+                    : config->cost[SCHED_ULTRAFAST] * SCHED_DEFAULT_DURATION *
+                          sched->calibration;
+  double backlog = sched->stats.backlog_sec + pending * mean;
+  double limit = config->max_wait_sec * config->nworkers;
+  bool full = config->max_queued > 0 && queued >= config->max_queued;
+  bool late = config->max_wait_sec > 0 && backlog >= limit;
+  if (!full && !late)
+    return true;
+  if (retry_after) {
+    // the workers take the excess off the queue at nworkers seconds a second
+    double excess = 0;
+    if (full)
+      excess = (queued - config->max_queued + 1) * mean;
+    if (late && backlog - limit + mean > excess)
+      excess = backlog - limit + mean;
+    *retry_after = excess / config->nworkers;
+  }
+  return false;
+}
+
+bool sched_admit(sched_t *sched, int pending, double *retry_after) {
+  hmutex_lock(&sched->mutex);
+  bool admit = sched_admit_locked(sched, pending, retry_after);
+  hmutex_unlock(&sched->mutex);
+  return admit;
+}
+
+void sched_done(sched_t *sched, sched_task_t *task, double now) {
+  sched->stats.running--;
+  sched->stats.finished++;
+  double measured =
+      task->encode_sec > 0 ? task->encode_sec : now - task->start;
+  task->owner->running--;
+  task->owner->finished++;
+  task->owner->service_sec += measured;
+  sched->service_sec += measured;
+  double work = sched_work(&sched->config, task, task->preset);
+  // sub-second encodes are mostly process startup
+  if (measured < 0.5 || work <= 0)
+    return;
+  double calibration = 0.8 * sched->calibration + 0.2 * measured / work;
+  sched->calibration = calibration < 0.05 ? 0.05
+                       : calibration > 20 ? 20
+                                          : calibration;
+}
+
+void sched_stats(sched_t *sched, sched_stats_t *stats) {
+  hmutex_lock(&sched->mutex);
+  *stats = sched->stats;
+  stats->calibration = sched->calibration;
+  stats->nclients = sched->nclients;
+  hmutex_unlock(&sched->mutex);
+}
+
+static int compare_client_stats(const void *a, const void *b) {
+  const sched_client_stats_t *x = (const sched_client_stats_t *)a;
+  const sched_client_stats_t *y = (const sched_client_stats_t *)b;
+  int xload = x->queued + x->running, yload = y->queued + y->running;
+  if (xload != yload)
+    return yload - xload;
+  return (x->service_sec < y->service_sec) - (x->service_sec > y->service_sec);
+}
+
+int sched_client_stats(sched_t *sched, sched_client_stats_t *stats, int max) {
+  sched_client_stats_t all[SCHED_MAX_CLIENTS];
+  int n = 0;
+  hmutex_lock(&sched->mutex);
+  for (int i = 0; i < sched->nclients; i++) {
+    const sched_client_t *client = sched->clients[i];
+    if (client->head == NULL && client->running == 0 && client->finished == 0)
+      continue;
+    sched_client_stats_t *s = &all[n++];
+    memcpy(s->id, client->id, sizeof(s->id));
+    s->weight = client->weight;
+    s->max_running = client->max_running;
+    s->queued = client->queued;
+    s->running = client->running;
+    s->finished = client->finished;
+    s->service_sec = client->service_sec;
+    s->share = sched->service_sec > 0
+                   ? client->service_sec / sched->service_sec
+                   : 0;
+  }
+  hmutex_unlock(&sched->mutex);
+  qsort(all, n, sizeof(all[0]), compare_client_stats);
+  if (n > max)
+    n = max;
+  memcpy(stats, all, n * sizeof(all[0]));
+  return n;
+}
+
+static HTHREAD_ROUTINE(sched_worker) {
+  sched_t *sched = (sched_t *)userdata;
+  hmutex_lock(&sched->mutex);
+  while (!sched->stop) {
+    sched_task_t *task = sched_pop(sched, sched_now());
+    if (task == NULL) {
+      hcondvar_wait(&sched->cond, &sched->mutex);
+      continue;
+    }
+    printf("sched: %.0fs of %dx%d as %s, predicted %.1fs, waited %.1fs\n",
+           task->duration, task->width, task->height,
+           sched_preset_name(task->preset), task->predicted,
+           task->start - task->arrival);
+    hmutex_unlock(&sched->mutex);
+    // the task may be gone once run returns, only keep what sched_done needs
+    sched_task_t done = *task;
+    done.encode_sec = sched->run(task);
+    hmutex_lock(&sched->mutex);
+    sched_done(sched, &done, sched_now());
+  }
+  hmutex_unlock(&sched->mutex);
+  return 0;
+}
+
+void sched_start(sched_t *sched, sched_run_fn run) {
+  sched->run = run;
+  sched->threads =
+      (hthread_t *)calloc(sched->config.nworkers, sizeof(hthread_t));
+  for (int i = 0; i < sched->config.nworkers; i++) {
+    sched->threads[i] = hthread_create(sched_worker, sched);
+  }
+}
+
+void sched_submit(sched_t *sched, sched_task_t *task) {
+  double now = sched_now();
+  char trace[SCHED_CLIENT_LEN + 128];
+  hmutex_lock(&sched->mutex);
+  sched_push(sched, task, now);
+  // the line is made under the lock, the file is written after it, each
+  // line goes out in one append
+  if (sched->config.trace_path)
+    snprintf(trace, sizeof(trace), "%.3f,%.3f,%d,%d,1,%s,%.3f\n", now,
+             task->duration, task->width, task->height, task->owner->id,
+             task->factor);
+  hcondvar_signal(&sched->cond);
+  hmutex_unlock(&sched->mutex);
+  if (sched->config.trace_path) {
+    FILE *fp = fopen(sched->config.trace_path, "a");
+    if (fp) {
+      fputs(trace, fp);
+      fclose(fp);
+    }
+  }
+}
+
+/*
+ * --sched-sim trace.csv|mixed|batch|overload [workers] [sla_sec] [speed]
+ * replays arrivals "time,duration,width,height[,factor[,client[,cost]]]" on
+ * a virtual clock. An encode takes the default cost model times speed (how
+ * much slower this machine is) times the per job factor, the scheduler has to
+ * learn speed through its calibration. cost is the task factor the server
+ * put on top of the encode (denoising, CRF samples), the scheduler sees it
+ * as it did live.
+ * mixed generates SIM_MIXED_JOBS arrivals instead: mostly short clips with
+ * a few long recordings, Poisson at SIM_MIXED_LOAD of the workers at
+ * ultrafast. batch has one client post SIM_BATCH_JOBS short files at once
+ * while SIM_BATCH_USERS others post a clip now and then for an hour.
+ * The synthetic workloads run every policy in FIFO, SEJF and fair order,
+ * others_p95 leaves out the client with the most jobs. Admission is off
+ * for them, overload runs an hour of clips at up to SIM_OVERLOAD_MAX times
+ * what the workers take with and without it, goodput counts the jobs done
+ * within the SLA.
+ */
+#define SIM_MIXED_JOBS  2000
+#define SIM_MIXED_LOAD  0.8
+#define SIM_MIXED_LONG  0.1 // share of long recordings
+#define SIM_BATCH_JOBS  1000
+#define SIM_BATCH_USERS 30
+#define SIM_BATCH_GAP   20.0 // seconds between clips, on average
+#define SIM_OVERLOAD_MAX 3
+#define SIM_HOUR        3600.0
+
+typedef struct sim_job_t {
+  sched_task_t  task;
+  char          client[SCHED_CLIENT_LEN];
+  bool          top; // of the client with the most jobs
+  double        factor;
+  double        finish;
+} sim_job_t;
+
+typedef struct sim_result_t {
+  double  mean;
+  double  p95;
+  double  max;
+  int     sla_missed;
+  double  others_p95; // -1 with a single client
+  int     rejected;
+  int     goodput;    // done within the SLA
+  double  mean_preset;
+  long    presets[SCHED_NPRESETS];
+} sim_result_t;
+
+static int compare_double(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+static int compare_arrival(const void *a, const void *b) {
+  return compare_double(&((const sim_job_t *)a)->task.arrival,
+                        &((const sim_job_t *)b)->task.arrival);
+}
+
+static double sim_random(unsigned long long *state) {
+  *state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+  return ((*state >> 11) + 0.5) / 9007199254740992.0; // (0, 1)
+}
+
+// the same jobs on every run, so policies are compared on equal terms
+static sim_job_t *sim_mixed_jobs(const sched_config_t *config, int njobs) {
+  static const int heights[] = {480, 720, 1080, 2160};
+  sim_job_t *jobs = (sim_job_t *)calloc(njobs, sizeof(sim_job_t));
+  unsigned long long state = 42;
+  double work = 0;
+  for (int i = 0; i < njobs; i++) {
+    sim_job_t *job = &jobs[i];
+    if (sim_random(&state) < SIM_MIXED_LONG)
+      job->task.duration = 1800 + 5400 * sim_random(&state);
+    else
+      job->task.duration = 10 + 50 * sim_random(&state);
+    job->task.height = heights[(int)(sim_random(&state) * 4)];
+    job->task.width = job->task.height * 16 / 9;
+    // denoised or sharpened uploads cost more than a plain encode
+    job->task.factor = sim_random(&state) < 0.2 ? 2.0 : 1.0;
+    // the cost model is off by up to 30% either way
+    job->factor = 0.7 + 0.6 * sim_random(&state);
+    work += sched_work(config, &job->task, SCHED_ULTRAFAST) * job->factor;
+  }
+  double rate = SIM_MIXED_LOAD * config->nworkers / (work / njobs);
+  double t = 0;
+  for (int i = 0; i < njobs; i++) {
+    jobs[i].task.arrival = t;
+    t -= log(sim_random(&state)) / rate;
+  }
+  return jobs;
+}
+
+static sim_job_t *sim_batch_jobs(int *pnjobs) {
+  int capacity = SIM_BATCH_JOBS + 3 * 3600 / SIM_BATCH_GAP;
+  sim_job_t *jobs = (sim_job_t *)calloc(capacity, sizeof(sim_job_t));
+  unsigned long long state = 7;
+  int njobs = 0;
+  for (; njobs < SIM_BATCH_JOBS; njobs++) {
+    sim_job_t *job = &jobs[njobs];
+    strcpy(job->client, "key:batch");
+    job->task.arrival = 60 * sim_random(&state);
+    job->task.duration = 30 + 60 * sim_random(&state);
+    job->task.width = 1920;
+    job->task.height = 1080;
+    job->factor = 0.7 + 0.6 * sim_random(&state);
+  }
+  for (double t = 0; t < 3600 && njobs < capacity; njobs++) {
+    sim_job_t *job = &jobs[njobs];
+    t -= log(sim_random(&state)) * SIM_BATCH_GAP;
+    snprintf(job->client, sizeof(job->client), "ip:10.0.0.%d",
+             1 + (int)(sim_random(&state) * SIM_BATCH_USERS));
+    job->task.arrival = t;
+    job->task.duration = 10 + 50 * sim_random(&state);
+    job->task.height = sim_random(&state) < 0.5 ? 720 : 1080;
+    job->task.width = job->task.height * 16 / 9;
+    job->factor = 0.7 + 0.6 * sim_random(&state);
+  }
+  *pnjobs = njobs;
+  return jobs;
+}
+
+// an hour of clips at load times what the workers take at ultrafast
+static sim_job_t *sim_overload_jobs(const sched_config_t *config, double load,
+                                    int *pnjobs) {
+  static const int heights[] = {480, 720, 1080, 2160};
+  unsigned long long state = 11;
+  double mean = 0;
+  for (int i = 0; i < 1000; i++) {
+    sched_task_t task;
+    memset(&task, 0, sizeof(task));
+    task.duration = 10 + 50 * sim_random(&state);
+    task.height = heights[(int)(sim_random(&state) * 4)];
+    task.width = task.height * 16 / 9;
+    mean += sched_work(config, &task, SCHED_ULTRAFAST) / 1000;
+  }
+  double rate = load * config->nworkers / mean;
+  int capacity = (int)(2 * rate * SIM_HOUR) + 16;
+  sim_job_t *jobs = (sim_job_t *)calloc(capacity, sizeof(sim_job_t));
+  int njobs = 0;
+  for (double t = 0; t < SIM_HOUR && njobs < capacity; njobs++) {
+    sim_job_t *job = &jobs[njobs];
+    job->task.arrival = t;
+    job->task.duration = 10 + 50 * sim_random(&state);
+    job->task.height = heights[(int)(sim_random(&state) * 4)];
+    job->task.width = job->task.height * 16 / 9;
+    job->factor = 0.7 + 0.6 * sim_random(&state);
+    t -= log(sim_random(&state)) / rate;
+  }
+  *pnjobs = njobs;
+  return jobs;
+}
+
+static void sim_mark_top(sim_job_t *jobs, int njobs) {
+  int top = -1, top_count = 0;
+  for (int i = 0; i < njobs; i++) {
+    int count = 0;
+    for (int j = 0; j < njobs && count * 2 <= njobs; j++) {
+      count += strcmp(jobs[j].client, jobs[i].client) == 0;
+    }
+    if (count > top_count)
+      top = i, top_count = count;
+    if (top_count * 2 > njobs)
+      break;
+  }
+  for (int i = 0; i < njobs; i++) {
+    jobs[i].top = strcmp(jobs[i].client, jobs[top].client) == 0;
+  }
+}
+
+static void sched_sim_run(const sched_config_t *config, sim_job_t *jobs,
+                          int njobs, double speed, sim_result_t *result) {
+  sched_t *sched = sched_new(config);
+  sim_job_t **running =
+      (sim_job_t **)calloc(sched->config.nworkers, sizeof(sim_job_t *));
+  double *latency = (double *)calloc(njobs, sizeof(double));
+  double *others = (double *)calloc(njobs, sizeof(double));
+  int nothers = 0;
+  double *arrival = (double *)calloc(njobs, sizeof(double));
+  for (int i = 0; i < njobs; i++) {
+    arrival[i] = jobs[i].task.arrival;
+  }
+  int next = 0, nfinished = 0, nlatency = 0;
+  memset(result, 0, sizeof(*result));
+  while (nfinished < njobs) {
+    // the next event is an arrival or the earliest finish
+    int slot = -1;
+    for (int w = 0; w < sched->config.nworkers; w++) {
+      if (running[w] && (slot < 0 || running[w]->finish < running[slot]->finish))
+        slot = w;
+    }
+    double now;
+    if (next < njobs && (slot < 0 || arrival[next] <= running[slot]->finish)) {
+      now = arrival[next];
+      jobs[next].task.client = jobs[next].client;
+      if (sched_admit_locked(sched, 0, NULL)) {
+        sched_push(sched, &jobs[next].task, now);
+      } else {
+        result->rejected++;
+        nfinished++;
+      }
+      next++;
+    } else {
+      sim_job_t *job = running[slot];
+      now = job->finish;
+      running[slot] = NULL;
+      sched_done(sched, &job->task, now);
+      latency[nlatency++] = now - job->task.arrival;
+      nfinished++;
+      if (!job->top)
+        others[nothers++] = now - job->task.arrival;
+    }
+    for (int w = 0; w < sched->config.nworkers; w++) {
+      if (running[w])
+        continue;
+      sched_task_t *task = sched_pop(sched, now);
+      if (task == NULL)
+        break;
+      sim_job_t *job = (sim_job_t *)task;
+      task->encode_sec =
+          sched_work(&sched->config, task, task->preset) * speed * job->factor;
+      job->finish = now + task->encode_sec;
+      running[w] = job;
+    }
+  }
+
+  qsort(latency, nlatency, sizeof(double), compare_double);
+  for (int i = 0; i < nlatency; i++) {
+    result->mean += latency[i] / nlatency;
+    result->sla_missed += latency[i] > config->sla_sec;
+  }
+  result->goodput = nlatency - result->sla_missed;
+  result->p95 = nlatency ? latency[(int)ceil(0.95 * nlatency) - 1] : 0;
+  result->max = nlatency ? latency[nlatency - 1] : 0;
+  qsort(others, nothers, sizeof(double), compare_double);
+  result->others_p95 = nothers ? others[(int)ceil(0.95 * nothers) - 1] : -1;
+  memcpy(result->presets, sched->stats.presets, sizeof(result->presets));
+  for (int p = 0; p < SCHED_NPRESETS; p++) {
+    if (nlatency)
+      result->mean_preset += (double)p * result->presets[p] / nlatency;
+  }
+  free(arrival);
+  free(others);
+  free(latency);
+  free(running);
+  sched_free(sched);
+}
+
+static void sched_sim_print(const sched_config_t *config, const char *policy,
+                            const sim_result_t *result) {
+  printf("%-5s %-10s %9.1f %9.1f %9.1f %9d ",
+         config->fair ? "fair" : sched_order_name(config->order), policy,
+         result->mean, result->p95, result->max, result->sla_missed);
+  if (result->others_p95 < 0)
+    printf("%10s ", "-");
+  else
+    printf("%10.1f ", result->others_p95);
+  printf("%7.2f  ", result->mean_preset);
+  for (int p = 0; p < SCHED_NPRESETS; p++) {
+    printf("%s%ld", p ? "/" : "", result->presets[p]);
+  }
+  printf("\n");
+}
+
+static int sched_sim_overload(sched_config_t *config, double speed) {
+  printf("an hour of clips, %d workers, SLA %.0fs, speed %.2f, adaptive\n",
+         config->nworkers, config->sla_sec, speed);
+  printf("%-5s %-9s %7s %9s %9s %9s %9s %9s\n", "load", "admission", "jobs",
+         "rejected", "goodput", "mean_s", "p95_s", "max_s");
+  int max_queued = config->max_queued;
+  double max_wait_sec = config->max_wait_sec;
+  for (int load = 1; load <= SIM_OVERLOAD_MAX; load++) {
+    int njobs = 0;
+    sim_job_t *jobs = sim_overload_jobs(config, load, &njobs);
+    for (int admit = 0; admit <= 1; admit++) {
+      config->max_queued = admit ? max_queued : 0;
+      config->max_wait_sec = admit ? max_wait_sec : 0;
+      sim_result_t result;
+      sched_sim_run(config, jobs, njobs, speed, &result);
+      printf("%-5d %-9s %7d %9d %9d %9.1f %9.1f %9.1f\n", load,
+             admit ? "on" : "off", njobs, result.rejected, result.goodput,
+             result.mean, result.p95, result.max);
+    }
+    free(jobs);
+  }
+  return 0;
+}
+
+static sim_job_t *sim_load_trace(const char *path, int *pnjobs) {
+  FILE *fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+  if (fp == NULL) {
+    fprintf(stderr, "Failed to open %s\n", path);
+    return NULL;
+  }
+  int njobs = 0, capacity = 0;
+  sim_job_t *jobs = NULL;
+  char line[256];
+  while (fgets(line, sizeof(line), fp)) {
+    sim_job_t job;
+    memset(&job, 0, sizeof(job));
+    job.factor = 1.0;
+    if (line[0] == '#' ||
+        sscanf(line, "%lf,%lf,%d,%d,%lf,%63[^,\n],%lf", &job.task.arrival,
+               &job.task.duration, &job.task.width, &job.task.height,
+               &job.factor, job.client, &job.task.factor) < 4)
+      continue;
+    if (njobs == capacity) {
+      capacity = capacity ? 2 * capacity : 256;
+      jobs = (sim_job_t *)realloc(jobs, capacity * sizeof(sim_job_t));
+    }
+    jobs[njobs++] = job;
+  }
+  if (fp != stdin)
+    fclose(fp);
+  if (njobs == 0) {
+    fprintf(stderr, "No arrivals in %s\n", path);
+    free(jobs);
+    return NULL;
+  }
+  *pnjobs = njobs;
+  return jobs;
+}
+
+int sched_sim_main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr,
+            "Usage: --sched-sim trace.csv|mixed|batch|overload [workers] "
+            "[sla_sec] [speed]\n");
+    return -10;
+  }
+  sched_config_t config;
+  sched_config_init(&config);
+  double speed = 1.0;
+  if (argc > 2)
+    config.nworkers = atoi(argv[2]);
+  if (argc > 3)
+    config.sla_sec = atof(argv[3]);
+  if (argc > 4)
+    speed = atof(argv[4]);
+
+  if (strcmp(argv[1], "overload") == 0)
+    return sched_sim_overload(&config, speed);
+  // the trace only has what was admitted
+  config.max_queued = 0;
+  config.max_wait_sec = 0;
+
+  int njobs = 0;
+  sim_job_t *jobs = NULL;
+  bool synthetic = true;
+  if (strcmp(argv[1], "mixed") == 0) {
+    njobs = SIM_MIXED_JOBS;
+    jobs = sim_mixed_jobs(&config, njobs);
+  } else if (strcmp(argv[1], "batch") == 0) {
+    jobs = sim_batch_jobs(&njobs);
+  } else {
+    synthetic = false;
+    jobs = sim_load_trace(argv[1], &njobs);
+    if (jobs == NULL)
+      return 1;
+  }
+  // recorded traces carry the server clock
+  qsort(jobs, njobs, sizeof(sim_job_t), compare_arrival);
+  double t0 = jobs[0].task.arrival;
+  for (int i = 0; i < njobs; i++) {
+    jobs[i].task.arrival -= t0;
+  }
+  sim_mark_top(jobs, njobs);
+
+  printf("%d jobs over %.0fs, %d workers, SLA %.0fs, speed %.2f\n", njobs,
+         jobs[njobs - 1].task.arrival, config.nworkers, config.sla_sec, speed);
+  printf("%-5s %-10s %9s %9s %9s %9s %10s %7s  %s\n", "order", "policy",
+         "mean_s", "p95_s", "max_s", "sla_miss", "others_p95", "preset",
+         "ultrafast/.../slow");
+  sim_job_t *replay = (sim_job_t *)malloc(njobs * sizeof(sim_job_t));
+  sim_result_t result;
+  // a trace runs in the server's order, the synthetic ones compare them
+  struct {
+    sched_order_e order;
+    bool          fair;
+  } orders[3] = {{config.order, config.fair},
+                 {SCHED_ORDER_SEJF, false},
+                 {SCHED_ORDER_SEJF, true}};
+  if (synthetic)
+    orders[0].order = SCHED_ORDER_FIFO, orders[0].fair = false;
+  for (int o = 0; o < (synthetic ? 3 : 1); o++) {
+    config.order = orders[o].order;
+    config.fair = orders[o].fair;
+    // the cost model first, then every fixed preset as a baseline
+    for (int p = -1; p < SCHED_NPRESETS; p++) {
+      memcpy(replay, jobs, njobs * sizeof(sim_job_t));
+      config.fixed_preset = p;
+      sched_sim_run(&config, replay, njobs, speed, &result);
+      sched_sim_print(
+          &config,
+          p < 0 ? "adaptive" : sched_preset_name((sched_preset_e)p), &result);
+    }
+  }
+  free(replay);
+  free(jobs);
+  return 0;
+}
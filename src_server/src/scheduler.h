@@ -0,0 +1,152 @@
+#pragma once
+
+#include <stdbool.h>
+
+// Transcode scheduler. Jobs wait in a queue for one of nworkers slots and
+// get their x264 preset when they are dispatched, from a cost model:
+//   predicted seconds = cost[preset] * duration * pixels / 1080p pixels
+//                       * calibration
+// The slowest preset that still finishes within the SLA, counting the time
+// already waited and the work queued behind, and that would keep the
+// workers below SCHED_TARGET_LOAD at the recent arrival rate wins. An idle
+// server encodes slow and small, a busy one ultrafast. The calibration
+// follows the ratio of measured to predicted encode times.
+// The queue runs the shortest expected job first. Every second waited takes
+// aging seconds off a job's expected cost, so long jobs still get their turn.
+// With fair on, every client (API key, cookie or address) has its own queue
+// and the workers go round them by deficit round robin: a turn credits
+// weight * quantum_sec seconds of expected work, a client runs its next job
+// once the credit covers it. Clients may be capped at max_running jobs at a
+// time, an uncapped client alone gets every idle worker.
+// sched_admit sheds load before it is queued: new work is turned away once
+// the queue would take more than max_wait_sec to drain at ultrafast, or
+// holds max_queued tasks, with the time until it would be let in.
+
+typedef enum {
+  SCHED_ULTRAFAST,
+  SCHED_SUPERFAST,
+  SCHED_VERYFAST,
+  SCHED_FASTER,
+  SCHED_FAST,
+  SCHED_MEDIUM,
+  SCHED_SLOW,
+  SCHED_NPRESETS
+} sched_preset_e;
+
+typedef enum {
+  SCHED_ORDER_FIFO,
+  SCHED_ORDER_SEJF, // shortest expected job first, with aging
+} sched_order_e;
+
+#define SCHED_SLA_SEC     600.0
+#define SCHED_AGING       0.5
+#define SCHED_QUANTUM_SEC 30.0
+#define SCHED_TRACE_FILE  "jobs/trace.csv"
+#define SCHED_CLIENTS_FILE "clients.conf"
+#define SCHED_CLIENT_LEN  64
+#define SCHED_MAX_CLIENTS 256
+#define SCHED_MAX_QUEUED  256
+
+typedef struct sched_config_t {
+  int         nworkers;
+  double      sla_sec;
+  // seconds per second of 1080p video on one worker, see sched_config_init
+  double      cost[SCHED_NPRESETS];
+  int         fixed_preset; // a sched_preset_e, or -1 for the cost model
+  sched_order_e order;
+  double      aging;
+  bool        fair;         // a queue per client, or one for all
+  double      quantum_sec;
+  // sched_admit limits, 0 is none
+  int         max_queued;
+  double      max_wait_sec;
+  const char *trace_path;   // arrivals are appended here, NULL is off
+} sched_config_t;
+
+typedef struct sched_task_t {
+  void                *userdata;
+  double               duration; // seconds of input
+  int                  width;
+  int                  height;
+  double               factor;   // pipeline cost over a plain encode, 0 is 1
+  double               arrival;  // sched clock, set by sched_submit
+  double               key;      // queue order
+  const char          *client;   // NULL or "" is anonymous
+  struct sched_client_t *owner;  // set by sched_push
+  // set on dispatch
+  sched_preset_e       preset;
+  double               predicted;
+  double               start;
+  double               encode_sec; // see sched_run_fn
+  struct sched_task_t *next;
+} sched_task_t;
+
+typedef struct sched_stats_t {
+  long    submitted;
+  long    finished;
+  int     queued;
+  int     running;
+  double  backlog_sec; // predicted work queued, at ultrafast
+  double  calibration;
+  long    presets[SCHED_NPRESETS];
+  int     nclients;
+} sched_stats_t;
+
+typedef struct sched_client_stats_t {
+  char    id[SCHED_CLIENT_LEN];
+  double  weight;
+  int     max_running; // 0 is no cap
+  int     queued;
+  int     running;
+  long    finished;
+  double  service_sec; // encode seconds so far
+  double  share;       // of the service_sec of all clients
+} sched_client_stats_t;
+
+// sched_run_fn returns the seconds spent encoding, 0 counts the whole run
+typedef double (*sched_run_fn)(sched_task_t *task);
+
+typedef struct sched_t sched_t;
+
+const char *sched_preset_name(sched_preset_e preset);
+// sched_preset_from_name returns SCHED_NPRESETS for unknown names
+sched_preset_e sched_preset_from_name(const char *name);
+void sched_config_init(sched_config_t *config);
+double sched_now(void);
+
+sched_t *sched_new(const sched_config_t *config);
+void sched_free(sched_t *sched);
+double sched_predict(const sched_t *sched, const sched_task_t *task,
+                     sched_preset_e preset);
+const char *sched_order_name(sched_order_e order);
+// sched_push queues a task stamped with now, in config order
+void sched_push(sched_t *sched, sched_task_t *task, double now);
+// sched_pop dequeues the next task and picks its preset, or returns NULL
+sched_task_t *sched_pop(sched_t *sched, double now);
+// sched_done releases the slot of a task and calibrates the cost model
+void sched_done(sched_t *sched, sched_task_t *task, double now);
+void sched_stats(sched_t *sched, sched_stats_t *stats);
+// sched_client_stats fills up to max clients, busiest first, and returns
+// how many
+int sched_client_stats(sched_t *sched, sched_client_stats_t *stats, int max);
+// sched_set_client sets the weight and cap of a client, "*" sets them for
+// the clients not set on their own
+void sched_set_client(sched_t *sched, const char *id, double weight,
+                      int max_running);
+// sched_load_clients reads "client weight max_running" lines, it returns
+// the number of clients set or -1 if path cannot be read
+int sched_load_clients(sched_t *sched, const char *path);
+
+// sched_admit tells if a new task would be queued now, pending counts the
+// tasks admitted but not submitted yet. Otherwise retry_after, if not NULL,
+// is set to the seconds until the queue has drained far enough.
+bool sched_admit(sched_t *sched, int pending, double *retry_after);
+
+// sched_start runs the queue on nworkers threads, sched_submit is the
+// thread safe sched_push for it
+void sched_start(sched_t *sched, sched_run_fn run);
+void sched_submit(sched_t *sched, sched_task_t *task);
+
+// sched_sim_main replays an arrival trace, or the synthetic "mixed",
+// "batch" and "overload" ones, against the policies, argv[0] is --sched-sim
+int sched_sim_main(int argc, char **argv);
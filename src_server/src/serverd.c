@@ -1,21 +1,46 @@
 #include "serverd.h"
 
-bool change_video_name(char*name) {
-  if (access(name, F_OK) == 0) {
-    // file exists
-    // change name
-    unsigned int video_name_len = strlen(name);
-    for (unsigned int i = video_name_len; i >= 0; i--) {
-      name[i + 1] =
-          name[i];
-      if (name[i + 1] == '.') {
-        name[i] = '2';
-        return change_video_name(name);
-      }
+bool path_match(const char *path, const char *route) {
+  size_t route_len = strlen(route);
+  if (strncmp(path, route, route_len) != 0)
+    return false;
+  return path[route_len] == '\0' || path[route_len] == '?';
+}
+
+bool get_query_param(const char *path, const char *key, char *value, int len) {
+  const char *query = strchr(path, '?');
+  if (query == NULL)
+    return false;
+  size_t key_len = strlen(key);
+  for (const char *p = query + 1; *p; ++p) {
+    if (strncmp(p, key, key_len) == 0 && p[key_len] == '=' &&
+        (p[-1] == '?' || p[-1] == '&')) {
+      p += key_len + 1;
+      int i = 0;
+      while (*p && *p != '&' && i < len - 1)
+        value[i++] = *p++;
+      value[i] = '\0';
+      return true;
     }
+  }
+  return false;
+}
 
-  } else {
-    return true;
+bool get_cookie(const char *cookies, const char *name, char *value, int len) {
+  size_t name_len = strlen(name);
+  for (const char *p = cookies; *p;) {
+    while (*p == ' ' || *p == ';')
+      ++p;
+    if (strncmp(p, name, name_len) == 0 && p[name_len] == '=') {
+      p += name_len + 1;
+      int i = 0;
+      while (*p && *p != ';' && i < len - 1)
+        value[i++] = *p++;
+      value[i] = '\0';
+      return i > 0;
+    }
+    while (*p && *p != ';')
+      ++p;
   }
   return false;
 }
@@ -19,6 +19,7 @@ static hloop_t** worker_loops = NULL;
 #define HTTP_KEEPALIVE_TIMEOUT  60000 // ms
 #define HTTP_MAX_URL_LENGTH     256
 #define HTTP_MAX_HEAD_LENGTH    4096
+#define CLIENT_COOKIE           "client" // X-Api-Key wins over it
 
 #define HTML_TAG_BEGIN  "<html><body><center><h1>"
 #define HTML_TAG_END    "</h1></center></body></html>"
@@ -31,6 +32,7 @@ static hloop_t** worker_loops = NULL;
 // Content-Type
 #define TEXT_PLAIN      "text/plain"
 #define TEXT_HTML       "text/html"
+#define APPLICATION_JSON "application/json"
 
 typedef enum {
     s_begin,
@@ -63,7 +65,13 @@ typedef struct {
     char        host[64];
     int         content_length;
     char        content_type[64];
+    char        headers[256]; // extra "Key: value\r\n" lines
+    char        client[64];   // "key:" or "cookie:" identity, see CLIENT_COOKIE
+    char        content_sha1[41]; // X-Content-SHA1 of a file not sent yet
+    long long   content_size;     // X-Content-Size, its size
     unsigned    keepalive:  1;
+    unsigned    expect_continue: 1; // Expect: 100-continue
+    unsigned    expect_unknown:  1; // any other expectation, answered 417
 //  char        head[HTTP_MAX_HEAD_LENGTH];
 //  int         head_len;
     // body
@@ -75,6 +83,7 @@ typedef struct Video_info{
 	char        video_process_done[3];
 	char        video_name_original[2048];
 	char        video_name_final[2048];
+	char        video_hash[41]; // hex SHA-1 of the upload
 	FILE *      original;
 }Video_info;
 
@@ -85,6 +94,17 @@ typedef struct http_conn_t{
     http_msg_t      response;
 	Video_info      video_info;
 	bool body_is_video;
+    long long       admitted_bytes; // reserved by admission_begin
+    struct upload_t *upload;        // the multipart body being received
+    struct spool_t  *spool;         // its file once complete, see spool.h
+    struct spool_t  *result;        // a result served straight back
+    struct job_t    *job;           // made with the head for streamed uploads
+    struct ingest_t *ingest;        // set once that job started on the upload
+    FILE*           stream;         // a /stream file still being sent
+    long long       stream_left;    // its bytes not queued yet
+    bool            streaming;      // stream_more is running
 } http_conn_t;
 
-bool change_video_name(char*name);
+bool path_match(const char *path, const char *route);
+bool get_query_param(const char *path, const char *key, char *value, int len);
+bool get_cookie(const char *cookies, const char *name, char *value, int len);
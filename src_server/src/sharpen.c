@@ -0,0 +1,357 @@
+#include "sharpen.h"
+#include "cpu.h"
+#include <immintrin.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SHARPEN_SLICES_PER_THREAD 4
+
+static inline int clamp_int(int v, int lo, int hi) {
+  return v < lo ? lo : v > hi ? hi : v;
+}
+
+/*
+ * C reference
+ */
+static void vblur_c(const uint8_t *const rows[5], uint16_t *tmp, int width) {
+  for (int x = 0; x < width; x++) {
+    tmp[x] = rows[0][x] + rows[4][x] + 4 * (rows[1][x] + rows[3][x]) +
+             6 * rows[2][x];
+  }
+}
+
+static void hsharp_c(const uint16_t *tmp, const uint8_t *src, uint8_t *dst,
+                     int width, int amount, int threshold) {
+  for (int x = 0; x < width; x++) {
+    int sum = tmp[x - 2] + tmp[x + 2] + 4 * (tmp[x - 1] + tmp[x + 1]) +
+              6 * tmp[x];
+    int blur = (sum + 128) >> 8;
+    int diff = src[x] - blur;
+    if (abs(diff) < threshold)
+      diff = 0;
+    int v = src[x] + ((diff * amount + (1 << (SHARPEN_AMOUNT_SHIFT - 1))) >>
+                      SHARPEN_AMOUNT_SHIFT);
+    dst[x] = (uint8_t)clamp_int(v, 0, 255);
+  }
+}
+
+static const sharpen_kernel_t sharpen_kernel_c = {vblur_c, hsharp_c};
+
+/*
+ * SSE2, 16 pixels per iteration
+ */
+static void vblur_sse2(const uint8_t *const rows[5], uint16_t *tmp,
+                       int width) {
+  const __m128i zero = _mm_setzero_si128();
+  int x = 0;
+  for (; x + 16 <= width; x += 16) {
+    __m128i r[5];
+    for (int i = 0; i < 5; i++) {
+      r[i] = _mm_loadu_si128((const __m128i *)(rows[i] + x));
+    }
+    for (int half = 0; half < 2; half++) {
+      __m128i v[5];
+      for (int i = 0; i < 5; i++) {
+        v[i] = half ? _mm_unpackhi_epi8(r[i], zero)
+                    : _mm_unpacklo_epi8(r[i], zero);
+      }
+      __m128i s13 = _mm_slli_epi16(_mm_add_epi16(v[1], v[3]), 2);
+      __m128i s2 = _mm_add_epi16(_mm_slli_epi16(v[2], 2),
+                                 _mm_slli_epi16(v[2], 1));
+      __m128i sum = _mm_add_epi16(_mm_add_epi16(v[0], v[4]),
+                                  _mm_add_epi16(s13, s2));
+      _mm_storeu_si128((__m128i *)(tmp + x + half * 8), sum);
+    }
+  }
+  const uint8_t *tail[5];
+  for (int i = 0; i < 5; i++) {
+    tail[i] = rows[i] + x;
+  }
+  vblur_c(tail, tmp + x, width - x);
+}
+
+static inline __m128i hsharp8_sse2(const uint16_t *tmp, __m128i src,
+                                   __m128i amount, __m128i threshold) {
+  __m128i t0 = _mm_loadu_si128((const __m128i *)(tmp - 2));
+  __m128i t1 = _mm_loadu_si128((const __m128i *)(tmp - 1));
+  __m128i t2 = _mm_loadu_si128((const __m128i *)(tmp));
+  __m128i t3 = _mm_loadu_si128((const __m128i *)(tmp + 1));
+  __m128i t4 = _mm_loadu_si128((const __m128i *)(tmp + 2));
+  // the sum peaks at 65280, it fits unsigned 16-bit lanes
+  __m128i s13 = _mm_slli_epi16(_mm_add_epi16(t1, t3), 2);
+  __m128i s2 = _mm_add_epi16(_mm_slli_epi16(t2, 2), _mm_slli_epi16(t2, 1));
+  __m128i sum =
+      _mm_add_epi16(_mm_add_epi16(t0, t4), _mm_add_epi16(s13, s2));
+  __m128i blur = _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(128)), 8);
+  __m128i diff = _mm_sub_epi16(src, blur);
+  __m128i absdiff = _mm_max_epi16(diff, _mm_sub_epi16(_mm_setzero_si128(), diff));
+  diff = _mm_and_si128(diff, _mm_cmpgt_epi16(absdiff, threshold));
+  __m128i delta = _mm_srai_epi16(
+      _mm_add_epi16(_mm_mullo_epi16(diff, amount),
+                    _mm_set1_epi16(1 << (SHARPEN_AMOUNT_SHIFT - 1))),
+      SHARPEN_AMOUNT_SHIFT);
+  return _mm_add_epi16(src, delta);
+}
+
+static void hsharp_sse2(const uint16_t *tmp, const uint8_t *src, uint8_t *dst,
+                        int width, int amount, int threshold) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i vamount = _mm_set1_epi16(amount);
+  const __m128i vthreshold = _mm_set1_epi16(threshold - 1);
+  int x = 0;
+  for (; x + 16 <= width; x += 16) {
+    __m128i s = _mm_loadu_si128((const __m128i *)(src + x));
+    __m128i lo = hsharp8_sse2(tmp + x, _mm_unpacklo_epi8(s, zero), vamount,
+                              vthreshold);
+    __m128i hi = hsharp8_sse2(tmp + x + 8, _mm_unpackhi_epi8(s, zero),
+                              vamount, vthreshold);
+    _mm_storeu_si128((__m128i *)(dst + x), _mm_packus_epi16(lo, hi));
+  }
+  hsharp_c(tmp + x, src + x, dst + x, width - x, amount, threshold);
+}
+
+static const sharpen_kernel_t sharpen_kernel_sse2 = {vblur_sse2, hsharp_sse2};
+
+/*
+ * AVX2, 16 pixels widened to one 256-bit register per iteration
+ */
+__attribute__((target("avx2"))) static void
+vblur_avx2(const uint8_t *const rows[5], uint16_t *tmp, int width) {
+  int x = 0;
+  for (; x + 16 <= width; x += 16) {
+    __m256i v[5];
+    for (int i = 0; i < 5; i++) {
+      v[i] = _mm256_cvtepu8_epi16(
+          _mm_loadu_si128((const __m128i *)(rows[i] + x)));
+    }
+    __m256i s13 = _mm256_slli_epi16(_mm256_add_epi16(v[1], v[3]), 2);
+    __m256i s2 = _mm256_add_epi16(_mm256_slli_epi16(v[2], 2),
+                                  _mm256_slli_epi16(v[2], 1));
+    __m256i sum = _mm256_add_epi16(_mm256_add_epi16(v[0], v[4]),
+                                   _mm256_add_epi16(s13, s2));
+    _mm256_storeu_si256((__m256i *)(tmp + x), sum);
+  }
+  const uint8_t *tail[5];
+  for (int i = 0; i < 5; i++) {
+    tail[i] = rows[i] + x;
+  }
+  vblur_c(tail, tmp + x, width - x);
+}
+
+__attribute__((target("avx2"))) static void
+hsharp_avx2(const uint16_t *tmp, const uint8_t *src, uint8_t *dst, int width,
+            int amount, int threshold) {
+  const __m256i vamount = _mm256_set1_epi16(amount);
+  const __m256i vthreshold = _mm256_set1_epi16(threshold - 1);
+  const __m256i round = _mm256_set1_epi16(1 << (SHARPEN_AMOUNT_SHIFT - 1));
+  int x = 0;
+  for (; x + 16 <= width; x += 16) {
+    const uint16_t *t = tmp + x;
+    __m256i t0 = _mm256_loadu_si256((const __m256i *)(t - 2));
+    __m256i t1 = _mm256_loadu_si256((const __m256i *)(t - 1));
+    __m256i t2 = _mm256_loadu_si256((const __m256i *)(t));
+    __m256i t3 = _mm256_loadu_si256((const __m256i *)(t + 1));
+    __m256i t4 = _mm256_loadu_si256((const __m256i *)(t + 2));
+    __m256i s13 = _mm256_slli_epi16(_mm256_add_epi16(t1, t3), 2);
+    __m256i s2 =
+        _mm256_add_epi16(_mm256_slli_epi16(t2, 2), _mm256_slli_epi16(t2, 1));
+    __m256i sum =
+        _mm256_add_epi16(_mm256_add_epi16(t0, t4), _mm256_add_epi16(s13, s2));
+    __m256i blur =
+        _mm256_srli_epi16(_mm256_add_epi16(sum, _mm256_set1_epi16(128)), 8);
+    __m256i s =
+        _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(src + x)));
+    __m256i diff = _mm256_sub_epi16(s, blur);
+    __m256i absdiff = _mm256_abs_epi16(diff);
+    diff = _mm256_and_si256(diff, _mm256_cmpgt_epi16(absdiff, vthreshold));
+    __m256i delta = _mm256_srai_epi16(
+        _mm256_add_epi16(_mm256_mullo_epi16(diff, vamount), round),
+        SHARPEN_AMOUNT_SHIFT);
+    __m256i res = _mm256_add_epi16(s, delta);
+    // packus works per 128-bit lane, gather both halves into the low lane
+    res = _mm256_permute4x64_epi64(_mm256_packus_epi16(res, res), 0xD8);
+    _mm_storeu_si128((__m128i *)(dst + x), _mm256_castsi256_si128(res));
+  }
+  hsharp_c(tmp + x, src + x, dst + x, width - x, amount, threshold);
+}
+
+static const sharpen_kernel_t sharpen_kernel_avx2 = {vblur_avx2, hsharp_avx2};
+
+/*
+ * AVX-512BW, 32 pixels per iteration
+ */
+#define AVX512_TARGET __attribute__((target("avx512f,avx512bw")))
+
+AVX512_TARGET static void vblur_avx512(const uint8_t *const rows[5],
+                                       uint16_t *tmp, int width) {
+  int x = 0;
+  for (; x + 32 <= width; x += 32) {
+    __m512i v[5];
+    for (int i = 0; i < 5; i++) {
+      v[i] = _mm512_cvtepu8_epi16(
+          _mm256_loadu_si256((const __m256i *)(rows[i] + x)));
+    }
+    __m512i s13 = _mm512_slli_epi16(_mm512_add_epi16(v[1], v[3]), 2);
+    __m512i s2 = _mm512_add_epi16(_mm512_slli_epi16(v[2], 2),
+                                  _mm512_slli_epi16(v[2], 1));
+    __m512i sum = _mm512_add_epi16(_mm512_add_epi16(v[0], v[4]),
+                                   _mm512_add_epi16(s13, s2));
+    _mm512_storeu_si512((void *)(tmp + x), sum);
+  }
+  vblur_avx2((const uint8_t *const[5]){rows[0] + x, rows[1] + x, rows[2] + x,
+                                       rows[3] + x, rows[4] + x},
+             tmp + x, width - x);
+}
+
+AVX512_TARGET static void hsharp_avx512(const uint16_t *tmp,
+                                        const uint8_t *src, uint8_t *dst,
+                                        int width, int amount, int threshold) {
+  const __m512i vamount = _mm512_set1_epi16(amount);
+  const __m512i vthreshold = _mm512_set1_epi16(threshold - 1);
+  const __m512i round = _mm512_set1_epi16(1 << (SHARPEN_AMOUNT_SHIFT - 1));
+  const __m512i zero = _mm512_setzero_si512();
+  int x = 0;
+  for (; x + 32 <= width; x += 32) {
+    const uint16_t *t = tmp + x;
+    __m512i t0 = _mm512_loadu_si512((const void *)(t - 2));
+    __m512i t1 = _mm512_loadu_si512((const void *)(t - 1));
+    __m512i t2 = _mm512_loadu_si512((const void *)(t));
+    __m512i t3 = _mm512_loadu_si512((const void *)(t + 1));
+    __m512i t4 = _mm512_loadu_si512((const void *)(t + 2));
+    __m512i s13 = _mm512_slli_epi16(_mm512_add_epi16(t1, t3), 2);
+    __m512i s2 =
+        _mm512_add_epi16(_mm512_slli_epi16(t2, 2), _mm512_slli_epi16(t2, 1));
+    __m512i sum =
+        _mm512_add_epi16(_mm512_add_epi16(t0, t4), _mm512_add_epi16(s13, s2));
+    __m512i blur =
+        _mm512_srli_epi16(_mm512_add_epi16(sum, _mm512_set1_epi16(128)), 8);
+    __m512i s =
+        _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *)(src + x)));
+    __m512i diff = _mm512_sub_epi16(s, blur);
+    __mmask32 keep =
+        _mm512_cmpgt_epi16_mask(_mm512_abs_epi16(diff), vthreshold);
+    diff = _mm512_maskz_mov_epi16(keep, diff);
+    __m512i delta = _mm512_srai_epi16(
+        _mm512_add_epi16(_mm512_mullo_epi16(diff, vamount), round),
+        SHARPEN_AMOUNT_SHIFT);
+    __m512i res = _mm512_max_epi16(_mm512_add_epi16(s, delta), zero);
+    _mm256_storeu_si256((__m256i *)(dst + x), _mm512_cvtusepi16_epi8(res));
+  }
+  hsharp_avx2(tmp + x, src + x, dst + x, width - x, amount, threshold);
+}
+
+static const sharpen_kernel_t sharpen_kernel_avx512 = {vblur_avx512,
+                                                       hsharp_avx512};
+
+const kernel_impl_t sharpen_impls[SHARPEN_NIMPLS] = {
+    {"avx512", CPU_SSE2 | CPU_AVX2 | CPU_AVX512, &sharpen_kernel_avx512},
+    {"avx2", CPU_SSE2 | CPU_AVX2, &sharpen_kernel_avx2},
+    {"sse2", CPU_SSE2, &sharpen_kernel_sse2},
+    {"c", 0, &sharpen_kernel_c},
+};
+
+/*
+ * frame driver
+ */
+struct sharpen_t {
+  const sharpen_kernel_t *kernel;
+  slice_pool_t   *pool;
+  int             amount;
+  int             threshold;
+  bool            chroma;
+  // one row of vertical sums per slice
+  uint16_t      **tmp;
+  int             tmp_width;
+  int             nslices;
+  // current frame
+  const frame_t  *src;
+  frame_t        *dst;
+};
+
+sharpen_t *sharpen_new(const sharpen_opts_t *opts, slice_pool_t *pool) {
+  sharpen_t *sharpen = (sharpen_t *)calloc(1, sizeof(sharpen_t));
+  sharpen->kernel = (const sharpen_kernel_t *)kernel_get(KERNEL_SHARPEN);
+  sharpen->pool = pool;
+  sharpen->amount = clamp_int((int)(opts->amount * (1 << SHARPEN_AMOUNT_SHIFT) + 0.5f),
+                              0, SHARPEN_AMOUNT_MAX);
+  sharpen->threshold = clamp_int(opts->threshold, 0, 255);
+  sharpen->chroma = opts->chroma;
+  sharpen->nslices = slice_pool_threads(pool) * SHARPEN_SLICES_PER_THREAD;
+  sharpen->tmp = (uint16_t **)calloc(sharpen->nslices, sizeof(uint16_t *));
+  return sharpen;
+}
+
+void sharpen_free(sharpen_t *sharpen) {
+  if (sharpen == NULL)
+    return;
+  for (int i = 0; i < sharpen->nslices; i++) {
+    free(sharpen->tmp[i]);
+  }
+  free(sharpen->tmp);
+  free(sharpen);
+}
+
+void sharpen_set_kernel(sharpen_t *sharpen, const sharpen_kernel_t *kernel) {
+  sharpen->kernel = kernel;
+}
+
+static void sharpen_plane_rows(sharpen_t *sharpen, uint16_t *tmp, int plane,
+                               int y0, int y1) {
+  const frame_t *src = sharpen->src;
+  frame_t *dst = sharpen->dst;
+  int w = frame_plane_width(src, plane);
+  int h = frame_plane_height(src, plane);
+  int src_stride = src->linesize[plane];
+  int dst_stride = dst->linesize[plane];
+  const uint8_t *s = src->data[plane];
+  uint8_t *d = dst->data[plane];
+
+  if ((plane > 0 && !sharpen->chroma) || sharpen->amount == 0) {
+    for (int y = y0; y < y1; y++) {
+      memcpy(d + (size_t)y * dst_stride, s + (size_t)y * src_stride, w);
+    }
+    return;
+  }
+  for (int y = y0; y < y1; y++) {
+    const uint8_t *rows[5];
+    for (int i = 0; i < 5; i++) {
+      rows[i] = s + (size_t)clamp_int(y + i - 2, 0, h - 1) * src_stride;
+    }
+    sharpen->kernel->vblur(rows, tmp, w);
+    tmp[-2] = tmp[-1] = tmp[0];
+    tmp[w] = tmp[w + 1] = tmp[w - 1];
+    sharpen->kernel->hsharp(tmp, rows[2], d + (size_t)y * dst_stride, w,
+                            sharpen->amount, sharpen->threshold);
+  }
+}
+
+static void sharpen_slice(void *arg, int slice, int nslices) {
+  sharpen_t *sharpen = (sharpen_t *)arg;
+  uint16_t *tmp = sharpen->tmp[slice] + SHARPEN_PAD;
+  for (int plane = 0; plane < 3; plane++) {
+    int h = frame_plane_height(sharpen->src, plane);
+    sharpen_plane_rows(sharpen, tmp, plane, h * slice / nslices,
+                       h * (slice + 1) / nslices);
+  }
+}
+
+void sharpen_frame(sharpen_t *sharpen, const frame_t *src, frame_t *dst) {
+  if (sharpen->tmp_width < src->width) {
+    for (int i = 0; i < sharpen->nslices; i++) {
+      free(sharpen->tmp[i]);
+      sharpen->tmp[i] = (uint16_t *)aligned_alloc(
+          FRAME_ALIGN, ((src->width + 2 * SHARPEN_PAD) * sizeof(uint16_t) +
+                        FRAME_ALIGN - 1) &
+                           ~(FRAME_ALIGN - 1));
+    }
+    sharpen->tmp_width = src->width;
+  }
+  sharpen->src = src;
+  sharpen->dst = dst;
+  int nslices = sharpen->nslices;
+  // slices thinner than a few rows cost more in handoff than they save
+  if (nslices > src->height / 16)
+    nslices = src->height / 16 > 0 ? src->height / 16 : 1;
+  slice_pool_run(sharpen->pool, sharpen_slice, sharpen, nslices);
+  dst->pts = src->pts;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "frame.h"
+#include "kernels.h"
+#include "slice.h"
+#include <stdbool.h>
+
+// Unsharp mask on YUV420 planes:
+//   blur = 5x5 binomial ([1 4 6 4 1] separable), edges replicated
+//   dst  = src + amount * (src - blur) where |src - blur| >= threshold
+// amount is applied in 1/32 steps so every kernel is bit-exact with the C one.
+
+#define SHARPEN_AMOUNT_SHIFT  5
+#define SHARPEN_AMOUNT_MAX    127 // 3.97 in 1/32 steps, keeps products in int16
+#define SHARPEN_PAD           16  // uint16 guard elements on each side of a row
+
+typedef void (*sharpen_vblur_fn)(const uint8_t *const rows[5], uint16_t *tmp,
+                                 int width);
+typedef void (*sharpen_hsharp_fn)(const uint16_t *tmp, const uint8_t *src,
+                                  uint8_t *dst, int width, int amount,
+                                  int threshold);
+
+typedef struct sharpen_kernel_t {
+  sharpen_vblur_fn   vblur;
+  sharpen_hsharp_fn  hsharp;
+} sharpen_kernel_t;
+
+// avx512, avx2, sse2, c, see kernels.h
+#define SHARPEN_NIMPLS 4
+extern const kernel_impl_t sharpen_impls[SHARPEN_NIMPLS];
+
+typedef struct sharpen_opts_t {
+  float amount;
+  int   threshold;
+  bool  chroma;
+} sharpen_opts_t;
+
+typedef struct sharpen_t sharpen_t;
+
+sharpen_t *sharpen_new(const sharpen_opts_t *opts, slice_pool_t *pool);
+void sharpen_free(sharpen_t *sharpen);
+// sharpen_set_kernel overrides the kernel bound in the registry
+void sharpen_set_kernel(sharpen_t *sharpen, const sharpen_kernel_t *kernel);
+// src and dst must be different frames of the same size
+void sharpen_frame(sharpen_t *sharpen, const frame_t *src, frame_t *dst);
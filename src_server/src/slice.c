@@ -0,0 +1,111 @@
+#include "slice.h"
+#include "include/hmutex.h"
+#include "include/hthread.h"
+#include <stdbool.h>
+#include <stdlib.h>
+
+struct slice_pool_t {
+  hmutex_t    caller; // one batch at a time
+  hmutex_t    mutex;
+  hcondvar_t  cond_work;
+  hcondvar_t  cond_done;
+  hthread_t  *threads;
+  int         nthreads;
+  // current batch
+  slice_fn    fn;
+  void       *arg;
+  int         nslices;
+  int         next_slice;
+  int         pending;
+  unsigned    generation;
+  bool        stop;
+};
+
+// claim slices until the batch is exhausted, called with the mutex held
+static void run_slices(slice_pool_t *pool) {
+  while (pool->next_slice < pool->nslices) {
+    int slice = pool->next_slice++;
+    hmutex_unlock(&pool->mutex);
+    pool->fn(pool->arg, slice, pool->nslices);
+    hmutex_lock(&pool->mutex);
+    if (--pool->pending == 0)
+      hcondvar_broadcast(&pool->cond_done);
+  }
+}
+
+static HTHREAD_ROUTINE(slice_thread) {
+  slice_pool_t *pool = (slice_pool_t *)userdata;
+  unsigned generation = 0;
+  hmutex_lock(&pool->mutex);
+  while (!pool->stop) {
+    if (pool->generation == generation) {
+      hcondvar_wait(&pool->cond_work, &pool->mutex);
+      continue;
+    }
+    generation = pool->generation;
+    run_slices(pool);
+  }
+  hmutex_unlock(&pool->mutex);
+  return 0;
+}
+
+slice_pool_t *slice_pool_new(int nthreads) {
+  slice_pool_t *pool = (slice_pool_t *)calloc(1, sizeof(slice_pool_t));
+  if (nthreads < 1)
+    nthreads = 1;
+  hmutex_init(&pool->caller);
+  hmutex_init(&pool->mutex);
+  hcondvar_init(&pool->cond_work);
+  hcondvar_init(&pool->cond_done);
+  // the caller is the first worker
+  pool->nthreads = nthreads;
+  pool->threads = (hthread_t *)calloc(nthreads, sizeof(hthread_t));
+  for (int i = 1; i < nthreads; i++) {
+    pool->threads[i] = hthread_create(slice_thread, pool);
+  }
+  return pool;
+}
+
+void slice_pool_free(slice_pool_t *pool) {
+  if (pool == NULL)
+    return;
+  hmutex_lock(&pool->mutex);
+  pool->stop = true;
+  hcondvar_broadcast(&pool->cond_work);
+  hmutex_unlock(&pool->mutex);
+  for (int i = 1; i < pool->nthreads; i++) {
+    hthread_join(pool->threads[i]);
+  }
+  hcondvar_destroy(&pool->cond_work);
+  hcondvar_destroy(&pool->cond_done);
+  hmutex_destroy(&pool->mutex);
+  hmutex_destroy(&pool->caller);
+  free(pool->threads);
+  free(pool);
+}
+
+int slice_pool_threads(slice_pool_t *pool) { return pool ? pool->nthreads : 1; }
+
+void slice_pool_run(slice_pool_t *pool, slice_fn fn, void *arg, int nslices) {
+  if (pool == NULL || pool->nthreads == 1 || nslices == 1) {
+    for (int i = 0; i < nslices; i++)
+      fn(arg, i, nslices);
+    return;
+  }
+  // a second caller waits for the batch in flight, sharing a pool between
+  // pipeline stages serializes them
+  hmutex_lock(&pool->caller);
+  hmutex_lock(&pool->mutex);
+  pool->fn = fn;
+  pool->arg = arg;
+  pool->nslices = nslices;
+  pool->next_slice = 0;
+  pool->pending = nslices;
+  pool->generation++;
+  hcondvar_broadcast(&pool->cond_work);
+  run_slices(pool);
+  while (pool->pending > 0)
+    hcondvar_wait(&pool->cond_done, &pool->mutex);
+  hmutex_unlock(&pool->mutex);
+  hmutex_unlock(&pool->caller);
+}
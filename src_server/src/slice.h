@@ -0,0 +1,15 @@
+#pragma once
+
+// slice_pool runs one function over nslices slices on a fixed set of
+// threads, the calling thread takes part and returns when all are done.
+// A pool runs one batch at a time, concurrent callers take turns: give
+// stages that run side by side a pool each.
+
+typedef void (*slice_fn)(void *arg, int slice, int nslices);
+
+typedef struct slice_pool_t slice_pool_t;
+
+slice_pool_t *slice_pool_new(int nthreads);
+void slice_pool_free(slice_pool_t *pool);
+int slice_pool_threads(slice_pool_t *pool);
+void slice_pool_run(slice_pool_t *pool, slice_fn fn, void *arg, int nslices);
@@ -0,0 +1,203 @@
+#include "sniff.h"
+#include <string.h>
+
+#define TS_PACKET   188
+#define M2TS_PACKET 192 // a 4 byte timestamp ahead of every TS packet
+#define TS_SYNC     0x47
+#define TS_PACKETS  4   // sync bytes to see before calling it TS
+
+static const char *s_names[] = {
+    "more", "unknown", "mp4", "mov", "mkv", "webm",
+    "ts",   "ps",      "avi", "flv", "y4m",
+};
+
+// ftyp major brands of stills and audio only files
+static const char *s_refused_brands[] = {
+    "heic", "heix", "heim", "heis", "mif1", "msf1", "avif", "avis",
+    "M4A ", "M4B ", "M4P ", "F4A ", "F4B ", "crx ", "jpx ", "jp2 ",
+};
+
+// boxes an ISO BMFF file starts with
+static const char *s_first_boxes[] = {
+    "ftyp", "moov", "mdat", "free", "skip", "wide", "pnot",
+};
+
+const char *sniff_name(sniff_e container) {
+  return container <= SNIFF_Y4M ? s_names[container] : "unknown";
+}
+
+static uint32_t be32(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+         p[3];
+}
+
+static bool in_list(const uint8_t *fourcc, const char **list, int n) {
+  for (int i = 0; i < n; i++) {
+    if (memcmp(fourcc, list[i], 4) == 0)
+      return true;
+  }
+  return false;
+}
+
+static sniff_e sniff_result(sniff_t *sniff, sniff_e container,
+                            bool streamable) {
+  sniff->container = container;
+  sniff->streamable = streamable;
+  return container;
+}
+
+// top level boxes until moov or mdat tells where the index is
+static sniff_e sniff_isobmff(const uint8_t *data, int len, bool final,
+                             sniff_t *sniff) {
+  sniff_e container = SNIFF_MP4;
+  uint64_t offset = 0;
+  while (offset + 8 <= (uint64_t)len) {
+    const uint8_t *box = data + offset;
+    uint64_t size = be32(box);
+    const uint8_t *type = box + 4;
+    for (int i = 0; i < 4; i++) {
+      if (type[i] < 0x20 || type[i] > 0x7e)
+        return sniff_result(sniff, SNIFF_UNKNOWN, false);
+    }
+    if (offset == 0 && !in_list(type, s_first_boxes,
+                                sizeof(s_first_boxes) / sizeof(char *)))
+      return sniff_result(sniff, SNIFF_UNKNOWN, false);
+    if (memcmp(type, "ftyp", 4) == 0) {
+      if (offset + 12 > (uint64_t)len)
+        break;
+      const uint8_t *brand = box + 8;
+      if (in_list(brand, s_refused_brands,
+                  sizeof(s_refused_brands) / sizeof(char *)))
+        return sniff_result(sniff, SNIFF_UNKNOWN, false);
+      if (memcmp(brand, "qt  ", 4) == 0)
+        container = SNIFF_MOV;
+    } else if (memcmp(type, "moov", 4) == 0) {
+      return sniff_result(sniff, container, true);
+    } else if (memcmp(type, "mdat", 4) == 0) {
+      return sniff_result(sniff, container, false);
+    }
+    if (size == 1) {
+      if (offset + 16 > (uint64_t)len)
+        break;
+      size = (uint64_t)be32(box + 8) << 32 | be32(box + 12);
+    } else if (size == 0) {
+      // the box runs to the end of the file
+      return sniff_result(sniff, container, false);
+    }
+    if (size < 8)
+      return sniff_result(sniff, SNIFF_UNKNOWN, false);
+    offset += size;
+  }
+  if (!final && len < SNIFF_MAX)
+    return SNIFF_MORE;
+  // a sane box layout so far, wherever the moov is
+  return sniff_result(sniff, offset > 0 ? container : SNIFF_UNKNOWN, false);
+}
+
+// EBML variable length integer, the length marker is kept for IDs
+static int ebml_vint(const uint8_t *p, int len, bool keep_marker,
+                     uint64_t *value) {
+  if (len < 1)
+    return 0;
+  if (p[0] == 0)
+    return -1;
+  int n = 1;
+  while (!(p[0] & (0x80 >> (n - 1))))
+    n++;
+  if (n > len)
+    return 0;
+  uint64_t v = keep_marker ? p[0] : p[0] & (0xff >> n);
+  for (int i = 1; i < n; i++) {
+    v = v << 8 | p[i];
+  }
+  *value = v;
+  return n;
+}
+
+#define EBML_MAGIC    0x1a45dfa3
+#define EBML_DOCTYPE  0x4282
+
+static sniff_e sniff_ebml(const uint8_t *data, int len, bool final,
+                          sniff_t *sniff) {
+  bool more = !final && len < SNIFF_MAX;
+  uint64_t size = 0;
+  int n = ebml_vint(data + 4, len - 4, false, &size);
+  if (n < 0)
+    return sniff_result(sniff, SNIFF_UNKNOWN, false);
+  if (n == 0)
+    return more ? SNIFF_MORE : sniff_result(sniff, SNIFF_UNKNOWN, false);
+  uint64_t offset = 4 + n;
+  uint64_t end = offset + size;
+  while (offset < end && offset < (uint64_t)len) {
+    uint64_t id = 0, element_size = 0;
+    int id_len = ebml_vint(data + offset, len - offset, true, &id);
+    int size_len = id_len > 0 ? ebml_vint(data + offset + id_len,
+                                          len - offset - id_len, false,
+                                          &element_size)
+                              : id_len;
+    if (id_len < 0 || size_len < 0)
+      return sniff_result(sniff, SNIFF_UNKNOWN, false);
+    if (id_len == 0 || size_len == 0)
+      break;
+    offset += id_len + size_len;
+    if (id == EBML_DOCTYPE) {
+      if (offset + element_size > (uint64_t)len)
+        break;
+      const char *doctype = (const char *)data + offset;
+      if (element_size == 4 && memcmp(doctype, "webm", 4) == 0)
+        return sniff_result(sniff, SNIFF_WEBM, true);
+      if (element_size == 8 && memcmp(doctype, "matroska", 8) == 0)
+        return sniff_result(sniff, SNIFF_MKV, true);
+      return sniff_result(sniff, SNIFF_UNKNOWN, false);
+    }
+    offset += element_size;
+  }
+  // no DocType in a whole header, or not enough of it
+  if (more && offset < end)
+    return SNIFF_MORE;
+  return sniff_result(sniff, SNIFF_UNKNOWN, false);
+}
+
+static bool sniff_ts(const uint8_t *data, int len, int first, int packet) {
+  int n = 0;
+  for (int offset = first; offset < len && n < TS_PACKETS;
+       offset += packet, n++) {
+    if (data[offset] != TS_SYNC)
+      return false;
+  }
+  return n > 0;
+}
+
+sniff_e sniff_container(const uint8_t *data, int len, bool final,
+                        sniff_t *sniff) {
+  sniff->container = SNIFF_MORE;
+  sniff->streamable = false;
+  if (len < 12)
+    return final ? sniff_result(sniff, SNIFF_UNKNOWN, false) : SNIFF_MORE;
+  // GIF starts with the TS sync byte
+  if (memcmp(data, "GIF8", 4) == 0)
+    return sniff_result(sniff, SNIFF_UNKNOWN, false);
+  if (memcmp(data, "YUV4MPEG2", 9) == 0)
+    return sniff_result(sniff, SNIFF_Y4M, true);
+  if (be32(data) == EBML_MAGIC)
+    return sniff_ebml(data, len, final, sniff);
+  if (memcmp(data, "RIFF", 4) == 0)
+    return sniff_result(
+        sniff, memcmp(data + 8, "AVI ", 4) == 0 ? SNIFF_AVI : SNIFF_UNKNOWN,
+        false);
+  if (memcmp(data, "FLV\x01", 4) == 0)
+    return sniff_result(sniff, SNIFF_FLV, true);
+  // a pack header, or a bare MPEG-1/2 video sequence header
+  if (be32(data) == 0x000001ba || be32(data) == 0x000001b3)
+    return sniff_result(sniff, SNIFF_PS, true);
+  if (data[0] == TS_SYNC || (len > 4 && data[4] == TS_SYNC)) {
+    int need = TS_SYNC == data[0] ? (TS_PACKETS - 1) * TS_PACKET + 1
+                                  : (TS_PACKETS - 1) * M2TS_PACKET + 5;
+    if (len < need && !final)
+      return SNIFF_MORE;
+    if (sniff_ts(data, len, 0, TS_PACKET) ||
+        sniff_ts(data, len, 4, M2TS_PACKET))
+      return sniff_result(sniff, SNIFF_TS, true);
+  }
+  return sniff_isobmff(data, len, final, sniff);
+}
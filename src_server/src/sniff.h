@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Container sniffing from the first bytes of an upload, so junk is turned
+// away after a few kilobytes and not after ffmpeg has read all of it.
+//   MP4/MOV  top level boxes, with an audio or image ftyp brand refused
+//   MKV/WebM the EBML header and its DocType
+//   MPEG-TS  sync bytes 188 bytes apart, MPEG-PS a pack header
+//   AVI, FLV and Y4M by their magic
+// Anything else, images and archives included, is not a video.
+
+#define SNIFF_MAX 4096 // bytes sniff_container wants at most
+
+typedef enum {
+  SNIFF_MORE,    // undecided, call again with more bytes
+  SNIFF_UNKNOWN, // not a video
+  SNIFF_MP4,
+  SNIFF_MOV,
+  SNIFF_MKV,
+  SNIFF_WEBM,
+  SNIFF_TS,
+  SNIFF_PS,
+  SNIFF_AVI,
+  SNIFF_FLV,
+  SNIFF_Y4M,
+} sniff_e;
+
+typedef struct sniff_t {
+  sniff_e container;
+  // a decoder can start before the last byte is in: MP4/MOV with the moov
+  // box ahead of mdat, and the formats that are streams anyway
+  bool    streamable;
+} sniff_t;
+
+// sniff_container looks at the first len bytes of a file, final tells that
+// there are no more
+sniff_e sniff_container(const uint8_t *data, int len, bool final,
+                        sniff_t *sniff);
+const char *sniff_name(sniff_e container);
@@ -0,0 +1,419 @@
+#define _GNU_SOURCE // memfd_create, O_TMPFILE
+#include "spool.h"
+#include "include/hatomic.h"
+#include "include/hbase.h"
+#include "include/hmutex.h"
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+typedef struct spool_dir_t {
+  char          path[SPOOL_DIR_LEN];
+  int           device;   // the first directory on the same device
+  int           writers;  // counted on the device
+} spool_dir_t;
+
+struct spool_t {
+  spool_tier_e  tier;
+  int           dir;
+  int           fd;
+  long long     reserved; // of the memory budget
+  bool          shared;   // a spool_dup, counted with the original
+  char          path[64];
+};
+
+static spool_config_t s_config;
+static hmutex_t s_mutex;
+static honce_t s_once = HONCE_INIT;
+static spool_stats_t s_stats;
+static spool_dir_t s_dirs[SPOOL_MAX_DIRS];
+static int s_ndirs = 0;
+static atomic_uint s_next_name = 0;
+
+// spool_set_dirs runs locked. It refuses while anything is placed, the
+// writers would be counted off the wrong device
+static bool spool_set_dirs(const char *const *dirs, int ndirs) {
+  dev_t devs[SPOOL_MAX_DIRS];
+  for (int i = 0; i < s_ndirs; i++) {
+    if (s_dirs[i].writers > 0) {
+      fprintf(stderr, "spool directories are in use, not reconfigured\n");
+      return false;
+    }
+  }
+  s_ndirs = 0;
+  for (int i = 0; i < ndirs && s_ndirs < SPOOL_MAX_DIRS; i++) {
+    spool_dir_t *dir = &s_dirs[s_ndirs];
+    struct stat st;
+    snprintf(dir->path, sizeof(dir->path), "%s", dirs[i]);
+    hv_mkdir_p(dir->path);
+    if (stat(dir->path, &st) != 0) {
+      fprintf(stderr, "spool directory %s: %s\n", dir->path, strerror(errno));
+      continue;
+    }
+    devs[s_ndirs] = st.st_dev;
+    dir->device = s_ndirs;
+    for (int j = 0; j < s_ndirs; j++) {
+      if (devs[j] == st.st_dev) {
+        dir->device = j;
+        break;
+      }
+    }
+    dir->writers = 0;
+    s_ndirs++;
+  }
+  if (s_ndirs == 0) {
+    snprintf(s_dirs[0].path, sizeof(s_dirs[0].path), "%s", SPOOL_DEFAULT_DIR);
+    hv_mkdir_p(s_dirs[0].path);
+    s_dirs[0].device = 0;
+    s_dirs[0].writers = 0;
+    s_ndirs = 1;
+  }
+  return true;
+}
+
+static void spool_once() {
+  hmutex_init(&s_mutex);
+  spool_config_init(&s_config);
+  spool_set_dirs(s_config.dirs, s_config.ndirs);
+}
+
+void spool_config_init(spool_config_t *config) {
+  memset(config, 0, sizeof(*config));
+  config->memory_max = SPOOL_MEMORY_MAX;
+  config->memory_budget = SPOOL_MEMORY_BUDGET;
+  config->dirs[0] = SPOOL_DEFAULT_DIR;
+  config->ndirs = 1;
+}
+
+void spool_init(const spool_config_t *config) {
+  honce(&s_once, spool_once);
+  hmutex_lock(&s_mutex);
+  s_config = *config;
+  spool_set_dirs(s_config.dirs, s_config.ndirs);
+  hmutex_unlock(&s_mutex);
+}
+
+int spool_load_dirs(const char *path) {
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL)
+    return -1;
+  char paths[SPOOL_MAX_DIRS][SPOOL_DIR_LEN];
+  const char *dirs[SPOOL_MAX_DIRS];
+  int ndirs = 0;
+  char line[256];
+  while (fgets(line, sizeof(line), fp) && ndirs < SPOOL_MAX_DIRS) {
+    if (line[0] == '#' || sscanf(line, "%63s", paths[ndirs]) != 1)
+      continue;
+    dirs[ndirs] = paths[ndirs];
+    ndirs++;
+  }
+  fclose(fp);
+  honce(&s_once, spool_once);
+  hmutex_lock(&s_mutex);
+  ndirs = spool_set_dirs(dirs, ndirs) ? s_ndirs : -1;
+  hmutex_unlock(&s_mutex);
+  return ndirs;
+}
+
+static long long spool_dir_free(const char *path) {
+  struct statvfs vfs;
+  if (statvfs(path, &vfs) != 0)
+    return -1;
+  return (long long)vfs.f_bavail * vfs.f_frsize;
+}
+
+// the free space per writer: a bigger disk takes more, a busy one less. The
+// free space is read outside the lock, it moves slowly
+int spool_place(void) {
+  honce(&s_once, spool_once);
+  long long free_bytes[SPOOL_MAX_DIRS];
+  hmutex_lock(&s_mutex);
+  int ndirs = s_ndirs;
+  char paths[SPOOL_MAX_DIRS][SPOOL_DIR_LEN];
+  for (int i = 0; i < ndirs; i++)
+    memcpy(paths[i], s_dirs[i].path, SPOOL_DIR_LEN);
+  hmutex_unlock(&s_mutex);
+  for (int i = 0; i < ndirs; i++)
+    free_bytes[i] = spool_dir_free(paths[i]);
+  hmutex_lock(&s_mutex);
+  int best = 0;
+  double best_score = -1;
+  for (int i = 0; i < ndirs && i < s_ndirs; i++) {
+    if (free_bytes[i] < 0)
+      continue;
+    double score = free_bytes[i] / (1.0 + s_dirs[s_dirs[i].device].writers);
+    if (score > best_score) {
+      best_score = score;
+      best = i;
+    }
+  }
+  s_dirs[s_dirs[best].device].writers++;
+  hmutex_unlock(&s_mutex);
+  return best;
+}
+
+void spool_unplace(int dir) {
+  hmutex_lock(&s_mutex);
+  if (dir >= 0 && dir < s_ndirs && s_dirs[s_dirs[dir].device].writers > 0)
+    s_dirs[s_dirs[dir].device].writers--;
+  hmutex_unlock(&s_mutex);
+}
+
+// FNV-1a
+static unsigned int spool_hash(const char *name) {
+  unsigned int hash = 2166136261u;
+  for (const char *p = name; *p; ++p) {
+    hash ^= (unsigned char)*p;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+void spool_fanout(int dir, const char *name, char *path, int len) {
+  honce(&s_once, spool_once);
+  char root[SPOOL_DIR_LEN];
+  hmutex_lock(&s_mutex);
+  memcpy(root, s_dirs[dir < s_ndirs ? dir : 0].path, sizeof(root));
+  hmutex_unlock(&s_mutex);
+  snprintf(path, len, "%s/%02x", root, spool_hash(name) % SPOOL_FANOUT);
+  hv_mkdir_p(path);
+  int offset = strlen(path);
+  snprintf(path + offset, len - offset, "/%s", name);
+}
+
+static void spool_remove_dir(const char *dir, int depth) {
+  DIR *dp = opendir(dir);
+  if (dp == NULL)
+    return;
+  char path[512];
+  struct dirent *ent = NULL;
+  while ((ent = readdir(dp)) != NULL) {
+    if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+      continue;
+    if (snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name) >=
+        (int)sizeof(path))
+      continue; // not one of ours
+    if (remove(path) != 0 && depth > 0)
+      spool_remove_dir(path, depth - 1);
+  }
+  closedir(dp);
+  rmdir(dir);
+}
+
+static bool spool_fanout_name(const char *name) {
+  return strlen(name) == 2 && isxdigit((unsigned char)name[0]) &&
+         isxdigit((unsigned char)name[1]);
+}
+
+void spool_sweep(void) {
+  honce(&s_once, spool_once);
+  char paths[SPOOL_MAX_DIRS][SPOOL_DIR_LEN];
+  hmutex_lock(&s_mutex);
+  int ndirs = s_ndirs;
+  for (int i = 0; i < ndirs; i++)
+    memcpy(paths[i], s_dirs[i].path, SPOOL_DIR_LEN);
+  hmutex_unlock(&s_mutex);
+  char path[512];
+  for (int i = 0; i < ndirs; i++) {
+    DIR *dp = opendir(paths[i]);
+    if (dp == NULL)
+      continue;
+    struct dirent *ent = NULL;
+    while ((ent = readdir(dp)) != NULL) {
+      if (snprintf(path, sizeof(path), "%s/%s", paths[i], ent->d_name) >=
+          (int)sizeof(path))
+        continue;
+      // fan out directories of job directories, and spool files a crash
+      // caught between open and unlink
+      if (spool_fanout_name(ent->d_name))
+        spool_remove_dir(path, 1);
+      else if (strncmp(ent->d_name, ".spool-", 7) == 0)
+        remove(path);
+    }
+    closedir(dp);
+  }
+}
+
+long long spool_free_bytes(void) {
+  honce(&s_once, spool_once);
+  char paths[SPOOL_MAX_DIRS][SPOOL_DIR_LEN];
+  int ndirs = 0;
+  hmutex_lock(&s_mutex);
+  for (int i = 0; i < s_ndirs; i++) {
+    if (s_dirs[i].device == i)
+      memcpy(paths[ndirs++], s_dirs[i].path, SPOOL_DIR_LEN);
+  }
+  hmutex_unlock(&s_mutex);
+  long long total = -1;
+  for (int i = 0; i < ndirs; i++) {
+    long long free_bytes = spool_dir_free(paths[i]);
+    if (free_bytes >= 0)
+      total = (total < 0 ? 0 : total) + free_bytes;
+  }
+  return total;
+}
+
+static bool spool_reserve(long long size) {
+  hmutex_lock(&s_mutex);
+  bool fits = size >= 0 && size <= s_config.memory_max &&
+              s_stats.memory_bytes + size <= s_config.memory_budget;
+  if (fits) {
+    s_stats.memory_files++;
+    s_stats.memory_bytes += size;
+  } else if (size >= 0 && size <= s_config.memory_max) {
+    s_stats.spilled++;
+  }
+  hmutex_unlock(&s_mutex);
+  return fits;
+}
+
+static void spool_release(spool_t *spool) {
+  hmutex_lock(&s_mutex);
+  if (spool->tier == SPOOL_MEMORY) {
+    s_stats.memory_files--;
+    s_stats.memory_bytes -= spool->reserved;
+  } else {
+    s_stats.disk_files--;
+  }
+  hmutex_unlock(&s_mutex);
+}
+
+// the memfd is close-on-exec, ffmpeg reaches it through the /proc entry of
+// the server and no other child holds it open by accident
+static int spool_memfd(long long size) {
+  if (!spool_reserve(size))
+    return -1;
+  int fd = memfd_create("upload", MFD_CLOEXEC);
+  if (fd < 0) {
+    hmutex_lock(&s_mutex);
+    s_stats.memory_files--;
+    s_stats.memory_bytes -= size;
+    hmutex_unlock(&s_mutex);
+    return -1;
+  }
+  return fd;
+}
+
+// filesystems without O_TMPFILE get a name that is unlinked right away, the
+// counter makes it unique in the process and O_EXCL against anything else
+static int spool_tmpfile(const char *dir) {
+  int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0644);
+  if (fd >= 0 || (errno != EOPNOTSUPP && errno != EISDIR))
+    return fd;
+  char path[512];
+  snprintf(path, sizeof(path), "%s/.spool-%d-%u", dir, (int)getpid(),
+           ATOMIC_INC(&s_next_name));
+  fd = open(path, O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0644);
+  if (fd >= 0)
+    unlink(path);
+  return fd;
+}
+
+spool_t *spool_new(long long size) {
+  honce(&s_once, spool_once);
+  spool_t *spool = NULL;
+  HV_ALLOC_SIZEOF(spool);
+  spool->fd = spool_memfd(size);
+  if (spool->fd >= 0) {
+    spool->tier = SPOOL_MEMORY;
+    spool->reserved = size;
+  } else {
+    spool->tier = SPOOL_DISK;
+    spool->dir = spool_place();
+    char dir[SPOOL_DIR_LEN];
+    hmutex_lock(&s_mutex);
+    memcpy(dir, s_dirs[spool->dir].path, sizeof(dir));
+    hmutex_unlock(&s_mutex);
+    spool->fd = spool_tmpfile(dir);
+    if (spool->fd < 0) {
+      spool_unplace(spool->dir);
+      HV_FREE(spool);
+      return NULL;
+    }
+    hmutex_lock(&s_mutex);
+    s_stats.disk_files++;
+    hmutex_unlock(&s_mutex);
+  }
+  snprintf(spool->path, sizeof(spool->path), "/proc/%d/fd/%d", (int)getpid(),
+           spool->fd);
+  return spool;
+}
+
+spool_t *spool_dup(const spool_t *spool) {
+  spool_t *dup = NULL;
+  HV_ALLOC_SIZEOF(dup);
+  dup->fd = fcntl(spool->fd, F_DUPFD_CLOEXEC, 0);
+  if (dup->fd < 0) {
+    HV_FREE(dup);
+    return NULL;
+  }
+  dup->tier = spool->tier;
+  dup->dir = -1;
+  dup->shared = true;
+  snprintf(dup->path, sizeof(dup->path), "/proc/%d/fd/%d", (int)getpid(),
+           dup->fd);
+  return dup;
+}
+
+void spool_free(spool_t *spool) {
+  if (spool == NULL)
+    return;
+  close(spool->fd);
+  if (!spool->shared) {
+    if (spool->tier == SPOOL_DISK)
+      spool_unplace(spool->dir);
+    spool_release(spool);
+  }
+  HV_FREE(spool);
+}
+
+bool spool_write(spool_t *spool, const void *data, int len) {
+  const char *p = (const char *)data;
+  while (len > 0) {
+    ssize_t n = write(spool->fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+spool_tier_e spool_tier(const spool_t *spool) { return spool->tier; }
+
+const char *spool_path(const spool_t *spool) { return spool->path; }
+
+long long spool_size(const spool_t *spool) {
+  struct stat st;
+  return fstat(spool->fd, &st) == 0 ? (long long)st.st_size : -1;
+}
+
+void spool_stats(spool_stats_t *stats) {
+  honce(&s_once, spool_once);
+  hmutex_lock(&s_mutex);
+  *stats = s_stats;
+  hmutex_unlock(&s_mutex);
+}
+
+int spool_dir_stats(spool_dir_stats_t *stats, int max) {
+  honce(&s_once, spool_once);
+  hmutex_lock(&s_mutex);
+  int n = s_ndirs < max ? s_ndirs : max;
+  for (int i = 0; i < n; i++) {
+    memcpy(stats[i].path, s_dirs[i].path, SPOOL_DIR_LEN);
+    stats[i].writers = s_dirs[s_dirs[i].device].writers;
+  }
+  hmutex_unlock(&s_mutex);
+  for (int i = 0; i < n; i++)
+    stats[i].free_bytes = spool_dir_free(stats[i].path);
+  return n;
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <stdbool.h>
+
+// Spool files of uploads, in two tiers. An upload of at most
+// SPOOL_MEMORY_MAX bytes is kept in a memfd while the memory tier holds less
+// than SPOOL_MEMORY_BUDGET, and never touches the disk. Bigger uploads, and
+// small ones past the budget, spill to an O_TMPFILE under the spool
+// directory. Neither has a name: ffmpeg opens them as /proc/<pid>/fd/N, and
+// they are gone with the last descriptor, a crash leaves nothing behind.
+//
+// The disk tier is a set of directories, one per line in SPOOL_DIRS_FILE,
+// ideally one per device. Spool files and job directories go to the one with
+// the most free space per writer on its device, so ingest and transcode I/O
+// spread over the disks. Job directories fan out over SPOOL_FANOUT hashed
+// subdirectories to keep directories small.
+
+#define SPOOL_MEMORY_MAX    (32LL << 20)
+#define SPOOL_MEMORY_BUDGET (512LL << 20)
+#define SPOOL_SIZE_UNKNOWN  -1 // straight to disk
+#define SPOOL_DIRS_FILE     "spool.conf"
+#define SPOOL_DEFAULT_DIR   "jobs" // without SPOOL_DIRS_FILE
+#define SPOOL_MAX_DIRS      16
+#define SPOOL_DIR_LEN       64
+#define SPOOL_FANOUT        256
+
+typedef enum {
+  SPOOL_MEMORY,
+  SPOOL_DISK,
+} spool_tier_e;
+
+typedef struct spool_config_t {
+  long long memory_max;    // per upload, 0 puts everything on disk
+  long long memory_budget;
+  const char *dirs[SPOOL_MAX_DIRS]; // of the disk tier
+  int       ndirs;
+} spool_config_t;
+
+typedef struct spool_stats_t {
+  int       memory_files;
+  long long memory_bytes;  // reserved, the upload sizes announced
+  int       disk_files;
+  long      spilled;       // small enough but over the budget
+} spool_stats_t;
+
+typedef struct spool_dir_stats_t {
+  char      path[SPOOL_DIR_LEN];
+  long long free_bytes;
+  int       writers;       // of its device
+} spool_dir_stats_t;
+
+typedef struct spool_t spool_t;
+
+void spool_config_init(spool_config_t *config);
+// spool_init is optional, the defaults are used otherwise. Like
+// spool_load_dirs it comes before anything is spooled
+void spool_init(const spool_config_t *config);
+// spool_load_dirs reads one directory per line in place of the configured
+// ones, it returns their number or -1 if path cannot be read. Call it before
+// anything is spooled, it is refused with -1 once a spool file or job
+// directory is placed
+int spool_load_dirs(const char *path);
+// spool_new makes a spool file for at most size bytes
+spool_t *spool_new(long long size);
+// spool_dup opens the spool file again under a descriptor of its own, the
+// file lives on until both are freed
+spool_t *spool_dup(const spool_t *spool);
+// spool_free closes the spool file, which deletes it
+void spool_free(spool_t *spool);
+// spool_write writes through, a reader of spool_path sees the data after it
+bool spool_write(spool_t *spool, const void *data, int len);
+spool_tier_e spool_tier(const spool_t *spool);
+// spool_path is what a transcoder opens
+const char *spool_path(const spool_t *spool);
+// spool_size is what has been written so far
+long long spool_size(const spool_t *spool);
+void spool_stats(spool_stats_t *stats);
+int spool_dir_stats(spool_dir_stats_t *stats, int max);
+
+// spool_place picks a spool directory for a new writer and counts it on the
+// device until spool_unplace
+int spool_place(void);
+void spool_unplace(int dir);
+// spool_fanout writes the path of name in dir, under a subdirectory picked
+// by a hash of name that it makes on the way
+void spool_fanout(int dir, const char *name, char *path, int len);
+// spool_sweep removes the job directories and spool files a previous run
+// left in the spool directories, call it at startup before anything is
+// placed
+void spool_sweep(void);
+// spool_free_bytes sums the free space of every device with a spool
+// directory
+long long spool_free_bytes(void);
@@ -14,12 +14,28 @@
  */
 
 #include "include/hloop.h"
+#include "include/hsocket.h"
 #include "include/hssl.h"
+#include "admission.h"
+#include "bench.h"
+#include "cpu.h"
+#include "framepool.h"
+#include "job.h"
+#include "kernels.h"
+#include "scheduler.h"
 #include "serverd.h"
+#include "ingest.h"
+#include "spool.h"
+#include "upload.h"
 #include "videoprocess.h"
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
 /*
  * workflow:
@@ -32,12 +48,34 @@
  *
  */
 
+#define HTTP_STREAM_CHUNK (64 * 1024)  // read from a /stream file at a time
+#define HTTP_STREAM_QUEUE (256 * 1024) // let libhv hold at most this much
+
 static char s_date[32] = {0};
 static void update_date(htimer_t *timer) {
   uint64_t now = hloop_now(hevent_loop(timer));
   gmtime_fmt(now, s_date);
 }
 
+// a response is out, take the next request or close
+static void http_request_done(http_conn_t *conn) {
+  if (conn->request.keepalive) {
+    // Connection: keep-alive\r\n
+    // reset and receive next request
+    spool_free(conn->spool);
+    spool_free(conn->result);
+    conn->spool = NULL;
+    conn->result = NULL;
+    memset(&conn->request, 0, sizeof(http_msg_t));
+    memset(&conn->response, 0, sizeof(http_msg_t));
+    conn->state = s_first_line;
+    hio_readline(conn->io);
+  } else {
+    // Connection: close\r\n
+    hio_close(conn->io);
+  }
+}
+
 static int http_response_dump(http_msg_t *msg, char *buf, int len,
                               char *file_name) {
   int offset = 0;
@@ -69,7 +107,9 @@ static int http_response_dump(http_msg_t *msg, char *buf, int len,
   if (*s_date) {
     offset += snprintf(buf + offset, len - offset, "Date: %s\r\n", s_date);
   }
-  // TODO: Add your headers
+  if (*msg->headers) {
+    offset += snprintf(buf + offset, len - offset, "%s", msg->headers);
+  }
   offset += snprintf(buf + offset, len - offset, "\r\n");
   // body
   if (msg->body && msg->content_length > 0) {
@@ -110,7 +150,9 @@ static int http_reply(http_conn_t *conn, int status_code,
   return nwrite < 0 ? nwrite : msglen;
 }
 
-static int http_serve_file(http_conn_t *conn, char *file_path_string) {
+// file_name is the name a download gets
+static int http_serve_file(http_conn_t *conn, char *file_path_string,
+                           char *file_name) {
   http_msg_t *req = &conn->request;
   http_msg_t *resp = &conn->response;
   // GET / HTTP/1.1\r\n
@@ -149,7 +191,7 @@ static int http_serve_file(http_conn_t *conn, char *file_path_string) {
 	if(strcmp(suffix, "html") == 0)
 		nwrite = http_reply(conn, 200, "OK", content_type, NULL, 0, NULL);
 	else
-		nwrite = http_reply(conn, 200, "OK", content_type, NULL, 0, file_path_string);
+		nwrite = http_reply(conn, 200, "OK", content_type, NULL, 0, file_name);
 	if (nwrite < 0)
 	  return nwrite; // disconnected
   // send file
@@ -172,6 +214,307 @@ static int http_serve_file(http_conn_t *conn, char *file_path_string) {
   return 200;
 }
 
+// stream_more tops up the write queue from conn->stream and runs again from
+// on_write as it drains, so a segment is never in memory whole
+static void stream_more(http_conn_t *conn) {
+  if (conn->stream == NULL || conn->streaming)
+    return;
+  // hio_write calls on_write itself when it writes straight away
+  conn->streaming = true;
+  char buf[HTTP_STREAM_CHUNK];
+  while (conn->stream_left > 0 &&
+         hio_write_bufsize(conn->io) < HTTP_STREAM_QUEUE) {
+    size_t want = conn->stream_left < (long long)sizeof(buf)
+                      ? (size_t)conn->stream_left
+                      : sizeof(buf);
+    size_t nread = fread(buf, 1, want, conn->stream);
+    if (nread == 0) {
+      // the file shrank under us, the length is already sent
+      hio_close(conn->io);
+      return;
+    }
+    if (hio_write(conn->io, buf, nread) < 0)
+      return; // disconnected
+    conn->stream_left -= nread;
+  }
+  conn->streaming = false;
+  if (conn->stream_left > 0)
+    return;
+  fclose(conn->stream);
+  conn->stream = NULL;
+  http_request_done(conn);
+}
+
+static const char *stream_content_type(const char *suffix) {
+  if (strcmp(suffix, "m3u8") == 0)
+    return "application/vnd.apple.mpegurl";
+  if (strcmp(suffix, "mpd") == 0)
+    return "application/dash+xml";
+  if (strcmp(suffix, "m4s") == 0)
+    return "video/iso.segment";
+  if (strcmp(suffix, "ts") == 0)
+    return "video/mp2t";
+  return "video/mp4";
+}
+
+// GET /stream/{id}/{file}
+static int http_serve_stream(http_conn_t *conn) {
+  http_msg_t *req = &conn->request;
+  unsigned int id = 0;
+  char name[64] = {0};
+  if (sscanf(req->path, "/stream/%u/%63[^/?]", &id, name) != 2 ||
+      strstr(name, "..")) {
+    http_reply(conn, 404, NOT_FOUND, TEXT_HTML,
+               HTML_TAG_BEGIN NOT_FOUND HTML_TAG_END, 0, NULL);
+    return 404;
+  }
+  job_t *job = job_get(id);
+  char filepath[256] = {0};
+  if (job) {
+    snprintf(filepath, sizeof(filepath), "%s/%s", job_output_dir(job), name);
+  }
+  FILE *fp = job ? fopen(filepath, "rb") : NULL;
+  if (fp == NULL) {
+    // not finalized yet, players retry on their own
+    job_put(job);
+    http_reply(conn, 404, NOT_FOUND, TEXT_HTML,
+               HTML_TAG_BEGIN NOT_FOUND HTML_TAG_END, 0, NULL);
+    return 404;
+  }
+  struct stat st;
+  fstat(fileno(fp), &st);
+
+  const char *suffix = hv_suffixname(name);
+  bool is_manifest =
+      strcmp(suffix, "m3u8") == 0 || strcmp(suffix, "mpd") == 0;
+  // the manifest changes until the job is done, segments never do.
+  // content_length is an int, the length goes in with the headers
+  snprintf(conn->response.headers, sizeof(conn->response.headers),
+           "Cache-Control: %s\r\nContent-Length: %lld\r\n",
+           is_manifest && job->state < JOB_DONE ? "no-cache"
+                                                : "max-age=3600",
+           (long long)st.st_size);
+  job_put(job);
+  if (http_reply(conn, 200, HTTP_OK, stream_content_type(suffix), NULL, 0,
+                 NULL) < 0) {
+    fclose(fp);
+    return 200; // disconnected
+  }
+  // on_recv sends the body with stream_more once on_request returns
+  conn->stream = fp;
+  conn->stream_left = st.st_size;
+  return 200;
+}
+
+// GET /jobs/{id}
+// GET /jobs/{id}/quality
+static int http_serve_job(http_conn_t *conn) {
+  unsigned int id = 0;
+  char what[16] = "";
+  job_t *job = NULL;
+  if (sscanf(conn->request.path, "/jobs/%u/%15s", &id, what) >= 1 &&
+      (what[0] == '\0' || strcmp(what, "quality") == 0)) {
+    job = job_get(id);
+  }
+  if (job == NULL) {
+    http_reply(conn, 404, NOT_FOUND, TEXT_HTML,
+               HTML_TAG_BEGIN NOT_FOUND HTML_TAG_END, 0, NULL);
+    return 404;
+  }
+  char body[2048];
+  int body_len = what[0] ? job_dump_quality_json(job, body, sizeof(body))
+                         : job_dump_json(job, body, sizeof(body));
+  job_put(job);
+  http_reply(conn, 200, HTTP_OK, APPLICATION_JSON, body, body_len, NULL);
+  return 200;
+}
+
+// POST /video_stream[?format=hls|dash]
+// POST /video_ladder[?sizes=1080,720,480]
+// POST /video_scale[?size=WxH|H&filter=bilinear|bicubic|lanczos&denoise=0-64]
+// POST /video_denoise[?strength=0-64]
+// POST /video_trim?start=seconds&end=seconds
+// the encoding routes also take crf=auto|0-51 and quality=MS-SSIM target
+// jobs queue per client: the X-Api-Key header, the client cookie or the
+// address, see GET /scheduler. /video_stream segments a streamable upload
+// while it is still arriving
+static job_t *new_job(http_conn_t *conn) {
+  http_msg_t *req = &conn->request;
+  job_t *job = NULL;
+  bool bad = false;
+  if (path_match(req->path, "/video_ladder")) {
+    char sizes[64] = "1080,720,480";
+    get_query_param(req->path, "sizes", sizes, sizeof(sizes));
+    job = job_new(JOB_OUTPUT_LADDER);
+    for (char *p = sizes; job && *p && job->nheights < JOB_MAX_RENDITIONS;) {
+      int height = (int)strtol(p, &p, 10);
+      if (height >= 64 && height <= 4320)
+        job->heights[job->nheights++] = height & ~1;
+      while (*p && *p != ',')
+        ++p;
+      if (*p == ',')
+        ++p;
+    }
+  } else if (path_match(req->path, "/video_scale") ||
+             path_match(req->path, "/video_denoise")) {
+    char size[32] = {0};
+    char filter[16] = "lanczos";
+    char denoise[8] = {0};
+    bool scale = path_match(req->path, "/video_scale");
+    if (scale)
+      strcpy(size, "1920x1080");
+    else
+      strcpy(denoise, "4");
+    get_query_param(req->path, "size", size, sizeof(size));
+    get_query_param(req->path, "filter", filter, sizeof(filter));
+    get_query_param(req->path, scale ? "denoise" : "strength", denoise,
+                    sizeof(denoise));
+    job = job_new(JOB_OUTPUT_FILE);
+    if (job) {
+      if (sscanf(size, "%dx%d", &job->scale_width, &job->scale_height) != 2) {
+        job->scale_width = 0;
+        job->scale_height = atoi(size);
+      }
+      job->scale_filter = scale_filter_from_name(filter);
+      job->denoise = atoi(denoise);
+      // a 0x0 size keeps the input size
+      bad = job->scale_filter == SCALE_NUM || job->scale_width < 0 ||
+            job->scale_width > 7680 || job->scale_height > 4320 ||
+            (job->scale_height < 64 && (scale || job->scale_height != 0)) ||
+            job->denoise < 0 || job->denoise > 64;
+    }
+  } else if (path_match(req->path, "/video_trim")) {
+    char start[32] = "0";
+    char end[32] = {0};
+    get_query_param(req->path, "start", start, sizeof(start));
+    get_query_param(req->path, "end", end, sizeof(end));
+    job = job_new(JOB_OUTPUT_TRIM);
+    if (job) {
+      job->trim_start = atof(start);
+      job->trim_end = atof(end);
+      bad = job->trim_start < 0 || job->trim_end <= job->trim_start;
+    }
+  } else {
+    char format[8] = {0};
+    get_query_param(req->path, "format", format, sizeof(format));
+    job = job_new(strcmp(format, "dash") == 0 ? JOB_OUTPUT_DASH
+                                              : JOB_OUTPUT_HLS);
+  }
+  if (job && job->crf == JOB_CRF_AUTO) {
+    char crf[8] = "auto";
+    char quality[16] = {0};
+    get_query_param(req->path, "crf", crf, sizeof(crf));
+    if (strcmp(crf, "auto") != 0)
+      job->crf = atoi(crf);
+    if (get_query_param(req->path, "quality", quality, sizeof(quality)))
+      job->crf_target = atof(quality);
+    bad = bad || job->crf < JOB_CRF_AUTO || job->crf > 51 ||
+          job->crf_target < 0.5 || job->crf_target >= 1.0;
+  }
+  if (job && ((job->output == JOB_OUTPUT_LADDER && job->nheights == 0) ||
+              bad)) {
+    job_drop(job);
+    return NULL;
+  }
+  if (job == NULL)
+    return NULL;
+  // jobs queue per client, anonymous ones by address
+  if (*req->client) {
+    snprintf(job->client, sizeof(job->client), "%s", req->client);
+  } else {
+    char ip[48] = {0}; // INET6_ADDRSTRLEN
+    sockaddr_ip((sockaddr_u *)hio_peeraddr(conn->io), ip, sizeof(ip));
+    snprintf(job->client, sizeof(job->client), "ip:%s", ip);
+  }
+  return job;
+}
+
+// a streamed upload made its job with the head and may have started it
+// already, see stream_upload
+static int start_job(http_conn_t *conn) {
+  job_t *job = conn->job ? conn->job : new_job(conn);
+  conn->job = NULL;
+  ingest_put(conn->ingest);
+  conn->ingest = NULL;
+  if (job == NULL || *conn->video_info.video_name_original == '\0') {
+    // a job never started leaves nothing behind for JOB_TTL
+    if (job && job->ingest == NULL)
+      job_drop(job);
+    else
+      job_put(job);
+    http_reply(conn, 503, "Service Unavailable", TEXT_HTML,
+               HTML_TAG_BEGIN "Service Unavailable" HTML_TAG_END, 0, NULL);
+    return 503;
+  }
+  // the job owns the upload from now on, on_close must not free it
+  job->spool = conn->spool;
+  conn->spool = NULL;
+  if (job->ingest == NULL) {
+    snprintf(job->input, sizeof(job->input), "%s", spool_path(job->spool));
+    snprintf(job->input_hash, sizeof(job->input_hash), "%s",
+             conn->video_info.video_hash);
+    job->input_size = spool_size(job->spool);
+    job_start(job);
+  }
+  conn->video_info.video_name_original[0] = '\0';
+
+  char body[512];
+  int body_len = job_dump_json(job, body, sizeof(body));
+  job_put(job);
+  http_reply(conn, 202, "Accepted", APPLICATION_JSON, body, body_len, NULL);
+  return 202;
+}
+
+static bool job_route(const char *path) {
+  return path_match(path, "/video_stream") ||
+         path_match(path, "/video_ladder") ||
+         path_match(path, "/video_scale") ||
+         path_match(path, "/video_denoise") ||
+         path_match(path, "/video_trim");
+}
+
+static bool parse_sha1(char *hash) {
+  int i = 0;
+  for (; hash[i]; i++) {
+    hash[i] = tolower((unsigned char)hash[i]);
+    if (!isxdigit((unsigned char)hash[i]))
+      return false;
+  }
+  return i == 40;
+}
+
+// a job route POSTed without a body but with X-Content-SHA1 and
+// X-Content-Size asks whether the upload can be skipped. A result in the
+// cache finishes the job at once, 200, and an input another job still holds
+// starts it, 202. Either way with the JSON of the job. 404 asks for the
+// upload
+static int probe_upload(http_conn_t *conn) {
+  http_msg_t *req = &conn->request;
+  job_t *job = NULL;
+  if (job_route(req->path) && parse_sha1(req->content_sha1) &&
+      req->content_size > 0 && (job = new_job(conn)) != NULL) {
+    snprintf(job->input_hash, sizeof(job->input_hash), "%s",
+             req->content_sha1);
+    job->input_size = req->content_size;
+    if (!job_start_known(job)) {
+      job_drop(job);
+      job = NULL;
+    }
+  }
+  if (job == NULL) {
+    http_reply(conn, 404, NOT_FOUND, TEXT_HTML,
+               HTML_TAG_BEGIN NOT_FOUND HTML_TAG_END, 0, NULL);
+    return 404;
+  }
+  char body[512];
+  int body_len = job_dump_json(job, body, sizeof(body));
+  int status_code = job->cached ? 200 : 202;
+  job_put(job);
+  http_reply(conn, status_code, status_code == 200 ? HTTP_OK : "Accepted",
+             APPLICATION_JSON, body, body_len, NULL);
+  return status_code;
+}
+
 static bool parse_http_request_line(http_conn_t *conn, char *buf, int len) {
   // GET / HTTP/1.1
   http_msg_t *req = &conn->request;
@@ -186,6 +529,26 @@ static bool parse_http_request_line(http_conn_t *conn, char *buf, int len) {
   return true;
 }
 
+// the client id ends up in JSON and in the scheduler trace, keep it plain
+static void set_client(http_msg_t *req, const char *kind, const char *val) {
+  int i = snprintf(req->client, sizeof(req->client), "%s", kind);
+  for (; *val && i < (int)sizeof(req->client) - 1; ++val) {
+    bool plain = (*val >= '0' && *val <= '9') || (*val >= 'a' && *val <= 'z') ||
+                 (*val >= 'A' && *val <= 'Z') || strchr("-._~", *val);
+    req->client[i++] = plain ? *val : '_';
+  }
+  req->client[i] = '\0';
+}
+
+static void reject_upload(http_conn_t *conn, int status_code,
+                          const char *status_message) {
+  conn->request.keepalive = 0;
+  char body[128];
+  snprintf(body, sizeof(body), HTML_TAG_BEGIN "%s" HTML_TAG_END,
+           status_message);
+  http_reply(conn, status_code, status_message, TEXT_HTML, body, 0, NULL);
+}
+
 static bool parse_http_head(http_conn_t *conn, char *buf, int len) {
   http_msg_t *req = &conn->request;
   // Content-Type: text/html
@@ -201,13 +564,43 @@ static bool parse_http_head(http_conn_t *conn, char *buf, int len) {
     ++val;
   // printf("%s: %s\r\n", key, val);
   if (stricmp(key, "Content-Length") == 0) {
-    req->content_length = atoi(val);
+    // parsed wide, a length past an int is turned away and not wrapped
+    char *end = NULL;
+    errno = 0;
+    long long length = strtoll(val, &end, 10);
+    while (*end == ' ')
+      ++end;
+    if (end == val || *end != '\0' || length < 0) {
+      reject_upload(conn, 400, "Bad Request");
+      return false;
+    }
+    if (errno == ERANGE || length > INT_MAX || admission_too_large(length)) {
+      reject_upload(conn, 413, "Payload Too Large");
+      return false;
+    }
+    req->content_length = (int)length;
   } else if (stricmp(key, "Content-Type") == 0) {
     strncpy(req->content_type, val, sizeof(req->content_type) - 1);
   } else if (stricmp(key, "Connection") == 0) {
     if (stricmp(val, "close") == 0) {
       req->keepalive = 0;
     }
+  } else if (stricmp(key, "Expect") == 0) {
+    if (stricmp(val, "100-continue") == 0)
+      req->expect_continue = 1;
+    else
+      req->expect_unknown = 1;
+  } else if (stricmp(key, "X-Content-SHA1") == 0) {
+    strncpy(req->content_sha1, val, sizeof(req->content_sha1) - 1);
+  } else if (stricmp(key, "X-Content-Size") == 0) {
+    req->content_size = atoll(val);
+  } else if (stricmp(key, "X-Api-Key") == 0) {
+    set_client(req, "key:", val);
+  } else if (stricmp(key, "Cookie") == 0) {
+    char value[64];
+    if (strncmp(req->client, "key:", 4) != 0 &&
+        get_cookie(val, CLIENT_COOKIE, value, sizeof(value)))
+      set_client(req, "cookie:", value);
   } else {
     // TODO: save other head
   }
@@ -222,7 +615,24 @@ static int on_request(http_conn_t *conn) {
   // TODO: router
   if (strcmp(req->method, "GET") == 0) {
     // GET /ping HTTP/1.1\r\n
-    if (strcmp(req->path, "/ping") == 0) {
+    if (hv_strstartswith(req->path, "/stream/")) {
+      return http_serve_stream(conn);
+    } else if (hv_strstartswith(req->path, "/jobs/")) {
+      return http_serve_job(conn);
+    } else if (strcmp(req->path, "/scheduler") == 0) {
+      // measured first, the stats can grow in between so measure again
+      // until the report fits
+      char *body = NULL;
+      int body_len = job_dump_sched_json(NULL, 0);
+      for (int size = 0; body_len >= size;) {
+        size = body_len + 256;
+        body = (char *)realloc(body, size);
+        body_len = job_dump_sched_json(body, size);
+      }
+      http_reply(conn, 200, HTTP_OK, APPLICATION_JSON, body, body_len, NULL);
+      free(body);
+      return 200;
+    } else if (strcmp(req->path, "/ping") == 0) {
       http_reply(conn, 200, "OK", TEXT_PLAIN, "pong", 4, NULL);
 	  hio_write(conn->io, "pong", 4);
       return 200;
@@ -236,18 +646,20 @@ static int on_request(http_conn_t *conn) {
       hio_write(conn->io, status, strlen(status));
     } else if(strcmp(req->path, "/index.html")){
 	  // TODO: handle other method
-	  http_serve_file(conn, "index.html");
+	  http_serve_file(conn, "index.html", NULL);
 		
 
 		printf("http_reply\n");
 		
 	}else if (strcmp(req->path, "/")) {
-			http_serve_file(conn, "index.html");
+			http_serve_file(conn, "index.html", NULL);
 			
 	}
     // TODO: FIX THIS
-    // return http_serve_file(conn, NULL);
+    // return http_serve_file(conn, NULL, NULL);
   } else if (strcmp(req->method, "POST") == 0) {
+    if (req->content_length == 0 && *req->content_sha1)
+      return probe_upload(conn);
     // POST /echo HTTP/1.1\r\n
     if (strcmp(req->path, "/echo") == 0) {
       //		FILE *fp = fopen("./test.mp4", "wb");
@@ -258,26 +670,22 @@ static int on_request(http_conn_t *conn) {
       // hio_write_upstream(conn->io, req->body, req->body_len);
 
       return 200;
+    } else if (job_route(req->path)) {
+      return start_job(conn);
     } else if (strcmp(req->path, "/video_sharpness") == 0) {
       // TODO: Add handler for your path
-      strcpy(conn->video_info.video_name_final,
-             conn->video_info.video_name_original);
-      change_video_name(conn->video_info.video_name_final);
-
-		for(unsigned int i=strlen(conn->video_info.video_name_final)-1; i>=0; i--){
-			if(conn->video_info.video_name_final[i] == '.'){
-				conn->video_info.video_name_final[i+1] ='m';
-				conn->video_info.video_name_final[i+2] ='p';
-				conn->video_info.video_name_final[i+3] ='4';	
-				break;											
-			}
-			conn->video_info.video_name_final[i] =' ';
-							
-		}
+      // the result is a nameless spool file too, gone with the connection
+      conn->result = spool_new(SPOOL_SIZE_UNKNOWN);
+      snprintf(conn->video_info.video_name_final,
+               sizeof(conn->video_info.video_name_final), "%s",
+               conn->result ? spool_path(conn->result) : "");
 		
-      if(video_sharpness_vaapi(conn, conn->video_info.video_name_original,
-							   conn->video_info.video_name_final)){
-		  http_serve_file(conn, conn->video_info.video_name_final);
+      // the VAAPI sharpness filter needs an Intel GPU, sharpen on the CPU
+      sharpen_opts_t sharpen_opts = {1.0f, 2, false};
+      if(conn->result && video_sharpness_cpu(conn->video_info.video_name_original,
+							 conn->video_info.video_name_final, &sharpen_opts)){
+		  http_serve_file(conn, conn->video_info.video_name_final,
+		                  "sharpened.mp4");
 	  }else {
 		  unsigned int message_len = strlen(HTML_TAG_BEGIN) + strlen(NOT_FOUND) + strlen(HTML_TAG_END); 
 		  http_reply(conn, 404, NOT_FOUND, TEXT_HTML,
@@ -290,7 +698,16 @@ static int on_request(http_conn_t *conn) {
       // http_reply(conn, 200, "OK", req->content_type, req->body,
       // req->content_length);
     }
-	} else{
+	} else if (strcmp(req->method, "OPTIONS") == 0) {
+    // the preflight of a cross origin hash probe, see probe_upload
+    snprintf(conn->response.headers, sizeof(conn->response.headers),
+             "Access-Control-Allow-Methods: GET, POST, OPTIONS\r\n"
+             "Access-Control-Allow-Headers: Content-Type, X-Content-SHA1, "
+             "X-Content-Size\r\n"
+             "Access-Control-Max-Age: 86400\r\n");
+    http_reply(conn, 204, "No Content", NULL, NULL, 0, NULL);
+    return 204;
+  } else{
 	  // TODO: handle other method
     }
   http_reply(conn, 501, NOT_IMPLEMENTED, TEXT_HTML,
@@ -298,15 +715,112 @@ static int on_request(http_conn_t *conn) {
   return 501;
 }
 
+static bool upload_route(const char *path) {
+  return strcmp(path, "/echo") == 0 || strcmp(path, "/video_sharpness") == 0 ||
+         job_route(path);
+}
+
+// admit_upload reserves the upload or answers 413 or 503 with Retry-After
+static bool admit_upload(http_conn_t *conn) {
+  http_msg_t *req = &conn->request;
+  int retry_after = 0;
+  admission_e admission = admission_begin(req->content_length, &retry_after);
+  if (admission == ADMISSION_OK) {
+    conn->admitted_bytes = req->content_length;
+    return true;
+  }
+  if (admission == ADMISSION_TOO_LARGE) {
+    reject_upload(conn, 413, "Payload Too Large");
+  } else {
+    snprintf(conn->response.headers, sizeof(conn->response.headers),
+             "Retry-After: %d\r\n", retry_after);
+    reject_upload(conn, 503, "Service Unavailable");
+  }
+  hio_close(conn->io);
+  return false;
+}
+
+// accept_upload runs once the head is in: route, content type, size and
+// admission are all known before the body, which is then parsed as it
+// arrives (see upload.h). A doomed upload is answered
+// right away and the connection closed, so a client waiting on
+// Expect: 100-continue never sends the body, the others are cut short.
+static bool accept_upload(http_conn_t *conn) {
+  http_msg_t *req = &conn->request;
+  if (req->expect_unknown) {
+    reject_upload(conn, 417, "Expectation Failed");
+  } else if (!upload_route(req->path)) {
+    reject_upload(conn, 404, NOT_FOUND);
+  } else if (strcmp(req->path, "/echo") != 0 &&
+             strncasecmp(req->content_type, "multipart/form-data", 19) != 0) {
+    reject_upload(conn, 415, "Unsupported Media Type");
+  } else if (req->content_length < 0 ||
+             (strcmp(req->path, "/echo") != 0 &&
+              (conn->upload = upload_new(req->content_type,
+                                         req->content_length)) == NULL)) {
+    reject_upload(conn, 400, "Bad Request");
+  } else if (!admit_upload(conn)) {
+    return false;
+  } else if (path_match(req->path, "/video_stream") &&
+             (conn->job = new_job(conn)) == NULL) {
+    // the admission is given back in on_close
+    reject_upload(conn, 503, "Service Unavailable");
+  } else {
+    if (req->expect_continue)
+      hio_write(conn->io, "HTTP/1.1 100 Continue\r\n\r\n", 25);
+    return true;
+  }
+  hio_close(conn->io);
+  return false;
+}
+
+static void upload_done(http_conn_t *conn, bool complete) {
+  if (conn->admitted_bytes > 0) {
+    admission_end(conn->admitted_bytes, complete);
+    conn->admitted_bytes = 0;
+  }
+  if (conn->ingest)
+    ingest_end(conn->ingest, complete);
+}
+
+// stream_upload starts the job of a streamable upload once the sniffer
+// named the container, the job follows the spool file as it grows
+static void stream_upload(http_conn_t *conn) {
+  if (conn->ingest == NULL && upload_sniff(conn->upload)->streamable &&
+      *upload_path(conn->upload)) {
+    job_t *job = conn->job;
+    snprintf(job->input, sizeof(job->input), "%s", upload_path(conn->upload));
+    conn->ingest = ingest_new();
+    if (!job_start_live(job, conn->ingest)) {
+      ingest_put(conn->ingest);
+      conn->ingest = NULL;
+    }
+  }
+  if (conn->ingest)
+    ingest_grow(conn->ingest, upload_size(conn->upload));
+}
+
 static void on_close(hio_t *io) {
   // printf("on_close fd=%d error=%d\n", hio_fd(io), hio_error(io));
   http_conn_t *conn = (http_conn_t *)hevent_userdata(io);
 
+  upload_done(conn, false);
+  upload_free(conn->upload);
+  conn->upload = NULL;
+  // a started job fails on the cut short ingest by itself, one that never
+  // started is taken out of the table
+  if (conn->job && conn->ingest == NULL)
+    job_drop(conn->job);
+  else
+    job_put(conn->job);
+  ingest_put(conn->ingest);
 	if(conn->video_info.original != NULL){
 		fclose(conn->video_info.original);
 	}
-  remove(conn->video_info.video_name_original);
-  remove(conn->video_info.video_name_final);
+  spool_free(conn->spool);
+  spool_free(conn->result);
+  if (conn->stream)
+    fclose(conn->stream);
  
 	
   if (conn) {
@@ -315,11 +829,11 @@ static void on_close(hio_t *io) {
   }
 }
 
-unsigned short start_body_if = 0;
-unsigned int buffer_len = 0;
-bool readline_fallback = false;
-void *buffer = NULL;
-// bool content_header_end = false;
+static void on_write(hio_t *io, const void *buf, int writebytes) {
+  http_conn_t *conn = (http_conn_t *)hevent_userdata(io);
+  if (conn)
+    stream_more(conn);
+}
 
 void on_recv(hio_t *io, void *buf, int readbytes) {
   char *str = (char *)buf;
@@ -328,8 +842,6 @@ void on_recv(hio_t *io, void *buf, int readbytes) {
   http_conn_t *conn = (http_conn_t *)hevent_userdata(io);
   http_msg_t *req = &conn->request;
 
-  unsigned int line_char_count = 0;
-
   switch (conn->state) {
   case s_begin:
     printf("s_begin");
@@ -379,6 +891,8 @@ void on_recv(hio_t *io, void *buf, int readbytes) {
       printf("content lenght = %d\n", req->content_length);
       goto s_end;
     } else {
+      if (strcmp(req->method, "POST") == 0 && !accept_upload(conn))
+        return;
       // start read body
       conn->state = s_body;
       // WARN: too large content_length should read multiple times!
@@ -389,122 +903,48 @@ void on_recv(hio_t *io, void *buf, int readbytes) {
       break;
     }
   case s_body:
-
-    printf("s_body\n");
-
-    if ((readbytes == 2 && str[0] == '\r' && str[1] == '\n')) {
-      printf("str == %s", str);
-      start_body_if++;
-      hio_read(io);
-    }
-
-    printf("%u\n", start_body_if);
-
-    req->body = str;
     req->body_len += readbytes;
-
-    // hv_delay(1);
-
-    if (buffer == NULL) {
-      buffer = malloc(req->content_length);
-      memset(buffer, 0, req->content_length);
-      buffer_len = 0;
-    }
-
-    // if(start_body_if){
-    memcpy(buffer + buffer_len, buf, readbytes);
-    buffer_len += readbytes;
-    /*
-printf("FILE = %p, buf = %p, readbytes = %d, body_len = %d, content_length "
-       "= %d, buffer_len = %u\n",
-       conn->video_info.final, buf, readbytes, req->body_len,
-       req->content_length, buffer_len);
-    */
-    if (req->body_len == req->content_length) {
-      // hio_read_remain(io);
-      conn->state = s_end;
-      // buffer = realloc(buffer, buffer_len);
-      printf("writing!!!!!!\n");
-      // buffer = realloc(buffer, buffer_len);
-
-      printf("bufferlen = %u\n", buffer_len);
-
-      unsigned int vid_name_index = 0;
-      unsigned short set_break = 0;
-      for (unsigned int i = 0; i < buffer_len; i++) {
-        if (strncmp(((char *)buffer + i), "name=", 5) == 0) {
-          if (strncmp(((char *)buffer + i + 5), "\"video_file\"", 12) == 0) {
-            conn->body_is_video = true;
-          }
-        }
-        if (strncmp(((char *)buffer + i), "filename=", 9) == 0) {
-          for (unsigned int j = 0; j < 1024; j++) {
-            if (((char *)buffer + i + j + 10)[0] == '\"') {
-              break;
-            }
-
-            conn->video_info.video_name_original[vid_name_index++] =
-                ((char *)buffer + i + j + 10)[0];
-          }
-        }
-
-        printf("conn->body_is_video = %s, video_name_original = %s\n",
-               conn->body_is_video ? "true" : "false",
-               conn->video_info.video_name_original);
-
-        if (((char *)buffer)[i] == '\r' && ((char *)buffer)[i + 1] == '\n' &&
-            ((char *)buffer)[i + 2] == '\r' &&
-            ((char *)buffer)[i + 3] == '\n') {
-          memcpy(buffer, &((char *)buffer)[i + 4], buffer_len - i - 4);
-          buffer_len = buffer_len - i - 4;
-
-          printf("bufferlen = %u\n", buffer_len);
-          break;
-        }
+    if (conn->upload) {
+      upload_e state = upload_feed(conn->upload, str, readbytes);
+      if (state == UPLOAD_NOT_VIDEO || state == UPLOAD_BAD ||
+          state == UPLOAD_IO_ERROR) {
+        upload_done(conn, false);
+        if (state == UPLOAD_NOT_VIDEO)
+          reject_upload(conn, 415, "Unsupported Media Type");
+        else if (state == UPLOAD_BAD)
+          reject_upload(conn, 400, "Bad Request");
+        else
+          reject_upload(conn, 500, "Internal Server Error");
+        hio_close(io);
+        return;
       }
-      unsigned int zeroDzeroA_count = 0;
-      unsigned int deleted_bytes_count = 0;
-      for (unsigned int i = buffer_len; i >= 0; i--) {
-        deleted_bytes_count++;
-        if (((char *)buffer)[i - 1] == '\r' && ((char *)buffer)[i] == '\n') {
-          zeroDzeroA_count++;
-        }
-        if (zeroDzeroA_count == 6) {
-          buffer = realloc(buffer, buffer_len - deleted_bytes_count);
-          printf("bufferlen = %u\n", buffer_len);
-          buffer_len = buffer_len - deleted_bytes_count;
-
-          printf("bufferlen = %u\n", buffer_len);
-          break;
-        }
+      if (conn->job)
+        stream_upload(conn);
+    }
+    if (req->body_len < req->content_length) {
+      hio_read(io);
+      break;
+    }
+    conn->state = s_end;
+    upload_done(conn, true);
+    if (conn->upload) {
+      conn->spool = upload_take(conn->upload);
+      conn->body_is_video = conn->spool != NULL;
+      snprintf(conn->video_info.video_hash, sizeof(conn->video_info.video_hash),
+               "%s", upload_hash(conn->upload));
+      if (conn->spool)
+        snprintf(conn->video_info.video_name_original,
+                 sizeof(conn->video_info.video_name_original), "%s",
+                 spool_path(conn->spool));
+      upload_free(conn->upload);
+      conn->upload = NULL;
+      if (!conn->body_is_video) {
+        reject_upload(conn, 400, "Bad Request");
+        hio_close(io);
+        return;
       }
-	  
-      printf("bufferlen = %u\n", buffer_len);
-
-      change_video_name(conn->video_info.video_name_original);
-      // file doesn't exist
-      conn->video_info.original =
-      fopen(conn->video_info.video_name_original, "wb");
-      fwrite(buffer, buffer_len, 2, conn->video_info.original);
-      fflush(conn->video_info.original);
-      ftruncate(fileno(conn->video_info.original), buffer_len);
-      free(buffer);
-      buffer = NULL;
-
-      goto s_end;
-      // hio_read(io);
     }
-
-    // WARN: too large content_length should be handled by streaming!
-
-    //}else{
-    hio_read(io);
-    //	readline_fallback = false;
-
-    //}
-    hio_read(io);
-
-    break;
+    goto s_end;
 
   case s_end:
   s_end:
@@ -513,17 +953,12 @@ printf("FILE = %p, buf = %p, readbytes = %d, body_len = %d, content_length "
     on_request(conn);
     if (hio_is_closed(io))
       return;
-    if (req->keepalive) {
-      // Connection: keep-alive\r\n
-      // reset and receive next request
-      memset(&conn->request, 0, sizeof(http_msg_t));
-      memset(&conn->response, 0, sizeof(http_msg_t));
-      conn->state = s_first_line;
-      hio_readline(io);
-    } else {
-      // Connection: close\r\n
-      hio_close(io);
+    // a streamed body finishes the request once it is all queued
+    if (conn->stream) {
+      stream_more(conn);
+      return;
     }
+    http_request_done(conn);
     break;
   default:
     break;
@@ -534,7 +969,6 @@ static void new_conn_event(hevent_t *ev) {
   hloop_t *loop = ev->loop;
   hio_t *io = (hio_t *)hevent_userdata(ev);
   hio_attach(loop, io);
-  start_body_if = false;
 	printf("new_conn_event\n");
   /*
   char localaddrstr[SOCKADDR_STRLEN] = {0};
@@ -548,6 +982,7 @@ static void new_conn_event(hevent_t *ev) {
 
   hio_setcb_close(io, on_close);
   hio_setcb_read(io, on_recv);
+  hio_setcb_write(io, on_write);
 
   hio_set_keepalive_timeout(io, HTTP_KEEPALIVE_TIMEOUT);
 
@@ -589,6 +1024,11 @@ static HTHREAD_ROUTINE(worker_thread) {
   return 0;
 }
 
+static void sweep_jobs(htimer_t *timer) {
+  job_sweep();
+  framepool_trim(framepool_default());
+}
+
 static HTHREAD_ROUTINE(accept_thread) {
   hloop_t *loop = (hloop_t *)userdata;
 	hio_t *listenio = hloop_create_tcp_server(loop, host, port, on_accept);
@@ -609,14 +1049,51 @@ static HTHREAD_ROUTINE(accept_thread) {
          port, hio_fd(listenio), thread_num);
   // NOTE: add timer to update date every 1s
   htimer_add(loop, update_date, 1000, INFINITE);
+  htimer_add(loop, sweep_jobs, 60000, INFINITE);
   hloop_run(loop);
   return 0;
 }
 
 int main(int argc, char **argv) {
 
+  // --cpu-features=c|sse2|avx2|avx512 may come first, before anything else
+  if (argc > 1 && strncmp(argv[1], "--cpu-features=", 15) == 0) {
+    if (!cpu_set_features(argv[1] + 15))
+      return -10;
+    --argc;
+    ++argv;
+  }
+  kernels_init(cpu_features());
+
+  if (argc > 1 && (strncmp(argv[1], "--bench", 7) == 0 ||
+                   strncmp(argv[1], "--y4m", 5) == 0 ||
+                   strcmp(argv[1], "--quality") == 0)) {
+    return bench_main(argc - 1, argv + 1);
+  }
+  if (argc > 1 && strcmp(argv[1], "--sched-sim") == 0) {
+    return sched_sim_main(argc - 1, argv + 1);
+  }
   if (argc < 2) {
-    printf("Usage: %s port [thread_num]\n", argv[0]);
+    printf("Usage: %s [--cpu-features=c|sse2|avx2|avx512] port [thread_num]\n",
+           argv[0]);
+    printf("       %s [--cpu-features=...] --bench [stage|all] [size|all] "
+           "[threads]\n",
+           argv[0]);
+    printf("       %s [--cpu-features=...] --bench-sharpen [WxH] [threads]\n",
+           argv[0]);
+    printf("       %s [--cpu-features=...] --bench-scale [WxH] [threads]\n",
+           argv[0]);
+    printf("       %s [--cpu-features=...] --bench-denoise [WxH] [threads] "
+           "[strength]\n",
+           argv[0]);
+    printf("       %s [--cpu-features=...] --bench-metrics [WxH] [threads]\n",
+           argv[0]);
+    printf("       %s --y4m-pattern WxH frames out.y4m [pattern]\n", argv[0]);
+    printf("       %s --y4m-process in.y4m out.y4m [stage...]\n", argv[0]);
+    printf("       %s --quality ref.y4m dist.y4m [-v]\n", argv[0]);
+    printf("       %s --sched-sim trace.csv|mixed|batch|overload [workers] "
+           "[sla_sec] [speed]\n",
+           argv[0]);
     return -10;
   }
   port = atoi(argv[1]);
@@ -627,6 +1104,13 @@ int main(int argc, char **argv) {
   }
   if (thread_num == 0)
     thread_num = 1;
+  kernels_dump();
+  // a transcoder that quits early must not take the server down with it
+  signal(SIGPIPE, SIG_IGN);
+  // before any upload is spooled, see spool.h. Job ids start over, so the
+  // directories of the last run go or a new job would serve their files
+  spool_load_dirs(SPOOL_DIRS_FILE);
+  spool_sweep();
 
   worker_loops = (hloop_t **)malloc(sizeof(hloop_t *) * thread_num);
   for (int i = 0; i < thread_num; ++i) {
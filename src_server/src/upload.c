@@ -0,0 +1,258 @@
+#define _GNU_SOURCE // memmem
+#include "upload.h"
+#include "include/sha1.h"
+#include "spool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+typedef enum {
+  UPLOAD_PREAMBLE,
+  UPLOAD_DELIMITER, // after a boundary, "\r\n" or the closing "--"
+  UPLOAD_HEAD,
+  UPLOAD_DATA,
+  UPLOAD_EPILOGUE,
+} upload_state_e;
+
+struct upload_t {
+  upload_state_e  state;
+  char            delimiter[UPLOAD_MAX_BOUNDARY + 5]; // "\r\n--" boundary
+  int             delimiter_len;
+  // what the parser has not consumed yet
+  char           *buf;
+  int             len;
+  int             cap;
+  // the file part
+  bool            file_part; // the current part is it
+  bool            have_file; // it is complete
+  uint8_t         head[SNIFF_MAX];
+  int             head_len;
+  bool            sniffed;
+  sniff_t         sniff;
+  long long       max_size;
+  spool_t        *spool;
+  HV_SHA1_CTX     sha1;     // of the file, as it is written
+  char            hash[41];
+  long long       size;
+};
+
+static bool parse_boundary(const char *content_type, char *boundary,
+                           int len) {
+  if (strncasecmp(content_type, "multipart/form-data", 19) != 0)
+    return false;
+  const char *p = strcasestr(content_type, "boundary=");
+  if (p == NULL)
+    return false;
+  p += 9;
+  bool quoted = *p == '"';
+  if (quoted)
+    ++p;
+  int i = 0;
+  while (*p && i < len - 1 &&
+         (quoted ? *p != '"' : *p != ';' && *p != ' ' && *p != '\t'))
+    boundary[i++] = *p++;
+  boundary[i] = '\0';
+  return i > 0 && (*p == '\0' || *p == '"' || *p == ';' || *p == ' ' ||
+                   *p == '\t');
+}
+
+upload_t *upload_new(const char *content_type, long long max_size) {
+  char boundary[UPLOAD_MAX_BOUNDARY + 1];
+  if (!parse_boundary(content_type, boundary, sizeof(boundary)))
+    return NULL;
+  upload_t *upload = (upload_t *)calloc(1, sizeof(upload_t));
+  upload->max_size = max_size;
+  HV_SHA1Init(&upload->sha1);
+  upload->delimiter_len = snprintf(upload->delimiter,
+                                   sizeof(upload->delimiter), "\r\n--%s",
+                                   boundary);
+  // the first boundary has no line break ahead of it, pretend it had
+  upload->cap = 4096;
+  upload->buf = (char *)malloc(upload->cap);
+  memcpy(upload->buf, "\r\n", 2);
+  upload->len = 2;
+  return upload;
+}
+
+void upload_free(upload_t *upload) {
+  if (upload == NULL)
+    return;
+  spool_free(upload->spool);
+  free(upload->buf);
+  free(upload);
+}
+
+const sniff_t *upload_sniff(const upload_t *upload) { return &upload->sniff; }
+
+long long upload_size(const upload_t *upload) { return upload->size; }
+
+const char *upload_hash(const upload_t *upload) { return upload->hash; }
+
+const char *upload_path(const upload_t *upload) {
+  return upload->spool ? spool_path(upload->spool) : "";
+}
+
+spool_t *upload_take(upload_t *upload) {
+  if (upload->state != UPLOAD_EPILOGUE || !upload->have_file)
+    return NULL;
+  spool_t *spool = upload->spool;
+  upload->spool = NULL;
+  return spool;
+}
+
+// the part head, filename="..." in Content-Disposition makes it the file.
+// The name itself is not used, spool files have none
+static void parse_part_head(upload_t *upload, char *head) {
+  upload->file_part = false;
+  for (char *line = head; line && *line;) {
+    char *next = strstr(line, "\r\n");
+    if (next) {
+      *next = '\0';
+      next += 2;
+    }
+    if (strncasecmp(line, "Content-Disposition:", 20) == 0) {
+      if (strstr(line, "filename=\"") && !upload->have_file &&
+          !upload->sniffed)
+        upload->file_part = true;
+    }
+    line = next;
+  }
+}
+
+static upload_e write_file(upload_t *upload, const void *data, int len) {
+  if (len > 0 && !spool_write(upload->spool, data, len))
+    return UPLOAD_IO_ERROR;
+  HV_SHA1Update(&upload->sha1, (const unsigned char *)data, len);
+  upload->size += len;
+  return UPLOAD_MORE;
+}
+
+// the file goes to memory or disk by the size of the whole body, see spool.h
+static upload_e open_file(upload_t *upload) {
+  upload->spool = spool_new(upload->max_size);
+  if (upload->spool == NULL)
+    return UPLOAD_IO_ERROR;
+  return write_file(upload, upload->head, upload->head_len);
+}
+
+// file_data sniffs the first SNIFF_MAX bytes before the spool file exists
+static upload_e file_data(upload_t *upload, const char *data, int len,
+                          bool final) {
+  if (!upload->sniffed) {
+    int n = len < SNIFF_MAX - upload->head_len ? len
+                                               : SNIFF_MAX - upload->head_len;
+    memcpy(upload->head + upload->head_len, data, n);
+    upload->head_len += n;
+    data += n;
+    len -= n;
+    sniff_e container = sniff_container(upload->head, upload->head_len, final,
+                                        &upload->sniff);
+    if (container == SNIFF_MORE)
+      return UPLOAD_MORE;
+    if (container == SNIFF_UNKNOWN)
+      return UPLOAD_NOT_VIDEO;
+    upload->sniffed = true;
+    upload_e state = open_file(upload);
+    if (state != UPLOAD_MORE)
+      return state;
+  }
+  return write_file(upload, data, len);
+}
+
+static upload_e part_end(upload_t *upload) {
+  if (!upload->file_part)
+    return UPLOAD_MORE;
+  upload->file_part = false;
+  upload_e state = file_data(upload, NULL, 0, true);
+  if (state != UPLOAD_MORE)
+    return state;
+  upload->have_file = true;
+  unsigned char digest[20];
+  HV_SHA1Final(digest, &upload->sha1);
+  for (int i = 0; i < 20; i++)
+    snprintf(upload->hash + 2 * i, 3, "%02x", digest[i]);
+  return state;
+}
+
+static upload_e upload_parse(upload_t *upload, int *pos) {
+  char *buf = upload->buf;
+  int len = upload->len;
+  for (;;) {
+    char *p = buf + *pos;
+    int left = len - *pos;
+    switch (upload->state) {
+    case UPLOAD_PREAMBLE:
+    case UPLOAD_DATA: {
+      char *delimiter =
+          (char *)memmem(p, left, upload->delimiter, upload->delimiter_len);
+      bool data = upload->state == UPLOAD_DATA;
+      if (delimiter == NULL) {
+        // the tail may be the start of a delimiter
+        int keep = upload->delimiter_len - 1;
+        if (left > keep) {
+          if (data && upload->file_part) {
+            upload_e state = file_data(upload, p, left - keep, false);
+            if (state != UPLOAD_MORE)
+              return state;
+          }
+          *pos += left - keep;
+        }
+        return UPLOAD_MORE;
+      }
+      if (data && upload->file_part) {
+        upload_e state = file_data(upload, p, (int)(delimiter - p), false);
+        if (state == UPLOAD_MORE)
+          state = part_end(upload);
+        if (state != UPLOAD_MORE)
+          return state;
+      }
+      *pos += (int)(delimiter - p) + upload->delimiter_len;
+      upload->state = UPLOAD_DELIMITER;
+      break;
+    }
+    case UPLOAD_DELIMITER:
+      if (left < 2)
+        return UPLOAD_MORE;
+      if (memcmp(p, "--", 2) == 0) {
+        upload->state = UPLOAD_EPILOGUE;
+        return upload->have_file ? UPLOAD_DONE : UPLOAD_BAD;
+      }
+      if (memcmp(p, "\r\n", 2) != 0)
+        return UPLOAD_BAD;
+      *pos += 2;
+      upload->state = UPLOAD_HEAD;
+      break;
+    case UPLOAD_HEAD: {
+      char *end = (char *)memmem(p, left, "\r\n\r\n", 4);
+      if (end == NULL)
+        return left > UPLOAD_MAX_PART_HEAD ? UPLOAD_BAD : UPLOAD_MORE;
+      *end = '\0';
+      parse_part_head(upload, p);
+      *pos += (int)(end - p) + 4;
+      upload->state = UPLOAD_DATA;
+      break;
+    }
+    case UPLOAD_EPILOGUE:
+      *pos = len;
+      return UPLOAD_DONE;
+    }
+  }
+}
+
+upload_e upload_feed(upload_t *upload, const char *data, int len) {
+  if (upload->state == UPLOAD_EPILOGUE)
+    return upload->have_file ? UPLOAD_DONE : UPLOAD_BAD;
+  if (upload->len + len > upload->cap) {
+    while (upload->len + len > upload->cap)
+      upload->cap *= 2;
+    upload->buf = (char *)realloc(upload->buf, upload->cap);
+  }
+  memcpy(upload->buf + upload->len, data, len);
+  upload->len += len;
+  int pos = 0;
+  upload_e state = upload_parse(upload, &pos);
+  upload->len -= pos;
+  memmove(upload->buf, upload->buf + pos, upload->len);
+  return state;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "sniff.h"
+#include "spool.h"
+#include <stdbool.h>
+
+// Streaming multipart/form-data ingest. The body is parsed as it arrives,
+// chunk by chunk, so an upload never sits in memory whole. The first part
+// with a filename is the video: its first bytes are sniffed (see sniff.h)
+// before any of it reaches the spool, then it is written through. The other
+// fields are dropped.
+
+#define UPLOAD_MAX_PART_HEAD 8192
+#define UPLOAD_MAX_BOUNDARY  70 // RFC 2046
+
+typedef enum {
+  UPLOAD_MORE,      // feed the next chunk
+  UPLOAD_DONE,      // the closing boundary is in
+  UPLOAD_BAD,       // malformed, or no file part
+  UPLOAD_NOT_VIDEO, // the file part failed sniffing
+  UPLOAD_IO_ERROR,  // the spool could not be written
+} upload_e;
+
+typedef struct upload_t upload_t;
+
+// upload_new returns NULL unless content_type is multipart/form-data with a
+// boundary, max_size bounds the file and picks its spool tier
+upload_t *upload_new(const char *content_type, long long max_size);
+// upload_free removes the spool file unless upload_take took it
+void upload_free(upload_t *upload);
+// whatever upload_feed took is written through to the spool file by the time
+// it returns, so a reader can follow it, see ingest.h
+upload_e upload_feed(upload_t *upload, const char *data, int len);
+// the file part, once it started
+const sniff_t *upload_sniff(const upload_t *upload);
+long long upload_size(const upload_t *upload);
+// upload_hash is the hex SHA-1 of the file, empty until it is complete
+const char *upload_hash(const upload_t *upload);
+// upload_path is the spool file, empty until the file part was sniffed
+const char *upload_path(const upload_t *upload);
+// upload_take hands the spool file of a done upload over, or returns NULL
+spool_t *upload_take(upload_t *upload);
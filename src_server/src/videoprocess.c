@@ -1,7 +1,16 @@
 #include "videoprocess.h"
+#include "framepool.h"
+#include "include/hbase.h"
+#include "include/hsysinfo.h"
+#include "include/hthread.h"
+#include "pipeline.h"
+#include "y4m.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
  
  
 bool video_sharpness_vaapi(http_conn_t *conn, char *video_name, char *output_name) {
@@ -23,3 +32,770 @@ bool video_sharpness_vaapi(http_conn_t *conn, char *video_name, char *output_nam
 	return system(command) == 0;
 	
 }
+
+// segments are written under a temporary name and renamed once complete,
+// so anything listed in the manifest can be served straight away
+static void segment_command(char *command, int len, const char *input,
+							const char *dir, const char *manifest, bool dash) {
+	if (dash) {
+		snprintf(command, len,
+				 "ffmpeg -y -i %s -c:v copy -c:a aac -f dash -seg_duration 2 "
+				 "-streaming 1 -use_template 1 -use_timeline 1 '%s/%s'",
+				 input, dir, manifest);
+	} else {
+		snprintf(command, len,
+				 "ffmpeg -y -i %s -c:v copy -c:a aac -f hls -hls_time 2 "
+				 "-hls_list_size 0 -hls_playlist_type event "
+				 "-hls_segment_type fmp4 -hls_flags independent_segments+temp_file "
+				 "-hls_segment_filename '%s/seg%%05d.m4s' '%s/%s'",
+				 input, dir, dir, manifest);
+	}
+}
+
+bool video_segment(const char *video_name, const char *dir,
+                   const char *manifest, bool dash) {
+	char command[4096] = {0};
+	char input[2100];
+	snprintf(input, sizeof(input), "'%s'", video_name);
+	segment_command(command, sizeof(command), input, dir, manifest, dash);
+	if (system(command) != 0)
+		return false;
+	// the dash muxer rewrites its manifest as static on its own
+	return dash ? true : hls_finalize_playlist(dir, manifest);
+}
+
+FILE *video_segment_pipe(const char *dir, const char *manifest, bool dash) {
+	char command[4096] = {0};
+	segment_command(command, sizeof(command), "pipe:0", dir, manifest, dash);
+	return popen(command, "w");
+}
+
+bool video_segment_close(FILE *fp, const char *dir, const char *manifest,
+                         bool dash) {
+	if (pclose(fp) != 0)
+		return false;
+	return dash ? true : hls_finalize_playlist(dir, manifest);
+}
+
+bool hls_finalize_playlist(const char *dir, const char *manifest) {
+	char path[512], tmp_path[520];
+	snprintf(path, sizeof(path), "%s/%s", dir, manifest);
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+	FILE *in = fopen(path, "rb");
+	if (in == NULL)
+		return false;
+	FILE *out = fopen(tmp_path, "wb");
+	if (out == NULL) {
+		fclose(in);
+		return false;
+	}
+	bool has_endlist = false;
+	char line[1024];
+	while (fgets(line, sizeof(line), in)) {
+		if (strncmp(line, "#EXT-X-PLAYLIST-TYPE:", 21) == 0) {
+			fputs("#EXT-X-PLAYLIST-TYPE:VOD\n", out);
+			continue;
+		}
+		if (strncmp(line, "#EXT-X-ENDLIST", 14) == 0)
+			has_endlist = true;
+		fputs(line, out);
+	}
+	if (!has_endlist)
+		fputs("#EXT-X-ENDLIST\n", out);
+	fclose(in);
+	fclose(out);
+	// players polling the playlist only ever see the old or the new file
+	return rename(tmp_path, path) == 0;
+}
+
+bool video_probe(const char *video_name, video_probe_t *probe) {
+	char command[4096] = {0};
+	snprintf(command, sizeof(command),
+			 "ffprobe -v error -select_streams v:0 -show_entries "
+			 "stream=codec_name,width,height,r_frame_rate,profile,level,"
+			 "pix_fmt:format=duration,start_time "
+			 "-of default=nw=1 '%s'",
+			 video_name);
+	memset(probe, 0, sizeof(*probe));
+	FILE *fp = popen(command, "r");
+	if (fp == NULL)
+		return false;
+	char line[256];
+	while (fgets(line, sizeof(line), fp)) {
+		if (strncmp(line, "width=", 6) == 0)
+			probe->width = atoi(line + 6);
+		else if (strncmp(line, "height=", 7) == 0)
+			probe->height = atoi(line + 7);
+		else if (strncmp(line, "duration=", 9) == 0)
+			probe->duration = atof(line + 9);
+		else if (strncmp(line, "start_time=", 11) == 0)
+			probe->start_time = atof(line + 11);
+		else if (strncmp(line, "r_frame_rate=", 13) == 0)
+			sscanf(line + 13, "%31s", probe->frame_rate);
+		else if (strncmp(line, "codec_name=", 11) == 0)
+			sscanf(line + 11, "%31s", probe->codec);
+		else if (strncmp(line, "profile=", 8) == 0)
+			sscanf(line + 8, "%31[^\n]", probe->profile);
+		else if (strncmp(line, "level=", 6) == 0)
+			probe->level = atoi(line + 6);
+		else if (strncmp(line, "pix_fmt=", 8) == 0)
+			sscanf(line + 8, "%31s", probe->pix_fmt);
+	}
+	if (*probe->frame_rate == '\0' || strcmp(probe->frame_rate, "0/0") == 0)
+		strcpy(probe->frame_rate, "25");
+	return pclose(fp) == 0 && probe->width > 0 && probe->height > 0;
+}
+
+bool run_command(const char *command, double *cpu_sec) {
+	pid_t pid = fork();
+	if (pid < 0)
+		return false;
+	if (pid == 0) {
+		execl("/bin/sh", "sh", "-c", command, (char *)NULL);
+		_exit(127);
+	}
+	int status = 0;
+	struct rusage usage;
+	memset(&usage, 0, sizeof(usage));
+	// wait4 only accounts this child, system() would mix in every other job
+	if (wait4(pid, &status, 0, &usage) < 0)
+		return false;
+	if (cpu_sec) {
+		*cpu_sec = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+				   usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+	}
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+#define LADDER_DECODE_SAMPLE 10 // seconds
+
+// x264 options ahead of the output, empty for the x264 defaults
+static const char *x264_args(char *buf, int len, int crf, const char *preset) {
+	int offset = 0;
+	buf[0] = '\0';
+	if (preset)
+		offset += snprintf(buf, len, "-preset %s ", preset);
+	if (crf > 0 && offset < len)
+		snprintf(buf + offset, len - offset, "-crf %d ", crf);
+	return buf;
+}
+
+bool video_ladder(const char *video_name, const char *dir, const int *heights,
+                  int nheights, int crf, const char *preset, double *cpu_sec,
+                  double *cpu_saved_sec) {
+	char command[8192] = {0};
+	char x264[64];
+	int offset = 0;
+	if (nheights <= 0)
+		return false;
+	x264_args(x264, sizeof(x264), crf, preset);
+
+	// one decoder, the frames are split to one scaler/encoder per rendition
+	offset += snprintf(command + offset, sizeof(command) - offset,
+					   "ffmpeg -y -i '%s' -filter_complex '[0:v]split=%d",
+					   video_name, nheights);
+	for (int i = 0; i < nheights; i++)
+		offset += snprintf(command + offset, sizeof(command) - offset, "[v%d]", i);
+	for (int i = 0; i < nheights; i++)
+		offset += snprintf(command + offset, sizeof(command) - offset,
+						   ";[v%d]scale=-2:%d[o%d]", i, heights[i], i);
+	offset += snprintf(command + offset, sizeof(command) - offset, "'");
+	for (int i = 0; i < nheights; i++)
+		offset += snprintf(command + offset, sizeof(command) - offset,
+						   " -map '[o%d]' -map '0:a?' -c:v libx264 %s-c:a aac "
+						   "-movflags +faststart '%s/%dp.mp4'",
+						   i, x264, dir, heights[i]);
+	if (!run_command(command, cpu_sec))
+		return false;
+
+	// running the renditions separately would decode the input once more per
+	// extra rendition, measure the decode cost on a sample and extrapolate it
+	video_probe_t probe;
+	double decode_sec = 0;
+	*cpu_saved_sec = 0;
+	if (nheights > 1 && video_probe(video_name, &probe)) {
+		snprintf(command, sizeof(command),
+				 "ffmpeg -v error -t %d -i '%s' -map 0:v:0 -f null -",
+				 LADDER_DECODE_SAMPLE, video_name);
+		if (run_command(command, &decode_sec)) {
+			if (probe.duration > LADDER_DECODE_SAMPLE)
+				decode_sec *= probe.duration / LADDER_DECODE_SAMPLE;
+			*cpu_saved_sec = decode_sec * (nheights - 1);
+		}
+	}
+	printf("ladder %s: %d renditions, cpu %.2fs, saved %.2fs\n", video_name,
+		   nheights, *cpu_sec, *cpu_saved_sec);
+	return true;
+}
+
+// state shared by the stages of an in process filter job, a NULL filter
+// leaves its stage out
+typedef struct cpu_filter_ctx_t {
+	FILE        *decoder;
+	FILE        *encoder;
+	y4m_t       *in;
+	y4m_t       *out;
+	framepool_t *pool;
+	denoise_t   *denoise;
+	sharpen_t   *sharpen;
+	scale_t     *scale;
+	int64_t      nframes;
+} cpu_filter_ctx_t;
+
+static int decode_stage(void *userdata, frame_t *in, frame_t **out) {
+	cpu_filter_ctx_t *ctx = (cpu_filter_ctx_t *)userdata;
+	frame_t *frame =
+		framepool_get(ctx->pool, FRAME_YUV420P, ctx->in->width, ctx->in->height);
+	if (frame == NULL)
+		return -1;
+	int ret = y4m_read_frame(ctx->in, frame);
+	if (ret != 0) {
+		frame_unref(frame);
+		return ret < 0 ? -1 : 0; // 1 is the end of stream
+	}
+	ctx->nframes++;
+	*out = frame;
+	return 0;
+}
+
+static int denoise_stage(void *userdata, frame_t *in, frame_t **out) {
+	cpu_filter_ctx_t *ctx = (cpu_filter_ctx_t *)userdata;
+	frame_t *frame =
+		framepool_get(ctx->pool, FRAME_YUV420P, in->width, in->height);
+	if (frame == NULL) {
+		frame_unref(in);
+		return -1;
+	}
+	// the denoiser keeps its own references to the previous inputs
+	denoise_frame(ctx->denoise, in, frame);
+	frame_unref(in);
+	*out = frame;
+	return 0;
+}
+
+static int sharpen_stage(void *userdata, frame_t *in, frame_t **out) {
+	cpu_filter_ctx_t *ctx = (cpu_filter_ctx_t *)userdata;
+	frame_t *frame =
+		framepool_get(ctx->pool, FRAME_YUV420P, in->width, in->height);
+	if (frame == NULL) {
+		frame_unref(in);
+		return -1;
+	}
+	sharpen_frame(ctx->sharpen, in, frame);
+	frame->pts = in->pts;
+	frame_unref(in);
+	*out = frame;
+	return 0;
+}
+
+static int scale_stage(void *userdata, frame_t *in, frame_t **out) {
+	cpu_filter_ctx_t *ctx = (cpu_filter_ctx_t *)userdata;
+	frame_t *frame = framepool_get(ctx->pool, FRAME_YUV420P, ctx->out->width,
+								   ctx->out->height);
+	if (frame == NULL) {
+		frame_unref(in);
+		return -1;
+	}
+	scale_frame(ctx->scale, in, frame);
+	frame_unref(in);
+	*out = frame;
+	return 0;
+}
+
+static int encode_stage(void *userdata, frame_t *in, frame_t **out) {
+	cpu_filter_ctx_t *ctx = (cpu_filter_ctx_t *)userdata;
+	int ret = y4m_write_frame(ctx->out, in);
+	frame_unref(in);
+	return ret;
+}
+
+bool video_filter_cpu(const char *video_name, const char *output_name,
+                      const video_filter_opts_t *opts) {
+	int width = opts->width;
+	int height = opts->height;
+	// Y4M carries size, frame rate and aspect in its header, so the encoder
+	// needs no probe and is started once the decoder has produced it
+	char command[4096] = {0};
+	cpu_filter_ctx_t ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	snprintf(command, sizeof(command),
+			 "ffmpeg -v error -i '%s' -map 0:v:0 -pix_fmt yuv420p "
+			 "-f yuv4mpegpipe -",
+			 video_name);
+	ctx.decoder = popen(command, "r");
+	if (ctx.decoder)
+		ctx.in = y4m_fdopen_read(ctx.decoder);
+	y4m_t params;
+	if (ctx.in) {
+		params = *ctx.in;
+		if (width > 0 || height > 0) {
+			params.width = width > 0 ? width
+									 : (int)((int64_t)ctx.in->width * height /
+											 ctx.in->height);
+			params.height = height > 0 ? height
+									   : (int)((int64_t)ctx.in->height * width /
+											   ctx.in->width);
+			// libx264 wants even dimensions in 4:2:0
+			params.width = params.width > 2 ? params.width & ~1 : 2;
+			params.height = params.height > 2 ? params.height & ~1 : 2;
+		}
+		char x264[64];
+		x264_args(x264, sizeof(x264), opts->crf, opts->preset);
+		snprintf(command, sizeof(command),
+				 "ffmpeg -y -v error -f yuv4mpegpipe -i - -i '%s' -map 0:v "
+				 "-map '1:a?' -c:v libx264 %s-pix_fmt yuv420p -c:a aac "
+				 "-movflags +faststart -f mp4 '%s'",
+				 video_name, x264, output_name);
+		ctx.encoder = popen(command, "w");
+	}
+	if (ctx.encoder)
+		ctx.out = y4m_fdopen_write(ctx.encoder, &params);
+
+	// decode, filters and encode overlap on their own threads, each filter
+	// slices its frames on a pool of its own as they run at the same time.
+	// The two ffmpeg processes, x264 above all, keep half the cores, the
+	// filters present split the rest
+	bool scaling = ctx.out && (ctx.out->width != ctx.in->width ||
+							   ctx.out->height != ctx.in->height);
+	int nfilters = (opts->denoise > 0) + (opts->sharpen != NULL) + scaling;
+	int nthreads = nfilters > 0 ? get_ncpu() / 2 / nfilters : 0;
+	slice_pool_t *denoise_slices = NULL;
+	slice_pool_t *sharpen_slices = NULL;
+	slice_pool_t *scale_slices = NULL;
+	if (opts->denoise > 0) {
+		denoise_opts_t denoise_opts = {opts->denoise, 2};
+		denoise_slices = slice_pool_new(nthreads);
+		ctx.denoise = denoise_new(&denoise_opts, denoise_slices);
+	}
+	if (opts->sharpen) {
+		sharpen_slices = slice_pool_new(nthreads);
+		ctx.sharpen = sharpen_new(opts->sharpen, sharpen_slices);
+	}
+	if (scaling) {
+		scale_slices = slice_pool_new(nthreads);
+		ctx.scale = scale_new(ctx.in->width, ctx.in->height, ctx.out->width,
+							  ctx.out->height, opts->filter, scale_slices);
+	}
+	ctx.pool = framepool_default();
+	framepool_stats_t before, after;
+	framepool_stats(ctx.pool, &before);
+
+	bool ok = ctx.in && ctx.out;
+	if (ok) {
+		pipeline_t pipeline;
+		pipeline_init(&pipeline, PIPELINE_RING_SIZE);
+		pipeline_add_stage(&pipeline, "decode", decode_stage, &ctx);
+		// denoise first, sharpening would amplify the noise
+		if (ctx.denoise)
+			pipeline_add_stage(&pipeline, "denoise", denoise_stage, &ctx);
+		// sharpen before upscaling and after downscaling, on the fewer pixels
+		bool upscale = ctx.out->width * ctx.out->height >
+					   ctx.in->width * ctx.in->height;
+		if (ctx.sharpen && upscale)
+			pipeline_add_stage(&pipeline, "sharpen", sharpen_stage, &ctx);
+		if (ctx.scale)
+			pipeline_add_stage(&pipeline, "scale", scale_stage, &ctx);
+		if (ctx.sharpen && !upscale)
+			pipeline_add_stage(&pipeline, "sharpen", sharpen_stage, &ctx);
+		pipeline_add_stage(&pipeline, "encode", encode_stage, &ctx);
+		ok = pipeline_run(&pipeline);
+		char stats[1024];
+		pipeline_dump_stats(&pipeline, stats, sizeof(stats));
+		printf("%s", stats);
+		pipeline_destroy(&pipeline);
+	}
+	denoise_free(ctx.denoise);
+	sharpen_free(ctx.sharpen);
+	scale_free(ctx.scale);
+	slice_pool_free(denoise_slices);
+	slice_pool_free(sharpen_slices);
+	slice_pool_free(scale_slices);
+	framepool_stats(ctx.pool, &after);
+	printf("framepool: %ld frames, %ld recycled, %ld mallocs\n",
+		   after.gets - before.gets, after.recycled - before.recycled,
+		   after.mallocs - before.mallocs);
+	y4m_close(ctx.in);
+	y4m_close(ctx.out);
+	if (ctx.decoder && pclose(ctx.decoder) != 0)
+		ok = false;
+	if (ctx.encoder && pclose(ctx.encoder) != 0)
+		ok = false;
+	printf("filtered %lld frames of %s: %s\n", (long long)ctx.nframes,
+		   video_name, ok ? "ok" : "failed");
+	return ok && ctx.nframes > 0;
+}
+
+static FILE *open_decoder(const char *video_name, int width, int height) {
+	char command[4096];
+	char scale[64] = "";
+	if (width > 0 && height > 0)
+		snprintf(scale, sizeof(scale), "-vf scale=%d:%d:flags=bicubic ", width,
+				 height);
+	snprintf(command, sizeof(command),
+			 "ffmpeg -v error -i '%s' -map 0:v:0 %s-pix_fmt yuv420p "
+			 "-f yuv4mpegpipe -",
+			 video_name, scale);
+	return popen(command, "r");
+}
+
+bool video_quality(const char *ref_name, const char *dist_name,
+                   metrics_result_t *result, long *nframes) {
+	// the output size is only known from its own stream, so it is opened
+	// first and the reference is scaled to it by the decoder
+	FILE *dist_fp = open_decoder(dist_name, 0, 0);
+	y4m_t *dist = dist_fp ? y4m_fdopen_read(dist_fp) : NULL;
+	FILE *ref_fp = dist ? open_decoder(ref_name, dist->width, dist->height)
+						: NULL;
+	y4m_t *ref = ref_fp ? y4m_fdopen_read(ref_fp) : NULL;
+	bool ok = ref && dist && ref->width == dist->width &&
+			  ref->height == dist->height;
+	*nframes = 0;
+	if (ok) {
+		int ncpu = get_ncpu();
+		slice_pool_t *slices = slice_pool_new(ncpu > 2 ? ncpu - 2 : 1);
+		metrics_t *metrics =
+			metrics_new(METRICS_SSIM | METRICS_MS_SSIM, slices);
+		framepool_t *pool = framepool_default();
+		frame_t *a = framepool_get(pool, FRAME_YUV420P, ref->width, ref->height);
+		frame_t *b = framepool_get(pool, FRAME_YUV420P, ref->width, ref->height);
+		// frame counts may differ by the encoder delay, the shorter one wins
+		while (y4m_read_frame(ref, a) == 0 && y4m_read_frame(dist, b) == 0)
+			metrics_frame(metrics, a, b, NULL);
+		*nframes = metrics_summary(metrics, result);
+		frame_unref(a);
+		frame_unref(b);
+		metrics_free(metrics);
+		slice_pool_free(slices);
+	}
+	y4m_close(ref);
+	y4m_close(dist);
+	// the decoders may be cut short, only their start matters
+	if (ref_fp)
+		pclose(ref_fp);
+	if (dist_fp)
+		pclose(dist_fp);
+	if (ok && *nframes > 0)
+		printf("quality %s: %ld frames, psnr %.2f dB, ssim %.4f, "
+			   "ms-ssim %.4f\n",
+			   dist_name, *nframes, result->psnr.yuv, result->ssim.yuv,
+			   result->ms_ssim);
+	return ok && *nframes > 0;
+}
+
+bool video_sharpness_cpu(const char *video_name, char *output_name,
+                         const sharpen_opts_t *opts) {
+	// the name built by on_request may end with padding spaces
+	for (int i = strlen(output_name) - 1; i >= 0 && output_name[i] == ' '; i--)
+		output_name[i] = '\0';
+	video_filter_opts_t filter_opts = {0, opts, 0, 0, SCALE_LANCZOS, 0, NULL};
+	return video_filter_cpu(video_name, output_name, &filter_opts);
+}
+
+static const int s_crf_candidates[] = {18, 21, 23, 26, 29, 32};
+#define CRF_NCANDIDATES (int)(sizeof(s_crf_candidates) / sizeof(int))
+
+// one CRF value over every sample, each candidate runs on its own thread
+typedef struct crf_task_t {
+	const char *dir;
+	const char *preset;
+	int         nsamples;
+	int         crf;
+	double      score;
+	size_t      bytes;
+	double      cpu_sec;
+	bool        ok;
+} crf_task_t;
+
+static HTHREAD_ROUTINE(crf_thread) {
+	crf_task_t *task = (crf_task_t *)userdata;
+	char command[1024], sample[256], output[256], x264[64];
+	task->score = 1.0;
+	task->ok = true;
+	for (int i = 0; i < task->nsamples && task->ok; i++) {
+		snprintf(sample, sizeof(sample), "%s/sample%d.mkv", task->dir, i);
+		snprintf(output, sizeof(output), "%s/sample%d_crf%d.mp4", task->dir, i,
+				 task->crf);
+		x264_args(x264, sizeof(x264), task->crf, task->preset);
+		snprintf(command, sizeof(command),
+				 "ffmpeg -y -v error -i '%s' -c:v libx264 %s'%s'", sample, x264,
+				 output);
+		double cpu_sec = 0;
+		metrics_result_t quality;
+		long nframes = 0;
+		task->ok = run_command(command, &cpu_sec) &&
+				   video_quality(sample, output, &quality, &nframes);
+		task->cpu_sec += cpu_sec;
+		task->bytes += hv_filesize(output);
+		if (task->ok && quality.ms_ssim < task->score)
+			task->score = quality.ms_ssim;
+		remove(output);
+	}
+	return 0;
+}
+
+bool video_choose_crf(const char *video_name, const char *dir, double target,
+                      const char *preset, video_crf_t *crf) {
+	video_probe_t probe;
+	memset(crf, 0, sizeof(*crf));
+	if (!video_probe(video_name, &probe) || probe.duration <= 0)
+		return false;
+
+	// samples spread evenly, cut losslessly so every candidate starts from
+	// the same frames and the seeks are not paid again
+	int nsamples = (int)(probe.duration / (2 * CRF_SAMPLE_SEC));
+	if (nsamples < 1)
+		nsamples = 1;
+	if (nsamples > CRF_SAMPLES)
+		nsamples = CRF_SAMPLES;
+	char command[4096], sample[256];
+	bool ok = true;
+	for (int i = 0; i < nsamples && ok; i++) {
+		double start = probe.duration * (2 * i + 1) / (2 * nsamples) -
+					   CRF_SAMPLE_SEC / 2.0;
+		snprintf(sample, sizeof(sample), "%s/sample%d.mkv", dir, i);
+		snprintf(command, sizeof(command),
+				 "ffmpeg -y -v error -ss %.3f -t %d -i '%s' -map 0:v:0 -an "
+				 "-c:v libx264 -preset ultrafast -qp 0 '%s'",
+				 start > 0 ? start : 0, CRF_SAMPLE_SEC, video_name, sample);
+		double cpu_sec = 0;
+		ok = run_command(command, &cpu_sec);
+		crf->cpu_sec += cpu_sec;
+	}
+
+	crf_task_t tasks[CRF_NCANDIDATES];
+	hthread_t threads[CRF_NCANDIDATES];
+	memset(tasks, 0, sizeof(tasks));
+	for (int i = 0; i < CRF_NCANDIDATES && ok; i++) {
+		tasks[i].dir = dir;
+		tasks[i].preset = preset;
+		tasks[i].nsamples = nsamples;
+		tasks[i].crf = s_crf_candidates[i];
+		threads[i] = hthread_create(crf_thread, &tasks[i]);
+	}
+	const crf_task_t *reference = NULL;
+	const crf_task_t *chosen = NULL;
+	for (int i = 0; i < CRF_NCANDIDATES && ok; i++) {
+		hthread_join(threads[i]);
+		crf->cpu_sec += tasks[i].cpu_sec;
+	}
+	for (int i = 0; i < CRF_NCANDIDATES && ok; i++) {
+		ok = tasks[i].ok && tasks[i].bytes > 0;
+		if (tasks[i].crf == CRF_DEFAULT)
+			reference = &tasks[i];
+		// candidates are sorted, the lowest CRF is the fallback
+		if (chosen == NULL || tasks[i].score >= target)
+			chosen = &tasks[i];
+	}
+	for (int i = 0; i < nsamples; i++) {
+		snprintf(sample, sizeof(sample), "%s/sample%d.mkv", dir, i);
+		remove(sample);
+	}
+	if (!ok || reference == NULL)
+		return false;
+	crf->crf = chosen->crf;
+	crf->score = chosen->score;
+	crf->size_ratio = (double)chosen->bytes / reference->bytes;
+	printf("crf %s: %d samples, crf %d at ms-ssim %.4f (target %.4f), "
+		   "%.0f%% of crf %d, cpu %.2fs\n",
+		   video_name, nsamples, crf->crf, crf->score, target,
+		   crf->size_ratio * 100, CRF_DEFAULT, crf->cpu_sec);
+	return true;
+}
+
+#define TRIM_EDGE_CRF 18 // the edges sit next to untouched source GOPs
+
+// the first keyframe at or after start and the last one at or before end,
+// only the packets around the range are read. Packet timestamps count from
+// the container's start_time while -ss counts from 0, so the range is
+// shifted into the packets' clock and the keyframes back out of it
+static bool probe_keyframes(const char *video_name, double start_time,
+							double start, double end, double *first,
+							double *last) {
+	char command[4096];
+	start += start_time;
+	end += start_time;
+	snprintf(command, sizeof(command),
+			 "ffprobe -v error -select_streams v:0 -read_intervals %.6f%%%.6f "
+			 "-show_entries packet=pts_time,flags -of csv=p=0 '%s'",
+			 start, end, video_name);
+	FILE *fp = popen(command, "r");
+	if (fp == NULL)
+		return false;
+	*first = -1;
+	*last = -1;
+	char line[256];
+	while (fgets(line, sizeof(line), fp)) {
+		double pts = 0;
+		char flags[16] = "";
+		if (sscanf(line, "%lf,%15s", &pts, flags) != 2 || flags[0] != 'K')
+			continue;
+		if (pts >= start && pts <= end) {
+			if (*first < 0 || pts < *first)
+				*first = pts;
+			if (pts > *last)
+				*last = pts;
+		}
+	}
+	pclose(fp);
+	if (*first < 0)
+		return false;
+	*first -= start_time;
+	*last -= start_time;
+	return true;
+}
+
+static const char *trim_encoder(const char *codec) {
+	if (strcmp(codec, "h264") == 0)
+		return "libx264";
+	if (strcmp(codec, "hevc") == 0)
+		return "libx265";
+	return NULL;
+}
+
+// ffprobe profile names against what the encoders take
+static const struct {
+	const char *codec;
+	const char *probed;
+	const char *profile;
+} s_trim_profiles[] = {
+	{"h264", "Constrained Baseline", "baseline"},
+	{"h264", "Baseline", "baseline"},
+	{"h264", "Main", "main"},
+	{"h264", "High", "high"},
+	{"h264", "High 10", "high10"},
+	{"h264", "High 4:2:2", "high422"},
+	{"h264", "High 4:4:4 Predictive", "high444"},
+	{"hevc", "Main", "main"},
+	{"hevc", "Main 10", "main10"},
+};
+
+// trim_edge_args makes the re-encoded edges match the copied middle: the
+// same profile, level and pixel format, so one sample entry fits all parts
+static void trim_edge_args(const video_probe_t *probe, char *args, int len) {
+	const char *profile = NULL;
+	for (size_t i = 0; i < ARRAY_SIZE(s_trim_profiles); i++) {
+		if (strcmp(s_trim_profiles[i].codec, probe->codec) == 0 &&
+			strcmp(s_trim_profiles[i].probed, probe->profile) == 0)
+			profile = s_trim_profiles[i].profile;
+	}
+	int offset = snprintf(args, len, "-pix_fmt %s ",
+						  *probe->pix_fmt ? probe->pix_fmt : "yuv420p");
+	if (profile && offset < len)
+		offset += snprintf(args + offset, len - offset, "-profile:v %s ",
+						   profile);
+	// H.264 levels come as 10 times the level, HEVC ones as 30 times
+	if (probe->level >= 10 && offset < len) {
+		if (strcmp(probe->codec, "hevc") == 0)
+			snprintf(args + offset, len - offset,
+					 "-x265-params level-idc=%d ", probe->level / 3);
+		else
+			snprintf(args + offset, len - offset, "-level %d.%d ",
+					 probe->level / 10, probe->level % 10);
+	}
+}
+
+// one video part of a trim, copied or re-encoded into MPEG-TS. The audio
+// is encoded once over the whole range in the join, AAC per part would
+// leave a priming gap at every seam
+static bool trim_part(const char *video_name, const char *encoder,
+					  const char *edge_args, double start, double end,
+					  const char *part, double *cpu_sec) {
+	char command[4096];
+	if (encoder) {
+		snprintf(command, sizeof(command),
+				 "ffmpeg -y -v error -ss %.6f -i '%s' -t %.6f -map 0:v:0 "
+				 "-c:v %s -preset veryfast -crf %d %s-an -f mpegts '%s'",
+				 start, video_name, end - start, encoder, TRIM_EDGE_CRF,
+				 edge_args, part);
+	} else {
+		// seeking the input lands exactly on the keyframe at start
+		snprintf(command, sizeof(command),
+				 "ffmpeg -y -v error -ss %.6f -i '%s' -t %.6f -map 0:v:0 "
+				 "-c:v copy -an -f mpegts '%s'",
+				 start, video_name, end - start, part);
+	}
+	return run_command(command, cpu_sec);
+}
+
+bool video_trim(const char *video_name, const char *dir,
+                const char *output_name, double start, double end) {
+	video_probe_t probe;
+	if (!video_probe(video_name, &probe))
+		return false;
+	if (probe.duration > 0 && end > probe.duration)
+		end = probe.duration;
+	if (start < 0 || end <= start)
+		return false;
+
+	// parts are [start, first) re-encoded, [first, last) copied and
+	// [last, end) re-encoded, a range inside one GOP is encoded as a whole
+	const char *encoder = trim_encoder(probe.codec);
+	double first = end, last = end;
+	if (encoder == NULL ||
+		!probe_keyframes(video_name, probe.start_time, start, end, &first,
+						 &last)) {
+		first = last = end;
+	}
+	struct {
+		double start;
+		double end;
+		bool   copy;
+	} parts[3] = {
+		{start, first, false},
+		{first, last, true},
+		{last, end, false},
+	};
+	if (encoder == NULL)
+		encoder = strcmp(probe.codec, "hevc") == 0 ? "libx265" : "libx264";
+	char edge_args[128];
+	trim_edge_args(&probe, edge_args, sizeof(edge_args));
+
+	char list_path[256], part[256], command[4096];
+	snprintf(list_path, sizeof(list_path), "%s/trim.txt", dir);
+	FILE *list = fopen(list_path, "w");
+	if (list == NULL)
+		return false;
+	bool ok = true;
+	double cpu_sec = 0, copied = 0, encoded = 0;
+	for (int i = 0; i < 3 && ok; i++) {
+		// a frame or less is not worth a part
+		if (parts[i].end - parts[i].start < 0.001)
+			continue;
+		double part_sec = 0;
+		snprintf(part, sizeof(part), "%s/trim%d.ts", dir, i);
+		ok = trim_part(video_name, parts[i].copy ? NULL : encoder, edge_args,
+					   parts[i].start, parts[i].end, part, &part_sec);
+		cpu_sec += part_sec;
+		if (parts[i].copy)
+			copied += parts[i].end - parts[i].start;
+		else
+			encoded += parts[i].end - parts[i].start;
+		// the list is read from dir, name the parts relative to it
+		fprintf(list, "file 'trim%d.ts'\n", i);
+	}
+	fclose(list);
+	if (ok) {
+		// the parameter sets go in band as well (avc3/hev1), a decoder
+		// picks up whatever the encoder still did differently at each seam
+		snprintf(command, sizeof(command),
+				 "ffmpeg -y -v error -f concat -safe 0 -i '%s' -ss %.6f "
+				 "-t %.6f -i '%s' -map 0:v -map '1:a:0?' -c:v copy -tag:v %s "
+				 "-c:a aac -movflags +faststart '%s'",
+				 list_path, start, end - start, video_name,
+				 strcmp(encoder, "libx265") == 0 ? "hev1" : "avc3",
+				 output_name);
+		double join_sec = 0;
+		ok = run_command(command, &join_sec);
+		cpu_sec += join_sec;
+	}
+	for (int i = 0; i < 3; i++) {
+		snprintf(part, sizeof(part), "%s/trim%d.ts", dir, i);
+		remove(part);
+	}
+	remove(list_path);
+	printf("trim %s [%.3f, %.3f): %.3fs copied, %.3fs re-encoded, cpu %.2fs: "
+		   "%s\n",
+		   video_name, start, end, copied, encoded, cpu_sec,
+		   ok ? "ok" : "failed");
+	return ok;
+}
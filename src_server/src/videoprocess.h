@@ -1,4 +1,82 @@
 #pragma once
 #include <stdbool.h>
 #include "serverd.h" 
+#include "denoise.h"
+#include "metrics.h"
+#include "scale.h"
+#include "sharpen.h"
+typedef struct video_probe_t {
+	int    width;
+	int    height;
+	double duration; // seconds
+	double start_time; // of the container, packet timestamps start there
+	char   frame_rate[32];
+	char   codec[32];
+	// what an encoder matching the stream needs, see video_trim
+	char   profile[32];
+	int    level;
+	char   pix_fmt[32];
+} video_probe_t;
+
 bool video_sharpness_vaapi(http_conn_t *conn, char *video_name, char *output_name);
+// video_sharpness_cpu decodes to raw frames, sharpens them in process and
+// encodes the result, it needs no GPU
+bool video_sharpness_cpu(const char *video_name, char *output_name,
+                         const sharpen_opts_t *opts);
+typedef struct video_filter_opts_t {
+	int                   denoise; // strength, 0 is off
+	const sharpen_opts_t *sharpen; // NULL is off
+	// a 0 dimension follows the aspect ratio, 0x0 keeps the input size
+	int                   width;
+	int                   height;
+	scale_filter_e        filter;
+	int                   crf;    // 0 is the x264 default
+	const char           *preset; // NULL is the x264 default
+} video_filter_opts_t;
+
+// video_filter_cpu runs decode -> denoise -> sharpen/scale -> encode with the
+// in process pixel engine
+bool video_filter_cpu(const char *video_name, const char *output_name,
+                      const video_filter_opts_t *opts);
+// video_trim cuts [start, end) seconds out of video_name. Whole GOPs are
+// stream copied and only the partial ones at both edges are re-encoded,
+// the parts are joined in MPEG-TS where every keyframe repeats its SPS/PPS
+bool video_trim(const char *video_name, const char *dir,
+                const char *output_name, double start, double end);
+// video_quality scores dist against ref scaled to the size of dist, over
+// the frames both have
+bool video_quality(const char *ref_name, const char *dist_name,
+                   metrics_result_t *result, long *nframes);
+bool video_segment(const char *video_name, const char *dir,
+                   const char *manifest, bool dash);
+// video_segment_pipe starts the segmenter on a video written to the returned
+// pipe as it arrives, video_segment_close waits for it to finish. Only
+// containers a decoder can read front to back work, see sniff_t
+FILE *video_segment_pipe(const char *dir, const char *manifest, bool dash);
+bool video_segment_close(FILE *fp, const char *dir, const char *manifest,
+                         bool dash);
+bool hls_finalize_playlist(const char *dir, const char *manifest);
+bool video_probe(const char *video_name, video_probe_t *probe);
+// run_command runs command through the shell and reports the CPU time it used
+bool run_command(const char *command, double *cpu_sec);
+bool video_ladder(const char *video_name, const char *dir, const int *heights,
+                  int nheights, int crf, const char *preset, double *cpu_sec,
+                  double *cpu_saved_sec);
+
+#define CRF_DEFAULT      23 // x264
+#define CRF_SAMPLES      4
+#define CRF_SAMPLE_SEC   2
+#define CRF_TARGET       0.98 // MS-SSIM
+
+typedef struct video_crf_t {
+	int    crf;
+	double score;      // MS-SSIM of the worst sample at crf
+	double size_ratio; // sample bytes at crf over those at CRF_DEFAULT
+	double cpu_sec;    // spent encoding the samples
+} video_crf_t;
+
+// video_choose_crf encodes a few short samples of the input at several CRF
+// values in parallel with the preset of the job and picks the highest one
+// whose worst sample still reaches target, scratch files go to dir
+bool video_choose_crf(const char *video_name, const char *dir, double target,
+                      const char *preset, video_crf_t *crf);
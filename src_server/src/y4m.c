@@ -0,0 +1,206 @@
+#include "y4m.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define Y4M_MAGIC       "YUV4MPEG2"
+#define Y4M_FRAME_MAGIC "FRAME"
+#define Y4M_MAX_HEADER  256
+
+static int y4m_parse_header(y4m_t *y4m, char *header) {
+  if (strncmp(header, Y4M_MAGIC, strlen(Y4M_MAGIC)) != 0)
+    return -1;
+  y4m->fps_num = 25;
+  y4m->fps_den = 1;
+  y4m->sar_num = y4m->sar_den = 1;
+  char *save = NULL;
+  for (char *tok = strtok_r(header + strlen(Y4M_MAGIC), " \n", &save); tok;
+       tok = strtok_r(NULL, " \n", &save)) {
+    switch (tok[0]) {
+    case 'W':
+      y4m->width = atoi(tok + 1);
+      break;
+    case 'H':
+      y4m->height = atoi(tok + 1);
+      break;
+    case 'F':
+      sscanf(tok + 1, "%d:%d", &y4m->fps_num, &y4m->fps_den);
+      break;
+    case 'A':
+      sscanf(tok + 1, "%d:%d", &y4m->sar_num, &y4m->sar_den);
+      break;
+    case 'C':
+      // 420jpeg, 420paldv, 420mpeg2 and 420 differ only in chroma siting
+      if (strncmp(tok + 1, "420", 3) != 0) {
+        fprintf(stderr, "y4m: unsupported colorspace %s\n", tok + 1);
+        return -1;
+      }
+      break;
+    default:
+      break;
+    }
+  }
+  if (y4m->width <= 0 || y4m->height <= 0)
+    return -1;
+  if (y4m->sar_num <= 0 || y4m->sar_den <= 0)
+    y4m->sar_num = y4m->sar_den = 1;
+  return 0;
+}
+
+static y4m_t *y4m_read_stream_header(y4m_t *y4m) {
+  char header[Y4M_MAX_HEADER];
+  if (fgets(header, sizeof(header), y4m->fp) == NULL ||
+      y4m_parse_header(y4m, header) != 0) {
+    y4m_close(y4m);
+    return NULL;
+  }
+  return y4m;
+}
+
+y4m_t *y4m_fdopen_read(FILE *fp) {
+  y4m_t *y4m = (y4m_t *)calloc(1, sizeof(y4m_t));
+  y4m->fp = fp;
+  return y4m_read_stream_header(y4m);
+}
+
+y4m_t *y4m_open_read(const char *path) {
+  if (strcmp(path, "-") == 0)
+    return y4m_fdopen_read(stdin);
+  y4m_t *y4m = (y4m_t *)calloc(1, sizeof(y4m_t));
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    if (fd >= 0)
+      close(fd);
+    free(y4m);
+    return NULL;
+  }
+  if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+    y4m->fp = fdopen(fd, "rb");
+    y4m->own_fp = true;
+    return y4m_read_stream_header(y4m);
+  }
+  y4m->map_size = st.st_size;
+  y4m->map = (uint8_t *)mmap(NULL, y4m->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (y4m->map == MAP_FAILED) {
+    free(y4m);
+    return NULL;
+  }
+  madvise(y4m->map, y4m->map_size, MADV_SEQUENTIAL);
+  const uint8_t *eol = (const uint8_t *)memchr(
+      y4m->map, '\n',
+      y4m->map_size < Y4M_MAX_HEADER ? y4m->map_size : Y4M_MAX_HEADER);
+  char header[Y4M_MAX_HEADER + 1] = {0};
+  if (eol)
+    memcpy(header, y4m->map, eol - y4m->map + 1);
+  if (eol == NULL || y4m_parse_header(y4m, header) != 0) {
+    y4m_close(y4m);
+    return NULL;
+  }
+  y4m->offset = eol - y4m->map + 1;
+  return y4m;
+}
+
+// the FRAME line may carry parameters, they are skipped
+static int y4m_read_frame_mmap(y4m_t *y4m, frame_t *frame) {
+  if (y4m->offset >= y4m->map_size)
+    return 1;
+  const uint8_t *p = y4m->map + y4m->offset;
+  size_t remain = y4m->map_size - y4m->offset;
+  const uint8_t *eol = (const uint8_t *)memchr(
+      p, '\n', remain < Y4M_MAX_HEADER ? remain : Y4M_MAX_HEADER);
+  if (eol == NULL || strncmp((const char *)p, Y4M_FRAME_MAGIC, 5) != 0)
+    return -1;
+  p = eol + 1;
+  size_t size = frame_size(FRAME_YUV420P, y4m->width, y4m->height);
+  if ((size_t)(y4m->map + y4m->map_size - p) < size)
+    return -1;
+  for (int i = 0; i < 3; i++) {
+    int w = frame_plane_width(frame, i);
+    int h = frame_plane_height(frame, i);
+    for (int y = 0; y < h; y++) {
+      memcpy(frame->data[i] + (size_t)y * frame->linesize[i], p, w);
+      p += w;
+    }
+  }
+  y4m->offset = p - y4m->map;
+  return 0;
+}
+
+static int y4m_read_frame_stream(y4m_t *y4m, frame_t *frame) {
+  char line[Y4M_MAX_HEADER];
+  if (fgets(line, sizeof(line), y4m->fp) == NULL)
+    return 1;
+  if (strncmp(line, Y4M_FRAME_MAGIC, 5) != 0)
+    return -1;
+  return frame_read_raw(frame, y4m->fp) == 0 ? 0 : -1;
+}
+
+int y4m_read_frame(y4m_t *y4m, frame_t *frame) {
+  if (frame->width != y4m->width || frame->height != y4m->height)
+    return -1;
+  int ret = y4m->map ? y4m_read_frame_mmap(y4m, frame)
+                     : y4m_read_frame_stream(y4m, frame);
+  if (ret == 0)
+    frame->pts = y4m->nframes++;
+  return ret;
+}
+
+y4m_t *y4m_fdopen_write(FILE *fp, const y4m_t *params) {
+  y4m_t *y4m = (y4m_t *)calloc(1, sizeof(y4m_t));
+  y4m->fp = fp;
+  y4m->width = params->width;
+  y4m->height = params->height;
+  y4m->fps_num = params->fps_num > 0 ? params->fps_num : 25;
+  y4m->fps_den = params->fps_den > 0 ? params->fps_den : 1;
+  y4m->sar_num = params->sar_num > 0 ? params->sar_num : 1;
+  y4m->sar_den = params->sar_den > 0 ? params->sar_den : 1;
+  if (fprintf(fp, Y4M_MAGIC " W%d H%d F%d:%d Ip A%d:%d C420jpeg\n",
+              y4m->width, y4m->height, y4m->fps_num, y4m->fps_den,
+              y4m->sar_num, y4m->sar_den) < 0) {
+    free(y4m);
+    return NULL;
+  }
+  return y4m;
+}
+
+y4m_t *y4m_open_write(const char *path, const y4m_t *params) {
+  if (strcmp(path, "-") == 0)
+    return y4m_fdopen_write(stdout, params);
+  FILE *fp = fopen(path, "wb");
+  if (fp == NULL)
+    return NULL;
+  y4m_t *y4m = y4m_fdopen_write(fp, params);
+  if (y4m == NULL) {
+    fclose(fp);
+    return NULL;
+  }
+  y4m->own_fp = true;
+  return y4m;
+}
+
+int y4m_write_frame(y4m_t *y4m, const frame_t *frame) {
+  if (frame->width != y4m->width || frame->height != y4m->height)
+    return -1;
+  if (fputs(Y4M_FRAME_MAGIC "\n", y4m->fp) < 0 ||
+      frame_write_raw(frame, y4m->fp) != 0)
+    return -1;
+  y4m->nframes++;
+  return 0;
+}
+
+void y4m_close(y4m_t *y4m) {
+  if (y4m == NULL)
+    return;
+  if (y4m->map && y4m->map != MAP_FAILED)
+    munmap(y4m->map, y4m->map_size);
+  if (y4m->fp && y4m->own_fp)
+    fclose(y4m->fp);
+  else if (y4m->fp)
+    fflush(y4m->fp);
+  free(y4m);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "frame.h"
+#include <stdbool.h>
+#include <stdio.h>
+
+// YUV4MPEG2 streams, 4:2:0 only. Regular files are read through mmap,
+// pipes (and "-" for stdin/stdout) are streamed with stdio.
+
+typedef struct y4m_t {
+  int       width;
+  int       height;
+  int       fps_num;
+  int       fps_den;
+  int       sar_num;
+  int       sar_den;
+  int64_t   nframes; // frames read or written so far
+  // streaming
+  FILE     *fp;
+  bool      own_fp;
+  // mmap'd file
+  uint8_t  *map;
+  size_t    map_size;
+  size_t    offset;
+} y4m_t;
+
+// y4m_open_read maps path, or streams it when it is a pipe or "-"
+y4m_t *y4m_open_read(const char *path);
+// y4m_fdopen_read streams from fp, e.g. the stdout of a decoder
+y4m_t *y4m_fdopen_read(FILE *fp);
+// y4m_read_frame returns 0, 1 at end of stream or -1 on error
+int y4m_read_frame(y4m_t *y4m, frame_t *frame);
+
+y4m_t *y4m_open_write(const char *path, const y4m_t *params);
+y4m_t *y4m_fdopen_write(FILE *fp, const y4m_t *params);
+int y4m_write_frame(y4m_t *y4m, const frame_t *frame);
+
+void y4m_close(y4m_t *y4m);
@@ -0,0 +1,100 @@
+// SHA-1 of a File off the main thread, for the hash first upload in test.js.
+// The file is read a slice at a time so a long video is never in memory
+// whole, crypto.subtle only hashes a complete buffer.
+
+var CHUNK = 4 * 1024 * 1024;
+
+function Sha1() {
+	this.h = [0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0];
+	this.w = new Int32Array(80);
+	this.tail = new Uint8Array(64);
+	this.tailLen = 0;
+	this.length = 0;
+}
+
+Sha1.prototype.block = function(bytes, off) {
+	var w = this.w, h = this.h;
+	var i, t;
+	for (i = 0; i < 16; i++, off += 4) {
+		w[i] = (bytes[off] << 24) | (bytes[off + 1] << 16) |
+			(bytes[off + 2] << 8) | bytes[off + 3];
+	}
+	for (; i < 80; i++) {
+		t = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+		w[i] = (t << 1) | (t >>> 31);
+	}
+	var a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+	for (i = 0; i < 80; i++) {
+		if (i < 20)
+			t = ((b & c) | (~b & d)) + 0x5a827999;
+		else if (i < 40)
+			t = (b ^ c ^ d) + 0x6ed9eba1;
+		else if (i < 60)
+			t = ((b & c) | (b & d) | (c & d)) + 0x8f1bbcdc;
+		else
+			t = (b ^ c ^ d) + 0xca62c1d6;
+		t = (((a << 5) | (a >>> 27)) + t + e + w[i]) | 0;
+		e = d;
+		d = c;
+		c = (b << 30) | (b >>> 2);
+		b = a;
+		a = t;
+	}
+	h[0] = (h[0] + a) | 0;
+	h[1] = (h[1] + b) | 0;
+	h[2] = (h[2] + c) | 0;
+	h[3] = (h[3] + d) | 0;
+	h[4] = (h[4] + e) | 0;
+};
+
+Sha1.prototype.update = function(bytes) {
+	var off = 0, n = bytes.length;
+	this.length += n;
+	if (this.tailLen > 0) {
+		off = Math.min(64 - this.tailLen, n);
+		this.tail.set(bytes.subarray(0, off), this.tailLen);
+		this.tailLen += off;
+		if (this.tailLen < 64)
+			return;
+		this.block(this.tail, 0);
+		this.tailLen = 0;
+	}
+	for (; off + 64 <= n; off += 64)
+		this.block(bytes, off);
+	this.tail.set(bytes.subarray(off), 0);
+	this.tailLen = n - off;
+};
+
+Sha1.prototype.hex = function() {
+	// the bit length is past 32 bits from 512MB on
+	var bits = this.length * 8;
+	var pad = new Uint8Array((this.tailLen < 56 ? 64 : 128) - this.tailLen);
+	var hi = Math.floor(bits / 0x100000000), lo = bits >>> 0;
+	var n = pad.length;
+	pad[0] = 0x80;
+	pad[n - 8] = hi >>> 24; pad[n - 7] = hi >>> 16;
+	pad[n - 6] = hi >>> 8;  pad[n - 5] = hi;
+	pad[n - 4] = lo >>> 24; pad[n - 3] = lo >>> 16;
+	pad[n - 2] = lo >>> 8;  pad[n - 1] = lo;
+	this.update(pad);
+	var out = "";
+	for (var i = 0; i < 5; i++)
+		out += ("0000000" + (this.h[i] >>> 0).toString(16)).slice(-8);
+	return out;
+};
+
+// posted a File, answers {hash, size} or {error}
+self.onmessage = function(e) {
+	var file = e.data;
+	try {
+		var reader = new FileReaderSync();
+		var sha1 = new Sha1();
+		for (var off = 0; off < file.size; off += CHUNK) {
+			var slice = file.slice(off, Math.min(off + CHUNK, file.size));
+			sha1.update(new Uint8Array(reader.readAsArrayBuffer(slice)));
+		}
+		self.postMessage({hash: sha1.hex(), size: file.size});
+	} catch (err) {
+		self.postMessage({error: String(err)});
+	}
+};
@@ -13,27 +13,50 @@ function getStatus() {
    });
 }
 
-$('#myform').submit(function(e){
-    //e.preventDefault();
+// the file is hashed in a worker and its hash offered first: a file the
+// server already has, as a cached result or as the input of another job,
+// is never sent again. Anything but a job back submits the form as usual
+var hashWorker = window.Worker ? new Worker("hash_worker.js") : null;
 
-	//binds to onchange event of your input field
-	//$('#video_file').files[0].size
+// the links are paths on the server the form posts to
+function showJob(job) {
+	var link = job.manifest || (job.renditions && job.renditions[0]);
+	if (link)
+		link = new URL(link, $('#myform')[0].action).href;
+	$('#result').text("job " + job.id + " " + job.state +
+		(job.cached ? ", from the cache" : ", no upload needed"));
+	if (link)
+		$('#result').append($('<a>').attr('href', link).text(" " + link));
+}
 
-		//this.files[0].size gets the size of your file.
-	//	alert($('#video_file')[0].files[0].size);
-		if($('#video_file')[0].files[0].size>100000000){
-			//e.preventDefault();
-		}
-	
-	
+$('#myform').submit(function(e){
+	var form = this;
+	var file = $('#video_file')[0].files[0];
+	if (hashWorker == null || file == null || form.probed)
+		return;
+	e.preventDefault();
 
-	//getStatus();
-	// $.getJSON("http://0.0.0.0:8080/status",{},//{"session":0, "requestID":12345}, 
-    //function(data) { //data is the returned JSON object from the server {name:"value"}
-          //setStatus(data.status);
-	//	console.log(data.status);
-	//});
-    // do ajax now
-    //console.log("submitted"); 
+	hashWorker.onmessage = function(msg) {
+		if (msg.data.error) {
+			console.log("hashing failed: " + msg.data.error);
+			form.probed = true;
+			form.submit();
+			return;
+		}
+		$.ajax({
+			url: form.action,
+			type: "POST",
+			headers: {"X-Content-SHA1": msg.data.hash,
+			          "X-Content-Size": String(msg.data.size)},
+			dataType: "json",
+			success: showJob,
+			error: function() {
+				// 404: the server does not have it, upload it
+				form.probed = true;
+				form.submit();
+			}
+		});
+	};
+	$('#result').text("checking " + file.name + "...");
+	hashWorker.postMessage(file);
 });
-